@@ -0,0 +1,188 @@
+/**
+ * @brief 比较sendfile和mmap两种文件发送方式的性能
+ *        通过本地回环的TCP连接发送小，中，大三种文件，
+ *        接收端在另一个线程中读取并丢弃数据
+ *        1. sendfile: 所有请求共享一个文件描述符，每次请求通过sendfile发送整个文件
+ *        2. mmap: 文件通过MmapCache映射一次，每次请求通过send发送映射中的数据
+ *        3. mmap(remap): 每次请求都重新映射，对应缓存未命中的情况
+ */
+#include <string>
+#include <thread>
+#include <vector>
+#include <iostream>
+#include <stdexcept>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "debughelper.h"
+#include "filecache.h"
+#include "mmapcache.h"
+
+
+struct BenchCase
+{
+    const char *desc;
+    off_t size;
+    int times;
+};
+
+static void check(bool ok, const char *what)
+{
+    if (!ok) {
+        throw std::runtime_error(std::string(what) + ": " + strerror(errno));
+    }
+}
+
+static std::string create_file(off_t size)
+{
+    char path[] = "/tmp/lws_bench_XXXXXX";
+    int fd = mkstemp(path);
+    check(fd >= 0, "mkstemp");
+
+    std::string block(64 * 1024, 'x');
+    off_t written = 0;
+    while (written < size) {
+        size_t n = std::min<off_t>(block.size(), size - written);
+        ssize_t ret = write(fd, block.data(), n);
+        check(ret > 0, "write");
+        written += ret;
+    }
+    close(fd);
+    return path;
+}
+
+static OpenFilePtr open_file(const std::string &path)
+{
+    std::shared_ptr<OpenFile> file = std::make_shared<OpenFile>();
+    file->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    check(file->fd >= 0, "open");
+    struct stat st;
+    check(fstat(file->fd, &st) == 0, "fstat");
+    file->size = st.st_size;
+    file->mtime = st.st_mtime;
+    file->ino = st.st_ino;
+    return file;
+}
+
+/**
+ * @brief 建立一对本地回环的TCP连接，返回发送端，接收端通过参数返回
+ */
+static int connect_loopback(int &peer)
+{
+    int lsn = socket(AF_INET, SOCK_STREAM, 0);
+    check(lsn >= 0, "socket");
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    check(bind(lsn, (struct sockaddr*)&addr, sizeof(addr)) == 0, "bind");
+    check(listen(lsn, 1) == 0, "listen");
+    socklen_t len = sizeof(addr);
+    check(getsockname(lsn, (struct sockaddr*)&addr, &len) == 0, "getsockname");
+
+    int cli = socket(AF_INET, SOCK_STREAM, 0);
+    check(cli >= 0, "socket");
+    check(connect(cli, (struct sockaddr*)&addr, sizeof(addr)) == 0, "connect");
+    peer = accept(lsn, nullptr, nullptr);
+    check(peer >= 0, "accept");
+    close(lsn);
+
+    int on = 1;
+    setsockopt(peer, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return cli;
+}
+
+static void drain(int sock, long long total)
+{
+    std::vector<char> buf(256 * 1024);
+    while (total > 0) {
+        ssize_t n = recv(sock, buf.data(), buf.size(), 0);
+        if (n <= 0) {
+            break;
+        }
+        total -= n;
+    }
+}
+
+static void send_by_sendfile(int sock, const OpenFile &file)
+{
+    off_t offset = 0;
+    while (offset < file.size) {
+        ssize_t n = sendfile(sock, file.fd, &offset, file.size - offset);
+        check(n > 0, "sendfile");
+    }
+}
+
+static void send_by_mem(int sock, const char *data, off_t size)
+{
+    off_t sent = 0;
+    while (sent < size) {
+        ssize_t n = send(sock, data + sent, size - sent, 0);
+        check(n > 0, "send");
+        sent += n;
+    }
+}
+
+template <typename SendFunc>
+static void run(const std::string &desc, const BenchCase &bc, SendFunc send_func)
+{
+    int recv_sock = -1;
+    int send_sock = connect_loopback(recv_sock);
+    std::thread receiver(drain, recv_sock, static_cast<long long>(bc.size) * bc.times);
+    {
+        TimeCount tc(desc, bc.times);
+        for (int i = 0; i < bc.times; ++i) {
+            send_func(send_sock);
+        }
+        // 数据全部被接收后才算结束
+        shutdown(send_sock, SHUT_WR);
+        receiver.join();
+    }
+    close(send_sock);
+    close(recv_sock);
+}
+
+int main()
+{
+    const BenchCase cases[] = {
+        {"small(4KB)", 4 * 1024, 50000},
+        {"medium(256KB)", 256 * 1024, 5000},
+        {"large(16MB)", 16 * 1024 * 1024, 100},
+    };
+
+    for (const BenchCase &bc : cases) {
+        std::string path = create_file(bc.size);
+        OpenFilePtr file = open_file(path);
+        MmapCache mmap_cache(static_cast<std::size_t>(1024) * 1024 * 1024, bc.size);
+
+        std::cout << "==== " << bc.desc << " ====" << std::endl;
+        run("sendfile     ", bc, [&](int sock) {
+            send_by_sendfile(sock, *file);
+        });
+        run("mmap(cached) ", bc, [&](int sock) {
+            MappedFilePtr mapped = mmap_cache.get(path, *file);
+            check(mapped != nullptr, "mmap");
+            send_by_mem(sock, mapped->data(), mapped->size);
+        });
+        run("mmap(remap)  ", bc, [&](int sock) {
+            MappedFilePtr mapped = MmapCache::map_file(*file);
+            check(mapped != nullptr, "mmap");
+            send_by_mem(sock, mapped->data(), mapped->size);
+        });
+
+        unlink(path.c_str());
+    }
+
+    return 0;
+}
@@ -0,0 +1,85 @@
+/**
+ * @brief 比较chaos::ThreadPool几种提交方式的吞吐量（每秒完成的任务数）
+ *        每个任务只对一个原子计数器加一，测量的基本上是提交和调度本身的开销
+ *        1. enqueue: 每个任务一个packaged_task和future，调用者丢弃future
+ *        2. post: 没有future，小的可调用对象不分配内存
+ *        3. post_bulk: 每BULK_SIZE个任务加一次锁
+ *        每种方式分别在普通模式和工作窃取模式下运行
+ */
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <string>
+#include <iostream>
+#include <iomanip>
+
+#include "ChaosThreadPool.h"
+
+
+constexpr const int TASK_NUM = 1000000;
+constexpr const int BULK_SIZE = 64;
+constexpr const int WORKER_NUM = 4;
+
+template <typename SubmitFunc>
+static void run(const std::string &desc, bool work_stealing, SubmitFunc submit)
+{
+    std::atomic<int> done(0);
+    chaos::ThreadPool pool(WORKER_NUM, WORKER_NUM, false, work_stealing);
+
+    auto start = std::chrono::steady_clock::now();
+    submit(pool, done);
+    while (done.load(std::memory_order_relaxed) < TASK_NUM) {
+        std::this_thread::yield();
+    }
+    auto elapse = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+
+    std::cout << std::left << std::setw(12) << desc
+              << (work_stealing ? " work-stealing " : " default       ")
+              << std::right << std::setw(10) << elapse / 1000 << "ms "
+              << std::setw(12) << static_cast<long long>(TASK_NUM * 1e6 / elapse) << " tasks/s"
+              << std::endl;
+}
+
+int main()
+{
+    for (bool work_stealing : {false, true}) {
+        run("enqueue", work_stealing, [](chaos::ThreadPool &pool, std::atomic<int> &done) {
+            for (int i = 0; i < TASK_NUM; ++i) {
+                pool.enqueue([&done]() { done.fetch_add(1, std::memory_order_relaxed); });
+            }
+        });
+
+        run("post", work_stealing, [](chaos::ThreadPool &pool, std::atomic<int> &done) {
+            for (int i = 0; i < TASK_NUM; ++i) {
+                pool.post([&done]() { done.fetch_add(1, std::memory_order_relaxed); });
+            }
+        });
+
+        run("post_bulk", work_stealing, [](chaos::ThreadPool &pool, std::atomic<int> &done) {
+            std::vector<chaos::Task> batch;
+            batch.reserve(BULK_SIZE);
+            for (int i = 0; i < TASK_NUM; i += BULK_SIZE) {
+                batch.clear();
+                for (int j = i; j < i + BULK_SIZE && j < TASK_NUM; ++j) {
+                    batch.emplace_back([&done]() { done.fetch_add(1, std::memory_order_relaxed); });
+                }
+                pool.post_bulk(batch.begin(), batch.end());
+            }
+        });
+
+        // 工作线程内部提交的任务，工作窃取模式下进入自己的无锁队列
+        run("nested post", work_stealing, [](chaos::ThreadPool &pool, std::atomic<int> &done) {
+            for (int i = 0; i < WORKER_NUM; ++i) {
+                pool.post([&pool, &done]() {
+                    for (int j = 0; j < TASK_NUM / WORKER_NUM; ++j) {
+                        pool.post([&done]() { done.fetch_add(1, std::memory_order_relaxed); });
+                    }
+                });
+            }
+        });
+    }
+
+    return 0;
+}
@@ -16,17 +16,425 @@
 #include <unordered_map>
 #include <atomic>
 #include <algorithm>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <iterator>
 
 
 namespace chaos {
 
 #define THREAD_STOP_ALL -1
-#define THREAD_MGR_TIMEOUT_S 10 // 管理线程的工作周期，单位：秒
-#define QUEUE_BUSY_NUM 100      // 队列中的任务数量大于该值时，认为线程池处于繁忙状态
-#define QUEUE_IDLE_NUM 10       // 队列中的任务数量小于该值时，认为线程池处于空闲状态
-#define THREAD_STATUS_TIMES 3   // 线程池处于繁忙的或空闲的状态的次数，超过该次数则认为线程池处于该状态
-#define THREAD_CHANGE_SETUP 1   // 动态调整线程池大小时，每次调整的线程数量
 #define POOL_MIN_WORKERS 1      // 线程池中最少存在的工作线程数量
+#define WAIT_HIST_BUCKETS 24    // 排队时间直方图的桶数，按微秒的2的幂划分，最后一个桶约为4.2秒以上
+#define POOL_LANE_NUM 3         // 任务优先级的数量，见Priority
+#define WS_DEQUE_INIT_CAP 256   // 工作窃取模式下，每个工作线程的双端队列的初始容量
+#define WS_SPIN_ROUNDS 64       // 工作窃取模式下，找不到任务时休眠前自旋的次数
+#define WS_PARK_TIMEOUT_MS 100  // 工作窃取模式下，休眠的最长时间，之后重新检查一次
+#define WS_FREE_NODES_MAX 256   // 工作窃取模式下，每个工作线程缓存的空闲任务节点的最大数量
+
+
+/**
+ * @brief 只能移动的void()任务，类似std::function<void()>，
+ *        1. 不要求可调用对象可拷贝，可以直接保存std::packaged_task，unique_ptr等
+ *        2. 不超过INLINE_SIZE字节，且移动构造不抛异常的可调用对象直接保存在内部，
+ *           不需要分配内存，超过的才在堆上分配
+ */
+class Task {
+public:
+    static constexpr std::size_t INLINE_SIZE = 48;
+
+public:
+    Task() noexcept : ops_(nullptr) {}
+
+    template <typename F,
+              typename = typename std::enable_if<
+                  !std::is_same<typename std::decay<F>::type, Task>::value>::type>
+    Task(F &&f)
+        : ops_(nullptr)
+    {
+        using Fn = typename std::decay<F>::type;
+        construct<Fn>(std::forward<F>(f), std::integral_constant<bool, fits_inline<Fn>()>());
+    }
+
+    Task(Task &&other) noexcept
+        : ops_(other.ops_)
+    {
+        if (ops_ != nullptr) {
+            ops_->move(storage_, other.storage_);
+            other.ops_ = nullptr;
+        }
+    }
+
+    Task& operator=(Task &&other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            ops_ = other.ops_;
+            if (ops_ != nullptr) {
+                ops_->move(storage_, other.storage_);
+                other.ops_ = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() { reset(); }
+
+public:
+    void operator()() { ops_->invoke(storage_); }
+    explicit operator bool() const noexcept { return ops_ != nullptr; }
+
+private:
+    struct Ops {
+        void (*invoke)(void *self);
+        // 将src移动到未初始化的dst，并销毁src
+        void (*move)(void *dst, void *src);
+        void (*destroy)(void *self);
+    };
+
+    template <typename Fn>
+    static constexpr bool fits_inline()
+    {
+        return sizeof(Fn) <= INLINE_SIZE
+               && alignof(Fn) <= alignof(std::max_align_t)
+               && std::is_nothrow_move_constructible<Fn>::value;
+    }
+
+    template <typename Fn>
+    struct InlineOps {
+        static void invoke(void *self) { (*static_cast<Fn*>(self))(); }
+        static void move(void *dst, void *src)
+        {
+            new (dst) Fn(std::move(*static_cast<Fn*>(src)));
+            static_cast<Fn*>(src)->~Fn();
+        }
+        static void destroy(void *self) { static_cast<Fn*>(self)->~Fn(); }
+        static const Ops ops;
+    };
+
+    // 内部只保存指向堆上对象的指针
+    template <typename Fn>
+    struct HeapOps {
+        static void invoke(void *self) { (**static_cast<Fn**>(self))(); }
+        static void move(void *dst, void *src) { *static_cast<Fn**>(dst) = *static_cast<Fn**>(src); }
+        static void destroy(void *self) { delete *static_cast<Fn**>(self); }
+        static const Ops ops;
+    };
+
+    template <typename Fn, typename F>
+    void construct(F &&f, std::true_type)
+    {
+        new (storage_) Fn(std::forward<F>(f));
+        ops_ = &InlineOps<Fn>::ops;
+    }
+
+    template <typename Fn, typename F>
+    void construct(F &&f, std::false_type)
+    {
+        *reinterpret_cast<Fn**>(storage_) = new Fn(std::forward<F>(f));
+        ops_ = &HeapOps<Fn>::ops;
+    }
+
+    void reset() noexcept
+    {
+        if (ops_ != nullptr) {
+            ops_->destroy(storage_);
+            ops_ = nullptr;
+        }
+    }
+
+private:
+    alignas(std::max_align_t) unsigned char storage_[INLINE_SIZE];
+    const Ops *ops_;
+};
+
+template <typename Fn>
+const Task::Ops Task::InlineOps<Fn>::ops = {
+    &Task::InlineOps<Fn>::invoke, &Task::InlineOps<Fn>::move, &Task::InlineOps<Fn>::destroy
+};
+
+template <typename Fn>
+const Task::Ops Task::HeapOps<Fn>::ops = {
+    &Task::HeapOps<Fn>::invoke, &Task::HeapOps<Fn>::move, &Task::HeapOps<Fn>::destroy
+};
+
+
+/**
+ * @brief Chase-Lev工作窃取双端队列
+ *        只有拥有者线程可以在底部push和pop（LIFO，缓存友好），
+ *        其他线程从顶部steal（FIFO），三个操作都是无锁的
+ *        容量不足时按2倍扩容，旧的数组可能还在被窃取者读取，
+ *        所以保留到队列销毁时再释放
+ *        参考：Lê et al. Correct and Efficient Work-Stealing for Weak Memory Models
+ */
+template <typename T>
+class WsDeque {
+private:
+    struct Array {
+        explicit Array(int64_t cap)
+            : cap(cap)
+            , mask(cap - 1)
+            , buf(new std::atomic<T*>[cap])
+            {}
+
+        // 槽位使用acquire/release而不是relaxed加fence，效果相同（x86上没有额外开销），
+        // 同时ThreadSanitizer可以正确识别
+        T* get(int64_t i) const { return buf[i & mask].load(std::memory_order_acquire); }
+        void put(int64_t i, T *x) { buf[i & mask].store(x, std::memory_order_release); }
+
+        const int64_t cap;
+        const int64_t mask;
+        std::unique_ptr<std::atomic<T*>[]> buf;
+    };
+
+public:
+    explicit WsDeque(int64_t cap = WS_DEQUE_INIT_CAP)
+        : top_(0)
+        , bottom_(0)
+        , array_(nullptr)
+    {
+        arrays_.emplace_back(new Array(cap));
+        array_.store(arrays_.back().get(), std::memory_order_relaxed);
+    }
+    WsDeque(const WsDeque&) = delete;
+    WsDeque& operator=(const WsDeque&) = delete;
+
+public:
+    /**
+     * @brief 只能由拥有者线程调用
+     */
+    void push(T *x)
+    {
+        int64_t b = bottom_.load(std::memory_order_relaxed);
+        int64_t t = top_.load(std::memory_order_acquire);
+        Array *a = array_.load(std::memory_order_relaxed);
+        if (b - t > a->cap - 1) {
+            a = grow(a, t, b);
+        }
+        a->put(b, x);
+        bottom_.store(b + 1, std::memory_order_release);
+    }
+
+    /**
+     * @brief 只能由拥有者线程调用
+     * @return 队列为空时返回nullptr
+     */
+    T* pop()
+    {
+        int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+        Array *a = array_.load(std::memory_order_relaxed);
+        bottom_.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top_.load(std::memory_order_relaxed);
+
+        T *x = nullptr;
+        if (t <= b) {
+            x = a->get(b);
+            if (t == b) {
+                // 最后一个元素，和窃取者竞争
+                if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                                  std::memory_order_relaxed)) {
+                    x = nullptr;
+                }
+                bottom_.store(b + 1, std::memory_order_relaxed);
+            }
+        } else {
+            bottom_.store(b + 1, std::memory_order_relaxed);
+        }
+        return x;
+    }
+
+    /**
+     * @brief 可以由任意线程调用
+     * @return 队列为空或者竞争失败时返回nullptr
+     */
+    T* steal()
+    {
+        int64_t t = top_.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom_.load(std::memory_order_acquire);
+
+        if (t < b) {
+            Array *a = array_.load(std::memory_order_acquire);
+            T *x = a->get(t);
+            if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                              std::memory_order_relaxed)) {
+                return nullptr;
+            }
+            return x;
+        }
+        return nullptr;
+    }
+
+    /**
+     * @brief 近似的元素数量
+     */
+    int64_t size() const
+    {
+        int64_t b = bottom_.load(std::memory_order_relaxed);
+        int64_t t = top_.load(std::memory_order_relaxed);
+        return b > t ? b - t : 0;
+    }
+
+private:
+    Array* grow(Array *a, int64_t t, int64_t b)
+    {
+        Array *bigger = new Array(a->cap * 2);
+        for (int64_t i = t; i < b; ++i) {
+            bigger->put(i, a->get(i));
+        }
+        arrays_.emplace_back(bigger);
+        array_.store(bigger, std::memory_order_release);
+        return bigger;
+    }
+
+private:
+    std::atomic<int64_t> top_;
+    std::atomic<int64_t> bottom_;
+    std::atomic<Array*> array_;
+    // 只由拥有者线程修改
+    std::vector<std::unique_ptr<Array> > arrays_;
+};
+
+
+/**
+ * @brief 任务的优先级，每个优先级是一条单独的队列，
+ *        工作线程总是先取高优先级队列中的任务，同一队列中的任务先进先出
+ */
+enum class Priority {
+    HIGH = 0,
+    NORMAL = 1,
+    LOW = 2
+};
+
+/**
+ * @brief 提交任务时的选项
+ */
+struct TaskOptions {
+    using Clock = std::chrono::steady_clock;
+
+    TaskOptions(Priority priority = Priority::NORMAL,
+                Clock::time_point deadline = Clock::time_point::max())
+        : priority(priority)
+        , deadline(deadline)
+        {}
+
+    /**
+     * @brief 从现在开始timeout之后截止
+     */
+    template <typename Rep, typename Period>
+    static TaskOptions within(Priority priority, std::chrono::duration<Rep, Period> timeout)
+    {
+        return TaskOptions(priority, Clock::now() + timeout);
+    }
+
+    Priority priority;
+    // 截止时间，到期时还没有开始执行的任务直接丢弃：
+    // post提交的任务不会被执行，enqueue返回的future得到broken_promise错误，
+    // 默认没有截止时间
+    Clock::time_point deadline;
+};
+
+
+/**
+ * @brief 动态调整线程池大小的策略
+ *        管理线程每interval_ms检查一次，统计这个周期内任务的排队时间和工作线程的利用率：
+ *        1. p95排队时间>=up_wait_us，或者所有线程都在执行任务且队列不为空，
+ *           或者利用率>=up_util且队列不为空，记为一次繁忙
+ *        2. p95排队时间<=down_wait_us且利用率<=down_util，记为一次空闲
+ *        3. 连续up_rounds次繁忙时增加step_up个线程，连续down_rounds次空闲时减少step_down个线程
+ *        扩容和缩容的阈值分开，并且缩容需要持续更久，避免线程数量来回抖动
+ */
+struct ScalePolicy {
+    int interval_ms = 100;
+    int64_t up_wait_us = 2000;
+    int64_t down_wait_us = 200;
+    double up_util = 0.9;
+    double down_util = 0.3;
+    unsigned int up_rounds = 2;
+    unsigned int down_rounds = 20;
+    size_t step_up = 2;
+    size_t step_down = 1;
+    // 缩容时最少保留的工作线程数量
+    size_t min_workers = POOL_MIN_WORKERS;
+};
+
+
+/**
+ * @brief 线程池的统计信息，除了queue_depth，workers和active，其他都是累计值，
+ *        两次快照相减（since）得到这段时间内的数据
+ */
+struct PoolStats {
+    // 排队中的任务数量
+    size_t queue_depth = 0;
+    // 工作线程数量
+    size_t workers = 0;
+    // 正在执行任务的工作线程数量
+    size_t active = 0;
+    // 完成的任务数量
+    uint64_t completed = 0;
+    // 超过截止时间被丢弃的任务数量
+    uint64_t expired = 0;
+    // 每个优先级的队列中排队的任务数量，不包括工作窃取模式下工作线程自己的队列
+    size_t lane_depth[POOL_LANE_NUM] = {0};
+    // 执行任务的总时间，单位：纳秒
+    uint64_t busy_ns = 0;
+    // 排队时间直方图，第0个桶为不到1微秒，第i个桶为[2^(i-1), 2^i)微秒
+    uint64_t wait_hist[WAIT_HIST_BUCKETS] = {0};
+
+    static size_t wait_bucket(int64_t wait_ns)
+    {
+        uint64_t us = wait_ns > 0 ? static_cast<uint64_t>(wait_ns) / 1000 : 0;
+        if (us == 0) {
+            return 0;
+        }
+        size_t idx = static_cast<size_t>(64 - __builtin_clzll(us));
+        return std::min(idx, static_cast<size_t>(WAIT_HIST_BUCKETS - 1));
+    }
+
+    /**
+     * @brief 排队时间的百分位数，返回所在桶的上界，没有数据时返回0
+     * @param p 例如0.95
+     */
+    uint64_t wait_percentile_us(double p) const
+    {
+        uint64_t total = 0;
+        for (uint64_t n : wait_hist) { total += n; }
+        if (total == 0) {
+            return 0;
+        }
+
+        uint64_t rank = static_cast<uint64_t>(p * static_cast<double>(total));
+        if (rank >= total) { rank = total - 1; }
+        uint64_t seen = 0;
+        for (size_t i = 0; i < WAIT_HIST_BUCKETS; ++i) {
+            seen += wait_hist[i];
+            if (seen > rank) {
+                return static_cast<uint64_t>(1) << i;
+            }
+        }
+        return static_cast<uint64_t>(1) << (WAIT_HIST_BUCKETS - 1);
+    }
+
+    /**
+     * @brief 相对于更早的快照prev的增量，非累计的值保持当前值
+     */
+    PoolStats since(const PoolStats &prev) const
+    {
+        PoolStats delta = *this;
+        delta.completed -= prev.completed;
+        delta.expired -= prev.expired;
+        delta.busy_ns -= prev.busy_ns;
+        for (size_t i = 0; i < WAIT_HIST_BUCKETS; ++i) {
+            delta.wait_hist[i] -= prev.wait_hist[i];
+        }
+        return delta;
+    }
+};
 
 
 class ThreadPool {
@@ -47,31 +455,175 @@ public:
      *        线程池在退出时会等待所有任务完成，
      *        如果有无法退出的任务则会导致卡死
      * 
-     *        目前线程的调整策略是：
-     *        1. 每THREAD_MGR_TIMEOUT_S秒管理线程检查一次，线程状态
-     *        2. 任务队列>=QUEUE_BUSY_NUM 时，记为一次繁忙
-     *        3. 任务队列<=QUEUE_IDLE_NUM 时，记为一次空闲
-     *        4. 繁忙或空闲状态持续超过THREAD_STATUS_TIMES次，则认为线程池处于该状态
-     *        5. 根据状态对线程池的数量进行调整
+     *        每个任务在提交时记录时间，工作线程取出任务时得到它的排队时间，
+     *        动态调整线程池大小时，根据排队时间的p95和工作线程的利用率进行调整，见ScalePolicy
+     *
+     *        任务按优先级放入不同的队列，见Priority和TaskOptions，
+     *        每个优先级可以限制同时执行的任务数量，见set_lane_cap
      * @param idle_num 线程池中默认存在的工作线程数量
      * @param max_num 线程池中最大可存在的工作线程数量
      * @param dynamic 是否动态调整线程池大小
+     * @param work_stealing 工作窃取模式：
+     *        1. 每个工作线程有自己的无锁双端队列，工作线程中提交的NORMAL优先级的任务
+     *           放入自己的队列（NORMAL没有并发限制时），这些任务不受并发限制
+     *        2. 其他任务放入全局的注入队列（即tasks_）
+     *        3. 工作线程依次从自己的队列，注入队列，随机的其他工作线程的队列中获取任务，
+     *           都没有时先自旋WS_SPIN_ROUNDS次，再休眠，注入队列中有HIGH优先级的任务时优先获取
+     *        适合任务很多很短，或者任务中会继续提交子任务的场景
      */
     ThreadPool(size_t idle_num = 5,
                size_t max_num = 10,
-               bool dynamic = false);
+               bool dynamic = false,
+               bool work_stealing = false,
+               const ScalePolicy &policy = ScalePolicy());
     ~ThreadPool();
 
 public:
     template<typename F, typename... Args>
     auto enqueue(F&& f, Args&&... args)
         -> std::future<typename std::result_of<F(Args...)>::type>;
+    /**
+     * @brief 按指定的优先级和截止时间提交任务，
+     *        任务超过截止时间被丢弃时，future抛出std::future_error（broken_promise）
+     */
+    template<typename F, typename... Args>
+    auto enqueue_with(const TaskOptions &opts, F&& f, Args&&... args)
+        -> std::future<typename std::result_of<F(Args...)>::type>;
+    /**
+     * @brief 提交不需要结果的任务，没有future和共享状态，
+     *        小的可调用对象不需要分配内存
+     *        任务中抛出的异常会被忽略
+     * @throw std::runtime_error 线程池已经停止
+     */
+    template<typename F, typename... Args>
+    void post(F&& f, Args&&... args);
+    template<typename F, typename... Args>
+    void post_with(const TaskOptions &opts, F&& f, Args&&... args);
+    /**
+     * @brief 批量提交不需要结果的任务，只加一次锁
+     * @param first，last 可调用对象的范围，元素会被移动
+     * @throw std::runtime_error 线程池已经停止
+     */
+    template<typename Iter>
+    void post_bulk(Iter first, Iter last, const TaskOptions &opts = TaskOptions());
+    /**
+     * @brief 限制一个优先级同时执行的任务数量，避免后台任务占满所有工作线程
+     * @param cap 0表示不限制
+     */
+    void set_lane_cap(Priority priority, size_t cap);
+    /**
+     * @brief 统计信息的快照，不加锁，可以在任意线程中频繁调用，
+     *        各项数据不是在同一时刻读取的，只保证近似一致
+     */
+    PoolStats stats() const;
+    /**
+     * @brief 排队中的任务数量，不加锁，可以在任意线程中调用
+     */
+    size_t pending_tasks() const;
 
 private:
+    /**
+     * @brief 队列中的任务，附带提交的时间和截止时间
+     */
+    struct QueuedTask {
+        QueuedTask();
+        QueuedTask(Task &&task, int64_t enqueue_ns, const TaskOptions &opts);
+
+        Task task;
+        int64_t enqueue_ns;
+        // 没有截止时间时为INT64_MAX
+        int64_t deadline_ns;
+        size_t lane;
+        // 取出时计入了lane_running_，执行完成后需要减去
+        bool capped;
+    };
+
+    /**
+     * @brief 每个工作线程的统计数据，只由占用它的工作线程写入，
+     *        按max_num_预先分配，线程退出后可以被新的工作线程复用
+     */
+    struct WorkerStats {
+        WorkerStats();
+
+        // 是否已经被某个工作线程占用
+        std::atomic<bool> owned;
+        std::atomic<bool> active;
+        std::atomic<uint64_t> completed;
+        std::atomic<uint64_t> expired;
+        std::atomic<uint64_t> busy_ns;
+        std::atomic<uint64_t> wait_hist[WAIT_HIST_BUCKETS];
+    };
+
+    using NodeList = std::vector<std::unique_ptr<QueuedTask> >;
+
+    /**
+     * @brief 当前线程所属的线程池和双端队列，不是工作线程时pool为nullptr
+     *        free_nodes缓存本线程执行完的任务节点，放入自己的队列时复用，不需要每次分配
+     */
+    struct WorkerCtx {
+        ThreadPool *pool;
+        WsDeque<QueuedTask> *deque;
+        NodeList *free_nodes;
+    };
+    static WorkerCtx& current_worker();
+    static int64_t now_ns();
+
     void create_workers(size_t n);
+    void push_task(Task &&task, const TaskOptions &opts);
+    /**
+     * @brief 从最高的没有达到并发限制的优先级队列中取出任务，必须持有queue_mutex_
+     */
+    bool pop_task_locked(QueuedTask &item);
+    bool has_runnable_locked() const;
+    bool lanes_empty_locked() const;
+    /**
+     * @brief 受并发限制的任务执行完成
+     */
+    void finish_capped(const QueuedTask &item);
+    void finish_task(const QueuedTask &item);
+    void notify_workers(size_t n);
+    /**
+     * @brief 执行任务并记录排队时间和执行时间，
+     *        post提交的任务没有future保存异常，这里直接忽略
+     * @param start 取出任务的时间，见dequeue_ns
+     * @return 任务的结束时间
+     */
+    static int64_t run_task(WorkerStats &stats, QueuedTask &item, int64_t start);
+    /**
+     * @brief 取出任务的时间，连续执行任务时直接使用上一个任务的结束时间，少读一次时钟，
+     *        任务是在上一个任务结束之后才提交的，或者中间等待过（last_end为0）时重新读取时钟
+     */
+    static int64_t dequeue_ns(const QueuedTask &item, int64_t last_end);
+    /**
+     * @brief 创建放入工作线程自己的队列的任务节点，优先复用本线程缓存的节点
+     */
+    static QueuedTask* make_node(WorkerCtx &ctx, Task &&task, int64_t enqueue_ns, const TaskOptions &opts);
+    /**
+     * @brief 任务执行完成后，把节点放回本线程的缓存，缓存满时释放
+     */
+    static void recycle_node(WorkerCtx &ctx, QueuedTask *node);
+    void run_worker(size_t slot);
+    void run_ws_worker(size_t slot);
+    void release_slot(size_t slot);
+    /**
+     * @brief 依次从注入队列和其他工作线程的队列中获取任务
+     * @param injected 从注入队列中取出的任务移动到这里，返回它的地址
+     * @return 窃取到的任务节点，或者&injected，都没有时返回nullptr
+     */
+    QueuedTask* take_ws_task(size_t self, QueuedTask &injected);
+    /**
+     * @brief 从注入队列中取出任务，所有队列都为空时不加锁直接返回false
+     */
+    bool take_injected_task(QueuedTask &item);
+    bool has_ws_task();
+    void wake_ws_worker();
     void create_mgr();
     bool make_adjust_complete();
-    auto check_queue_status() -> QueueStatus;
+    /**
+     * @param delta 这个周期内的统计数据
+     * @param elapsed_ns 周期的实际长度
+     */
+    auto check_queue_status(const PoolStats &delta, int64_t elapsed_ns) -> QueueStatus;
     void handle_queue_busy();
     void handle_queue_idle();
 
@@ -88,27 +640,58 @@ private:
     // 将会从exited_workers_中移除，该线程ID
     // 正常情况下将在所有停止的线程从workers_中移除后，变为空
     std::unordered_set<std::thread::id> exited_workers_;
-    std::queue< std::function<void()> > tasks_;
+    // 每个优先级一条队列
+    std::queue<QueuedTask> tasks_[POOL_LANE_NUM];
+    // tasks_中每条队列的任务数量，在queue_mutex_内修改，不加锁读取
+    std::atomic<size_t> lane_depth_[POOL_LANE_NUM];
+    // 每个优先级的并发限制，0表示不限制
+    std::atomic<size_t> lane_cap_[POOL_LANE_NUM];
+    // 每个优先级正在执行的受限制的任务数量，在queue_mutex_内访问
+    size_t lane_running_[POOL_LANE_NUM];
     std::unordered_map<QueueStatus, unsigned int> queue_status_times_;
+    const ScalePolicy policy_;
     std::mutex queue_mutex_;
     std::condition_variable queue_cond_;
     std::mutex mgr_mutex_;
     std::condition_variable mgr_cond_;
     std::mutex workers_mutex_;
+    const bool work_stealing_;
+    // 按max_num_预先分配，不会重新分配，窃取者可以无锁地遍历
+    std::vector<std::unique_ptr<WsDeque<QueuedTask> > > deques_;
+    // 下标和deques_一致，同样不会重新分配
+    std::vector<std::unique_ptr<WorkerStats> > worker_stats_;
+    // 正在休眠或者准备休眠的工作线程数量
+    std::atomic<int> sleepers_;
 };
 
 inline ThreadPool::ThreadPool(size_t idle_num, 
                               size_t max_num,
-                              bool dynamic)
+                              bool dynamic,
+                              bool work_stealing,
+                              const ScalePolicy &policy)
     : max_num_(max_num)
     , stop_num_(0)
     , stop_mgr_(false)
     , queue_status_times_({{QueueStatus::QUEUE_BUSY, 0},
                            {QueueStatus::QUEUE_IDLE, 0}})
+    , policy_(policy)
+    , work_stealing_(work_stealing)
+    , sleepers_(0)
 {
     if (idle_num > max_num) {
         idle_num = max_num;
     }
+    for (size_t lane = 0; lane < POOL_LANE_NUM; ++lane) {
+        lane_depth_[lane].store(0, std::memory_order_relaxed);
+        lane_cap_[lane].store(0, std::memory_order_relaxed);
+        lane_running_[lane] = 0;
+    }
+    for (size_t i = 0; i < max_num_; ++i) {
+        worker_stats_.emplace_back(new WorkerStats());
+        if (work_stealing_) {
+            deques_.emplace_back(new WsDeque<QueuedTask>());
+        }
+    }
     create_workers(idle_num);
     if (dynamic) {
         create_mgr();
@@ -144,68 +727,530 @@ inline ThreadPool::~ThreadPool()
 template<typename F, typename... Args>
 auto ThreadPool::enqueue(F&& f, Args&&... args)
     -> std::future<typename std::result_of<F(Args...)>::type>
+{
+    return enqueue_with(TaskOptions(), std::forward<F>(f), std::forward<Args>(args)...);
+}
+
+template<typename F, typename... Args>
+auto ThreadPool::enqueue_with(const TaskOptions &opts, F&& f, Args&&... args)
+    -> std::future<typename std::result_of<F(Args...)>::type>
 {
     using return_type = typename std::result_of<F(Args...)>::type;
 
-    auto p_task = std::make_shared<std::packaged_task<return_type()> >(
+    // Task可以保存只能移动的packaged_task，不需要再通过shared_ptr包装一次
+    std::packaged_task<return_type()> p_task(
         std::bind(std::forward<F>(f), std::forward<Args>(args)...)
     );
-    auto ret = p_task->get_future();
+    auto ret = p_task.get_future();
+
+    push_task(Task(std::move(p_task)), opts);
 
+    return ret;
+}
+
+template<typename F, typename... Args>
+void ThreadPool::post(F&& f, Args&&... args)
+{
+    push_task(Task(std::bind(std::forward<F>(f), std::forward<Args>(args)...)), TaskOptions());
+}
+
+template<typename F, typename... Args>
+void ThreadPool::post_with(const TaskOptions &opts, F&& f, Args&&... args)
+{
+    push_task(Task(std::bind(std::forward<F>(f), std::forward<Args>(args)...)), opts);
+}
+
+template<typename Iter>
+void ThreadPool::post_bulk(Iter first, Iter last, const TaskOptions &opts)
+{
+    if (first == last) {
+        return;
+    }
+
+    // 同一批任务使用同一个提交时间
+    int64_t enqueue_ns = now_ns();
+    size_t lane = static_cast<size_t>(opts.priority);
+    WorkerCtx &ctx = current_worker();
+    if (work_stealing_ && ctx.pool == this && opts.priority == Priority::NORMAL
+        && lane_cap_[lane].load(std::memory_order_relaxed) == 0) {
+        for (; first != last; ++first) {
+            ctx.deque->push(make_node(ctx, Task(std::move(*first)), enqueue_ns, opts));
+        }
+        wake_ws_worker();
+        return;
+    }
+
+    size_t n = 0;
     {
         std::unique_lock<std::mutex> lock(queue_mutex_);
         if (stop_num_ == THREAD_STOP_ALL) {
             throw std::runtime_error("ThreadPool is stopped!");
         }
-        tasks_.emplace( [p_task](){ (*p_task)(); } );
+        for (; first != last; ++first, ++n) {
+            tasks_[lane].emplace(Task(std::move(*first)), enqueue_ns, opts);
+        }
+        lane_depth_[lane].store(tasks_[lane].size(), std::memory_order_relaxed);
     }
+    notify_workers(n);
+}
 
-    queue_cond_.notify_one();
+inline void ThreadPool::set_lane_cap(Priority priority, size_t cap)
+{
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        lane_cap_[static_cast<size_t>(priority)].store(cap, std::memory_order_relaxed);
+    }
+    // 放宽限制后，等待中的工作线程可能可以继续执行了
+    queue_cond_.notify_all();
+}
 
-    return ret;
+inline PoolStats ThreadPool::stats() const
+{
+    PoolStats snapshot;
+    snapshot.queue_depth = pending_tasks();
+    for (size_t lane = 0; lane < POOL_LANE_NUM; ++lane) {
+        snapshot.lane_depth[lane] = lane_depth_[lane].load(std::memory_order_relaxed);
+    }
+    for (const auto &ws : worker_stats_) {
+        if (ws->owned.load(std::memory_order_relaxed)) {
+            ++snapshot.workers;
+        }
+        if (ws->active.load(std::memory_order_relaxed)) {
+            ++snapshot.active;
+        }
+        // 线程退出后累计值仍然保留在槽位中
+        snapshot.completed += ws->completed.load(std::memory_order_relaxed);
+        snapshot.expired += ws->expired.load(std::memory_order_relaxed);
+        snapshot.busy_ns += ws->busy_ns.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < WAIT_HIST_BUCKETS; ++i) {
+            snapshot.wait_hist[i] += ws->wait_hist[i].load(std::memory_order_relaxed);
+        }
+    }
+    return snapshot;
+}
+
+inline ThreadPool::QueuedTask::QueuedTask()
+    : enqueue_ns(0)
+    , deadline_ns(INT64_MAX)
+    , lane(static_cast<size_t>(Priority::NORMAL))
+    , capped(false)
+{}
+
+inline ThreadPool::QueuedTask::QueuedTask(Task &&task, int64_t enqueue_ns, const TaskOptions &opts)
+    : task(std::move(task))
+    , enqueue_ns(enqueue_ns)
+    , deadline_ns(INT64_MAX)
+    , lane(static_cast<size_t>(opts.priority))
+    , capped(false)
+{
+    if (opts.deadline != TaskOptions::Clock::time_point::max()) {
+        deadline_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            opts.deadline.time_since_epoch()).count();
+    }
+}
+
+inline ThreadPool::WorkerStats::WorkerStats()
+    : owned(false)
+    , active(false)
+    , completed(0)
+    , expired(0)
+    , busy_ns(0)
+{
+    for (auto &n : wait_hist) {
+        n.store(0, std::memory_order_relaxed);
+    }
+}
+
+inline void ThreadPool::notify_workers(size_t n)
+{
+    if (work_stealing_ && sleepers_.load(std::memory_order_seq_cst) == 0) {
+        return;
+    }
+    if (n == 1) {
+        queue_cond_.notify_one();
+    } else {
+        queue_cond_.notify_all();
+    }
+}
+
+inline int64_t ThreadPool::run_task(WorkerStats &stats, QueuedTask &item, int64_t start)
+{
+    // 只有本线程写入，不需要fetch_add
+    std::atomic<uint64_t> &bucket = stats.wait_hist[PoolStats::wait_bucket(start - item.enqueue_ns)];
+    bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+    if (start > item.deadline_ns) {
+        // 销毁packaged_task时future会得到broken_promise
+        item.task = Task();
+        stats.expired.store(stats.expired.load(std::memory_order_relaxed) + 1,
+                            std::memory_order_relaxed);
+        return start;
+    }
+
+    stats.active.store(true, std::memory_order_relaxed);
+    try {
+        item.task();
+    } catch (...) {
+    }
+
+    int64_t end = now_ns();
+    stats.active.store(false, std::memory_order_relaxed);
+    stats.busy_ns.store(stats.busy_ns.load(std::memory_order_relaxed) + (end - start),
+                        std::memory_order_relaxed);
+    stats.completed.store(stats.completed.load(std::memory_order_relaxed) + 1,
+                          std::memory_order_relaxed);
+    return end;
+}
+
+inline int64_t ThreadPool::dequeue_ns(const QueuedTask &item, int64_t last_end)
+{
+    return last_end != 0 && item.enqueue_ns <= last_end ? last_end : now_ns();
+}
+
+inline ThreadPool::QueuedTask* ThreadPool::make_node(WorkerCtx &ctx, Task &&task, int64_t enqueue_ns,
+                                                     const TaskOptions &opts)
+{
+    if (ctx.free_nodes->empty()) {
+        return new QueuedTask(std::move(task), enqueue_ns, opts);
+    }
+    QueuedTask *node = ctx.free_nodes->back().release();
+    ctx.free_nodes->pop_back();
+    *node = QueuedTask(std::move(task), enqueue_ns, opts);
+    return node;
+}
+
+inline void ThreadPool::recycle_node(WorkerCtx &ctx, QueuedTask *node)
+{
+    // 被窃取的任务由窃取者回收，节点会在线程之间流动，缓存有上限
+    if (ctx.free_nodes->size() < WS_FREE_NODES_MAX) {
+        node->task = Task();
+        ctx.free_nodes->emplace_back(node);
+    } else {
+        delete node;
+    }
+}
+
+inline ThreadPool::WorkerCtx& ThreadPool::current_worker()
+{
+    static thread_local WorkerCtx ctx{nullptr, nullptr, nullptr};
+    return ctx;
+}
+
+inline int64_t ThreadPool::now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline void ThreadPool::push_task(Task &&task, const TaskOptions &opts)
+{
+    int64_t enqueue_ns = now_ns();
+    size_t lane = static_cast<size_t>(opts.priority);
+
+    // 本线程池的工作线程提交的任务，放入自己的队列，不需要加锁
+    WorkerCtx &ctx = current_worker();
+    if (work_stealing_ && ctx.pool == this && opts.priority == Priority::NORMAL
+        && lane_cap_[lane].load(std::memory_order_relaxed) == 0) {
+        ctx.deque->push(make_node(ctx, std::move(task), enqueue_ns, opts));
+        wake_ws_worker();
+        return;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(queue_mutex_);
+        if (stop_num_ == THREAD_STOP_ALL) {
+            throw std::runtime_error("ThreadPool is stopped!");
+        }
+        tasks_[lane].emplace(std::move(task), enqueue_ns, opts);
+        lane_depth_[lane].store(tasks_[lane].size(), std::memory_order_relaxed);
+    }
+    // 工作窃取模式下，休眠的线程在加锁后检查注入队列，所以这里不需要在锁内通知
+    notify_workers(1);
+}
+
+inline bool ThreadPool::pop_task_locked(QueuedTask &item)
+{
+    for (size_t lane = 0; lane < POOL_LANE_NUM; ++lane) {
+        if (tasks_[lane].empty()) {
+            continue;
+        }
+        size_t cap = lane_cap_[lane].load(std::memory_order_relaxed);
+        if (cap != 0 && lane_running_[lane] >= cap) {
+            continue;
+        }
+
+        item = std::move(tasks_[lane].front());
+        tasks_[lane].pop();
+        lane_depth_[lane].store(tasks_[lane].size(), std::memory_order_relaxed);
+        item.capped = (cap != 0);
+        if (item.capped) {
+            ++lane_running_[lane];
+        }
+        return true;
+    }
+    return false;
+}
+
+inline bool ThreadPool::has_runnable_locked() const
+{
+    for (size_t lane = 0; lane < POOL_LANE_NUM; ++lane) {
+        size_t cap = lane_cap_[lane].load(std::memory_order_relaxed);
+        if (!tasks_[lane].empty() && (cap == 0 || lane_running_[lane] < cap)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline bool ThreadPool::lanes_empty_locked() const
+{
+    for (size_t lane = 0; lane < POOL_LANE_NUM; ++lane) {
+        if (!tasks_[lane].empty()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline void ThreadPool::finish_capped(const QueuedTask &item)
+{
+    bool waiting = false;
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        --lane_running_[item.lane];
+        waiting = !tasks_[item.lane].empty();
+    }
+    // 同一优先级还有任务在等待并发名额，唤醒一个工作线程
+    if (waiting) {
+        queue_cond_.notify_one();
+    }
+}
+
+inline void ThreadPool::finish_task(const QueuedTask &item)
+{
+    if (item.capped) {
+        finish_capped(item);
+    }
+}
+
+inline void ThreadPool::wake_ws_worker()
+{
+    // 和run_ws_worker中的++sleepers_配对：
+    // 要么这里看到有线程在休眠，要么休眠的线程看到刚放入的任务
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleepers_.load(std::memory_order_relaxed) > 0) {
+        // 加锁保证通知不会发生在检查任务和开始等待之间
+        { std::lock_guard<std::mutex> lock(queue_mutex_); }
+        queue_cond_.notify_one();
+    }
+}
+
+inline bool ThreadPool::take_injected_task(QueuedTask &item)
+{
+    // 空闲的工作线程自旋时每一轮都会来这里，队列都为空时不加锁，
+    // 避免和其他线程提交任务竞争queue_mutex_，
+    // 没有看到刚放入的任务也没关系，休眠前会在锁内再检查一次
+    bool empty = true;
+    for (size_t lane = 0; lane < POOL_LANE_NUM; ++lane) {
+        if (lane_depth_[lane].load(std::memory_order_relaxed) > 0) {
+            empty = false;
+            break;
+        }
+    }
+    if (empty) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    return pop_task_locked(item);
+}
+
+inline ThreadPool::QueuedTask* ThreadPool::take_ws_task(size_t self, QueuedTask &injected)
+{
+    if (take_injected_task(injected)) {
+        return &injected;
+    }
+    QueuedTask *item = nullptr;
+
+    // 从随机的位置开始窃取，避免所有空闲线程都盯着同一个队列
+    static thread_local uint32_t seed = static_cast<uint32_t>(
+        std::hash<std::thread::id>()(std::this_thread::get_id())) | 1;
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+
+    size_t n = deques_.size();
+    size_t start = seed % n;
+    for (size_t i = 0; i < n; ++i) {
+        size_t victim = (start + i) % n;
+        if (victim == self) { continue; }
+        item = deques_[victim]->steal();
+        if (item != nullptr) {
+            return item;
+        }
+    }
+    return nullptr;
+}
+
+inline bool ThreadPool::has_ws_task()
+{
+    if (has_runnable_locked()) {
+        return true;
+    }
+    for (auto &deque : deques_) {
+        if (deque->size() > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline void ThreadPool::release_slot(size_t slot)
+{
+    {
+        std::lock_guard<std::mutex> lock(workers_mutex_);
+        exited_workers_.emplace(std::this_thread::get_id());
+    }
+    --stop_num_;
+    worker_stats_[slot]->owned.store(false, std::memory_order_release);
+}
+
+inline void ThreadPool::run_ws_worker(size_t slot)
+{
+    WsDeque<QueuedTask> *deque = deques_[slot].get();
+    WorkerStats &stats = *worker_stats_[slot];
+    NodeList free_nodes;
+    free_nodes.reserve(WS_FREE_NODES_MAX);
+    current_worker() = WorkerCtx{this, deque, &free_nodes};
+    // 从注入队列中取出的任务直接移动到这里，不需要分配节点
+    QueuedTask injected;
+    int spins = 0;
+    // 上一个任务的结束时间，自旋或者休眠过之后需要重新读取
+    int64_t last_end = 0;
+
+    for (;;) {
+        QueuedTask *item = nullptr;
+        // 高优先级的任务不在自己的队列后面排队
+        if (lane_depth_[static_cast<size_t>(Priority::HIGH)].load(std::memory_order_relaxed) > 0
+            && take_injected_task(injected)) {
+            item = &injected;
+        }
+        if (item == nullptr) {
+            item = deque->pop();
+        }
+        if (item == nullptr) {
+            item = take_ws_task(slot, injected);
+        }
+        if (item != nullptr) {
+            last_end = run_task(stats, *item, dequeue_ns(*item, spins == 0 ? last_end : 0));
+            finish_task(*item);
+            if (item == &injected) {
+                injected.task = Task();
+            } else {
+                recycle_node(current_worker(), item);
+            }
+            spins = 0;
+            continue;
+        }
+
+        if (++spins < WS_SPIN_ROUNDS) {
+            std::this_thread::yield();
+            continue;
+        }
+        spins = 0;
+
+        std::unique_lock<std::mutex> lock(queue_mutex_);
+        sleepers_.fetch_add(1, std::memory_order_seq_cst);
+        for (;;) {
+            // 自己的队列一定是空的，可以直接退出
+            if (stop_num_ > 0) {
+                sleepers_.fetch_sub(1, std::memory_order_seq_cst);
+                current_worker() = WorkerCtx{nullptr, nullptr, nullptr};
+                release_slot(slot);
+                return;
+            }
+
+            bool has_task = has_ws_task();
+            // 所有任务都完成后才退出，见run_worker
+            if (stop_num_ == THREAD_STOP_ALL && !has_task && lanes_empty_locked()) {
+                sleepers_.fetch_sub(1, std::memory_order_seq_cst);
+                current_worker() = WorkerCtx{nullptr, nullptr, nullptr};
+                return;
+            }
+            if (has_task) {
+                break;
+            }
+            queue_cond_.wait_for(lock, std::chrono::milliseconds(WS_PARK_TIMEOUT_MS));
+        }
+        sleepers_.fetch_sub(1, std::memory_order_seq_cst);
+        last_end = 0;
+    }
+}
+
+inline size_t ThreadPool::pending_tasks() const
+{
+    size_t n = 0;
+    for (size_t lane = 0; lane < POOL_LANE_NUM; ++lane) {
+        n += lane_depth_[lane].load(std::memory_order_relaxed);
+    }
+    for (auto &deque : deques_) {
+        n += static_cast<size_t>(deque->size());
+    }
+    return n;
 }
 
 inline void ThreadPool::create_workers(size_t n)
 {
-    for (unsigned int i = 0; i < n; ++i) {
-        workers_.emplace_back(
-            [this] () -> void {
-                for (;;) {
-                    std::function<void()> task;
-                    {
-                        std::unique_lock<std::mutex> lock(queue_mutex_);
-                        queue_cond_.wait(lock, 
-                            [this]() {
-                                return stop_num_ != 0
-                                       || !tasks_.empty();
-                            }
-                        );
-
-                        // 允许先退出部分线程
-                        if (stop_num_ > 0) {
-                            {
-                                std::lock_guard<std::mutex> lock(workers_mutex_);
-                                exited_workers_.emplace(std::this_thread::get_id());
-                            }
-                            --stop_num_;
-                            return;
-                        }
-
-                        // 退出所有线城时，
-                        // 目前必须等待所有任务都完成，才允许线程退出，
-                        // 因为返回的future可能还在等待结果，
-                        // 如果任务没有完成就被销毁，可能会有意想不到的结果
-                        if (stop_num_ == THREAD_STOP_ALL
-                            && tasks_.empty()) {
-                            return;
-                        }
-                        task = std::move(tasks_.front());
-                        tasks_.pop();
-                    }
-                    task();
+    for (size_t slot = 0; slot < worker_stats_.size() && n > 0; ++slot) {
+        bool expected = false;
+        if (worker_stats_[slot]->owned.compare_exchange_strong(expected, true)) {
+            if (work_stealing_) {
+                workers_.emplace_back(&ThreadPool::run_ws_worker, this, slot);
+            } else {
+                workers_.emplace_back(&ThreadPool::run_worker, this, slot);
+            }
+            --n;
+        }
+    }
+}
+
+inline void ThreadPool::run_worker(size_t slot)
+{
+    WorkerStats &stats = *worker_stats_[slot];
+    int64_t last_end = 0;
+    QueuedTask item;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex_);
+            // 不需要等待时，上一个任务的结束时间就是取出任务的时间
+            if (!has_runnable_locked()) {
+                last_end = 0;
+            }
+            queue_cond_.wait(lock, 
+                [this]() {
+                    return stop_num_ > 0
+                           || has_runnable_locked()
+                           || (stop_num_ == THREAD_STOP_ALL && lanes_empty_locked());
                 }
+            );
+
+            // 允许先退出部分线程
+            if (stop_num_ > 0) {
+                release_slot(slot);
+                return;
+            }
+
+            // 退出所有线城时，
+            // 目前必须等待所有任务都完成，才允许线程退出，
+            // 因为返回的future可能还在等待结果，
+            // 如果任务没有完成就被销毁，可能会有意想不到的结果
+            if (!pop_task_locked(item)) {
+                return;
             }
-        );
+        }
+        last_end = run_task(stats, item, dequeue_ns(item, last_end));
+        item.task = Task();
+        finish_task(item);
     }
 }
 
@@ -213,20 +1258,29 @@ inline void ThreadPool::create_mgr()
 {
     mgr_ = std::thread(
         [this] () -> void {
+            PoolStats prev = stats();
+            int64_t prev_ns = now_ns();
             for (;;) {
                 std::unique_lock<std::mutex> lock(mgr_mutex_);
                 mgr_cond_.wait_for(lock, 
-                    std::chrono::seconds(THREAD_MGR_TIMEOUT_S),
+                    std::chrono::milliseconds(policy_.interval_ms),
                     [this] { return stop_mgr_; });
                 if (stop_mgr_) {
                     return;
                 }
 
+                PoolStats cur = stats();
+                int64_t cur_ns = now_ns();
+                PoolStats delta = cur.since(prev);
+                int64_t elapsed_ns = cur_ns - prev_ns;
+                prev = cur;
+                prev_ns = cur_ns;
+
                 if (make_adjust_complete() == false) {
                     continue;
                 }
 
-                QueueStatus status = check_queue_status();
+                QueueStatus status = check_queue_status(delta, elapsed_ns);
                 if (status == QueueStatus::QUEUE_BUSY) {
                     handle_queue_busy();
                 } else if (status == QueueStatus::QUEUE_IDLE) {
@@ -236,7 +1290,6 @@ inline void ThreadPool::create_mgr()
         }
     );
 }
-
 inline bool ThreadPool::make_adjust_complete()
 {
     if (stop_num_ > 0)  { return false; }
@@ -264,12 +1317,22 @@ inline bool ThreadPool::make_adjust_complete()
     }
 }
 
-inline auto ThreadPool::check_queue_status() -> QueueStatus
+inline auto ThreadPool::check_queue_status(const PoolStats &delta, int64_t elapsed_ns) -> QueueStatus
 {
-    if (tasks_.size() > QUEUE_BUSY_NUM) {
+    int64_t p95_us = static_cast<int64_t>(delta.wait_percentile_us(0.95));
+    double util = 0.0;
+    if (elapsed_ns > 0 && delta.workers > 0) {
+        util = static_cast<double>(delta.busy_ns)
+               / (static_cast<double>(elapsed_ns) * static_cast<double>(delta.workers));
+    }
+    // 执行时间很长的任务完成之前不会计入busy_ns，所以也看正在执行任务的线程数量
+    bool saturated = delta.queue_depth > 0 && delta.active >= delta.workers;
+
+    if (p95_us >= policy_.up_wait_us || saturated
+        || (delta.queue_depth > 0 && util >= policy_.up_util)) {
         ++queue_status_times_[QueueStatus::QUEUE_BUSY];
         queue_status_times_[QueueStatus::QUEUE_IDLE] = 0;
-    } else if (tasks_.size() < QUEUE_IDLE_NUM) {
+    } else if (p95_us <= policy_.down_wait_us && util <= policy_.down_util) {
         ++queue_status_times_[QueueStatus::QUEUE_IDLE];
         queue_status_times_[QueueStatus::QUEUE_BUSY] = 0;
     } else {
@@ -277,9 +1340,11 @@ inline auto ThreadPool::check_queue_status() -> QueueStatus
         queue_status_times_[QueueStatus::QUEUE_IDLE] = 0;
     }
 
-    if (queue_status_times_[QueueStatus::QUEUE_BUSY] >= THREAD_STATUS_TIMES) {
+    if (queue_status_times_[QueueStatus::QUEUE_BUSY] >= policy_.up_rounds) {
+        queue_status_times_[QueueStatus::QUEUE_BUSY] = 0;
         return QueueStatus::QUEUE_BUSY;
-    } else if (queue_status_times_[QueueStatus::QUEUE_IDLE] >= THREAD_STATUS_TIMES) {
+    } else if (queue_status_times_[QueueStatus::QUEUE_IDLE] >= policy_.down_rounds) {
+        queue_status_times_[QueueStatus::QUEUE_IDLE] = 0;
         return QueueStatus::QUEUE_IDLE;
     } else {
         return QueueStatus::QUEUE_NORMAL;
@@ -288,7 +1353,7 @@ inline auto ThreadPool::check_queue_status() -> QueueStatus
 
 inline void ThreadPool::handle_queue_busy()
 {
-    size_t new_workers = THREAD_CHANGE_SETUP;
+    size_t new_workers = policy_.step_up;
     
     if (workers_.size() + new_workers > max_num_) {
         new_workers = max_num_ - workers_.size();
@@ -301,11 +1366,11 @@ inline void ThreadPool::handle_queue_busy()
 
 inline void ThreadPool::handle_queue_idle()
 {
-    size_t rm_workers = THREAD_CHANGE_SETUP;
-
-    if (workers_.size() - rm_workers < POOL_MIN_WORKERS) {
-        rm_workers = workers_.size() - POOL_MIN_WORKERS;
+    size_t min_workers = std::max<size_t>(policy_.min_workers, POOL_MIN_WORKERS);
+    if (workers_.size() <= min_workers) {
+        return;
     }
+    size_t rm_workers = std::min(policy_.step_down, workers_.size() - min_workers);
 
     if (rm_workers > 0) {
         {
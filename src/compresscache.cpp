@@ -0,0 +1,150 @@
+#include "compresscache.h"
+
+#include <cstring>
+
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef LWS_ENABLE_ZLIB
+#include <zlib.h>
+#endif
+
+
+CompressCache::CompressCache(chaos::ThreadPool *worker,
+                             std::size_t max_bytes,
+                             off_t max_file_size,
+                             off_t min_file_size,
+                             int level)
+    : worker_(worker)
+    , max_file_size_(max_file_size)
+    , min_file_size_(min_file_size)
+    , level_(level)
+    , cache_(max_bytes)
+{}
+
+bool CompressCache::available()
+{
+#ifdef LWS_ENABLE_ZLIB
+    return true;
+#else
+    return false;
+#endif
+}
+
+const char* CompressCache::encoding_name(Encoding enc)
+{
+    switch (enc) {
+        case Encoding::GZIP: return "gzip";
+        case Encoding::DEFLATE: return "deflate";
+        default: return "";
+    }
+}
+
+bool CompressCache::compress(const std::string &in, Encoding enc, int level, std::string &out)
+{
+#ifdef LWS_ENABLE_ZLIB
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+
+    // windowBits 15是zlib格式，加16是gzip格式
+    int window_bits = (enc == Encoding::GZIP) ? (15 + 16) : 15;
+    if (deflateInit2(&zs, level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+
+    out.resize(deflateBound(&zs, in.size()));
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+    zs.avail_in = in.size();
+    zs.next_out = reinterpret_cast<Bytef*>(&out[0]);
+    zs.avail_out = out.size();
+
+    int ret = deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+
+    return ret == Z_STREAM_END;
+#else
+    (void)in; (void)enc; (void)level; (void)out;
+    return false;
+#endif
+}
+
+CompressCache::Buffer CompressCache::get(const std::string &path, const OpenFilePtr &file, Encoding enc)
+{
+    if (!available() || file->fd < 0
+        || file->size < min_file_size_ || file->size > max_file_size_) {
+        return nullptr;
+    }
+
+    std::string key = make_key(path, enc);
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        Entry *entry = cache_.get(key);
+        if (entry != nullptr && entry->ino == file->ino
+            && entry->mtime == file->mtime && entry->size == file->size) {
+            return entry->data;
+        }
+        if (pending_.count(key) != 0) {
+            return nullptr;
+        }
+        pending_.insert(key);
+    }
+
+    try {
+        // 压缩是CPU密集的批量任务，不能影响后台线程池中的其他任务
+        worker_->post_with(chaos::TaskOptions(chaos::Priority::LOW),
+                           &CompressCache::build, this, path, enc, file);
+    } catch (const std::exception &) {
+        // 线程池已经停止，不再压缩
+        std::lock_guard<std::mutex> lock(mtx_);
+        pending_.erase(key);
+    }
+
+    return nullptr;
+}
+
+std::size_t CompressCache::bytes()
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    return cache_.cost();
+}
+
+std::string CompressCache::make_key(const std::string &path, Encoding enc)
+{
+    return std::string(encoding_name(enc)) + ':' + path;
+}
+
+void CompressCache::build(const std::string &path, Encoding enc, OpenFilePtr file)
+{
+    std::string key = make_key(path, enc);
+    std::string raw(file->size, '\0');
+
+    // 描述符和ConnLoop共享，必须使用pread
+    off_t total = 0;
+    while (total < file->size) {
+        ssize_t n = pread(file->fd, &raw[total], file->size - total, total);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n <= 0) { break; }
+        total += n;
+    }
+
+    // 文件在打开后被截断了，下一次请求时OpenFileCache会重新打开
+    if (total != file->size) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        pending_.erase(key);
+        return;
+    }
+
+    Entry entry{file->ino, file->mtime, file->size, nullptr};
+    std::string *out = new std::string();
+    Buffer data(out);
+    if (compress(raw, enc, level_, *out) && out->size() < raw.size()) {
+        out->shrink_to_fit();
+        entry.data = data;
+    }
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    pending_.erase(key);
+    // 不值得压缩的条目也占用一点空间，保证它们最终也会被淘汰
+    cache_.put(key, entry, (entry.data ? entry.data->size() : 0) + key.size());
+}
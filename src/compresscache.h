@@ -0,0 +1,106 @@
+#ifndef SRC_COMPRESSCACHE_H_
+#define SRC_COMPRESSCACHE_H_
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
+
+#include <time.h>
+#include <sys/types.h>
+
+#include "lrucache.h"
+#include "filecache.h"
+#include "ChaosThreadPool.h"
+
+
+/**
+ * @brief 静态文件的压缩缓存
+ *        1. 以文件路径+编码为key，保存压缩后的数据，同时记录源文件的inode，mtime和大小，
+ *           源文件修改后，旧的缓存自动失效
+ *        2. 缓存未命中时不会阻塞事件循环，而是把压缩任务交给后台线程池，
+ *           本次请求直接发送未压缩的文件，后续的请求再命中缓存
+ *        3. 总大小有上限，超过后按LRU淘汰
+ *        线程安全，可以被多个ConnLoop共享
+ */
+class CompressCache
+{
+public:
+    enum class Encoding {
+        GZIP,
+        DEFLATE
+    };
+
+    using Buffer = std::shared_ptr<const std::string>;
+
+public:
+    /**
+     * @param worker 执行压缩任务的后台线程池
+     * @param max_bytes 缓存的压缩数据总大小上限
+     * @param max_file_size 超过该大小的文件不压缩
+     * @param min_file_size 小于该大小的文件不压缩，压缩收益太小
+     * @param level zlib压缩等级，1-9
+     */
+    CompressCache(chaos::ThreadPool *worker,
+                  std::size_t max_bytes,
+                  off_t max_file_size,
+                  off_t min_file_size,
+                  int level);
+    CompressCache(const CompressCache&) = delete;
+    CompressCache(CompressCache&&) = delete;
+    CompressCache& operator=(const CompressCache&) = delete;
+    CompressCache& operator=(CompressCache&&) = delete;
+    ~CompressCache() = default;
+
+public:
+    /**
+     * @brief 是否编译了压缩支持（zlib）
+     */
+    static bool available();
+    static const char* encoding_name(Encoding enc);
+    /**
+     * @brief 压缩数据
+     * @param in 原始数据
+     * @param enc 编码，GZIP对应gzip格式，DEFLATE对应zlib格式（HTTP中的deflate）
+     * @param level 压缩等级
+     * @param out 压缩后的数据
+     * @return 是否压缩成功
+     */
+    static bool compress(const std::string &in, Encoding enc, int level, std::string &out);
+
+    /**
+     * @brief 获取压缩后的文件内容
+     *        未命中或者已经过期时，提交后台压缩任务，并返回nullptr
+     * @param path 文件的URL路径，作为缓存的key
+     * @param file 已经打开的文件，后台任务直接从它读取
+     * @return 命中返回压缩数据，否则返回nullptr
+     */
+    Buffer get(const std::string &path, const OpenFilePtr &file, Encoding enc);
+    std::size_t bytes();
+
+private:
+    struct Entry
+    {
+        // mtime只精确到秒，同一秒内被替换成大小相同的文件时靠inode区分
+        ino_t ino;
+        time_t mtime;
+        off_t size;
+        // 为空表示压缩后反而变大了，不值得压缩，避免反复提交任务
+        Buffer data;
+    };
+
+    static std::string make_key(const std::string &path, Encoding enc);
+    void build(const std::string &path, Encoding enc, OpenFilePtr file);
+
+private:
+    chaos::ThreadPool *worker_;
+    const off_t max_file_size_;
+    const off_t min_file_size_;
+    const int level_;
+    std::mutex mtx_;
+    LruCache<std::string, Entry> cache_;
+    // 正在压缩中的key，防止重复提交任务
+    std::unordered_set<std::string> pending_;
+};
+
+#endif // SRC_COMPRESSCACHE_H_
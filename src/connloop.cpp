@@ -1,6 +1,7 @@
 #include "connloop.h"
 
 #include <stdexcept>
+#include <algorithm>
 
 #include <stdio.h>
 #include <unistd.h>
@@ -13,26 +14,56 @@
 #include "spdlog/spdlog.h"
 
 #include "fdutil.h"
+#include "cpuutil.h"
 
 
-ConnLoop::ConnLoop(const ServerConf *const srv_conf, int epoll_wait_timeout)
+// make_shared的控制块（虚表指针和两个引用计数）
+constexpr const std::size_t MEM_SHARED_PTR_CTRL_BYTES = 16;
+// 打开文件缓存每个条目的估算：OpenFile对象及其控制块，LRU链表和哈希表的节点，路径字符串
+constexpr const std::size_t MEM_FILE_CACHE_ENTRY_BYTES = sizeof(OpenFile) + 256;
+
+
+ConnLoop::ConnLoop(const ServerConf *const srv_conf,
+                   const ConnLoopShared *const shared,
+                   int epoll_wait_timeout)
     : srv_conf_(srv_conf)
+    , shared_(shared)
     , stop_(false)
+    , started_(false)
     , epoll_wait_timeout_(epoll_wait_timeout)
     , epfd_(-1)
-    , events_(new struct epoll_event[srv_conf_->epoll_max_events_])
-    , conns_(10000)
+    , events_(nullptr)
+    , file_cache_(shared_->doc_root,
+                  srv_conf_->open_file_cache_max_, srv_conf_->open_file_cache_valid_ms_)
+    , read_scratch_(nullptr)
+    , read_buf_pool_(READ_BUF_POOL_MAX_FREE)
+    , io_done_local_(false)
+    , migrate_num_(0)
+    , migrate_requested_(false)
+    , busy_ns_(0)
+    , conn_num_(0)
+    , open_conns_(0)
+    , lag_ns_(0)
+    , shed_num_(0)
+    , shed_rsp_(UserConn::make_shed_rsp(srv_conf_->shed_retry_after_s_))
+    , mem_stats_at_(SteadyClock::now())
+    , mem_peak_total_(0)
+    , mem_closed_num_(0)
+    , last_active_(SteadyClock::now())
+    , spin_budget_ns_(0)
+    , spin_ns_(0)
+    , draining_(false)
+    , drain_deadline_ns_(0)
     , cmd_sockpair_{-1, -1}
     , cmd_r_buf_{0}
 {
-    expired_.reserve(10000);
     new_cli_socks_.reserve(10000);
     new_cli_socks_swap_.reserve(10000);
 
     epfd_ = epoll_create1(EPOLL_CLOEXEC);
     if (epfd_ == -1) { throw std::runtime_error(strerror(errno)); }
     
-    if (socketpair(AF_UNIX, SOCK_STREAM, 0, cmd_sockpair_) == -1) {
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, cmd_sockpair_) == -1) {
         throw std::runtime_error(strerror(errno));
     }
     // 命令接收的socket设置为非阻塞，添加到epoll中
@@ -59,10 +90,38 @@ void ConnLoop::loop()
 {
     int n_event = 0;
 
+    if (CpuUtil::pin_current_thread(cpus_) != 0) {
+        SPDLOG_WARN("ConnLoop bind cpu failed, running unbound");
+    }
+    init_local();
+    started_.store(true, std::memory_order_release);
+
+    bool busy_poll = srv_conf_->busy_poll_us_ > 0;
+    bool spinning = false;
+    SteadyClock::time_point wait_at;
+
     while (true) {
-        n_event = epoll_wait(epfd_, events_, srv_conf_->epoll_max_events_, epoll_wait_timeout_);
+        int timeout = epoll_wait_timeout_;
+        if (busy_poll) {
+            wait_at = SteadyClock::now();
+            timeout = wait_timeout(wait_at, spinning);
+        }
+        if (draining_ && (timeout < 0 || timeout > DRAIN_CHECK_INTERVAL_MS)) {
+            timeout = DRAIN_CHECK_INTERVAL_MS;
+        }
+        n_event = epoll_wait(epfd_, events_, srv_conf_->epoll_max_events_, timeout);
         // SPDLOG_DEBUG("epoll_wait return n_event: {}", n_event);
-        // SteadyClock::time_point start = SteadyClock::now();
+        SteadyClock::time_point start = SteadyClock::now();
+        if (busy_poll) {
+            adapt_spin_budget(spinning, n_event, wait_at, start);
+            // 自旋时没有事件，不需要检查定时器等，也不计入繁忙时间
+            if (spinning && n_event == 0) {
+                continue;
+            }
+        }
+        if (n_event >= 0) {
+            metrics_.record_events(n_event);
+        }
 
         // 如果等待事件失败，且不是因为系统中断造成的，
         // 直接退出主循环
@@ -76,7 +135,13 @@ void ConnLoop::loop()
             
             if (sockfd == cmd_sockpair_[1]) {
                 cmd_recv();
-                if (stop_) { return; }
+                if (stop_) {
+                    if (busy_poll) {
+                        SPDLOG_INFO("ConnLoop stopped, busy: {}ms, spin: {}ms",
+                                    busy_ns_.load() / 1000000, spin_ns_.load() / 1000000);
+                    }
+                    return;
+                }
             } else if (events_[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
                 handle_conn_close(sockfd);
             } else {
@@ -96,6 +161,11 @@ void ConnLoop::loop()
             }
         }
 
+        if (io_done_local_) {
+            io_done_local_ = false;
+            handle_io_done();
+        }
+
         // auto elapse = std::chrono::duration_cast<std::chrono::seconds>(SteadyClock::now() - start);
         // SPDLOG_DEBUG("epoll_wait elapse: {}s", elapse.count());
 
@@ -104,23 +174,111 @@ void ConnLoop::loop()
         // 这个要想办法解决
         expired_.clear();
         timer_mgr_.handle_expired_timers(expired_);
+        if (!expired_.empty()) {
+            metrics_.timeouts.add(expired_.size());
+        }
         for (auto &sockfd : expired_) {
             handle_conn_close(sockfd);
         }
+
+        // 必须在这一批事件全部处理完之后迁移，
+        // 否则被迁移的连接在这一批中剩余的事件会在本线程中重新创建连接
+        if (migrate_requested_) {
+            migrate_idle_conns();
+        }
+
+        if (srv_conf_->mem_stats_interval_ms_ > 0 && start >= mem_stats_at_) {
+            update_mem_stats();
+            mem_stats_at_ = start + MilliSeconds(srv_conf_->mem_stats_interval_ms_);
+        }
+
+        conn_num_.store(conns_.size(), std::memory_order_relaxed);
+        int64_t batch_ns = std::chrono::duration_cast<NanoSeconds>(SteadyClock::now() - start).count();
+        busy_ns_.store(busy_ns_.load(std::memory_order_relaxed) + batch_ns, std::memory_order_relaxed);
+        int64_t lag_ns = lag_ns_.load(std::memory_order_relaxed);
+        lag_ns_.store(lag_ns + (batch_ns - lag_ns) / LOOP_LAG_EWMA_WEIGHT, std::memory_order_relaxed);
+
+        // 定时器覆盖了所有打开的连接，包括还没有收到数据的
+        if (draining_ && (timer_mgr_.queue_size() == 0
+                          || std::chrono::duration_cast<NanoSeconds>(
+                                 SteadyClock::now().time_since_epoch()).count()
+                             >= drain_deadline_ns_.load(std::memory_order_relaxed))) {
+            SPDLOG_INFO("ConnLoop drained, {} connections left", timer_mgr_.queue_size());
+            return;
+        }
     }
 }
 
+int ConnLoop::wait_timeout(SteadyClock::time_point now, bool &spinning) const
+{
+    int64_t budget = spin_budget_ns_.load(std::memory_order_relaxed);
+    spinning = budget > 0 && (now - last_active_) < NanoSeconds(budget);
+    return spinning ? 0 : epoll_wait_timeout_;
+}
+
+void ConnLoop::adapt_spin_budget(bool spinning, int n_event,
+                                 SteadyClock::time_point wait_at, SteadyClock::time_point now)
+{
+    int64_t budget = spin_budget_ns_.load(std::memory_order_relaxed);
+    int64_t max_ns = static_cast<int64_t>(srv_conf_->busy_poll_us_) * 1000;
+    int64_t min_ns = std::min(static_cast<int64_t>(srv_conf_->busy_poll_min_us_) * 1000, max_ns);
+    int64_t waited = std::chrono::duration_cast<NanoSeconds>(now - wait_at).count();
+
+    if (spinning) {
+        spin_ns_.store(spin_ns_.load(std::memory_order_relaxed) + waited, std::memory_order_relaxed);
+    } else if (n_event > 0 && waited <= max_ns) {
+        budget = std::min(std::max(budget * 2, min_ns), max_ns);
+    } else {
+        budget /= 2;
+        if (budget < min_ns) { budget = 0; }
+    }
+
+    if (n_event > 0) {
+        last_active_ = now;
+    }
+    spin_budget_ns_.store(budget, std::memory_order_relaxed);
+}
+
+void ConnLoop::init_local()
+{
+    // epoll事件数组，连接表，以及之后每个连接的UserConn和读写缓冲区，
+    // 都在本线程中第一次写入，和本线程位于同一个NUMA节点上
+    if (events_ == nullptr) {
+        events_ = new struct epoll_event[srv_conf_->epoll_max_events_];
+    }
+    if (!read_scratch_) {
+        read_scratch_.reset(new char[READ_SCRATCH_BYTES]);
+    }
+    conns_.reserve(10000);
+    expired_.reserve(10000);
+}
+
 void ConnLoop::stop()
 {
     cmd_send(ConnLoopCmd::CMD_CLOSE);
 }
 
+void ConnLoop::drain(SteadyClock::time_point deadline)
+{
+    drain_deadline_ns_.store(std::chrono::duration_cast<NanoSeconds>(deadline.time_since_epoch()).count(),
+                             std::memory_order_relaxed);
+    cmd_send(ConnLoopCmd::CMD_DRAIN);
+}
+
+void ConnLoop::preload_files(const std::vector<std::pair<std::string, OpenFilePtr> > &files)
+{
+    for (auto it = files.rbegin(); it != files.rend(); ++it) {
+        file_cache_.insert(it->first, it->second);
+    }
+}
+
 void ConnLoop::add_clisock_to_queue(int cli_sock)
 {
     {
         std::lock_guard<std::mutex> lock(new_cli_socks_mtx_);
         new_cli_socks_.push_back(cli_sock);
     }
+    open_conns_.fetch_add(1, std::memory_order_relaxed);
 
     cmd_send(ConnLoopCmd::CMD_ADD_FD);
 }
@@ -171,12 +329,106 @@ void ConnLoop::handle_conn_close(int cli_sock)
     conns_.erase(cli_sock);
     timer_mgr_.rm_timer(cli_sock);
     close(cli_sock);
+    open_conns_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+bool ConnLoop::overloaded() const
+{
+    int64_t max_lag_ns = static_cast<int64_t>(srv_conf_->shed_loop_lag_us_) * 1000;
+    if (max_lag_ns > 0 && lag_ns_.load(std::memory_order_relaxed) > max_lag_ns) {
+        return true;
+    }
+    std::size_t max_depth = srv_conf_->shed_io_queue_depth_;
+    return max_depth > 0 && shared_->io_pool != nullptr
+           && shared_->io_pool->pending_tasks() > max_depth;
+}
+
+void ConnLoop::shed_conn(int cli_sock)
+{
+    // 刚收到完整的请求，发送缓冲区是空的，响应很小，一次就能发完，
+    // 发不完也不再等待
+    send(cli_sock, shed_rsp_.data(), shed_rsp_.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    shed_num_.store(shed_num_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    handle_conn_close(cli_sock);
+}
+
+LoopMemStats ConnLoop::mem_stats() const
+{
+    std::lock_guard<std::mutex> lock(mem_mtx_);
+    return mem_stats_;
+}
+
+LoopMemStats ConnLoop::mem_peak() const
+{
+    std::lock_guard<std::mutex> lock(mem_mtx_);
+    return mem_peak_;
+}
+
+std::size_t ConnLoop::mem_peak_total() const
+{
+    std::lock_guard<std::mutex> lock(mem_mtx_);
+    return mem_peak_total_;
+}
+
+void ConnLoop::conn_mem_exceeded(int cli_sock)
+{
+    SPDLOG_WARN("connection memory exceeds {} bytes, closed, cli_sock: {}",
+                srv_conf_->max_conn_mem_bytes_, cli_sock);
+    mem_closed_num_.store(mem_closed_num_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    handle_conn_close(cli_sock);
+}
+
+void ConnLoop::update_mem_stats()
+{
+    LoopMemStats stats;
+    std::vector<int> exceeded;
+    for (const auto &conn : conns_) {
+        const UserConn &user_conn = *(conn.second);
+        std::size_t read_buf = user_conn.read_buf_bytes();
+        std::size_t req = user_conn.req_mem_bytes();
+        std::size_t rsp = user_conn.rsp_mem_bytes();
+        stats.read_bufs += read_buf;
+        stats.requests += req;
+        stats.responses += rsp;
+        if (srv_conf_->max_conn_mem_bytes_ > 0
+            && sizeof(UserConn) + read_buf + req + rsp > srv_conf_->max_conn_mem_bytes_) {
+            exceeded.push_back(conn.first);
+        }
+    }
+    // 哈希表的每个节点额外有一个next指针，make_shared的控制块和UserConn在同一块内存中
+    stats.conns = conns_.size() * (sizeof(UserConn) + MEM_SHARED_PTR_CTRL_BYTES
+                                   + sizeof(decltype(conns_)::value_type) + sizeof(void*))
+                  + conns_.bucket_count() * sizeof(void*);
+    stats.read_pool = (read_scratch_ ? READ_SCRATCH_BYTES : 0) + read_buf_pool_.pooled_bytes();
+    stats.timers = timer_mgr_.mem_bytes();
+    stats.file_cache = file_cache_.size() * MEM_FILE_CACHE_ENTRY_BYTES;
+
+    {
+        std::lock_guard<std::mutex> lock(mem_mtx_);
+        mem_stats_ = stats;
+        mem_peak_.conns = std::max(mem_peak_.conns, stats.conns);
+        mem_peak_.read_bufs = std::max(mem_peak_.read_bufs, stats.read_bufs);
+        mem_peak_.read_pool = std::max(mem_peak_.read_pool, stats.read_pool);
+        mem_peak_.requests = std::max(mem_peak_.requests, stats.requests);
+        mem_peak_.responses = std::max(mem_peak_.responses, stats.responses);
+        mem_peak_.timers = std::max(mem_peak_.timers, stats.timers);
+        mem_peak_.file_cache = std::max(mem_peak_.file_cache, stats.file_cache);
+        mem_peak_total_ = std::max(mem_peak_total_, stats.total());
+    }
+
+    for (int cli_sock : exceeded) {
+        conn_mem_exceeded(cli_sock);
+    }
+    SPDLOG_DEBUG("ConnLoop memory: {} bytes, {} connections, {} closed for exceeding the cap",
+                 stats.total(), conns_.size(), exceeded.size());
 }
 
 void ConnLoop::cmd_recv()
 {
     while (true) {
         bool cmd_recv_add_fd = false;
+        bool cmd_recv_io_done = false;
+        bool cmd_recv_adopt = false;
         int ret = read(cmd_sockpair_[1], cmd_r_buf_, sizeof(cmd_r_buf_));
         // ret == 0 EOF
         // ret == -1:
@@ -203,6 +455,30 @@ void ConnLoop::cmd_recv()
                     }
                     break;
                 }
+                case static_cast<char>(ConnLoopCmd::CMD_DRAIN): {
+                    if (!draining_) {
+                        start_drain();
+                    }
+                    break;
+                }
+                case static_cast<char>(ConnLoopCmd::CMD_MIGRATE): {
+                    migrate_requested_ = true;
+                    break;
+                }
+                case static_cast<char>(ConnLoopCmd::CMD_ADOPT): {
+                    if (!cmd_recv_adopt) {
+                        handle_adopted();
+                        cmd_recv_adopt = true;
+                    }
+                    break;
+                }
+                case static_cast<char>(ConnLoopCmd::CMD_IO_DONE): {
+                    if (!cmd_recv_io_done) {
+                        handle_io_done();
+                        cmd_recv_io_done = true;
+                    }
+                    break;
+                }
                 default: break;
             }
         }
@@ -222,3 +498,211 @@ void ConnLoop::add_clisock_to_epoll()
         timer_mgr_.add_timer(clisock);
     }
 }
+
+void ConnLoop::start_drain()
+{
+    draining_ = true;
+
+    std::vector<int> idle;
+    for (auto &conn : conns_) {
+        if (conn.second->idle()) {
+            idle.push_back(conn.first);
+        }
+    }
+    for (int cli_sock : idle) {
+        handle_conn_close(cli_sock);
+    }
+    SPDLOG_INFO("ConnLoop draining, {} idle connections closed, {} left",
+                idle.size(), timer_mgr_.queue_size());
+}
+
+void ConnLoop::async_open_file(const std::shared_ptr<UserConn> &conn, const std::string &path)
+{
+    std::weak_ptr<UserConn> weak_conn = conn;
+    // 任务持有ConnLoop的引用，保证任务完成前ConnLoop不会被销毁
+    std::shared_ptr<ConnLoop> self = shared_from_this();
+    off_t readahead_bytes = srv_conf_->io_readahead_bytes_;
+
+    try {
+        // 请求在等待打开的结果，排在预读任务的前面
+        shared_->io_pool->post_with(chaos::TaskOptions(chaos::Priority::HIGH),
+                                    [self, weak_conn, path, readahead_bytes]() {
+            OpenFilePtr file = OpenFileCache::open_file(*self->shared_->doc_root, path);
+            if (file->err == 0 && !file->is_dir) {
+                OpenFileCache::warm(*file, 0, readahead_bytes);
+            }
+            self->post_io_done(IoDone{weak_conn, path, file, false});
+        });
+    } catch (const std::exception &) {
+        // 线程池已经停止，直接在本线程中打开
+        post_io_done_local(IoDone{weak_conn, path, OpenFileCache::open_file(*shared_->doc_root, path), false});
+    }
+}
+
+void ConnLoop::async_warm_file(const std::shared_ptr<UserConn> &conn, const OpenFilePtr &file, off_t offset)
+{
+    std::weak_ptr<UserConn> weak_conn = conn;
+    std::shared_ptr<ConnLoop> self = shared_from_this();
+    off_t readahead_bytes = srv_conf_->io_readahead_bytes_;
+
+    try {
+        shared_->io_pool->post([self, weak_conn, file, offset, readahead_bytes]() {
+            OpenFileCache::warm(*file, offset, readahead_bytes);
+            self->post_io_done(IoDone{weak_conn, "", nullptr, false});
+        });
+    } catch (const std::exception &) {
+        post_io_done_local(IoDone{weak_conn, "", nullptr, false});
+    }
+}
+
+void ConnLoop::async_fill_content(const std::shared_ptr<UserConn> &conn, const std::string &path,
+                                  const OpenFilePtr &file)
+{
+    std::weak_ptr<UserConn> weak_conn = conn;
+    std::shared_ptr<ConnLoop> self = shared_from_this();
+
+    try {
+        // 和打开文件一样，请求在等待结果
+        shared_->io_pool->post_with(chaos::TaskOptions(chaos::Priority::HIGH),
+                                    [self, weak_conn, path, file]() {
+            self->shared_->content_cache->get(path, *file);
+            self->post_io_done(IoDone{weak_conn, "", nullptr, false});
+        });
+    } catch (const std::exception &) {
+        // 恢复后跳过探测，直接在本线程中读取
+        post_io_done_local(IoDone{weak_conn, "", nullptr, false});
+    }
+}
+
+void ConnLoop::wake_conn(const std::weak_ptr<UserConn> &conn)
+{
+    post_io_done(IoDone{conn, "", nullptr, true});
+}
+
+void ConnLoop::migrate_conns(const std::shared_ptr<ConnLoop> &target, std::size_t max_num)
+{
+    {
+        std::lock_guard<std::mutex> lock(migrate_mtx_);
+        migrate_target_ = target;
+        migrate_num_ = max_num;
+    }
+
+    cmd_send(ConnLoopCmd::CMD_MIGRATE);
+}
+
+void ConnLoop::migrate_idle_conns()
+{
+    migrate_requested_ = false;
+    std::shared_ptr<ConnLoop> target;
+    std::size_t max_num = 0;
+    {
+        std::lock_guard<std::mutex> lock(migrate_mtx_);
+        target = migrate_target_.lock();
+        max_num = migrate_num_;
+        migrate_target_.reset();
+        migrate_num_ = 0;
+    }
+    if (!target || target.get() == this) {
+        return;
+    }
+
+    std::size_t moved = 0;
+    for (auto it = conns_.begin(); it != conns_.end() && moved < max_num; ) {
+        if (!it->second->idle()) {
+            ++it;
+            continue;
+        }
+
+        int cli_sock = it->first;
+        SteadyClock::time_point expire = SteadyClock::now() + MilliSeconds(DEF_TIMER_EXPIRE_MS);
+        timer_mgr_.get_timer(cli_sock, expire);
+        FdUtil::epoll_del_fd(epfd_, cli_sock);
+        timer_mgr_.rm_timer(cli_sock);
+        target->adopt_conn(it->second, expire);
+        it = conns_.erase(it);
+        open_conns_.fetch_sub(1, std::memory_order_relaxed);
+        ++moved;
+    }
+
+    SPDLOG_DEBUG("migrated {} idle connections", moved);
+}
+
+void ConnLoop::adopt_conn(const std::shared_ptr<UserConn> &conn, SteadyClock::time_point expire)
+{
+    {
+        std::lock_guard<std::mutex> lock(adopted_mtx_);
+        adopted_.push_back(Adopted{conn, expire});
+    }
+    open_conns_.fetch_add(1, std::memory_order_relaxed);
+
+    cmd_send(ConnLoopCmd::CMD_ADOPT);
+}
+
+void ConnLoop::handle_adopted()
+{
+    adopted_swap_.clear();
+    {
+        std::lock_guard<std::mutex> lock(adopted_mtx_);
+        adopted_swap_.swap(adopted_);
+    }
+
+    for (auto &adopted : adopted_swap_) {
+        int cli_sock = adopted.conn->cli_sock();
+        adopted.conn->attach_loop(this);
+        conns_[cli_sock] = adopted.conn;
+        // 保留原来的超时时间，迁移不会延长空闲连接的生命
+        FdUtil::epoll_add_fd_oneshot(epfd_, cli_sock, EPOLLIN | EPOLLRDHUP);
+        timer_mgr_.add_timer(cli_sock, adopted.expire);
+    }
+    adopted_swap_.clear();
+}
+
+void ConnLoop::post_io_done(IoDone &&done)
+{
+    {
+        std::lock_guard<std::mutex> lock(io_done_mtx_);
+        io_done_.push_back(std::move(done));
+    }
+
+    cmd_send(ConnLoopCmd::CMD_IO_DONE);
+}
+
+void ConnLoop::post_io_done_local(IoDone &&done)
+{
+    {
+        std::lock_guard<std::mutex> lock(io_done_mtx_);
+        io_done_.push_back(std::move(done));
+    }
+    io_done_local_ = true;
+}
+
+void ConnLoop::handle_io_done()
+{
+    io_done_swap_.clear();
+    {
+        std::lock_guard<std::mutex> lock(io_done_mtx_);
+        io_done_swap_.swap(io_done_);
+    }
+
+    for (auto &done : io_done_swap_) {
+        if (done.file) {
+            file_cache_.insert(done.path, done.file);
+        }
+
+        // 连接已经被关闭（超时，客户端断开）
+        std::shared_ptr<UserConn> conn = done.conn.lock();
+        if (!conn) {
+            continue;
+        }
+        if (done.wake) {
+            // 连接没有挂起时（重复的唤醒，或者数据已经在发送中）忽略
+            if (!conn->stream_wake()) {
+                continue;
+            }
+        } else {
+            conn->io_done(done.path, done.file);
+        }
+        handle_conn_out(conn->cli_sock(), *conn);
+    }
+    io_done_swap_.clear();
+}
@@ -2,18 +2,79 @@
 #include <vector>
 #include <memory>
 #include <mutex>
+#include <atomic>
 
 #include "timeutil.h"
 
 #include "userconn.h"
 #include "serverconf.h"
+#include "compresscache.h"
+#include "filecache.h"
+#include "contentcache.h"
+#include "mmapcache.h"
+#include "etagcache.h"
+#include "readbufpool.h"
+#include "metrics.h"
+#include "ChaosThreadPool.h"
 
 constexpr const int DEF_EPOLL_WAIT_TIMEOUT = 10 * 1000;
 constexpr const int DEF_CMD_BUFF_LEN = 1024; 
+// 排空连接期间，epoll_wait最多等待这么久，用于检查是否超过期限
+constexpr const int DRAIN_CHECK_INTERVAL_MS = 100;
+// 事件循环延迟的指数移动平均中，新的一批事件的权重为1/LOOP_LAG_EWMA_WEIGHT
+constexpr const int64_t LOOP_LAG_EWMA_WEIGHT = 8;
+// 所有连接共用的接收缓冲区大小，每次recv最多读取这么多
+constexpr const std::size_t READ_SCRATCH_BYTES = 64 * 1024;
+// 读缓冲区池每个等级最多保留的空闲缓冲区数量
+constexpr const std::size_t READ_BUF_POOL_MAX_FREE = 64;
+
+
+/**
+ * @brief 所有ConnLoop共享的资源，
+ *        由LiteWebServer持有，生命周期长于所有的ConnLoop，
+ *        没有启用的功能对应的指针为nullptr
+ */
+struct ConnLoopShared
+{
+    DocRoot *doc_root = nullptr;
+    CompressCache *compress_cache = nullptr;
+    ContentCache *content_cache = nullptr;
+    MmapCache *mmap_cache = nullptr;
+    ETagCache *etag_cache = nullptr;
+    // 执行可能阻塞的文件操作（open，fstat，磁盘读取）的线程池
+    chaos::ThreadPool *io_pool = nullptr;
+};
+
+
+/**
+ * @brief ConnLoop按类别统计的内存占用，单位：字节，
+ *        容器节点等开销是估算的，不包括所有ConnLoop共享的缓存
+ */
+struct LoopMemStats
+{
+    // 连接表和UserConn对象
+    std::size_t conns = 0;
+    // 连接持有的读缓冲区
+    std::size_t read_bufs = 0;
+    // 接收数据的临时缓冲区，以及读缓冲区池中空闲的缓冲区
+    std::size_t read_pool = 0;
+    // 请求行，请求头，请求参数和请求体
+    std::size_t requests = 0;
+    // 响应头，内存中的响应体，流式响应的缓存
+    std::size_t responses = 0;
+    // 定时器
+    std::size_t timers = 0;
+    // 打开文件缓存的条目，文件内容由共享的缓存统计
+    std::size_t file_cache = 0;
+
+    std::size_t total() const {
+        return conns + read_bufs + read_pool + requests + responses + timers + file_cache;
+    }
+};
 
 
 //TODO 优雅的回收所有socketfd？
-class ConnLoop {
+class ConnLoop : public std::enable_shared_from_this<ConnLoop> {
 public:
     /**
      * @brief 命令类型
@@ -23,11 +84,16 @@ public:
     enum class ConnLoopCmd {
         CMD_UNKNOWN = 0,
         CMD_ADD_FD = 1,
-        CMD_CLOSE = 2
+        CMD_CLOSE = 2,
+        CMD_IO_DONE = 3,
+        CMD_MIGRATE = 4,
+        CMD_ADOPT = 5,
+        CMD_DRAIN = 6
     };
 
 public:
     ConnLoop(const ServerConf *const srv_conf,
+             const ConnLoopShared *const shared,
              int epoll_wait_timeout = DEF_EPOLL_WAIT_TIMEOUT);
     /**
      * @brief 五法则，实现拷贝，移动，析构中的任意一个，都需要将其他四个实现
@@ -42,11 +108,137 @@ public:
 public:
     void loop();
     void stop();
+    /**
+     * @brief 优雅的停止：立即关闭空闲的连接，之后的响应都带上Connection: close，
+     *        发送完毕后关闭连接，所有连接关闭或者超过deadline后loop()返回
+     *        调用之前需要停止向本线程分配新连接，可以在任意线程中调用
+     */
+    void drain(SteadyClock::time_point deadline);
+    /**
+     * @brief loop()是否已经开始运行，可以在任意线程中调用
+     */
+    bool started() const { return started_.load(std::memory_order_acquire); }
+    /**
+     * @brief 是否正在排空连接，只能在本线程中调用
+     */
+    bool draining() const { return draining_; }
+    /**
+     * @brief 设置本线程绑定的CPU，在loop()开始时生效
+     *        !!! 只能在loop()开始之前调用
+     * @param cpus 为空表示不绑定
+     */
+    void set_cpu_affinity(const std::vector<int> &cpus) { cpus_ = cpus; }
     void add_clisock_to_queue(int cli_sock);
     void mod_conn_event_read(int cli_sock);
     void mod_conn_event_write(int cli_sock);
     void conn_close(int cli_sock);
     void cmd_send(ConnLoopCmd cmd);
+    const ConnLoopShared* shared() const { return shared_; }
+    OpenFileCache& file_cache() { return file_cache_; }
+    /**
+     * @brief 本线程所有连接共用的接收缓冲区，大小为READ_SCRATCH_BYTES，只能在本线程中使用
+     */
+    char* read_scratch() { return read_scratch_.get(); }
+    /**
+     * @brief 本线程的读缓冲区池，只能在本线程中使用
+     */
+    ReadBufPool& read_buf_pool() { return read_buf_pool_; }
+    /**
+     * @brief 本线程的指标，只能在本线程中写入，可以在任意线程中读取
+     */
+    LoopMetrics& metrics() { return metrics_; }
+    const LoopMetrics& metrics() const { return metrics_; }
+    /**
+     * @brief 将预热时打开的文件放入本线程的文件缓存，
+     *        按逆序插入，列表前面的文件在LRU中最新
+     *        !!! 只能在loop()开始之前调用
+     */
+    void preload_files(const std::vector<std::pair<std::string, OpenFilePtr> > &files);
+    /**
+     * @brief 本线程最近访问的文件，用于保存热点路径列表
+     *        !!! 只能在loop()退出之后调用
+     */
+    std::vector<std::string> hot_paths(std::size_t max) const { return file_cache_.hot_paths(max); }
+    /**
+     * @brief 本线程处理事件（不包括epoll_wait等待）累计的时间
+     *        可以在任意线程中调用
+     */
+    uint64_t busy_ns() const { return busy_ns_.load(std::memory_order_relaxed); }
+    /**
+     * @brief 低延迟模式下自旋（0超时的epoll_wait没有等到事件）累计的时间，不计入busy_ns
+     */
+    uint64_t spin_ns() const { return spin_ns_.load(std::memory_order_relaxed); }
+    /**
+     * @brief 低延迟模式下当前的自旋窗口
+     */
+    int64_t spin_budget_ns() const { return spin_budget_ns_.load(std::memory_order_relaxed); }
+    std::size_t conn_num() const { return conn_num_.load(std::memory_order_relaxed); }
+    /**
+     * @brief 分配给本线程并且还没有关闭的连接数，包括还在队列中和还没有收到数据的，
+     *        用于限制连接数，可以在任意线程中调用
+     */
+    std::size_t open_conns() const { return open_conns_.load(std::memory_order_relaxed); }
+    /**
+     * @brief 过载时直接回复503的请求数
+     */
+    uint64_t shed_num() const { return shed_num_.load(std::memory_order_relaxed); }
+    /**
+     * @brief 事件循环的延迟（每一批事件处理时间的指数移动平均），
+     *        这一批处理期间到达的事件至少要等待这么久
+     */
+    int64_t lag_ns() const { return lag_ns_.load(std::memory_order_relaxed); }
+    /**
+     * @brief 本线程是否过载：延迟超过shed_loop_lag_us_，或者IO线程池排队的任务超过shed_io_queue_depth_，
+     *        只能在本线程中调用
+     */
+    bool overloaded() const;
+    /**
+     * @brief 发送准备好的503响应并关闭连接，只能在本线程中调用
+     */
+    void shed_conn(int cli_sock);
+    /**
+     * @brief 最近一次统计的内存占用，没有启用统计时全部为0，可以在任意线程中调用
+     */
+    LoopMemStats mem_stats() const;
+    /**
+     * @brief 每个类别各自的最高值，可以在任意线程中调用
+     *        各个类别的最高值不一定出现在同一时刻，总量的最高值见mem_peak_total
+     */
+    LoopMemStats mem_peak() const;
+    std::size_t mem_peak_total() const;
+    /**
+     * @brief 因为超过max_conn_mem_bytes_被关闭的连接数
+     */
+    uint64_t mem_closed_num() const { return mem_closed_num_.load(std::memory_order_relaxed); }
+    /**
+     * @brief 关闭占用内存超过上限的连接，只能在本线程中调用
+     */
+    void conn_mem_exceeded(int cli_sock);
+    /**
+     * @brief 请求本线程将最多max_num个空闲连接迁移到target，
+     *        在本线程处理完当前这一批事件后执行，可以在任意线程中调用
+     */
+    void migrate_conns(const std::shared_ptr<ConnLoop> &target, std::size_t max_num);
+    /**
+     * @brief 在IO线程池中打开文件并预读开头的数据，
+     *        完成后在本线程中缓存文件，并通过UserConn::io_done恢复连接
+     *        连接在完成前被关闭的话，结果只会被缓存
+     */
+    void async_open_file(const std::shared_ptr<UserConn> &conn, const std::string &path);
+    /**
+     * @brief 在IO线程池中将文件offset处的数据预读进页缓存，完成后恢复连接
+     */
+    void async_warm_file(const std::shared_ptr<UserConn> &conn, const OpenFilePtr &file, off_t offset);
+    /**
+     * @brief 在IO线程池中读取小文件的内容放入ContentCache，完成后恢复连接
+     */
+    void async_fill_content(const std::shared_ptr<UserConn> &conn, const std::string &path,
+                            const OpenFilePtr &file);
+    /**
+     * @brief 流式响应的生产者有了新数据，通过UserConn::stream_wake恢复连接，
+     *        可以在任意线程中调用
+     */
+    void wake_conn(const std::weak_ptr<UserConn> &conn);
 
 private:
     void handle_conn_in(int cli_sock, UserConn &user_conn);
@@ -54,21 +246,133 @@ private:
     void handle_conn_close(int cli_sock);
     void cmd_recv();
     void add_clisock_to_epoll();
+    /**
+     * @brief 开始排空连接，关闭所有空闲的连接
+     */
+    void start_drain();
+    /**
+     * @brief 在本线程中（绑定CPU之后）分配只由本线程访问的数据，
+     *        按照first-touch策略，内存会被分配在本线程所在的NUMA节点上
+     */
+    void init_local();
+    /**
+     * @brief 计算本次epoll_wait的超时时间，低延迟模式下最近有事件时返回0
+     * @param spinning 是否处于自旋状态
+     */
+    int wait_timeout(SteadyClock::time_point now, bool &spinning) const;
+    /**
+     * @brief 根据本次epoll_wait的结果调整自旋窗口（类似haltpoll）：
+     *        1. 自旋结束后阻塞等待，很快（不超过busy_poll_us_）又有事件，
+     *           说明再多自旋一会儿就可以避免这次唤醒，窗口加倍
+     *        2. 阻塞等待很久或者超时，说明负载较低，窗口减半，小于busy_poll_min_us_时不再自旋
+     * @param wait_at 调用epoll_wait的时间
+     * @param now epoll_wait返回的时间
+     */
+    void adapt_spin_budget(bool spinning, int n_event,
+                           SteadyClock::time_point wait_at, SteadyClock::time_point now);
+    /**
+     * @brief 执行migrate_conns的请求
+     *        连接从epoll和定时器中移除后交给目标线程，
+     *        期间到达的数据留在内核的接收缓冲区中，目标线程注册事件后立即触发
+     */
+    void migrate_idle_conns();
+    /**
+     * @brief 遍历所有连接统计内存占用，同时关闭超过max_conn_mem_bytes_的连接
+     */
+    void update_mem_stats();
+    /**
+     * @brief 由其他ConnLoop调用，交接迁移过来的连接
+     */
+    void adopt_conn(const std::shared_ptr<UserConn> &conn, SteadyClock::time_point expire);
+    void handle_adopted();
+
+    /**
+     * @brief IO线程池中完成的任务
+     *        path为空表示预读任务，否则为打开文件的任务，
+     *        wake为true表示流式响应的唤醒，见wake_conn
+     */
+    struct IoDone
+    {
+        std::weak_ptr<UserConn> conn;
+        std::string path;
+        OpenFilePtr file;
+        bool wake;
+    };
+    /**
+     * @brief 由IO线程池调用，将结果交给本线程
+     */
+    void post_io_done(IoDone &&done);
+    /**
+     * @brief 在本线程中得到的结果（线程池已经停止），不经过cmd_sockpair_，
+     *        阻塞地写入本线程自己读取的socket可能死锁，也不能在这里直接处理，
+     *        调用方的连接还在处理中，处理完当前这一批事件后由loop()调用handle_io_done
+     */
+    void post_io_done_local(IoDone &&done);
+    void handle_io_done();
 
 private:
     const ServerConf *srv_conf_;
+    const ConnLoopShared *shared_;
+    std::vector<int> cpus_;
     bool stop_;
+    std::atomic<bool> started_;
     const int epoll_wait_timeout_;
     int epfd_;
     struct epoll_event *events_;    
     std::unordered_map<int, std::shared_ptr<UserConn> > conns_;
     std::vector<int> expired_;
     TimerManager timer_mgr_;
+    // 每个线程独立的文件缓存，不需要加锁
+    OpenFileCache file_cache_;
+    std::unique_ptr<char[]> read_scratch_;
+    ReadBufPool read_buf_pool_;
     std::vector<int> new_cli_socks_;
     // 因为new_cli_socks_可能被多个线程同时访问，
     // 所以提供个用于交换数据的内部变量，提高访问性能
     std::vector<int> new_cli_socks_swap_;
     std::mutex new_cli_socks_mtx_;
+    // 和new_cli_socks_一样，由IO线程池写入，本线程交换后处理
+    std::vector<IoDone> io_done_;
+    std::vector<IoDone> io_done_swap_;
+    std::mutex io_done_mtx_;
+    // 本线程放入io_done_的结果，见post_io_done_local
+    bool io_done_local_;
+    // 迁移请求，由再平衡线程写入
+    std::weak_ptr<ConnLoop> migrate_target_;
+    std::size_t migrate_num_;
+    bool migrate_requested_;
+    std::mutex migrate_mtx_;
+    // 其他ConnLoop迁移过来的连接及其定时器的超时时间
+    struct Adopted
+    {
+        std::shared_ptr<UserConn> conn;
+        SteadyClock::time_point expire;
+    };
+    std::vector<Adopted> adopted_;
+    std::vector<Adopted> adopted_swap_;
+    std::mutex adopted_mtx_;
+    std::atomic<uint64_t> busy_ns_;
+    std::atomic<std::size_t> conn_num_;
+    std::atomic<std::size_t> open_conns_;
+    // 过载保护的状态，只由本线程写入
+    std::atomic<int64_t> lag_ns_;
+    std::atomic<uint64_t> shed_num_;
+    std::string shed_rsp_;
+    // 内存统计，由本线程定期写入
+    SteadyClock::time_point mem_stats_at_;
+    LoopMemStats mem_stats_;
+    LoopMemStats mem_peak_;
+    std::size_t mem_peak_total_;
+    mutable std::mutex mem_mtx_;
+    std::atomic<uint64_t> mem_closed_num_;
+    LoopMetrics metrics_;
+    // 低延迟模式的状态，只由本线程写入
+    SteadyClock::time_point last_active_;
+    std::atomic<int64_t> spin_budget_ns_;
+    std::atomic<uint64_t> spin_ns_;
+    // 排空连接的状态，draining_只在本线程中访问
+    bool draining_;
+    std::atomic<int64_t> drain_deadline_ns_;
     //TODO use pipe or eventfd?
     int cmd_sockpair_[2];
     char cmd_r_buf_[DEF_CMD_BUFF_LEN];
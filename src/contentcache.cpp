@@ -0,0 +1,94 @@
+#include "contentcache.h"
+
+#include <functional>
+
+#include <errno.h>
+#include <unistd.h>
+
+
+// 分片数量，大于ConnLoop的数量即可
+constexpr const std::size_t CONTENT_CACHE_SHARDS = 16;
+
+
+ContentCache::ContentCache(std::size_t max_bytes, off_t max_file_size)
+    : max_file_size_(max_file_size)
+{
+    shards_.reserve(CONTENT_CACHE_SHARDS);
+    for (std::size_t i = 0; i < CONTENT_CACHE_SHARDS; ++i) {
+        shards_.emplace_back(new Shard(max_bytes / CONTENT_CACHE_SHARDS));
+    }
+}
+
+ContentCache::Buffer ContentCache::get(const std::string &path, const OpenFile &file)
+{
+    Buffer data = peek(path, file);
+    if (data || file.fd < 0 || file.size > max_file_size_) {
+        return data;
+    }
+
+    // 在锁外读取文件，多个线程同时未命中时可能会重复读取，
+    // 但是结果是一样的，后插入的会覆盖先插入的
+    data = read_file(file);
+    if (!data) {
+        return nullptr;
+    }
+
+    Shard &shard = shard_of(path);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    shard.cache.put(path, Entry{file.ino, file.mtime, file.size, data},
+                    data->size() + path.size());
+    return data;
+}
+
+ContentCache::Buffer ContentCache::peek(const std::string &path, const OpenFile &file)
+{
+    if (file.err != 0 || file.is_dir || file.size > max_file_size_) {
+        return nullptr;
+    }
+
+    Shard &shard = shard_of(path);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    Entry *entry = shard.cache.get(path);
+    if (entry != nullptr
+        && entry->ino == file.ino
+        && entry->mtime == file.mtime
+        && entry->size == file.size) {
+        return entry->data;
+    }
+    return nullptr;
+}
+
+std::size_t ContentCache::bytes()
+{
+    std::size_t total = 0;
+    for (auto &shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard->mtx);
+        total += shard->cache.cost();
+    }
+    return total;
+}
+
+ContentCache::Shard& ContentCache::shard_of(const std::string &path)
+{
+    return *shards_[std::hash<std::string>()(path) % shards_.size()];
+}
+
+ContentCache::Buffer ContentCache::read_file(const OpenFile &file)
+{
+    std::string *raw = new std::string(file.size, '\0');
+    Buffer data(raw);
+
+    off_t total = 0;
+    while (total < file.size) {
+        ssize_t n = pread(file.fd, &(*raw)[total], file.size - total, total);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n <= 0) { break; }
+        total += n;
+    }
+
+    // 文件在打开后被截断了，不缓存，等待OpenFileCache重新校验
+    if (total != file.size) {
+        return nullptr;
+    }
+    return data;
+}
@@ -0,0 +1,81 @@
+#ifndef SRC_CONTENTCACHE_H_
+#define SRC_CONTENTCACHE_H_
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <stddef.h>
+
+#include "lrucache.h"
+#include "filecache.h"
+
+
+/**
+ * @brief 小文件的内容缓存
+ *        对于favicon.ico，css，图标等小文件，open，fstat，sendfile的开销比数据本身还大，
+ *        将它们的内容保存在内存中，多个ConnLoop共享只读的数据，
+ *        发送时可以和响应头合并为一次writev
+ *        1. 以文件路径为key，同时记录inode，mtime和大小，文件变化后缓存自动失效
+ *        2. 总大小有上限，超过后按LRU淘汰
+ *        3. 按key的哈希分片加锁，降低多个ConnLoop之间的锁竞争
+ *        线程安全
+ */
+class ContentCache
+{
+public:
+    using Buffer = std::shared_ptr<const std::string>;
+
+public:
+    /**
+     * @param max_bytes 缓存的总大小上限
+     * @param max_file_size 超过该大小的文件不缓存
+     */
+    ContentCache(std::size_t max_bytes, off_t max_file_size);
+    ContentCache(const ContentCache&) = delete;
+    ContentCache(ContentCache&&) = delete;
+    ContentCache& operator=(const ContentCache&) = delete;
+    ContentCache& operator=(ContentCache&&) = delete;
+    ~ContentCache() = default;
+
+public:
+    /**
+     * @brief 获取文件内容，未命中或者已经过期时，从file中读取并缓存
+     * @param path 文件的完整路径
+     * @param file 已经打开的文件
+     * @return 成功返回文件内容，文件太大或者读取失败返回nullptr
+     */
+    Buffer get(const std::string &path, const OpenFile &file);
+    /**
+     * @brief 只查找，不读取文件
+     */
+    Buffer peek(const std::string &path, const OpenFile &file);
+    off_t max_file_size() const { return max_file_size_; }
+    std::size_t bytes();
+
+private:
+    struct Entry
+    {
+        ino_t ino;
+        time_t mtime;
+        off_t size;
+        Buffer data;
+    };
+
+    struct Shard
+    {
+        explicit Shard(std::size_t max_bytes) : cache(max_bytes) {}
+        std::mutex mtx;
+        LruCache<std::string, Entry> cache;
+    };
+
+    Shard& shard_of(const std::string &path);
+    static Buffer read_file(const OpenFile &file);
+
+private:
+    const off_t max_file_size_;
+    std::vector<std::unique_ptr<Shard> > shards_;
+};
+
+#endif // SRC_CONTENTCACHE_H_
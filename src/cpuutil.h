@@ -0,0 +1,178 @@
+#ifndef SRC_CPU_UTIL_
+#define SRC_CPU_UTIL_
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+
+
+/**
+ * @brief CPU和NUMA拓扑相关的工具函数
+ *        全部通过sysfs和cgroup文件获取，不依赖libnuma
+ */
+class CpuUtil
+{
+public:
+    /**
+     * @brief 解析内核格式的CPU（或NUMA节点）列表，例如"0-3,8,10-11"
+     * @return 升序去重的编号，格式错误时返回空
+     */
+    static std::vector<int> parse_cpu_list(const std::string &list);
+    /**
+     * @brief 获取NUMA节点上的所有CPU，节点不存在时返回空
+     */
+    static std::vector<int> node_cpus(int node);
+    /**
+     * @brief 当前进程允许使用的CPU数量（sched_getaffinity）
+     */
+    static int affinity_cpu_count();
+    /**
+     * @brief cgroup限制的CPU数量（quota / period，向上取整），
+     *        同时支持cgroup v2（cpu.max）和v1（cpu.cfs_quota_us），
+     *        没有限制或者无法获取时返回0
+     */
+    static int cgroup_cpu_limit();
+    /**
+     * @brief 默认的ConnLoop线程数：允许使用的CPU数量和cgroup配额中较小的一个
+     * @param max_num 上限
+     */
+    static int default_nthread(int max_num = 255);
+    /**
+     * @brief 将当前线程绑定到cpus上
+     * @return pthread_setaffinity_np的返回值，cpus为空时什么都不做，返回0
+     */
+    static int pin_current_thread(const std::vector<int> &cpus);
+
+private:
+    static bool read_first_line(const std::string &file, std::string &line);
+};
+
+inline std::vector<int> CpuUtil::parse_cpu_list(const std::string &list)
+{
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string item;
+
+    while (std::getline(ss, item, ',')) {
+        item.erase(std::remove_if(item.begin(), item.end(), ::isspace), item.end());
+        if (item.empty()) {
+            continue;
+        }
+
+        const char *begin = item.c_str();
+        char *end = nullptr;
+        long first = strtol(begin, &end, 10);
+        long last = first;
+        if (end == begin) {
+            return std::vector<int>();
+        }
+        if (*end == '-') {
+            begin = end + 1;
+            last = strtol(begin, &end, 10);
+            if (end == begin) {
+                return std::vector<int>();
+            }
+        }
+        if (*end != '\0' || first < 0 || last < first || last >= CPU_SETSIZE) {
+            return std::vector<int>();
+        }
+        for (long cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(static_cast<int>(cpu));
+        }
+    }
+
+    std::sort(cpus.begin(), cpus.end());
+    cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+    return cpus;
+}
+
+inline std::vector<int> CpuUtil::node_cpus(int node)
+{
+    std::string line;
+    if (!read_first_line("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist", line)) {
+        return std::vector<int>();
+    }
+    return parse_cpu_list(line);
+}
+
+inline int CpuUtil::affinity_cpu_count()
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        return n > 0 ? static_cast<int>(n) : 1;
+    }
+    return CPU_COUNT(&set);
+}
+
+inline int CpuUtil::cgroup_cpu_limit()
+{
+    std::string line;
+    long long quota = -1;
+    long long period = 0;
+
+    // cgroup v2: "max 100000" 或者 "200000 100000"
+    if (read_first_line("/sys/fs/cgroup/cpu.max", line)) {
+        char quota_str[32] = {0};
+        if (sscanf(line.c_str(), "%31s %lld", quota_str, &period) == 2
+            && std::string(quota_str) != "max") {
+            quota = atoll(quota_str);
+        }
+    } else {
+        // cgroup v1
+        std::string period_line;
+        if (read_first_line("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", line)
+            && read_first_line("/sys/fs/cgroup/cpu/cpu.cfs_period_us", period_line)) {
+            quota = atoll(line.c_str());
+            period = atoll(period_line.c_str());
+        }
+    }
+
+    if (quota <= 0 || period <= 0) {
+        return 0;
+    }
+    return static_cast<int>((quota + period - 1) / period);
+}
+
+inline int CpuUtil::default_nthread(int max_num)
+{
+    int n = affinity_cpu_count();
+    int limit = cgroup_cpu_limit();
+    if (limit > 0 && limit < n) {
+        n = limit;
+    }
+    return std::max(1, std::min(n, max_num));
+}
+
+inline int CpuUtil::pin_current_thread(const std::vector<int> &cpus)
+{
+    if (cpus.empty()) {
+        return 0;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+inline bool CpuUtil::read_first_line(const std::string &file, std::string &line)
+{
+    std::ifstream in(file);
+    return static_cast<bool>(std::getline(in, line));
+}
+
+#endif // SRC_CPU_UTIL_
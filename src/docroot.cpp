@@ -0,0 +1,122 @@
+#include "docroot.h"
+
+#include <stdexcept>
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+
+DocRoot::DocRoot(const std::string &dir, std::size_t max_dirs, int valid_ms)
+    : dir_(dir)
+    , root_fd_(-1)
+    , has_openat2_(true)
+    , max_dirs_(max_dirs)
+    , valid_(valid_ms)
+    , dirs_(0, max_dirs)
+{
+    root_fd_ = ::open(dir_.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd_ < 0) {
+        throw std::runtime_error("open doc_root " + dir_ + " failed: " + strerror(errno));
+    }
+}
+
+DocRoot::~DocRoot()
+{
+    if (root_fd_ >= 0) {
+        close(root_fd_);
+    }
+}
+
+int DocRoot::open(const std::string &path, int flags)
+{
+    DirFdPtr holder;
+    std::string name;
+    int dirfd = parent_dir(path, holder, name);
+    if (dirfd < 0) {
+        return -1;
+    }
+
+    int fd = openat_beneath(dirfd, name.c_str(), flags);
+    // 指向子目录之外（但仍在doc_root之内）的符号链接，
+    // 相对于子目录解析时会被拒绝，从根目录重新解析一次
+    if (fd < 0 && errno == EXDEV && holder) {
+        fd = openat_beneath(root_fd_, path.c_str() + 1, flags);
+    }
+    return fd;
+}
+
+int DocRoot::stat(const std::string &path, struct stat &st)
+{
+    DirFdPtr holder;
+    std::string name;
+    int dirfd = parent_dir(path, holder, name);
+    if (dirfd < 0) {
+        return -1;
+    }
+    // 只用于校验已经打开过的文件是否变化，不需要再次限制在doc_root中
+    return fstatat(dirfd, name.c_str(), &st, 0);
+}
+
+int DocRoot::parent_dir(const std::string &path, DirFdPtr &holder, std::string &name)
+{
+    std::size_t slash = path.rfind('/');
+    if (slash == std::string::npos || slash == 0 || max_dirs_ == 0) {
+        name = (!path.empty() && path.front() == '/') ? path.substr(1) : path;
+        if (name.empty()) {
+            name = ".";
+        }
+        return root_fd_;
+    }
+
+    std::string dir = path.substr(1, slash - 1);
+    name = path.substr(slash + 1);
+    if (name.empty()) {
+        name = ".";
+    }
+
+    SteadyClock::time_point now = SteadyClock::now();
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        DirFdPtr *cached = dirs_.get(dir);
+        if (cached != nullptr && now < (*cached)->valid_until) {
+            holder = *cached;
+            return holder->fd;
+        }
+    }
+
+    int fd = openat_beneath(root_fd_, dir.c_str(), O_PATH | O_DIRECTORY);
+    if (fd < 0) {
+        return -1;
+    }
+    holder = std::make_shared<DirFd>(fd, now + valid_);
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    dirs_.put(dir, holder);
+    return holder->fd;
+}
+
+int DocRoot::openat_beneath(int dirfd, const char *path, int flags)
+{
+    flags |= O_CLOEXEC;
+
+    if (has_openat2_.load(std::memory_order_relaxed)) {
+        struct open_how how;
+        memset(&how, 0, sizeof(how));
+        how.flags = flags;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+
+        int fd = 0;
+        do {
+            fd = static_cast<int>(syscall(SYS_openat2, dirfd, path, &how, sizeof(how)));
+        } while (fd < 0 && errno == EAGAIN);
+        if (fd >= 0 || errno != ENOSYS) {
+            return fd;
+        }
+        has_openat2_.store(false, std::memory_order_relaxed);
+    }
+
+    return openat(dirfd, path, flags);
+}
@@ -0,0 +1,95 @@
+#ifndef SRC_DOCROOT_H_
+#define SRC_DOCROOT_H_
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <atomic>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "lrucache.h"
+#include "timeutil.h"
+
+
+/**
+ * @brief doc_root目录
+ *        持有doc_root的O_PATH目录描述符，所有文件都相对于它打开，
+ *        内核不需要每次都从'/'开始遍历doc_root的前缀
+ *        1. 优先使用openat2(RESOLVE_BENEATH)，符号链接等任何方式都无法逃出doc_root，
+ *           内核不支持时（< 5.6）退化为openat，此时只依赖路径的规范化阻止".."
+ *        2. 热点子目录的O_PATH描述符也会被缓存，打开"/a/b/c.html"时只需要解析"c.html"，
+ *           子目录描述符有有效期，过期后重新打开，以便感知目录的替换
+ *        线程安全，所有ConnLoop和IO线程池共享
+ */
+class DocRoot
+{
+public:
+    /**
+     * @param dir doc_root目录
+     * @param max_dirs 最多缓存的子目录描述符数量，0表示不缓存
+     * @param valid_ms 子目录描述符的有效期
+     * @throw std::runtime_error 目录无法打开
+     */
+    DocRoot(const std::string &dir, std::size_t max_dirs, int valid_ms);
+    DocRoot(const DocRoot&) = delete;
+    DocRoot(DocRoot&&) = delete;
+    DocRoot& operator=(const DocRoot&) = delete;
+    DocRoot& operator=(DocRoot&&) = delete;
+    ~DocRoot();
+
+public:
+    /**
+     * @brief 打开doc_root下的文件
+     * @param path 规范化后的URL路径（normalize_url_path），以'/'开头
+     * @param flags open的flags，会自动加上O_CLOEXEC
+     * @return 成功返回文件描述符，失败返回-1并设置errno，
+     *         路径逃出doc_root时errno为EXDEV
+     */
+    int open(const std::string &path, int flags);
+    /**
+     * @brief 获取doc_root下的文件信息
+     * @return 成功返回0，失败返回-1并设置errno
+     */
+    int stat(const std::string &path, struct stat &st);
+    const std::string& dir() const { return dir_; }
+
+private:
+    struct DirFd
+    {
+        explicit DirFd(int fd, SteadyClock::time_point valid_until)
+            : fd(fd), valid_until(valid_until) {}
+        ~DirFd() { if (fd >= 0) { close(fd); } }
+        DirFd(const DirFd&) = delete;
+        DirFd& operator=(const DirFd&) = delete;
+
+        int fd;
+        SteadyClock::time_point valid_until;
+    };
+    using DirFdPtr = std::shared_ptr<const DirFd>;
+
+    /**
+     * @brief 获取path所在目录的描述符
+     * @param holder 子目录描述符的引用，使用期间不会被关闭，根目录时为空
+     * @param name 输出path中的文件名部分
+     * @return 目录描述符，失败返回-1并设置errno
+     */
+    int parent_dir(const std::string &path, DirFdPtr &holder, std::string &name);
+    /**
+     * @brief 打开dirfd下的相对路径，不允许逃出dirfd
+     */
+    int openat_beneath(int dirfd, const char *path, int flags);
+
+private:
+    const std::string dir_;
+    int root_fd_;
+    // 内核是否支持openat2，第一次ENOSYS后不再尝试
+    std::atomic<bool> has_openat2_;
+    const std::size_t max_dirs_;
+    const MilliSeconds valid_;
+    std::mutex mtx_;
+    LruCache<std::string, DirFdPtr> dirs_;
+};
+
+#endif // SRC_DOCROOT_H_
@@ -0,0 +1,89 @@
+#include "etagcache.h"
+
+#include <vector>
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+
+
+// 计算哈希时每次读取的大小
+constexpr const std::size_t ETAG_READ_BLOCK_SIZE = 64 * 1024;
+
+
+ETagCache::ETagCache(chaos::ThreadPool *worker, std::size_t max_items, off_t max_file_size)
+    : worker_(worker)
+    , max_file_size_(max_file_size)
+    , cache_(0, max_items)
+{}
+
+std::string ETagCache::get(const std::string &path, const OpenFilePtr &file)
+{
+    if (file->fd < 0 || file->size > max_file_size_) {
+        return "";
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        Entry *entry = cache_.get(path);
+        if (entry != nullptr && entry->ino == file->ino
+            && entry->mtime == file->mtime && entry->size == file->size) {
+            return entry->etag;
+        }
+        if (pending_.count(path) != 0) {
+            return "";
+        }
+        pending_.insert(path);
+    }
+
+    try {
+        worker_->post(&ETagCache::build, this, path, file);
+    } catch (const std::exception &) {
+        // 线程池已经停止，不再计算
+        std::lock_guard<std::mutex> lock(mtx_);
+        pending_.erase(path);
+    }
+
+    return "";
+}
+
+uint64_t ETagCache::fnv1a(const void *data, std::size_t len, uint64_t seed)
+{
+    const unsigned char *p = static_cast<const unsigned char*>(data);
+    uint64_t hash = seed;
+    for (std::size_t i = 0; i < len; ++i) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+void ETagCache::build(const std::string &path, OpenFilePtr file)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    std::vector<char> buf(ETAG_READ_BLOCK_SIZE);
+
+    // 描述符和ConnLoop共享，必须使用pread
+    off_t total = 0;
+    while (total < file->size) {
+        ssize_t n = pread(file->fd, buf.data(), buf.size(), total);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n <= 0) { break; }
+        hash = fnv1a(buf.data(), n, hash);
+        total += n;
+    }
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    pending_.erase(path);
+    // 文件在打开后被截断了，下一次请求时OpenFileCache会重新打开
+    if (total != file->size) {
+        return;
+    }
+
+    // 加上大小，进一步降低碰撞的概率
+    char etag[48] = {0};
+    snprintf(etag, sizeof(etag), "\"%016llx-%llx\"",
+             static_cast<unsigned long long>(hash),
+             static_cast<unsigned long long>(file->size));
+    cache_.put(path, Entry{file->ino, file->mtime, file->size, etag});
+}
@@ -0,0 +1,80 @@
+#ifndef SRC_ETAGCACHE_H_
+#define SRC_ETAGCACHE_H_
+
+#include <string>
+#include <mutex>
+#include <unordered_set>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "lrucache.h"
+#include "filecache.h"
+#include "ChaosThreadPool.h"
+
+
+/**
+ * @brief 基于文件内容哈希的强ETag缓存
+ *        默认的ETag由mtime和大小生成，文件被重新部署（内容不变，mtime变化）后
+ *        所有客户端都需要重新下载，多台机器上同一个文件的ETag也不一致，
+ *        使用内容的哈希（FNV-1a 64位）作为ETag可以避免这些问题
+ *        1. 以文件路径为key，同时记录inode，mtime和大小，文件变化后缓存自动失效
+ *        2. 未命中时不会阻塞事件循环，而是把计算任务交给后台线程池，
+ *           本次请求继续使用mtime和大小生成的ETag
+ *        3. 条目数有上限，超过后按LRU淘汰
+ *        线程安全，可以被多个ConnLoop共享
+ */
+class ETagCache
+{
+public:
+    /**
+     * @param worker 执行哈希计算的后台线程池
+     * @param max_items 最多缓存的条目数
+     * @param max_file_size 超过该大小的文件不计算哈希
+     */
+    ETagCache(chaos::ThreadPool *worker, std::size_t max_items, off_t max_file_size);
+    ETagCache(const ETagCache&) = delete;
+    ETagCache(ETagCache&&) = delete;
+    ETagCache& operator=(const ETagCache&) = delete;
+    ETagCache& operator=(ETagCache&&) = delete;
+    ~ETagCache() = default;
+
+public:
+    /**
+     * @brief 获取文件内容的ETag
+     *        未命中或者已经过期时，提交后台计算任务，并返回空字符串
+     * @param path 文件的URL路径，作为缓存的key
+     * @param file 已经打开的文件，后台任务直接从它读取
+     * @return 命中返回带引号的ETag，否则返回空字符串
+     */
+    std::string get(const std::string &path, const OpenFilePtr &file);
+
+    /**
+     * @brief FNV-1a 64位哈希，可以分块计算，后一块以前一块的结果为seed
+     */
+    static uint64_t fnv1a(const void *data, std::size_t len,
+                          uint64_t seed = 0xcbf29ce484222325ULL);
+
+private:
+    struct Entry
+    {
+        ino_t ino;
+        time_t mtime;
+        off_t size;
+        std::string etag;
+    };
+
+    void build(const std::string &path, OpenFilePtr file);
+
+private:
+    chaos::ThreadPool *worker_;
+    const off_t max_file_size_;
+    std::mutex mtx_;
+    LruCache<std::string, Entry> cache_;
+    // 正在计算中的文件，防止重复提交任务
+    std::unordered_set<std::string> pending_;
+};
+
+#endif // SRC_ETAGCACHE_H_
@@ -1,13 +1,30 @@
 #ifndef SRC_FD_UTIL_
 #define SRC_FD_UTIL_
 
+#include <vector>
+
 #include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
 
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/sockios.h>
 #include <netinet/tcp.h> 
 #include <netinet/ip.h>
 
+// 较老的libc头文件中没有定义
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
 
 class FdUtil
 {
@@ -41,8 +58,48 @@ public:
      */
     static int set_socket_nodelay(int fd);
     static int set_socket_reuseaddr(int fd);
+    static int set_socket_reuseport(int fd);
+    /**
+     * @brief 设置TCP_NOTSENT_LOWAT
+     *        发送队列中未发送的数据少于bytes时，socket才是可写的，
+     *        可以减少内核中堆积的数据，降低内存占用和可写事件的次数
+     */
+    static int set_tcp_notsent_lowat(int fd, int bytes);
+    /**
+     * @brief 设置SO_BUSY_POLL和SO_PREFER_BUSY_POLL（Linux 5.11+），
+     *        读取时先忙轮询网卡队列usec微秒，而不是等待中断
+     * @return 任意一个设置失败都返回-1
+     */
+    static int set_socket_busy_poll(int fd, int usec);
+    /**
+     * @brief 获取发送缓冲区大小（SO_SNDBUF），
+     *        开启自动调整时，这个值会随着连接的状况变化
+     * @return 失败返回-1
+     */
+    static int get_socket_sndbuf(int fd);
+    /**
+     * @brief 获取发送队列中还没有发送出去的字节数（SIOCOUTQNSD），
+     *        和TCP_INFO中的tcpi_notsent_bytes相同，但是glibc的tcp_info没有这个字段
+     * @return 失败返回-1
+     */
+    static int get_tcp_notsent_bytes(int fd);
+    /**
+     * @brief 通过Unix域socket发送描述符（SCM_RIGHTS），对端收到的是同一个打开的文件
+     * @param sock AF_UNIX socket
+     * @param fds 最多FD_PASS_MAX个
+     * @return sendmsg的返回值
+     */
+    static int send_fds(int sock, const std::vector<int> &fds);
+    /**
+     * @brief 接收send_fds发送的描述符，收到的描述符设置了FD_CLOEXEC
+     * @return 成功返回0，失败或者描述符被截断时返回-1，已经收到的描述符会被关闭
+     */
+    static int recv_fds(int sock, std::vector<int> &fds);
 };
 
+// send_fds一次最多发送的描述符数量
+constexpr const std::size_t FD_PASS_MAX = 64;
+
 inline int FdUtil::set_nonblocking(int fd)
 {
     int flags = fcntl(fd, F_GETFL, 0);
@@ -91,4 +148,122 @@ inline int FdUtil::set_socket_reuseaddr(int fd)
     return setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
 }
 
+inline int FdUtil::set_socket_reuseport(int fd)
+{
+    int flag = 1;
+    return setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag));
+}
+
+inline int FdUtil::set_tcp_notsent_lowat(int fd, int bytes)
+{
+    return setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &bytes, sizeof(bytes));
+}
+
+inline int FdUtil::set_socket_busy_poll(int fd, int usec)
+{
+    int prefer = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) != 0) {
+        return -1;
+    }
+    return setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer));
+}
+
+inline int FdUtil::get_socket_sndbuf(int fd)
+{
+    int sndbuf = 0;
+    socklen_t len = sizeof(sndbuf);
+    if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) != 0) {
+        return -1;
+    }
+    return sndbuf;
+}
+
+inline int FdUtil::get_tcp_notsent_bytes(int fd)
+{
+    int bytes = 0;
+    if (ioctl(fd, SIOCOUTQNSD, &bytes) != 0) {
+        return -1;
+    }
+    return bytes;
+}
+
+inline int FdUtil::send_fds(int sock, const std::vector<int> &fds)
+{
+    if (fds.empty() || fds.size() > FD_PASS_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // 至少要发送一个字节的数据，这里是描述符的数量
+    unsigned char num = static_cast<unsigned char>(fds.size());
+    struct iovec iov;
+    iov.iov_base = &num;
+    iov.iov_len = sizeof(num);
+
+    std::vector<char> ctrl(CMSG_SPACE(sizeof(int) * fds.size()), 0);
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.data();
+    msg.msg_controllen = ctrl.size();
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+
+    int ret = -1;
+    do {
+        ret = static_cast<int>(sendmsg(sock, &msg, MSG_NOSIGNAL));
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+inline int FdUtil::recv_fds(int sock, std::vector<int> &fds)
+{
+    fds.clear();
+
+    unsigned char num = 0;
+    struct iovec iov;
+    iov.iov_base = &num;
+    iov.iov_len = sizeof(num);
+
+    std::vector<char> ctrl(CMSG_SPACE(sizeof(int) * FD_PASS_MAX), 0);
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.data();
+    msg.msg_controllen = ctrl.size();
+
+    ssize_t ret = -1;
+    do {
+        ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (ret < 0 && errno == EINTR);
+    if (ret <= 0) {
+        if (ret == 0) { errno = ECONNRESET; }
+        return -1;
+    }
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        std::size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        std::size_t old = fds.size();
+        fds.resize(old + n);
+        memcpy(fds.data() + old, CMSG_DATA(cmsg), sizeof(int) * n);
+    }
+
+    if ((msg.msg_flags & MSG_CTRUNC) || fds.size() != num) {
+        for (int fd : fds) { close(fd); }
+        fds.clear();
+        errno = EMSGSIZE;
+        return -1;
+    }
+    return 0;
+}
+
 #endif // SRC_FD_UTIL_
@@ -0,0 +1,172 @@
+#include "filecache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+
+OpenFileCache::OpenFileCache(DocRoot *doc_root, std::size_t max_items, int valid_ms)
+    : doc_root_(doc_root)
+    , max_items_(max_items)
+    , valid_(valid_ms)
+    , cache_(0, max_items)
+{}
+
+OpenFilePtr OpenFileCache::open(const std::string &path)
+{
+    OpenFilePtr file = lookup(path);
+    if (file) {
+        return file;
+    }
+
+    file = open_file(*doc_root_, path);
+    insert(path, file);
+    return file;
+}
+
+OpenFilePtr OpenFileCache::lookup(const std::string &path)
+{
+    if (max_items_ == 0) {
+        return nullptr;
+    }
+
+    Entry *entry = cache_.get(path);
+    if (entry == nullptr) {
+        return nullptr;
+    }
+
+    SteadyClock::time_point now = SteadyClock::now();
+    if (now < entry->valid_until) {
+        return entry->file;
+    }
+    if (still_valid(path, *(entry->file))) {
+        entry->valid_until = now + valid_;
+        return entry->file;
+    }
+    return nullptr;
+}
+
+void OpenFileCache::insert(const std::string &path, const OpenFilePtr &file)
+{
+    if (max_items_ == 0) {
+        return;
+    }
+
+    // 除了不存在的文件，其他错误（例如EMFILE）可能是暂时的，不缓存
+    if (file->err == 0 || file->err == ENOENT || file->err == ENOTDIR) {
+        cache_.put(path, Entry{file, SteadyClock::now() + valid_});
+    } else {
+        cache_.erase(path);
+    }
+}
+
+void OpenFileCache::invalidate(const OpenFile &file)
+{
+    // 调用方不一定知道缓存的key（例如预压缩文件），只在出错时调用，直接遍历
+    std::vector<std::string> paths;
+    cache_.for_each([&paths, &file](const std::string &path, const Entry &entry) -> bool {
+        if (entry.file.get() == &file) {
+            paths.push_back(path);
+        }
+        return true;
+    });
+    for (const auto &path : paths) {
+        cache_.erase(path);
+    }
+}
+
+OpenFilePtr OpenFileCache::open_file(DocRoot &doc_root, const std::string &path)
+{
+    std::shared_ptr<OpenFile> file = std::make_shared<OpenFile>();
+
+    file->fd = doc_root.open(path, O_RDONLY);
+    if (file->fd < 0) {
+        file->err = errno;
+        return file;
+    }
+
+    struct stat file_stat;
+    if (fstat(file->fd, &file_stat) != 0) {
+        file->err = errno;
+        close(file->fd);
+        file->fd = -1;
+        return file;
+    }
+
+    file->size = file_stat.st_size;
+    file->mtime = file_stat.st_mtime;
+    file->ino = file_stat.st_ino;
+    file->is_dir = S_ISDIR(file_stat.st_mode);
+    file->type = get_file_content_type(path);
+    // 目录不需要保持打开
+    if (file->is_dir) {
+        close(file->fd);
+        file->fd = -1;
+    }
+
+    return file;
+}
+
+bool OpenFileCache::still_valid(const std::string &path, const OpenFile &file)
+{
+    struct stat file_stat;
+    if (doc_root_->stat(path, file_stat) != 0) {
+        // 之前不存在，现在仍然不存在
+        return file.err != 0 && (errno == ENOENT || errno == ENOTDIR);
+    }
+
+    if (file.err != 0) {
+        return false;
+    }
+
+    return file_stat.st_ino == file.ino
+           && file_stat.st_mtime == file.mtime
+           && file_stat.st_size == file.size
+           && S_ISDIR(file_stat.st_mode) == file.is_dir;
+}
+
+std::vector<std::string> OpenFileCache::hot_paths(std::size_t max) const
+{
+    std::vector<std::string> paths;
+    cache_.for_each([&paths, max](const std::string &path, const Entry &entry) -> bool {
+        if (paths.size() >= max) {
+            return false;
+        }
+        if (entry.file->err == 0 && !entry.file->is_dir) {
+            paths.push_back(path);
+        }
+        return true;
+    });
+    return paths;
+}
+
+bool OpenFileCache::page_cached(const OpenFile &file, off_t offset)
+{
+    if (file.fd < 0 || offset >= file.size) {
+        return true;
+    }
+
+    char byte = 0;
+    struct iovec iov;
+    iov.iov_base = &byte;
+    iov.iov_len = sizeof(byte);
+    ssize_t n = preadv2(file.fd, &iov, 1, offset, RWF_NOWAIT);
+    return n >= 0 || errno != EAGAIN;
+}
+
+void OpenFileCache::warm(const OpenFile &file, off_t offset, off_t len)
+{
+    if (file.fd < 0 || offset >= file.size || len <= 0) {
+        return;
+    }
+
+    // readahead只负责提交读请求，再读一个字节等待第一页数据就绪，
+    // 之后的数据由内核的预读继续跟上
+    readahead(file.fd, offset, len);
+    char byte = 0;
+    ssize_t n = 0;
+    do {
+        n = pread(file.fd, &byte, sizeof(byte), offset);
+    } while (n < 0 && errno == EINTR);
+}
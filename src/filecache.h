@@ -0,0 +1,142 @@
+#ifndef SRC_FILECACHE_H_
+#define SRC_FILECACHE_H_
+
+#include <string>
+#include <memory>
+#include <vector>
+
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "lrucache.h"
+#include "timeutil.h"
+#include "httpdata.h"
+#include "docroot.h"
+
+
+/**
+ * @brief 打开的文件及其元数据
+ *        多个连接共享同一个文件描述符，最后一个引用释放时关闭文件，
+ *        所以被缓存淘汰的文件，在正在发送它的连接结束前不会被关闭
+ */
+struct OpenFile
+{
+public:
+    OpenFile()
+        : fd(-1)
+        , err(0)
+        , size(0)
+        , mtime(0)
+        , ino(0)
+        , is_dir(false)
+        , type(HttpContentType::UNKNOWN)
+        {}
+    ~OpenFile() { if (fd >= 0) { close(fd); } }
+    OpenFile(const OpenFile&) = delete;
+    OpenFile(OpenFile&&) = delete;
+    OpenFile& operator=(const OpenFile&) = delete;
+    OpenFile& operator=(OpenFile&&) = delete;
+
+public:
+    int fd;
+    // 打开失败时的errno，不为0时其他字段无意义，
+    // 不存在的文件也会被缓存，避免反复查找（例如预压缩文件）
+    int err;
+    off_t size;
+    time_t mtime;
+    ino_t ino;
+    bool is_dir;
+    HttpContentType type;
+};
+
+using OpenFilePtr = std::shared_ptr<const OpenFile>;
+
+
+/**
+ * @brief 打开文件的缓存，缓存文件描述符和stat信息
+ *        1. 命中且没有过期时，不需要open，fstat等任何系统调用
+ *        2. 过期后通过stat重新校验，文件没有变化时继续使用旧的描述符，
+ *           变化了（inode，mtime，size不同）才重新打开
+ *        3. 条目数有上限，超过后按LRU淘汰
+ *        !!! 非线程安全，每个ConnLoop持有一个，只在自己的线程中使用
+ */
+class OpenFileCache
+{
+public:
+    /**
+     * @param doc_root 文件所在的doc_root，缓存中的路径都相对于它
+     * @param max_items 最多缓存的文件数量，0表示不缓存
+     * @param valid_ms 缓存条目的有效期，过期后需要重新校验
+     */
+    OpenFileCache(DocRoot *doc_root, std::size_t max_items, int valid_ms);
+    OpenFileCache(const OpenFileCache&) = delete;
+    OpenFileCache(OpenFileCache&&) = delete;
+    OpenFileCache& operator=(const OpenFileCache&) = delete;
+    OpenFileCache& operator=(OpenFileCache&&) = delete;
+    ~OpenFileCache() = default;
+
+public:
+    /**
+     * @brief 打开文件（只读）
+     * @param path 规范化后的URL路径，同时也是缓存的key
+     * @return 总是返回非空的指针，打开失败时err不为0
+     */
+    OpenFilePtr open(const std::string &path);
+    /**
+     * @brief 只查找缓存，过期的条目会通过stat重新校验
+     * @return 命中返回文件，未命中或者文件已经变化返回nullptr
+     */
+    OpenFilePtr lookup(const std::string &path);
+    /**
+     * @brief 缓存在其他线程中打开的文件，open_file的结果
+     */
+    void insert(const std::string &path, const OpenFilePtr &file);
+    /**
+     * @brief 文件在有效期内被修改（例如被截断），和缓存的信息不一致时调用，
+     *        删除所有指向file的条目，下次访问时重新打开
+     */
+    void invalidate(const OpenFile &file);
+    std::size_t size() const { return cache_.size(); }
+    /**
+     * @brief 按最近访问顺序返回缓存中的普通文件的路径
+     * @param max 最多返回的数量
+     */
+    std::vector<std::string> hot_paths(std::size_t max) const;
+
+    /**
+     * @brief 打开文件并获取stat信息，不访问缓存，可以在任意线程中调用
+     */
+    static OpenFilePtr open_file(DocRoot &doc_root, const std::string &path);
+    /**
+     * @brief 通过preadv2(RWF_NOWAIT)探测offset处的数据是否已经在页缓存中，
+     *        不在时直接sendfile会阻塞当前线程直到磁盘读取完成
+     *        内核或者文件系统不支持RWF_NOWAIT时，总是返回true
+     */
+    static bool page_cached(const OpenFile &file, off_t offset);
+    /**
+     * @brief 将[offset, offset + len)的数据预读进页缓存，
+     *        会阻塞到第一页数据读取完成，只能在后台线程中调用
+     */
+    static void warm(const OpenFile &file, off_t offset, off_t len);
+
+private:
+    struct Entry
+    {
+        OpenFilePtr file;
+        SteadyClock::time_point valid_until;
+    };
+
+    /**
+     * @brief 通过stat判断文件是否还是缓存中的那个文件
+     */
+    bool still_valid(const std::string &path, const OpenFile &file);
+
+private:
+    DocRoot *doc_root_;
+    const std::size_t max_items_;
+    const MilliSeconds valid_;
+    LruCache<std::string, Entry> cache_;
+};
+
+#endif // SRC_FILECACHE_H_
@@ -58,4 +58,48 @@ inline std::string combine_two_path(const std::string &first, const std::string
     }
 }
 
+/**
+ * @brief 规范化URL路径
+ *        合并连续的'/'，去掉"."，按字面处理".."，
+ *        "/a//b/./c" -> "/a/b/c"，"/a/../b" -> "/b"，末尾的'/'会被保留
+ * @param path 以'/'开头的URL路径
+ * @param out 规范化后的路径，以'/'开头
+ * @return 路径为空，不以'/'开头，或者".."超出了根目录时返回false
+ */
+inline bool normalize_url_path(const std::string &path, std::string &out)
+{
+    if (path.empty() || path.front() != '/') {
+        return false;
+    }
+
+    out.clear();
+    out.reserve(path.size());
+    std::size_t pos = 0;
+    while (pos < path.size()) {
+        std::size_t end = path.find('/', pos);
+        if (end == std::string::npos) {
+            end = path.size();
+        }
+        std::size_t len = end - pos;
+
+        if (len == 0 || (len == 1 && path[pos] == '.')) {
+            // 空的部分或者"."
+        } else if (len == 2 && path[pos] == '.' && path[pos + 1] == '.') {
+            if (out.empty()) {
+                return false;
+            }
+            out.erase(out.rfind('/'));
+        } else {
+            out.push_back('/');
+            out.append(path, pos, len);
+        }
+        pos = end + 1;
+    }
+
+    if (out.empty() || path.back() == '/') {
+        out.push_back('/');
+    }
+    return true;
+}
+
 #endif //SRC_FILEPATHUTIL_H_
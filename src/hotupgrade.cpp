@@ -0,0 +1,205 @@
+#include "hotupgrade.h"
+
+#include <fstream>
+#include <iterator>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "fdutil.h"
+
+extern char **environ;
+
+
+// 记录channel描述符的环境变量
+constexpr const char *UPGRADE_ENV = "LWS_UPGRADE_FD";
+// 新进程中channel的描述符，在exec之前dup2到这里
+constexpr const int UPGRADE_CHAN_FD = 3;
+// 新进程就绪时发送的字节
+constexpr const char UPGRADE_READY = 'R';
+
+
+int HotUpgrade::inherited_channel()
+{
+    const char *val = getenv(UPGRADE_ENV);
+    if (val == nullptr) {
+        return -1;
+    }
+
+    char *end = nullptr;
+    long fd = strtol(val, &end, 10);
+    unsetenv(UPGRADE_ENV);
+    if (end == val || *end != '\0' || fd < 0 || fd > INT_MAX) {
+        return -1;
+    }
+    // 不要传给这个进程之后fork的其他进程
+    if (fcntl(static_cast<int>(fd), F_SETFD, FD_CLOEXEC) != 0) {
+        return -1;
+    }
+    return static_cast<int>(fd);
+}
+
+pid_t HotUpgrade::spawn(const std::vector<int> &listen_socks, int &chan)
+{
+    chan = -1;
+
+    // fork之后只能调用异步信号安全的函数，需要的数据全部提前准备好
+    std::string exe = self_exe();
+    std::vector<std::string> args = self_args();
+    if (exe.empty() || args.empty()) {
+        errno = ENOENT;
+        return -1;
+    }
+    std::vector<char*> argv;
+    for (std::string &arg : args) {
+        argv.push_back(&arg[0]);
+    }
+    argv.push_back(nullptr);
+
+    std::string env_chan = std::string(UPGRADE_ENV) + "=" + std::to_string(UPGRADE_CHAN_FD);
+    std::string env_prefix = std::string(UPGRADE_ENV) + "=";
+    std::vector<char*> envp;
+    for (char **env = environ; *env != nullptr; ++env) {
+        if (strncmp(*env, env_prefix.c_str(), env_prefix.size()) != 0) {
+            envp.push_back(*env);
+        }
+    }
+    envp.push_back(&env_chan[0]);
+    envp.push_back(nullptr);
+
+    int pair[2] = {-1, -1};
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) != 0) {
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // dup2到同一个描述符时什么都不做，需要单独清除FD_CLOEXEC
+        if (pair[1] == UPGRADE_CHAN_FD) {
+            fcntl(pair[1], F_SETFD, 0);
+        } else if (dup2(pair[1], UPGRADE_CHAN_FD) < 0) {
+            _exit(127);
+        }
+#ifdef SYS_close_range
+        // 客户端连接等没有设置FD_CLOEXEC的描述符也不能泄漏给新进程，
+        // 否则旧进程关闭连接时不会真正断开
+        syscall(SYS_close_range, UPGRADE_CHAN_FD + 1, ~0U, 0);
+#endif
+        // 信号掩码和忽略的信号会被exec继承
+        sigset_t set;
+        sigemptyset(&set);
+        sigprocmask(SIG_SETMASK, &set, nullptr);
+        execve(exe.c_str(), argv.data(), envp.data());
+        _exit(127);
+    }
+
+    close(pair[1]);
+    if (pid < 0) {
+        int err = errno;
+        close(pair[0]);
+        errno = err;
+        return -1;
+    }
+
+    // 数据留在socket的缓冲区中，新进程启动后再读取
+    if (FdUtil::send_fds(pair[0], listen_socks) < 0) {
+        int err = errno;
+        close(pair[0]);
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+        errno = err;
+        return -1;
+    }
+
+    chan = pair[0];
+    return pid;
+}
+
+std::vector<int> HotUpgrade::recv_listen_socks(int chan, int timeout_ms)
+{
+    std::vector<int> socks;
+    struct pollfd pfd;
+    pfd.fd = chan;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    int ret = -1;
+    do {
+        ret = poll(&pfd, 1, timeout_ms);
+    } while (ret < 0 && errno == EINTR);
+    if (ret <= 0) {
+        if (ret == 0) { errno = ETIMEDOUT; }
+        return socks;
+    }
+
+    FdUtil::recv_fds(chan, socks);
+    return socks;
+}
+
+bool HotUpgrade::notify_ready(int chan)
+{
+    char ready = UPGRADE_READY;
+    ssize_t ret = -1;
+    do {
+        ret = send(chan, &ready, sizeof(ready), MSG_NOSIGNAL);
+    } while (ret < 0 && errno == EINTR);
+    return ret == sizeof(ready);
+}
+
+int HotUpgrade::check_ready(int chan)
+{
+    char buf = 0;
+    ssize_t ret = -1;
+    do {
+        ret = recv(chan, &buf, sizeof(buf), MSG_DONTWAIT);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    return (ret == sizeof(buf) && buf == UPGRADE_READY) ? 1 : -1;
+}
+
+std::string HotUpgrade::self_exe()
+{
+    char buf[PATH_MAX] = {0};
+    ssize_t len = readlink("/proc/self/exe", buf, sizeof(buf) - 1);
+    if (len <= 0) {
+        return "";
+    }
+
+    // 可执行文件被新版本替换后，链接指向的是已经删除的旧文件
+    std::string exe(buf, len);
+    const std::string deleted = " (deleted)";
+    if (exe.size() > deleted.size()
+        && exe.compare(exe.size() - deleted.size(), deleted.size(), deleted) == 0) {
+        exe.erase(exe.size() - deleted.size());
+    }
+    return exe;
+}
+
+std::vector<std::string> HotUpgrade::self_args()
+{
+    std::vector<std::string> args;
+    std::ifstream in("/proc/self/cmdline", std::ios::binary);
+    std::string cmdline((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+    std::size_t start = 0;
+    while (start < cmdline.size()) {
+        std::size_t end = cmdline.find('\0', start);
+        if (end == std::string::npos) {
+            end = cmdline.size();
+        }
+        args.push_back(cmdline.substr(start, end - start));
+        start = end + 1;
+    }
+    return args;
+}
@@ -0,0 +1,63 @@
+#ifndef SRC_HOTUPGRADE_H_
+#define SRC_HOTUPGRADE_H_
+
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+
+/**
+ * @brief 不停机升级：运行中的进程把监听socket交给重新exec的新版本
+ *        1. 旧进程收到SIGUSR2后调用spawn，fork并exec磁盘上的可执行文件（参数和原来相同），
+ *           通过Unix域socket（SCM_RIGHTS）把监听socket发给新进程，旧进程继续处理请求
+ *        2. 新进程启动时通过inherited_channel发现自己是升级启动的，
+ *           用recv_listen_socks收到的socket代替创建新的，预热完成开始接收连接后调用notify_ready
+ *        3. 旧进程收到ready后停止接收新连接，处理完已有的请求（不超过drain_timeout_ms_）后退出；
+ *           新进程在ready之前退出时（channel关闭），旧进程继续运行，相当于回滚
+ *        两个进程持有同一个监听socket，完成队列中的连接不会丢失，也不会出现拒绝连接的窗口
+ */
+class HotUpgrade
+{
+public:
+    /**
+     * @brief 升级启动的新进程中，获取和旧进程通信的channel，
+     *        同时清除对应的环境变量，不会传给之后再升级的进程
+     * @return 不是升级启动的返回-1
+     */
+    static int inherited_channel();
+    /**
+     * @brief 启动新版本的进程，并发送监听socket
+     * @param listen_socks 需要交给新进程的监听socket
+     * @param chan 输出参数，和新进程通信的channel，由调用者关闭
+     * @return 新进程的pid，失败返回-1，详细错误通过errno获取
+     */
+    static pid_t spawn(const std::vector<int> &listen_socks, int &chan);
+    /**
+     * @brief 接收旧进程发送的监听socket
+     * @param timeout_ms 最多等待的时间
+     * @return 失败返回空
+     */
+    static std::vector<int> recv_listen_socks(int chan, int timeout_ms);
+    /**
+     * @brief 新进程已经开始接收连接，通知旧进程停止接收并退出
+     */
+    static bool notify_ready(int chan);
+    /**
+     * @brief 旧进程读取新进程的通知，channel需要是非阻塞的
+     * @return 1 新进程已经就绪；0 还没有通知；-1 新进程在就绪之前退出了
+     */
+    static int check_ready(int chan);
+
+private:
+    /**
+     * @brief 当前进程的可执行文件的路径，文件被替换后也是新文件的路径
+     */
+    static std::string self_exe();
+    /**
+     * @brief 当前进程的启动参数（/proc/self/cmdline）
+     */
+    static std::vector<std::string> self_args();
+};
+
+#endif // SRC_HOTUPGRADE_H_
@@ -6,19 +6,170 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <stdio.h>
 
 
+// reset时每个字符串（请求体，响应头等）最多保留的容量，超过后释放，
+// 防止偶尔一个很大的请求或者响应让keep-alive连接一直占着内存
+constexpr const std::size_t RETAIN_STR_MAX_BYTES = 16 * 1024;
+// reset时头部和请求参数的槽位最多保留的内存
+constexpr const std::size_t RETAIN_FIELDS_MAX_BYTES = 8 * 1024;
+
+
+/**
+ * @brief 容量超过上限时释放字符串的内存，否则只清空
+ */
+static void clear_retain(std::string &str, std::size_t max_bytes)
+{
+    if (str.capacity() > max_bytes) {
+        std::string().swap(str);
+    } else {
+        str.clear();
+    }
+}
+
+/**
+ * @brief 在[start_pos, end_pos)中获取以delim分割的key-val对，直接写入dst的槽位，
+ *        规则同StringUtil::str_get_key_val
+ */
+static bool get_key_val(HttpFields &dst, const std::string &src, const std::string &delim,
+                        std::size_t start_pos, std::size_t end_pos)
+{
+    std::size_t pos = src.find(delim, start_pos);
+    if (pos == std::string::npos || pos + delim.size() > end_pos || pos == start_pos) {
+        return false;
+    }
+    std::size_t val_pos = pos + delim.size();
+    dst.emplace(src.data() + start_pos, pos - start_pos, src.data() + val_pos, end_pos - val_pos);
+    return true;
+}
+
+std::string make_etag(time_t mtime, off_t size)
+{
+    char buf[48] = {0};
+    snprintf(buf, sizeof(buf), "\"%llx-%llx\"",
+             static_cast<unsigned long long>(mtime),
+             static_cast<unsigned long long>(size));
+    return buf;
+}
+
+bool etag_match(const std::string &list, const std::string &etag, bool weak)
+{
+    bool etag_weak = (etag.compare(0, 2, "W/") == 0);
+    if (!weak && etag_weak) {
+        return false;
+    }
+    const std::string opaque = etag_weak ? etag.substr(2) : etag;
+
+    for (std::string &item : StringUtil::str_split(list, ",")) {
+        StringUtil::str_trim(item);
+        if (item == "*") {
+            return true;
+        }
+        if (item.compare(0, 2, "W/") == 0) {
+            if (!weak) {
+                continue;
+            }
+            item.erase(0, 2);
+        }
+        if (item == opaque) {
+            return true;
+        }
+    }
+    return false;
+}
+
+HttpRangeResult parse_range_header(const std::string &val, off_t size, std::vector<HttpRange> &ranges)
+{
+    static const std::string unit = "bytes=";
+
+    ranges.clear();
+    if (val.compare(0, unit.size(), unit) != 0) {
+        return HttpRangeResult::NONE;
+    }
+
+    std::vector<std::string> specs = StringUtil::str_split(val.substr(unit.size()), ",");
+    if (specs.size() > HTTP_MAX_RANGES) {
+        return HttpRangeResult::NONE;
+    }
+
+    for (auto &spec : specs) {
+        StringUtil::str_trim(spec);
+        std::size_t dash = spec.find('-');
+        if (spec.empty() || dash == std::string::npos) {
+            return HttpRangeResult::NONE;
+        }
+
+        std::string first_str = spec.substr(0, dash);
+        std::string last_str = spec.substr(dash + 1);
+        // 只允许数字，strtoll会接受正负号和空白字符
+        if (first_str.find_first_not_of("0123456789") != std::string::npos
+            || last_str.find_first_not_of("0123456789") != std::string::npos) {
+            return HttpRangeResult::NONE;
+        }
+
+        long long first = 0;
+        long long last = 0;
+        if (first_str.empty()) {
+            // "-500"，最后500个字节
+            if (last_str.empty()
+                || !StringUtil::str_to_inum(last, last_str, strtoll)) {
+                return HttpRangeResult::NONE;
+            }
+            if (last == 0 || size == 0) {
+                continue;
+            }
+            first = (last >= size) ? 0 : size - last;
+            last = size - 1;
+        } else {
+            if (!StringUtil::str_to_inum(first, first_str, strtoll)) {
+                return HttpRangeResult::NONE;
+            }
+            if (last_str.empty()) {
+                last = size - 1;
+            } else if (!StringUtil::str_to_inum(last, last_str, strtoll)
+                       || last < first) {
+                return HttpRangeResult::NONE;
+            }
+            if (first >= size) {
+                continue;
+            }
+            if (last >= size) {
+                last = size - 1;
+            }
+        }
+
+        ranges.push_back(HttpRange{static_cast<off_t>(first), static_cast<off_t>(last)});
+    }
+
+    return ranges.empty() ? HttpRangeResult::UNSATISFIABLE : HttpRangeResult::OK;
+}
+
 HttpRequest::HttpRequest()
     : state_(ParseState::PARSE_REQ_LINE)
     , is_bad_req_(false)
     , method_(HttpMethod::UNKNOWN)
     , path_("")
     , http_ver_("HTTP/1.1")
-    , headers_(10)   // 预分配大小，降低哈希开销，空间换时间
-    , param_(10)
+    , headers_(16)   // 预分配槽位，之后的请求复用
+    , param_(4)
     , body_("")
     {}
 
+void HttpRequest::reset()
+{
+    state_ = ParseState::PARSE_REQ_LINE;
+    is_bad_req_ = false;
+    method_ = HttpMethod::UNKNOWN;
+    clear_retain(path_, RETAIN_STR_MAX_BYTES);
+    http_ver_.clear();
+    headers_.clear();
+    headers_.trim(RETAIN_FIELDS_MAX_BYTES);
+    param_.clear();
+    param_.trim(RETAIN_FIELDS_MAX_BYTES);
+    clear_retain(body_, RETAIN_STR_MAX_BYTES);
+}
+
 uint32_t HttpRequest::parse(const std::string &data, uint32_t start_idx)
 {
     // example:
@@ -59,27 +210,76 @@ uint32_t HttpRequest::parse(const std::string &data, uint32_t start_idx)
     return parsed_bytes;
 }
 
+std::size_t HttpRequest::mem_bytes() const
+{
+    return StringUtil::str_heap_bytes(path_) + StringUtil::str_heap_bytes(http_ver_)
+           + headers_.retained_bytes() + param_.retained_bytes()
+           + StringUtil::str_heap_bytes(body_);
+}
+
 bool HttpRequest::get_header(const std::string &key, std::string &val) const
 {
-    auto it = headers_.find(key);
-    if (it == headers_.end()) {
+    const std::string *header = headers_.find(key);
+    if (header == nullptr) {
         return false;
     }
-    val = it->second;
+    val = *header;
     return true;
 }
 
 bool HttpRequest::get_param(const std::string &key, std::string &val) const
 {
-    auto it = param_.find(key);
-    if (it == param_.end()) {
+    const std::string *param = param_.find(key);
+    if (param == nullptr) {
         return false;
     }
 
-    val = it->second;
+    val = *param;
     return true;
 }
 
+bool HttpRequest::accept_encoding(const std::string &coding) const
+{
+    const std::string *header = headers_.find("Accept-Encoding");
+    if (header == nullptr) {
+        return false;
+    }
+
+    // example:
+    // Accept-Encoding: gzip, deflate;q=0.5, br;q=0, *;q=0.1
+    int matched = -1;       // -1 未列出，0 不接受，1 接受
+    int wildcard = -1;
+    for (auto &item : StringUtil::str_split(*header, ",")) {
+        std::string name;
+        std::string params;
+        std::size_t semi = item.find(';');
+        name = item.substr(0, semi);
+        if (semi != std::string::npos) {
+            params = item.substr(semi + 1);
+        }
+        StringUtil::str_trim(name);
+        StringUtil::str_to_lower(name);
+
+        // 只关心q是否为0，q=0，q=0.0，q=0.000都表示不接受
+        bool acceptable = true;
+        StringUtil::str_trim(params);
+        if (params.size() >= 2 && (params[0] == 'q' || params[0] == 'Q') && params[1] == '=') {
+            acceptable = (params.find_first_not_of("0.", 2) != std::string::npos);
+        }
+
+        if (name == coding) {
+            matched = acceptable ? 1 : 0;
+        } else if (name == "*") {
+            wildcard = acceptable ? 1 : 0;
+        }
+    }
+
+    if (matched != -1) {
+        return matched == 1;
+    }
+    return wildcard == 1;
+}
+
 void HttpRequest::dump_data() const
 {
     std::cout << "====================================" << std::endl;
@@ -235,7 +435,7 @@ bool HttpRequest::parse_uri(const std::string &uri)
             key_val = raw_param.substr(start_pos);
         }
         
-        get_token = StringUtil::str_get_key_val(param_, key_val, "=");
+        get_token = get_key_val(param_, key_val, "=", 0, key_val.size());
         if (!get_token) {
             return false;
         }
@@ -258,32 +458,34 @@ bool HttpRequest::path_is_vaild(const std::string &path)
 uint32_t HttpRequest::parse_req_header(const std::string &data, uint32_t start_idx)
 {
     uint32_t parsed_bytes = 0;
-    std::string line;
     bool get_token = false;
 
     while(1) {
-        get_token = StringUtil::str_get_first_token(
-                        line, data, "\r\n",
-                        start_idx + parsed_bytes
-                    );
-        if (!get_token) {
+        // 直接在data中定位，不复制出每一行，键值写入headers_复用的槽位
+        std::size_t line_start = start_idx + parsed_bytes;
+        std::size_t line_end = data.find("\r\n", line_start);
+        if (line_end == std::string::npos) {
             // 可能没有"\r\n"，说明数据量不足，需要等待下次调用
             return parsed_bytes;
         }
 
-        if (line.empty()) {
+        if (line_end == line_start) {
             // 是空行, 说明请求头解析完毕
             parsed_bytes += 2;
             break;
         }
+        if (headers_.size() >= HTTP_MAX_HEADER_FIELDS) {
+            set_bad_req();
+            return parsed_bytes;
+        }
         //BUG 需要检查key-val的合法性
-        get_token = StringUtil::str_get_key_val(headers_, line, ": ");
+        get_token = get_key_val(headers_, data, ": ", line_start, line_end);
         if(!get_token) {
             set_bad_req();
             return parsed_bytes;
         }
 
-        parsed_bytes += line.size() + 2;
+        parsed_bytes += line_end - line_start + 2;
     }
 
     //BUG 需要校验Host头是否存在
@@ -305,8 +507,8 @@ uint32_t HttpRequest::parse_req_body(const std::string &data, uint32_t start_idx
         //TODO 封装成独立函数
         //BUG 目前只支持有Content-Length的POST请求
         //     不含Content-Length的默认包体大小为0
-        const auto &header = headers_.find("Content-Length");
-        if (header == headers_.end()) {
+        const std::string *header = headers_.find("Content-Length");
+        if (header == nullptr) {
             state_ = ParseState::PARSE_SUCCESS;
             return 0;
         }
@@ -316,7 +518,7 @@ uint32_t HttpRequest::parse_req_body(const std::string &data, uint32_t start_idx
         }
         unsigned long content_len = 0;
         //TODO 优化每一次都要转换的问题
-        bool converted = StringUtil::str_to_inum(content_len, header->second, strtoul);
+        bool converted = StringUtil::str_to_inum(content_len, *header, strtoul);
         if (!converted) {
             set_bad_req();
             return 0;
@@ -346,25 +548,72 @@ HttpResponse::HttpResponse(const HttpRequest &req)
     , code_(HttpCode::OK)
     , headers_({{"Content-Type", "text/html; charset=UTF-8"},
                 {"Connection", "close"}, {"Server", LITEWEBSERVER_NAME_VER}},
-               10) // 预分配大小，降低哈希开销，空间换时间
+               10) // 预分配槽位
     , maked_base_rsp_(false)
     , base_rsp_("")
     , body_("")
     , body_type_(HttpContentType::HTML_TYPE)
-    , body_is_file_(true)
+    , body_kind_(BodyKind::FILE)
+    , producer_(nullptr)
+    , chunked_(false)
 {
     req.get_header("Connection", headers_["Connection"]);
 }
 
+void HttpResponse::reset()
+{
+    http_ver_.clear();
+    code_ = HttpCode::OK;
+    headers_.clear();
+    headers_.trim(RETAIN_FIELDS_MAX_BYTES);
+    headers_.emplace("Content-Type", "text/html; charset=UTF-8");
+    headers_.emplace("Connection", "close");
+    headers_.emplace("Server", LITEWEBSERVER_NAME_VER);
+    maked_base_rsp_ = false;
+    clear_retain(base_rsp_, RETAIN_STR_MAX_BYTES);
+    clear_retain(body_, RETAIN_STR_MAX_BYTES);
+    body_type_ = HttpContentType::HTML_TYPE;
+    body_kind_ = BodyKind::FILE;
+    producer_ = nullptr;
+    chunked_ = false;
+}
+
+void HttpResponse::reset(const HttpRequest &req)
+{
+    reset();
+    http_ver_.assign(req.get_http_ver());
+    req.get_header("Connection", headers_["Connection"]);
+}
+
+void HttpResponse::assign(HttpResponse &&other)
+{
+    if (this == &other) {
+        return;
+    }
+    http_ver_.assign(other.http_ver_);
+    code_ = other.code_;
+    headers_.assign(other.headers_);
+    maked_base_rsp_ = false;
+    body_.assign(other.body_);
+    body_type_ = other.body_type_;
+    body_kind_ = other.body_kind_;
+    producer_ = std::move(other.producer_);
+    chunked_ = other.chunked_;
+}
+
+std::size_t HttpResponse::mem_bytes() const
+{
+    return StringUtil::str_heap_bytes(http_ver_) + headers_.retained_bytes()
+           + StringUtil::str_heap_bytes(base_rsp_) + StringUtil::str_heap_bytes(body_);
+}
+
 void HttpResponse::header_oper(HeaderOper oper, const std::string &key, const std::string &val)
 {
     if (oper == HeaderOper::ADD || oper == HeaderOper::MODIFY) {
         headers_[key] = val;
         maked_base_rsp_ = false;
     } else if (oper == HeaderOper::DEL) {
-        const auto &it = headers_.find(key);
-        if (it != headers_.end()) {
-            headers_.erase(it);
+        if (headers_.erase(key)) {
             maked_base_rsp_ = false;
         }
     } else if (oper == HeaderOper::CLEAR) {
@@ -379,9 +628,7 @@ void HttpResponse::header_oper(HeaderOper oper, const std::string &key, std::str
         headers_[key] = std::move(val);
         maked_base_rsp_ = false;
     } else if (oper == HeaderOper::DEL) {
-        const auto &it = headers_.find(key);
-        if (it != headers_.end()) {
-            headers_.erase(it);
+        if (headers_.erase(key)) {
             maked_base_rsp_ = false;
         }
     } else if (oper == HeaderOper::CLEAR) {
@@ -392,29 +639,48 @@ void HttpResponse::header_oper(HeaderOper oper, const std::string &key, std::str
 
 bool HttpResponse::get_header(const std::string &key, std::string &val) const
 {
-    const auto &it = headers_.find(key);
-    if (it == headers_.end()) {
+    const std::string *header = headers_.find(key);
+    if (header == nullptr) {
         return false;
     }
-    val = it->second;
+    val = *header;
     return true;
 }
 
 void HttpResponse::set_body_file(const std::string &path, HttpContentType type, const std::string &charset)
 {
-    set_body(path, true);
+    set_body(path, BodyKind::FILE);
     update_content_type(type, charset);
 }
 
 void HttpResponse::set_body_bin(const std::string &data, HttpContentType type, const std::string &charset)
 {
-    set_body(data, false);
+    set_body(data, BodyKind::BIN);
+    update_content_type(type, charset);
+}
+
+void HttpResponse::set_body_stream(BodyProducer producer, HttpContentType type, const std::string &charset)
+{
+    body_kind_ = BodyKind::STREAM;
+    body_.clear();
+    producer_ = std::move(producer);
+    header_oper(HeaderOper::DEL, "Content-Length", "");
+
+    // HTTP/1.0不支持chunked，只能通过关闭连接来标识数据结束
+    chunked_ = (http_enum_to_str(HttpVersion::HTTP_1_0) != http_ver_);
+    if (chunked_) {
+        header_oper(HeaderOper::MODIFY, "Transfer-Encoding", "chunked");
+    } else {
+        header_oper(HeaderOper::MODIFY, "Connection", "close");
+    }
     update_content_type(type, charset);
 }
 
 void HttpResponse::set_no_body()
 {
-    body_is_file_ = false;
+    body_kind_ = BodyKind::BIN;
+    body_.clear();
+    producer_ = nullptr;
     header_oper(HeaderOper::MODIFY, "Content-Length", "0");
     header_oper(HeaderOper::DEL, "Content-Type", "");
 }
@@ -455,13 +721,15 @@ void HttpResponse::make_base_rsp()
         return;
     }
 
+    // 逐段追加，不产生临时字符串，复用base_rsp_上一次响应的容量
     base_rsp_.clear();
-    base_rsp_ = http_ver_ + " "
-                + std::to_string((int)code_) + " " + http_enum_to_str(code_) + "\r\n";
+    base_rsp_.append(http_ver_).append(" ")
+             .append(std::to_string((int)code_)).append(" ")
+             .append(http_enum_to_str(code_)).append("\r\n");
     for (const auto &kv : headers_) {
-        base_rsp_ += kv.first + ": " + kv.second + "\r\n";
+        base_rsp_.append(kv.first).append(": ").append(kv.second).append("\r\n");
     }
-    base_rsp_ += "\r\n";
+    base_rsp_.append("\r\n");
 
     maked_base_rsp_ = true;
 }
@@ -500,9 +768,14 @@ void HttpResponse::update_content_type(HttpContentType type, const std::string &
     }
 }
 
-void HttpResponse::set_body(const std::string &data, bool is_file)
+void HttpResponse::set_body(const std::string &data, BodyKind kind)
 {
-    body_is_file_ = is_file;
+    body_kind_ = kind;
+    producer_ = nullptr;
+    if (chunked_) {
+        chunked_ = false;
+        header_oper(HeaderOper::DEL, "Transfer-Encoding", "");
+    }
 
     if (!body_is_file()) {
         // 不是文件类型，直接计算"Content-Length"，
@@ -515,17 +788,27 @@ void HttpResponse::set_body(const std::string &data, bool is_file)
 HttpResponse root_handler(const HttpRequest &req)
 {
     HttpResponse rsp(req);
-    rsp.set_body_file(req.get_path() + "index.html", HttpContentType::HTML_TYPE);
+    root_handler(req, rsp);
     return rsp;
 }
 
 HttpResponse static_file_handler(const HttpRequest &req)
 {
     HttpResponse rsp(req);
-    rsp.set_body_file(req.get_path(), get_file_content_type(req.get_path()));
+    static_file_handler(req, rsp);
     return rsp;
 }
 
+void root_handler(const HttpRequest &req, HttpResponse &rsp)
+{
+    rsp.set_body_file(req.get_path() + "index.html", HttpContentType::HTML_TYPE);
+}
+
+void static_file_handler(const HttpRequest &req, HttpResponse &rsp)
+{
+    rsp.set_body_file(req.get_path(), get_file_content_type(req.get_path()));
+}
+
 HttpResponse def_err_handler(HttpCode code, const HttpRequest &req)
 {
     HttpResponse rsp(req);
@@ -558,6 +841,11 @@ HttpResponse err_handler_400(const HttpRequest &req)
     return def_err_handler(HttpCode::BAD_REQUEST, req);
 }
 
+HttpResponse err_handler_403(const HttpRequest &req)
+{
+    return def_err_handler(HttpCode::FORBIDDEN, req);
+}
+
 HttpResponse err_handler_404(const HttpRequest &req)
 {
     return def_err_handler(HttpCode::NOT_FOUND, req);
@@ -568,7 +856,17 @@ HttpResponse err_handler_405(const HttpRequest &req)
     return def_err_handler(HttpCode::NOT_ALLOWED, req);
 }
 
+HttpResponse err_handler_416(const HttpRequest &req)
+{
+    return def_err_handler(HttpCode::RANGE_NOT_SATISFIABLE, req);
+}
+
 HttpResponse err_handler_500(const HttpRequest &req)
 {
     return def_err_handler(HttpCode::INTERNAL_SERVER_ERROR, req);
 }
+
+HttpResponse err_handler_503(const HttpRequest &req)
+{
+    return def_err_handler(HttpCode::SERVICE_UNAVAILABLE, req);
+}
@@ -3,12 +3,16 @@
 
 #include <unordered_map>
 #include <string>
+#include <vector>
+#include <functional>
 
 #include <stdint.h>
+#include <sys/types.h>
 
 #include <serverinfo.h>
 #include "stringutil.h"
 #include "filepathutil.h"
+#include "httpfields.h"
 
 
 template <typename EnumType> LWS_CONSTEXPR const char* http_enum_to_str(EnumType e);
@@ -38,12 +42,16 @@ enum class HttpMethod
 #define HTTPCODE_ENUM                   \
     X(UNKNOWN, 0, "Unknown")            \
     X(OK, 200, "OK")                    \
+    X(PARTIAL_CONTENT, 206, "Partial Content") \
     X(MOVED_PERMANENTLY, 301, "Moved Permanently") \
+    X(NOT_MODIFIED, 304, "Not Modified") \
     X(BAD_REQUEST, 400, "Bad Request")  \
     X(NOT_FOUND, 404, "Not Found")      \
     X(FORBIDDEN, 403, "Forbidden")      \
     X(NOT_ALLOWED, 405, "Method Not Allowed") \
+    X(RANGE_NOT_SATISFIABLE, 416, "Range Not Satisfiable") \
     X(INTERNAL_SERVER_ERROR, 500, "Internal Server Error") \
+    X(SERVICE_UNAVAILABLE, 503, "Service Unavailable") \
 
 enum class HttpCode
 {
@@ -185,6 +193,73 @@ inline HttpContentType get_file_content_type(const std::string &path)
     return HttpContentType::UNKNOWN;    
 }
 
+/**
+ * @brief 文本类的内容压缩效果好，值得压缩，
+ *        图片等类型本身就是压缩过的，不需要再压缩
+ */
+inline bool content_type_compressible(HttpContentType type)
+{
+    switch (type) {
+        case HttpContentType::HTML_TYPE:
+        case HttpContentType::JSON_TYPE:
+        case HttpContentType::CSS_TYPE:
+        case HttpContentType::JS_TYPE:
+        case HttpContentType::SVGXML_TYPE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+// 一次请求中最多允许的Range数量，超过后忽略Range，返回整个文件，
+// 防止客户端通过大量的小Range放大服务器的开销
+constexpr const std::size_t HTTP_MAX_RANGES = 16;
+// 一次请求中最多允许的头部字段数量，超过后认为是非法请求，
+// 头部插入时线性查找重复的键，不限制时大量的字段会让解析的开销成平方增长
+constexpr const std::size_t HTTP_MAX_HEADER_FIELDS = 100;
+
+/**
+ * @brief 字节范围，[first, last]，闭区间
+ */
+struct HttpRange
+{
+    off_t first;
+    off_t last;
+    off_t length() const { return last - first + 1; }
+};
+
+enum class HttpRangeResult
+{
+    NONE,           // 没有Range，或者Range无法识别，应该忽略Range返回整个文件
+    OK,             // 至少有一个可以满足的Range
+    UNSATISFIABLE   // 所有Range都超出了文件范围，应该返回416
+};
+
+/**
+ * @brief 解析Range请求头，只支持bytes单位
+ *        "bytes=0-499"，"bytes=500-"，"bytes=-500"，"bytes=0-0,-1"
+ *        超出文件范围的last会被截断到文件末尾
+ * @param val Range请求头的值
+ * @param size 文件大小
+ * @param ranges 输出的可满足的Range，按请求中的顺序排列
+ * @return 解析结果
+ */
+HttpRangeResult parse_range_header(const std::string &val, off_t size, std::vector<HttpRange> &ranges);
+
+/**
+ * @brief 根据文件的修改时间和大小生成ETag，格式同nginx："mtime-size"（十六进制）
+ */
+std::string make_etag(time_t mtime, off_t size);
+/**
+ * @brief 判断ETag列表（If-None-Match，If-Match）中是否有和etag匹配的
+ * @param list 请求头的值，"*"，或者逗号分隔的ETag列表
+ * @param etag 当前响应的ETag
+ * @param weak 是否使用弱比较（忽略W/前缀），If-None-Match使用弱比较，
+ *             If-Range使用强比较，弱ETag永远不匹配
+ */
+bool etag_match(const std::string &list, const std::string &etag, bool weak);
+
 
 class HttpRequest
 {
@@ -247,18 +322,26 @@ public:
      * @return false 获取失败
      */
     bool get_param(const std::string &key, std::string &val) const;
+    /**
+     * @brief 根据Accept-Encoding判断客户端是否接受指定的内容编码
+     *        支持q值，q=0表示明确不接受，"*"匹配未列出的编码
+     * @param coding 内容编码，例如"gzip"，"br"，小写
+     * @return true 接受
+     * @return false 不接受，或者没有Accept-Encoding头
+     */
+    bool accept_encoding(const std::string &coding) const;
     //TODO 添加解析body的方法
-    void reset() {
-        state_ = ParseState::PARSE_REQ_LINE;
-        is_bad_req_ = false;
-        method_ = HttpMethod::UNKNOWN;
-        path_.clear();
-        http_ver_.clear();
-        headers_.clear();
-        param_.clear();
-        body_.clear();
-    }
+    /**
+     * @brief 重置为初始状态，保留字符串和头部槽位的容量给下一个请求复用，
+     *        超过上限的部分（例如很大的请求体）会被释放，
+     *        检查上限需要遍历头部的槽位，开销和字段数成正比
+     */
+    void reset();
     const std::string& get_body() const { return body_; }
+    /**
+     * @brief 占用的堆内存，包括为下一个请求保留的容量
+     */
+    std::size_t mem_bytes() const;
     void dump_data() const;
     std::string dump_data_str() const;
 
@@ -277,10 +360,8 @@ private:
     HttpMethod method_;
     std::string path_;
     std::string http_ver_;
-    //TODO 使用shared_ptr优化内存和执行效率！
-    //TODO unordered_map or map?
-    std::unordered_map<std::string, std::string> headers_;
-    std::unordered_map<std::string, std::string> param_;
+    HttpFields headers_;
+    HttpFields param_;
     std::string body_;
 };
 
@@ -294,11 +375,42 @@ public:
         CLEAR
     };
 
+    /**
+     * @brief 响应体的类型
+     *        BIN: 内存中的数据，一次性生成
+     *        FILE: 文件，body_中保存的是相对于doc_root的文件路径
+     *        STREAM: 流式数据，由BodyProducer在socket可写时按需生成
+     */
+    enum class BodyKind {
+        BIN,
+        FILE,
+        STREAM
+    };
+
+    /**
+     * @brief 唤醒等待数据的流式响应，可以在任意线程中调用，可以多次调用，
+     *        连接已经关闭时什么也不做
+     */
+    using StreamWaker = std::function<void()>;
+    /**
+     * @brief 流式响应体的生产者，拉取模式，
+     *        只有在上一块数据完全写入socket后才会被再次调用，
+     *        所以每个连接最多只缓存一块数据
+     * @param chunk 输出参数，调用前已被清空，本次生成的数据追加到这里
+     * @param max_bytes 本次最多生成的字节数，超出的部分也会被发送，但是会增加内存占用
+     * @param wake 暂时没有数据时，保存下来，有数据后调用它让连接重新拉取
+     * @return true 后续还有数据，chunk可以为空，表示暂时没有数据，
+     *         此时连接不再监听任何事件，直到wake被调用（或者连接超时）
+     * @return false 数据已经全部生成，chunk中可以带有最后一块数据
+     */
+    using BodyProducer = std::function<bool(std::string &chunk, std::size_t max_bytes, const StreamWaker &wake)>;
+
 public:
     HttpResponse(const HttpRequest &req);
 
 public:
     void set_code(HttpCode code) { maked_base_rsp_ = false; code_ = code; }
+    HttpCode get_code() const { return code_; }
     /**
      * @brief 设置响应头
      * @param oper 操作类型
@@ -316,27 +428,50 @@ public:
      */
     void set_body_file(const std::string &path, HttpContentType type, const std::string &charset = "");
     void set_body_bin(const std::string &data, HttpContentType type, const std::string &charset = "");
+    /**
+     * @brief 设置流式响应体，不会设置"Content-Length"，
+     *        HTTP/1.1使用"Transfer-Encoding: chunked"发送，
+     *        HTTP/1.0不支持chunked，直接发送数据并在发送完成后关闭连接
+     * @param producer 数据生产者
+     * @param type 响应体类型
+     * @param charset 响应体编码，不传现在默认为UTF-8
+     */
+    void set_body_stream(BodyProducer producer, HttpContentType type, const std::string &charset = "");
     void set_no_body();
     HttpContentType get_body_type() const { return body_type_; }
-    bool body_is_file() const { return body_is_file_; }
+    BodyKind get_body_kind() const { return body_kind_; }
+    bool body_is_file() const { return body_kind_ == BodyKind::FILE; }
+    bool body_is_stream() const { return body_kind_ == BodyKind::STREAM; }
+    bool body_is_chunked() const { return body_is_stream() && chunked_; }
+    /**
+     * @brief 拉取下一块流式数据，仅在body_is_stream()时有效
+     * @return 同BodyProducer
+     */
+    bool produce_body(std::string &chunk, std::size_t max_bytes, const StreamWaker &wake = StreamWaker()) {
+        return producer_ ? producer_(chunk, max_bytes, wake) : false;
+    }
     const std::string& get_body() const { return body_; }
     const std::string& get_base_rsp() {
         if (!maked_base_rsp_) { make_base_rsp(); }
         return base_rsp_;
     }
-    void reset() {
-        http_ver_.clear();
-        code_ = HttpCode::OK;
-        headers_.clear();
-        headers_.emplace("Content-Type", "text/html; charset=UTF-8");
-        headers_.emplace("Connection", "close");
-        headers_.emplace("Server", LITEWEBSERVER_NAME_VER);
-        maked_base_rsp_ = false;
-        base_rsp_.clear();
-        body_.clear();
-        body_type_ = HttpContentType::HTML_TYPE;
-        body_is_file_ = true;
-    }
+    /**
+     * @brief 同HttpRequest::reset
+     */
+    void reset();
+    /**
+     * @brief 重置后按照req初始化，和用req构造的结果相同，但复用已有的容量
+     */
+    void reset(const HttpRequest &req);
+    /**
+     * @brief 代替operator=，把other的内容复制到已有的字符串和头部槽位中，
+     *        不丢弃reset保留下来的容量，只有流式响应的生产者是移动过来的
+     */
+    void assign(HttpResponse &&other);
+    /**
+     * @brief 占用的堆内存，不包括共享的缓存和流式响应的生产者
+     */
+    std::size_t mem_bytes() const;
     void dump_data();
     std::string dump_data_str();
 
@@ -344,26 +479,36 @@ private:
     void make_base_rsp();
     std::string def_charset(HttpContentType type);
     void update_content_type(HttpContentType type, const std::string &charset);
-    void set_body(const std::string &data, bool is_file);
+    void set_body(const std::string &data, BodyKind kind);
 
 private:
     std::string http_ver_;
     HttpCode code_;
-    std::unordered_map<std::string, std::string> headers_;
+    HttpFields headers_;
     bool maked_base_rsp_;
     std::string base_rsp_;
     std::string body_;
     HttpContentType body_type_;
-    bool body_is_file_;
+    BodyKind body_kind_;
+    BodyProducer producer_;
+    bool chunked_;
 };
 
 HttpResponse root_handler(const HttpRequest &req);
 HttpResponse static_file_handler(const HttpRequest &req);
+/**
+ * @brief 同上，直接填写调用方已经reset(req)的rsp，不创建新的响应
+ */
+void root_handler(const HttpRequest &req, HttpResponse &rsp);
+void static_file_handler(const HttpRequest &req, HttpResponse &rsp);
 HttpResponse def_err_handler(HttpCode code, const HttpRequest &req);
 HttpResponse err_handler_301(const HttpRequest &req); 
 HttpResponse err_handler_400(const HttpRequest &req);
+HttpResponse err_handler_403(const HttpRequest &req);
 HttpResponse err_handler_404(const HttpRequest &req);
 HttpResponse err_handler_405(const HttpRequest &req);
+HttpResponse err_handler_416(const HttpRequest &req);
 HttpResponse err_handler_500(const HttpRequest &req);
+HttpResponse err_handler_503(const HttpRequest &req);
 
 #endif //SRC_HTTPDATA_H_
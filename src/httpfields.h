@@ -0,0 +1,187 @@
+#ifndef SRC_HTTPFIELDS_H_
+#define SRC_HTTPFIELDS_H_
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <initializer_list>
+
+#include <stddef.h>
+#include <string.h>
+
+#include "stringutil.h"
+
+
+/**
+ * @brief HTTP头部（或者请求参数）的键值表，代替unordered_map
+ *        1. 按插入顺序保存在连续的槽位中，字段通常只有十几个，线性查找比哈希更快
+ *        2. clear()只是把已用的槽位数置0，槽位和其中字符串的容量都保留下来，
+ *           keep-alive连接上的下一个请求直接覆盖写入，稳定后解析请求头不再分配内存
+ *        3. 偶尔出现很大的请求头时，保留的容量由trim()按上限释放
+ *        !!! 非线程安全
+ */
+class HttpFields
+{
+public:
+    using Field = std::pair<std::string, std::string>;
+    using const_iterator = std::vector<Field>::const_iterator;
+
+public:
+    /**
+     * @param reserve 预分配的槽位数
+     */
+    explicit HttpFields(std::size_t reserve = 0)
+        : size_(0)
+    {
+        slots_.reserve(reserve);
+    }
+    HttpFields(std::initializer_list<Field> init, std::size_t reserve = 0)
+        : size_(0)
+    {
+        slots_.reserve(std::max(reserve, init.size()));
+        for (const Field &field : init) {
+            emplace(field.first, field.second);
+        }
+    }
+
+public:
+    /**
+     * @return 没找到返回nullptr，指针在下一次修改前有效
+     */
+    const std::string* find(const std::string &key) const
+    {
+        for (std::size_t i = 0; i < size_; ++i) {
+            if (slots_[i].first == key) {
+                return &slots_[i].second;
+            }
+        }
+        return nullptr;
+    }
+    std::string* find(const std::string &key)
+    {
+        return const_cast<std::string*>(static_cast<const HttpFields*>(this)->find(key));
+    }
+
+    /**
+     * @brief 插入键值对，同unordered_map::emplace，key已存在时不修改
+     * @return 是否插入
+     */
+    bool emplace(const char *key, std::size_t key_len, const char *val, std::size_t val_len)
+    {
+        for (std::size_t i = 0; i < size_; ++i) {
+            if (slots_[i].first.size() == key_len
+                && memcmp(slots_[i].first.data(), key, key_len) == 0) {
+                return false;
+            }
+        }
+        Field &slot = next_slot();
+        slot.first.assign(key, key_len);
+        slot.second.assign(val, val_len);
+        return true;
+    }
+    bool emplace(const std::string &key, const std::string &val)
+    {
+        return emplace(key.data(), key.size(), val.data(), val.size());
+    }
+
+    /**
+     * @brief 同unordered_map::operator[]，key不存在时插入空值
+     */
+    std::string& operator[](const std::string &key)
+    {
+        std::string *val = find(key);
+        if (val != nullptr) {
+            return *val;
+        }
+        Field &slot = next_slot();
+        slot.first.assign(key);
+        slot.second.clear();
+        return slot.second;
+    }
+
+    /**
+     * @brief 删除后保持其他字段的顺序，被删除的槽位移到末尾继续复用
+     * @return 是否删除
+     */
+    bool erase(const std::string &key)
+    {
+        for (std::size_t i = 0; i < size_; ++i) {
+            if (slots_[i].first == key) {
+                std::rotate(slots_.begin() + i, slots_.begin() + i + 1, slots_.begin() + size_);
+                --size_;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @brief 复制other的字段，写入已有的槽位，不释放保留的容量，代替operator=
+     */
+    void assign(const HttpFields &other)
+    {
+        if (this == &other) {
+            return;
+        }
+        size_ = 0;
+        for (const Field &field : other) {
+            Field &slot = next_slot();
+            slot.first.assign(field.first);
+            slot.second.assign(field.second);
+        }
+    }
+
+    /**
+     * @brief O(1)，保留所有槽位的容量
+     */
+    void clear() { size_ = 0; }
+    bool empty() const { return size_ == 0; }
+    std::size_t size() const { return size_; }
+    const_iterator begin() const { return slots_.begin(); }
+    const_iterator end() const { return slots_.begin() + size_; }
+
+    /**
+     * @brief 所有槽位（包括未使用的）保留的堆内存字节数，需要遍历所有槽位
+     */
+    std::size_t retained_bytes() const
+    {
+        std::size_t bytes = slots_.capacity() * sizeof(Field);
+        for (const Field &slot : slots_) {
+            bytes += StringUtil::str_heap_bytes(slot.first) + StringUtil::str_heap_bytes(slot.second);
+        }
+        return bytes;
+    }
+
+    /**
+     * @brief 保留的内存超过max_bytes时释放未使用的槽位，
+     *        仍然超过时重新复制正在使用的字段，去掉字符串多余的容量
+     */
+    void trim(std::size_t max_bytes)
+    {
+        if (retained_bytes() <= max_bytes) {
+            return;
+        }
+        slots_.resize(size_);
+        if (size_ == 0 || retained_bytes() > max_bytes) {
+            std::vector<Field> fresh(slots_.begin(), slots_.end());
+            slots_.swap(fresh);
+        }
+    }
+
+private:
+    Field& next_slot()
+    {
+        if (size_ == slots_.size()) {
+            slots_.emplace_back();
+        }
+        return slots_[size_++];
+    }
+
+private:
+    // [0, size_)是正在使用的字段，之后是等待复用的空闲槽位
+    std::vector<Field> slots_;
+    std::size_t size_;
+};
+
+#endif // SRC_HTTPFIELDS_H_
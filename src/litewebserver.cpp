@@ -4,6 +4,7 @@
 #include <stdexcept>
 #include <cstring>
 #include <functional>
+#include <algorithm>
 
 #include <stdlib.h>
 #include <errno.h>
@@ -12,7 +13,9 @@
 #include <arpa/inet.h>
 #include <signal.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/eventfd.h>
+#include <sys/wait.h>
 
 #include "spdlog/spdlog.h"
 #include "spdlog/async.h"
@@ -21,28 +24,75 @@
 
 #include <serverinfo.h>
 #include "fdutil.h"
+#include "warmup.h"
+#include "cpuutil.h"
+#include "hotupgrade.h"
 // #include "debughelper.h"
 
 
+// 升级启动的新进程等待旧进程发送监听socket的时间
+constexpr const int UPGRADE_RECV_TIMEOUT_MS = 5 * 1000;
+// 暂停接收连接时，检查是否可以恢复的间隔
+constexpr const int ACCEPT_RESUME_CHECK_MS = 10;
+// 等待所有ConnLoop开始运行的时间
+constexpr const int LOOP_START_TIMEOUT_MS = 5 * 1000;
+
+
 int LiteWebServer::exit_event_ = -1;
+volatile sig_atomic_t LiteWebServer::stop_requested_ = 0;
+volatile sig_atomic_t LiteWebServer::drain_requested_ = 0;
+volatile sig_atomic_t LiteWebServer::upgrade_requested_ = 0;
 void LiteWebServer::handle_signal(int sig)
 {
     if (sig == SIGTERM || sig == SIGINT) {
-        uint64_t event_count = 1;
-        // 不管返回值，失败就是失败算了，
-        // 如果失败了，就是无法按正常流程退出
-        write(LiteWebServer::exit_event_, &event_count, sizeof(event_count));
+        stop_requested_ = 1;
+    } else if (sig == SIGQUIT) {
+        drain_requested_ = 1;
+    } else if (sig == SIGUSR2) {
+        upgrade_requested_ = 1;
+    } else {
+        return;
     }
+
+    int saved_errno = errno;
+    uint64_t event_count = 1;
+    // 不管返回值，失败就是失败算了，
+    // 如果失败了，就是无法按正常流程退出
+    write(LiteWebServer::exit_event_, &event_count, sizeof(event_count));
+    errno = saved_errno;
 }
 
-LiteWebServer::LiteWebServer(const ServerConf srv_conf)
+LiteWebServer::LiteWebServer(const ServerConf srv_conf, int listen_sock, int ready_chan)
     : srv_conf_(srv_conf)
     , running_(false)
     , epoll_fd_(-1)
-    , srv_sock_(-1)
-    , eventpool_(srv_conf_.nthread_)
+    , srv_sock_(listen_sock)
+    , draining_(false)
+    , upgrade_chan_(ready_chan)
+    , upgrade_pid_(-1)
+    , srv_sock_events_(0)
+    , accept_paused_(false)
+    , spare_fd_(-1)
+    , doc_root_(nullptr)
+    , compress_cache_(nullptr)
+    , content_cache_(nullptr)
+    , mmap_cache_(nullptr)
+    , etag_cache_(nullptr)
+    , bgpool_(srv_conf_.bg_nthread_,
+              std::max(srv_conf_.bg_nthread_, srv_conf_.bg_max_nthread_),
+              srv_conf_.bg_max_nthread_ > srv_conf_.bg_nthread_,
+              srv_conf_.pool_work_stealing_,
+              scale_policy(srv_conf_.bg_nthread_))
+    , iopool_(nullptr)
+    // 每个ConnLoop一直占用一个线程，线程数必须和ConnLoop的数量相同，
+    // 否则多出来的ConnLoop一直在队列中，分配给它们的连接得不到处理
+    , eventpool_(srv_conf_.nthread_, srv_conf_.nthread_)
     , events_(new struct epoll_event[srv_conf_.epoll_max_events_])
+    , loop_busy_ns_(srv_conf_.nthread_, 0)
+    , rebalance_at_(SteadyClock::now())
+    , imbalance_rounds_(0)
     , pool_idx_(0)
+    , metrics_service_(nullptr)
 {
     init_log();
 
@@ -53,7 +103,37 @@ LiteWebServer::LiteWebServer(const ServerConf srv_conf)
     register_exit_signal();
     FdUtil::set_nonblocking(exit_event_);
 
-    create_listen_service();
+    create_shared_res();
+
+    //BUG 如何优雅的结束程序？如何关闭sock？如何释放资源？
+    for (int i = 0; i < srv_conf_.nthread_; ++i) {
+        conn_loops_.emplace_back(std::make_shared<ConnLoop>(&srv_conf_, &loop_shared_));
+        conn_loops_[i]->set_cpu_affinity(loop_cpus(i));
+    }
+    // 预热完成后才开始监听，在此之前连接不会进入完成队列
+    warm_up();
+    for (int i = 0; i < srv_conf_.nthread_; ++i) {
+        loop_futures_.push_back(eventpool_.enqueue(&ConnLoop::loop, conn_loops_[i]));
+    }
+    wait_loops_started();
+
+    if (srv_sock_ < 0) {
+        // 升级启动时使用旧进程的监听socket，失败时旧进程还在监听，创建新的也会失败
+        upgrade_chan_ = HotUpgrade::inherited_channel();
+        if (upgrade_chan_ >= 0) {
+            std::vector<int> socks = HotUpgrade::recv_listen_socks(upgrade_chan_, UPGRADE_RECV_TIMEOUT_MS);
+            if (socks.size() == 1) {
+                srv_sock_ = socks[0];
+                SPDLOG_INFO("upgrade: inherited listen socket from the old process");
+            } else {
+                SPDLOG_ERROR("upgrade: receive listen socket failed: {}", strerror(errno));
+                for (int sock : socks) { close(sock); }
+            }
+        }
+    }
+    if (srv_sock_ < 0) {
+        create_listen_service();
+    }
     FdUtil::set_nonblocking(srv_sock_);
 
     epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
@@ -61,22 +141,33 @@ LiteWebServer::LiteWebServer(const ServerConf srv_conf)
         throw std::runtime_error(strerror(errno));
     }
 
-    uint32_t srv_sock_events = EPOLLIN | EPOLLRDHUP;
+    srv_sock_events_ = EPOLLIN | EPOLLRDHUP;
+    if (srv_conf_.worker_processes_ > 0 && !srv_conf_.reuseport_) {
+        // 多个工作进程监听同一个socket，每个连接只唤醒其中一个，避免惊群
+        // EPOLLEXCLUSIVE不能和EPOLLRDHUP一起使用
+        srv_sock_events_ = EPOLLIN | EPOLLEXCLUSIVE;
+    }
     if (srv_conf_.epoll_et_srv_) {
-        srv_sock_events |= EPOLLET;
+        srv_sock_events_ |= EPOLLET;
     }
-    FdUtil::epoll_add_fd(epoll_fd_, srv_sock_, srv_sock_events);
-    FdUtil::epoll_add_fd_oneshot(epoll_fd_, exit_event_, EPOLLIN | EPOLLRDHUP);
+    FdUtil::epoll_add_fd(epoll_fd_, srv_sock_, srv_sock_events_);
 
-    //BUG 如何优雅的结束程序？如何关闭sock？如何释放资源？
-    for (int i = 0; i < srv_conf_.nthread_; ++i) {
-        conn_loops_.emplace_back(std::make_shared<ConnLoop>(&srv_conf_));
-        eventpool_.enqueue(&ConnLoop::loop, conn_loops_[i]);
+    // 预留一个描述符，描述符用完时释放它来接收并关闭连接
+    spare_fd_ = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    FdUtil::epoll_add_fd(epoll_fd_, exit_event_, EPOLLIN);
+
+    if (srv_conf_.metrics_port_ > 0) {
+        metrics_service_.reset(new MetricsService(srv_conf_, [this]() { return render_metrics(); }));
+        if (!metrics_service_->start(epoll_fd_)) {
+            metrics_service_.reset();
+        }
     }
 }
 
 LiteWebServer::~LiteWebServer()
 {
+    metrics_service_.reset();
+
     if (epoll_fd_ >= 0) {
         close(epoll_fd_);
     }
@@ -85,6 +176,14 @@ LiteWebServer::~LiteWebServer()
         close(srv_sock_);
     }
 
+    if (upgrade_chan_ >= 0) {
+        close(upgrade_chan_);
+    }
+
+    if (spare_fd_ >= 0) {
+        close(spare_fd_);
+    }
+
     if (exit_event_ >= 0) {
         close(exit_event_);
     }
@@ -101,8 +200,35 @@ void LiteWebServer::start_loop()
     running_ = true;
     int n_event = 0;
 
+    // 新进程已经可以处理连接了，通知旧进程（或者主进程）让原来的进程退出
+    if (upgrade_chan_ >= 0) {
+        if (HotUpgrade::notify_ready(upgrade_chan_)) {
+            SPDLOG_INFO("upgrade: ready, old process notified");
+        } else {
+            SPDLOG_WARN("upgrade: notify old process failed: {}", strerror(errno));
+        }
+        close(upgrade_chan_);
+        upgrade_chan_ = -1;
+    }
+
+    if (!srv_conf_.acceptor_cpus_.empty()) {
+        std::vector<int> cpus = CpuUtil::parse_cpu_list(srv_conf_.acceptor_cpus_);
+        if (cpus.empty() || CpuUtil::pin_current_thread(cpus) != 0) {
+            SPDLOG_WARN("bind acceptor to cpus {} failed, running unbound", srv_conf_.acceptor_cpus_);
+        }
+    }
+
+    // 启用再平衡时，epoll_wait最多等待一个周期
+    int wait_timeout = srv_conf_.rebalance_interval_ms_ > 0 ? srv_conf_.rebalance_interval_ms_ : -1;
+    rebalance_at_ = SteadyClock::now();
+
     while(running_) {
-        n_event = epoll_wait(epoll_fd_, events_, srv_conf_.epoll_max_events_, -1);
+        // 暂停接收连接时，定期检查是否有连接关闭
+        int timeout = wait_timeout;
+        if (accept_paused_ && (timeout < 0 || timeout > ACCEPT_RESUME_CHECK_MS)) {
+            timeout = ACCEPT_RESUME_CHECK_MS;
+        }
+        n_event = epoll_wait(epoll_fd_, events_, srv_conf_.epoll_max_events_, timeout);
 
         // 如果等待事件失败，且不是因为系统中断造成的，
         // 直接退出主循环
@@ -122,23 +248,132 @@ void LiteWebServer::start_loop()
             if (sockfd == srv_sock_) {
                 deal_new_conn_greedy();
             } else if (sockfd == exit_event_) {
-                SPDLOG_DEBUG("Main server loop recive exit signal");
-                running_ = false;
+                handle_signal_event();
+            } else if (sockfd == upgrade_chan_) {
+                handle_upgrade_chan();
+            } else if (metrics_service_) {
+                metrics_service_->handle_event(sockfd, events_[i].events);
+            }
+            if (!running_) {
                 break;
             }
         }
+
+        if (accept_paused_ && running_) {
+            resume_accept();
+        }
+
+        if (wait_timeout > 0
+            && SteadyClock::now() - rebalance_at_ >= MilliSeconds(srv_conf_.rebalance_interval_ms_)) {
+            rebalance();
+        }
     }
 
     // 停掉所有事件循环
     // 这里只要简单的调用stop就行，
     // eventpool_线程池在销毁时会等待所有线程退出
+    // 优雅退出时由各个事件循环在排空连接后自己退出
+    SteadyClock::time_point drain_deadline = SteadyClock::now() + MilliSeconds(srv_conf_.drain_timeout_ms_);
     for (int i = 0; i < srv_conf_.nthread_; ++i) {
-        conn_loops_[i]->stop();
+        if (draining_) {
+            conn_loops_[i]->drain(drain_deadline);
+        } else {
+            conn_loops_[i]->stop();
+        }
     }
+    save_hot_list();
 
     SPDLOG_INFO("END {} looping...", LITEWEBSERVER_NAME_VER);
 }
 
+void LiteWebServer::handle_signal_event()
+{
+    uint64_t event_count = 0;
+    // 非阻塞的，多个信号合并为一次读取
+    read(exit_event_, &event_count, sizeof(event_count));
+
+    if (stop_requested_) {
+        SPDLOG_DEBUG("Main server loop recive exit signal");
+        running_ = false;
+        return;
+    }
+    if (drain_requested_) {
+        drain_requested_ = 0;
+        SPDLOG_INFO("graceful shutdown, draining connections");
+        start_drain();
+        return;
+    }
+    if (upgrade_requested_) {
+        upgrade_requested_ = 0;
+        start_upgrade();
+    }
+}
+
+void LiteWebServer::start_drain()
+{
+    // 新进程（如果有）持有同一个监听socket，完成队列中的连接由它接收
+    FdUtil::epoll_del_fd(epoll_fd_, srv_sock_);
+    close(srv_sock_);
+    srv_sock_ = -1;
+    // 管理端口同样交给新进程
+    if (metrics_service_) {
+        metrics_service_->stop();
+    }
+    draining_ = true;
+    running_ = false;
+}
+
+void LiteWebServer::start_upgrade()
+{
+    if (srv_conf_.worker_processes_ > 0) {
+        SPDLOG_WARN("upgrade: not supported in worker processes, ignored");
+        return;
+    }
+    if (upgrade_pid_ > 0) {
+        SPDLOG_WARN("upgrade: new process {} is starting, ignored", upgrade_pid_);
+        return;
+    }
+
+    int chan = -1;
+    pid_t pid = HotUpgrade::spawn(std::vector<int>{srv_sock_}, chan);
+    if (pid < 0) {
+        SPDLOG_ERROR("upgrade: start new process failed: {}", strerror(errno));
+        return;
+    }
+    FdUtil::set_nonblocking(chan);
+    FdUtil::epoll_add_fd(epoll_fd_, chan, EPOLLIN | EPOLLRDHUP);
+    upgrade_chan_ = chan;
+    upgrade_pid_ = pid;
+    SPDLOG_INFO("upgrade: started new process {}, waiting for it to be ready", pid);
+}
+
+void LiteWebServer::handle_upgrade_chan()
+{
+    int ready = HotUpgrade::check_ready(upgrade_chan_);
+    if (ready == 0) {
+        return;
+    }
+    FdUtil::epoll_del_fd(epoll_fd_, upgrade_chan_);
+    close(upgrade_chan_);
+    upgrade_chan_ = -1;
+
+    if (ready > 0) {
+        SPDLOG_INFO("upgrade: new process {} is ready, draining connections", upgrade_pid_);
+        start_drain();
+        return;
+    }
+
+    // 新进程退出时才会关闭channel，通常已经可以回收了
+    int status = 0;
+    if (waitpid(upgrade_pid_, &status, WNOHANG) == upgrade_pid_ && WIFEXITED(status)) {
+        SPDLOG_ERROR("upgrade: new process {} exited with code {} before ready, keep running",
+                     upgrade_pid_, WEXITSTATUS(status));
+    } else {
+        SPDLOG_ERROR("upgrade: new process {} exited before ready, keep running", upgrade_pid_);
+    }
+    upgrade_pid_ = -1;
+}
+
 void LiteWebServer::init_log()
 {
     /***********************************************************
@@ -206,7 +441,7 @@ void LiteWebServer::init_log()
         spdlog::set_pattern("[%Y-%m-%d %H:%M:%S.%e] [%P|%t] [%l] %v");
         spdlog::set_level(spdlog::level::info);
         // create a file rotating logger with 10mb size max and 5 rotated files
-        spdlog::rotating_logger_mt<spdlog::async_factory>("server_log", "litewebserver.log", 1024 * 1024 * 10, 5);
+        spdlog::rotating_logger_mt<spdlog::async_factory>("server_log", srv_conf_.log_file_, 1024 * 1024 * 10, 5);
         spdlog::set_default_logger(spdlog::get("server_log"));
     } catch (const spdlog::spdlog_ex &ex) {
         std::cout << "Log initialization failed: " << ex.what() << std::endl;
@@ -214,38 +449,257 @@ void LiteWebServer::init_log()
 }
 
 void LiteWebServer::create_listen_service()
+{
+    srv_sock_ = create_listen_socket(srv_conf_, false);
+}
+
+int LiteWebServer::create_listen_socket(const ServerConf &srv_conf, bool reuseport)
 {
     int sock_ret = -1;
 
-    srv_sock_ = socket(PF_INET, SOCK_STREAM, 0);
-    if (srv_sock_ < 0) {
+    int sock = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
         throw std::runtime_error(strerror(errno));
     }
 
-    sock_ret = FdUtil::set_socket_reuseaddr(srv_sock_);
+    sock_ret = FdUtil::set_socket_reuseaddr(sock);
     if (sock_ret == -1) {
+        close(sock);
+        throw std::runtime_error(strerror(errno));
+    }
+
+    if (reuseport && FdUtil::set_socket_reuseport(sock) == -1) {
+        close(sock);
         throw std::runtime_error(strerror(errno));
     }
 
+    // 在监听socket上检查一次，避免每个连接都输出警告
+    if (srv_conf.so_busy_poll_us_ > 0
+        && FdUtil::set_socket_busy_poll(sock, srv_conf.so_busy_poll_us_) != 0) {
+        SPDLOG_WARN("set SO_BUSY_POLL failed: {}", strerror(errno));
+    }
+
     struct sockaddr_in host_addr;
     socklen_t host_addr_size = sizeof(host_addr);
     memset(&host_addr, 0, host_addr_size);
     host_addr.sin_family = AF_INET;
     host_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    host_addr.sin_port = htons(srv_conf_.port_);
-    sock_ret = bind(srv_sock_, (struct sockaddr*)&host_addr, host_addr_size);
+    host_addr.sin_port = htons(srv_conf.port_);
+    sock_ret = bind(sock, (struct sockaddr*)&host_addr, host_addr_size);
+    if (sock_ret == -1) {
+        std::string err = strerror(errno);
+        close(sock);
+        throw std::runtime_error("bind port " + std::to_string(srv_conf.port_) + " failed: " + err);
+    }
 
-    sock_ret = listen(srv_sock_, srv_conf_.backlog_);
+    sock_ret = listen(sock, srv_conf.backlog_);
     if (sock_ret == -1) {
+        close(sock);
         throw std::runtime_error(strerror(errno));
     }
+    return sock;
+}
+
+void LiteWebServer::create_shared_res()
+{
+    doc_root_.reset(new DocRoot(srv_conf_.doc_root_,
+                                srv_conf_.doc_root_dir_cache_max_,
+                                srv_conf_.open_file_cache_valid_ms_));
+    loop_shared_.doc_root = doc_root_.get();
+
+    if (srv_conf_.small_file_cache_max_bytes_ > 0) {
+        content_cache_.reset(new ContentCache(srv_conf_.small_file_cache_max_bytes_,
+                                              srv_conf_.small_file_max_size_));
+        loop_shared_.content_cache = content_cache_.get();
+    }
+
+    if (srv_conf_.file_serve_mode_ == FileServeMode::MMAP) {
+        mmap_cache_.reset(new MmapCache(srv_conf_.mmap_cache_max_bytes_,
+                                        srv_conf_.mmap_max_size_));
+        loop_shared_.mmap_cache = mmap_cache_.get();
+    }
+
+    if (srv_conf_.async_file_io_ && srv_conf_.io_nthread_ > 0) {
+        iopool_.reset(new chaos::ThreadPool(srv_conf_.io_nthread_,
+                                            std::max(srv_conf_.io_nthread_, srv_conf_.io_max_nthread_),
+                                            srv_conf_.io_max_nthread_ > srv_conf_.io_nthread_,
+                                            srv_conf_.pool_work_stealing_,
+                                            scale_policy(srv_conf_.io_nthread_)));
+        loop_shared_.io_pool = iopool_.get();
+    }
+
+    bgpool_.set_lane_cap(chaos::Priority::LOW, srv_conf_.bg_low_lane_cap_);
+
+    if (srv_conf_.etag_hash_) {
+        etag_cache_.reset(new ETagCache(&bgpool_,
+                                        srv_conf_.etag_hash_cache_max_,
+                                        srv_conf_.etag_hash_max_size_));
+        loop_shared_.etag_cache = etag_cache_.get();
+    }
+
+    if (srv_conf_.gzip_) {
+        if (CompressCache::available()) {
+            compress_cache_.reset(new CompressCache(&bgpool_,
+                                                    srv_conf_.gzip_cache_max_bytes_,
+                                                    srv_conf_.gzip_max_length_,
+                                                    srv_conf_.gzip_min_length_,
+                                                    srv_conf_.gzip_level_));
+            loop_shared_.compress_cache = compress_cache_.get();
+        } else {
+            SPDLOG_WARN("gzip is enabled, but compiled without zlib, ignored");
+        }
+    }
+}
+
+void LiteWebServer::warm_up()
+{
+    if (!srv_conf_.warmup_) {
+        return;
+    }
+
+    std::vector<std::string> hot_paths;
+    if (!srv_conf_.hot_list_file_.empty()) {
+        hot_paths = WarmUp::load_hot_list(srv_conf_.hot_list_file_, srv_conf_.hot_list_max_);
+    }
+
+    SteadyClock::time_point start = SteadyClock::now();
+    WarmUp warm_up(srv_conf_, loop_shared_);
+    WarmUp::FileList files = warm_up.run(hot_paths);
+    for (auto &conn_loop : conn_loops_) {
+        conn_loop->preload_files(files);
+    }
+
+    auto elapse = std::chrono::duration_cast<MilliSeconds>(SteadyClock::now() - start);
+    SPDLOG_INFO("warm-up done in {}ms, {} hot paths, {} files warmed, {} files preloaded",
+                elapse.count(), hot_paths.size(), warm_up.files_warmed(), files.size());
+}
+
+void LiteWebServer::wait_loops_started()
+{
+    SteadyClock::time_point deadline = SteadyClock::now() + MilliSeconds(LOOP_START_TIMEOUT_MS);
+    for (int i = 0; i < srv_conf_.nthread_; ++i) {
+        while (!conn_loops_[i]->started()) {
+            bool exited = loop_futures_[i].wait_for(MilliSeconds(1)) == std::future_status::ready;
+            if (exited || SteadyClock::now() > deadline) {
+                // 已经运行的ConnLoop需要退出，否则eventpool_析构时会一直等待
+                for (auto &conn_loop : conn_loops_) {
+                    conn_loop->stop();
+                }
+                throw std::runtime_error("ConnLoop " + std::to_string(i) + " did not start");
+            }
+        }
+    }
+}
+
+void LiteWebServer::save_hot_list()
+{
+    if (srv_conf_.hot_list_file_.empty()) {
+        return;
+    }
+
+    // 文件缓存只能在ConnLoop的线程中访问，等它们全部退出
+    for (auto &fut : loop_futures_) {
+        fut.wait();
+    }
+
+    std::vector<std::vector<std::string> > lists;
+    for (auto &conn_loop : conn_loops_) {
+        lists.push_back(conn_loop->hot_paths(srv_conf_.hot_list_max_));
+    }
+    std::vector<std::string> paths = WarmUp::merge_hot_lists(lists, srv_conf_.hot_list_max_);
+    if (!WarmUp::save_hot_list(srv_conf_.hot_list_file_, paths)) {
+        SPDLOG_ERROR("save hot list {} failed: {}", srv_conf_.hot_list_file_, strerror(errno));
+        return;
+    }
+    SPDLOG_INFO("saved {} hot paths to {}", paths.size(), srv_conf_.hot_list_file_);
+}
+
+void LiteWebServer::rebalance()
+{
+    SteadyClock::time_point now = SteadyClock::now();
+    double elapse_ns = static_cast<double>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(now - rebalance_at_).count());
+    rebalance_at_ = now;
+    if (conn_loops_.size() < 2 || elapse_ns <= 0) {
+        return;
+    }
+
+    std::size_t busiest = 0;
+    std::size_t idlest = 0;
+    std::vector<double> busy(conn_loops_.size(), 0);
+    for (std::size_t i = 0; i < conn_loops_.size(); ++i) {
+        uint64_t busy_ns = conn_loops_[i]->busy_ns();
+        busy[i] = (busy_ns - loop_busy_ns_[i]) / elapse_ns;
+        loop_busy_ns_[i] = busy_ns;
+        if (busy[i] > busy[busiest]) { busiest = i; }
+        if (busy[i] < busy[idlest]) { idlest = i; }
+    }
+
+    // 偶尔的不均衡（一个大文件下载）很快就会结束，只处理持续的不均衡
+    if (busiest == idlest
+        || busy[busiest] < srv_conf_.rebalance_min_busy_
+        || busy[busiest] - busy[idlest] < srv_conf_.rebalance_busy_diff_) {
+        imbalance_rounds_ = 0;
+        return;
+    }
+    if (++imbalance_rounds_ < srv_conf_.rebalance_sustain_rounds_) {
+        return;
+    }
+    imbalance_rounds_ = 0;
+
+    // 按繁忙程度之差的比例迁移连接，迁移一半的差值，避免来回振荡
+    std::size_t conn_num = conn_loops_[busiest]->conn_num();
+    std::size_t num = static_cast<std::size_t>(
+        conn_num * (busy[busiest] - busy[idlest]) / (2 * busy[busiest]));
+    num = std::max<std::size_t>(1, std::min(num, srv_conf_.rebalance_max_conns_));
+
+    SPDLOG_INFO("rebalance: loop {} busy {:.2f}, loop {} busy {:.2f}, migrate up to {} of {} connections",
+                busiest, busy[busiest], idlest, busy[idlest], num, conn_num);
+    conn_loops_[busiest]->migrate_conns(conn_loops_[idlest], num);
+}
+
+chaos::ScalePolicy LiteWebServer::scale_policy(std::size_t min_nthread) const
+{
+    chaos::ScalePolicy policy;
+    policy.interval_ms = srv_conf_.pool_scale_interval_ms_;
+    policy.up_wait_us = srv_conf_.pool_scale_up_wait_us_;
+    policy.down_wait_us = srv_conf_.pool_scale_down_wait_us_;
+    policy.min_workers = min_nthread;
+    return policy;
+}
+
+std::vector<int> LiteWebServer::loop_cpus(int idx) const
+{
+    if (!srv_conf_.loop_cpus_.empty()) {
+        std::vector<int> cpus = CpuUtil::parse_cpu_list(srv_conf_.loop_cpus_);
+        if (cpus.empty()) {
+            SPDLOG_WARN("invalid loop_cpus_ {}, ignored", srv_conf_.loop_cpus_);
+            return cpus;
+        }
+        return std::vector<int>{cpus[idx % cpus.size()]};
+    }
+
+    if (!srv_conf_.loop_numa_nodes_.empty()) {
+        std::vector<int> nodes = CpuUtil::parse_cpu_list(srv_conf_.loop_numa_nodes_);
+        if (nodes.empty()) {
+            SPDLOG_WARN("invalid loop_numa_nodes_ {}, ignored", srv_conf_.loop_numa_nodes_);
+            return nodes;
+        }
+        std::vector<int> cpus = CpuUtil::node_cpus(nodes[idx % nodes.size()]);
+        if (cpus.empty()) {
+            SPDLOG_WARN("numa node {} has no cpus, ignored", nodes[idx % nodes.size()]);
+        }
+        return cpus;
+    }
+
+    return std::vector<int>();
 }
 
 void LiteWebServer::register_exit_signal()
 {
     int ret = -1;
 
-    exit_event_ = eventfd(0, 0);
+    exit_event_ = eventfd(0, EFD_CLOEXEC);
     if (exit_event_ == -1) {
         throw std::runtime_error(strerror(errno));
     }
@@ -264,6 +718,16 @@ void LiteWebServer::register_exit_signal()
     if (ret == -1) {
         throw std::runtime_error(strerror(errno));
     }
+
+    ret = sigaction(SIGQUIT, &sa, NULL);
+    if (ret == -1) {
+        throw std::runtime_error(strerror(errno));
+    }
+
+    ret = sigaction(SIGUSR2, &sa, NULL);
+    if (ret == -1) {
+        throw std::runtime_error(strerror(errno));
+    }
 }
 
 void LiteWebServer::ignore_SIGPIPE()
@@ -287,12 +751,18 @@ void LiteWebServer::deal_new_conn()
     socklen_t cli_addr_size = sizeof(cli_addr);
     memset(&cli_addr, 0, cli_addr_size);
 
-    int cli_sock = accept(srv_sock_, (struct sockaddr *)&cli_addr, &cli_addr_size);
+    int cli_sock = accept4(srv_sock_, (struct sockaddr *)&cli_addr, &cli_addr_size, SOCK_CLOEXEC);
     if (cli_sock < 0) {
         return;
     }
     FdUtil::set_nonblocking(cli_sock);
     // FdUtil::set_socket_nodelay(cli_sock);
+    if (srv_conf_.tcp_notsent_lowat_ > 0) {
+        FdUtil::set_tcp_notsent_lowat(cli_sock, srv_conf_.tcp_notsent_lowat_);
+    }
+    if (srv_conf_.so_busy_poll_us_ > 0) {
+        FdUtil::set_socket_busy_poll(cli_sock, srv_conf_.so_busy_poll_us_);
+    }
     //BUG 优化分配方式
     // 简单的分配接收到的链接，这种方式有一个缺陷，
     // 如果连接存在部分长连接，部分短连接，会导致分配不均
@@ -309,23 +779,265 @@ void LiteWebServer::deal_new_conn_greedy()
     socklen_t cli_addr_size = sizeof(cli_addr);
     //TODO 仅初始化一次，应该是没问题的
     memset(&cli_addr, 0, cli_addr_size);
+    std::size_t dropped = 0;
 
     while (true) {
-        int cli_sock = accept(srv_sock_, (struct sockaddr *)&cli_addr, &cli_addr_size);
+        // 先确定分配给哪个ConnLoop，全部满了时不再接收，连接留在完成队列中
+        int loop_idx = pick_loop();
+        if (loop_idx < 0) {
+            pause_accept();
+            break;
+        }
+
+        int cli_sock = accept4(srv_sock_, (struct sockaddr *)&cli_addr, &cli_addr_size, SOCK_CLOEXEC);
         if (cli_sock < 0) {
             // 除了系统中断外，都应该直接退出，目前是这样的
             if (errno == EINTR) { continue; }
-            else { break; }
+            // 描述符用完时连接一直留在完成队列中，水平触发的监听socket会让主循环空转，
+            // 用预留的描述符接收并立即关闭
+            if ((errno == EMFILE || errno == ENFILE) && accept_and_drop()) {
+                ++dropped;
+                acceptor_metrics_.accept_dropped.add();
+                continue;
+            }
+            break;
         }
+        acceptor_metrics_.accepts.add();
 
         FdUtil::set_nonblocking(cli_sock);
         // FdUtil::set_socket_nodelay(cli_sock);
+        if (srv_conf_.tcp_notsent_lowat_ > 0) {
+            FdUtil::set_tcp_notsent_lowat(cli_sock, srv_conf_.tcp_notsent_lowat_);
+        }
+        if (srv_conf_.so_busy_poll_us_ > 0) {
+            FdUtil::set_socket_busy_poll(cli_sock, srv_conf_.so_busy_poll_us_);
+        }
         //BUG 优化分配方式
         // 简单的分配接收到的链接，这种方式有一个缺陷，
         // 如果连接存在部分长连接，部分短连接，会导致分配不均
-        conn_loops_[pool_idx_]->add_clisock_to_queue(cli_sock);
-        pool_idx_ = (pool_idx_ + 1) % srv_conf_.nthread_;
+        conn_loops_[loop_idx]->add_clisock_to_queue(cli_sock);
+        pool_idx_ = (loop_idx + 1) % srv_conf_.nthread_;
         // SPDLOG_DEBUG("Recive client connect, cli_sock: {}, ip: {}",
         //              cli_sock, inet_ntoa(cli_addr.sin_addr));
     }
+
+    if (dropped > 0) {
+        SPDLOG_WARN("too many open files, {} connections dropped", dropped);
+    }
+}
+
+int LiteWebServer::pick_loop() const
+{
+    if (srv_conf_.max_conns_ > 0) {
+        std::size_t total = 0;
+        for (const auto &conn_loop : conn_loops_) {
+            total += conn_loop->open_conns();
+        }
+        if (total >= srv_conf_.max_conns_) {
+            return -1;
+        }
+    }
+
+    if (srv_conf_.max_conns_per_loop_ == 0) {
+        return pool_idx_;
+    }
+    for (int i = 0; i < srv_conf_.nthread_; ++i) {
+        int idx = (pool_idx_ + i) % srv_conf_.nthread_;
+        if (conn_loops_[idx]->open_conns() < srv_conf_.max_conns_per_loop_) {
+            return idx;
+        }
+    }
+    return -1;
+}
+
+void LiteWebServer::pause_accept()
+{
+    if (accept_paused_) {
+        return;
+    }
+    FdUtil::epoll_del_fd(epoll_fd_, srv_sock_);
+    accept_paused_ = true;
+    SPDLOG_WARN("connection limit reached, accepting paused");
+}
+
+void LiteWebServer::resume_accept()
+{
+    if (!accept_paused_ || srv_sock_ < 0 || pick_loop() < 0) {
+        return;
+    }
+    // 添加时已经可读的话会立即触发，边缘触发模式也不会错过
+    FdUtil::epoll_add_fd(epoll_fd_, srv_sock_, srv_sock_events_);
+    accept_paused_ = false;
+    SPDLOG_INFO("accepting resumed");
+}
+
+bool LiteWebServer::accept_and_drop()
+{
+    if (spare_fd_ < 0) {
+        return false;
+    }
+    close(spare_fd_);
+    spare_fd_ = -1;
+    int cli_sock = accept4(srv_sock_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (cli_sock >= 0) {
+        close(cli_sock);
+    }
+    spare_fd_ = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return cli_sock >= 0;
+}
+
+std::string LiteWebServer::render_metrics() const
+{
+    MetricsWriter w;
+    char labels[128] = {0};
+
+    w.family("lws_accepted_connections_total", "Connections accepted by the acceptor thread.", "counter");
+    w.sample("lws_accepted_connections_total", "", acceptor_metrics_.accepts.get());
+    w.family("lws_dropped_connections_total", "Connections accepted and closed because file descriptors ran out.", "counter");
+    w.sample("lws_dropped_connections_total", "", acceptor_metrics_.accept_dropped.get());
+
+    w.family("lws_open_connections", "Open client connections.", "gauge");
+    for (std::size_t i = 0; i < conn_loops_.size(); ++i) {
+        snprintf(labels, sizeof(labels), "loop=\"%zu\"", i);
+        w.sample("lws_open_connections", labels, static_cast<uint64_t>(conn_loops_[i]->open_conns()));
+    }
+
+    // 按请求方法和状态码汇总所有ConnLoop，只输出出现过的组合
+    w.family("lws_http_requests_total", "Completed HTTP requests.", "counter");
+    for (std::size_t m = 0; m < HTTP_METHOD_NUM; ++m) {
+        for (std::size_t c = 0; c < HTTP_CODE_NUM; ++c) {
+            uint64_t num = 0;
+            for (const auto &conn_loop : conn_loops_) {
+                num += conn_loop->metrics().requests[m][c].get();
+            }
+            if (num == 0) {
+                continue;
+            }
+            snprintf(labels, sizeof(labels), "method=\"%s\",code=\"%d\"",
+                     http_enum_to_str(static_cast<HttpMethod>(m)), static_cast<int>(http_code_at(c)));
+            w.sample("lws_http_requests_total", labels, num);
+        }
+    }
+
+    struct LoopCounter {
+        const char *name;
+        const char *help;
+        const MetricCounter LoopMetrics::*counter;
+    };
+    const LoopCounter loop_counters[] = {
+        {"lws_received_bytes_total", "Bytes received from clients.", &LoopMetrics::bytes_in},
+        {"lws_sent_bytes_total", "Bytes sent to clients, including sendfile.", &LoopMetrics::bytes_out},
+        {"lws_sendfile_bytes_total", "Bytes sent to clients by sendfile.", &LoopMetrics::sendfile_bytes},
+        {"lws_timeouts_total", "Connections closed by timers.", &LoopMetrics::timeouts},
+        {"lws_parse_errors_total", "Requests rejected as malformed.", &LoopMetrics::parse_errors},
+    };
+    for (const LoopCounter &lc : loop_counters) {
+        uint64_t num = 0;
+        for (const auto &conn_loop : conn_loops_) {
+            num += (conn_loop->metrics().*lc.counter).get();
+        }
+        w.family(lc.name, lc.help, "counter");
+        w.sample(lc.name, "", num);
+    }
+
+    uint64_t shed = 0;
+    uint64_t mem_closed = 0;
+    for (const auto &conn_loop : conn_loops_) {
+        shed += conn_loop->shed_num();
+        mem_closed += conn_loop->mem_closed_num();
+    }
+    w.family("lws_shed_requests_total", "Requests answered with 503 by overload protection.", "counter");
+    w.sample("lws_shed_requests_total", "", shed);
+    w.family("lws_memory_closed_connections_total", "Connections closed for exceeding the memory cap.", "counter");
+    w.sample("lws_memory_closed_connections_total", "", mem_closed);
+
+    // 直方图的桶是累计的
+    w.family("lws_epoll_events", "Events returned by each epoll_wait of the connection loops.", "histogram");
+    uint64_t cumulative = 0;
+    uint64_t events_sum = 0;
+    for (std::size_t b = 0; b < EVENTS_HIST_BUCKETS; ++b) {
+        for (const auto &conn_loop : conn_loops_) {
+            cumulative += conn_loop->metrics().events_hist[b].get();
+        }
+        if (b + 1 == EVENTS_HIST_BUCKETS) {
+            snprintf(labels, sizeof(labels), "le=\"+Inf\"");
+        } else {
+            snprintf(labels, sizeof(labels), "le=\"%u\"", b == 0 ? 0u : 1u << (b - 1));
+        }
+        w.sample("lws_epoll_events_bucket", labels, cumulative);
+    }
+    for (const auto &conn_loop : conn_loops_) {
+        events_sum += conn_loop->metrics().events_sum.get();
+    }
+    w.sample("lws_epoll_events_sum", "", events_sum);
+    w.sample("lws_epoll_events_count", "", cumulative);
+
+    w.family("lws_loop_busy_seconds_total", "Time the connection loops spent handling events.", "counter");
+    for (std::size_t i = 0; i < conn_loops_.size(); ++i) {
+        snprintf(labels, sizeof(labels), "loop=\"%zu\"", i);
+        w.sample("lws_loop_busy_seconds_total", labels, conn_loops_[i]->busy_ns() / 1e9);
+    }
+    w.family("lws_loop_spin_seconds_total", "Time the connection loops spent busy polling without events.", "counter");
+    for (std::size_t i = 0; i < conn_loops_.size(); ++i) {
+        snprintf(labels, sizeof(labels), "loop=\"%zu\"", i);
+        w.sample("lws_loop_spin_seconds_total", labels, conn_loops_[i]->spin_ns() / 1e9);
+    }
+    w.family("lws_loop_lag_seconds", "Recent event loop lag.", "gauge");
+    for (std::size_t i = 0; i < conn_loops_.size(); ++i) {
+        snprintf(labels, sizeof(labels), "loop=\"%zu\"", i);
+        w.sample("lws_loop_lag_seconds", labels, conn_loops_[i]->lag_ns() / 1e9);
+    }
+
+    if (srv_conf_.mem_stats_interval_ms_ > 0) {
+        const char *categories[] = {"conns", "read_bufs", "read_pool", "requests", "responses", "timers", "file_cache"};
+        const char *names[] = {"lws_loop_memory_bytes", "lws_loop_memory_peak_bytes"};
+        const char *helps[] = {"Memory held by the connection loops, by category.",
+                               "Highest memory held by the connection loops, by category."};
+        for (int k = 0; k < 2; ++k) {
+            w.family(names[k], helps[k], "gauge");
+            for (std::size_t i = 0; i < conn_loops_.size(); ++i) {
+                LoopMemStats st = k == 0 ? conn_loops_[i]->mem_stats() : conn_loops_[i]->mem_peak();
+                const std::size_t vals[] = {st.conns, st.read_bufs, st.read_pool, st.requests,
+                                            st.responses, st.timers, st.file_cache};
+                for (std::size_t j = 0; j < sizeof(vals) / sizeof(vals[0]); ++j) {
+                    snprintf(labels, sizeof(labels), "loop=\"%zu\",category=\"%s\"", i, categories[j]);
+                    w.sample(names[k], labels, static_cast<uint64_t>(vals[j]));
+                }
+            }
+        }
+    }
+
+    std::vector<std::pair<const char*, chaos::PoolStats> > pools;
+    pools.emplace_back("bg", bgpool_.stats());
+    if (iopool_) {
+        pools.emplace_back("io", iopool_->stats());
+    }
+    w.family("lws_pool_queue_depth", "Tasks waiting in the thread pools.", "gauge");
+    for (const auto &pool : pools) {
+        snprintf(labels, sizeof(labels), "pool=\"%s\"", pool.first);
+        w.sample("lws_pool_queue_depth", labels, static_cast<uint64_t>(pool.second.queue_depth));
+    }
+    w.family("lws_pool_workers", "Worker threads of the thread pools.", "gauge");
+    for (const auto &pool : pools) {
+        snprintf(labels, sizeof(labels), "pool=\"%s\"", pool.first);
+        w.sample("lws_pool_workers", labels, static_cast<uint64_t>(pool.second.workers));
+    }
+    w.family("lws_pool_completed_tasks_total", "Tasks completed by the thread pools.", "counter");
+    for (const auto &pool : pools) {
+        snprintf(labels, sizeof(labels), "pool=\"%s\"", pool.first);
+        w.sample("lws_pool_completed_tasks_total", labels, pool.second.completed);
+    }
+
+    w.family("lws_cache_bytes", "Bytes held by the shared caches.", "gauge");
+    if (content_cache_) {
+        w.sample("lws_cache_bytes", "cache=\"content\"", static_cast<uint64_t>(content_cache_->bytes()));
+    }
+    if (compress_cache_) {
+        w.sample("lws_cache_bytes", "cache=\"compress\"", static_cast<uint64_t>(compress_cache_->bytes()));
+    }
+    if (mmap_cache_) {
+        w.sample("lws_cache_bytes", "cache=\"mmap\"", static_cast<uint64_t>(mmap_cache_->bytes()));
+    }
+
+    return w.str();
 }
@@ -5,11 +5,17 @@
 #include <unordered_map>
 #include <memory>
 #include <chrono>
+#include <future>
 
+#include <signal.h>
+#include <sys/types.h>
 #include <sys/epoll.h>
 
 #include "connloop.h"
 #include "serverconf.h"
+#include "compresscache.h"
+#include "metrics.h"
+#include "metricsservice.h"
 #include "ChaosThreadPool.h"
 #include "cppver.h"
 
@@ -17,7 +23,11 @@
 class LiteWebServer
 {
 private:
+    // 信号处理函数设置对应的标志后写入exit_event_，在主循环中处理
     static int exit_event_;
+    static volatile sig_atomic_t stop_requested_;
+    static volatile sig_atomic_t drain_requested_;
+    static volatile sig_atomic_t upgrade_requested_;
     static void handle_signal(int sig);
 
 public:
@@ -25,7 +35,13 @@ public:
      * @brief 先实现成不可拷贝，不可移动的
      */
     //TODO
-    LiteWebServer(const ServerConf srv_conf);
+    /**
+     * @param listen_sock 已经在监听的socket，多进程模式下由主进程创建后传入，
+     *        -1表示由本对象创建，对象析构时会关闭它
+     * @param ready_chan 多进程模式下和主进程通信的channel，开始接收连接后通知主进程，
+     *        -1表示不需要通知，由本对象关闭
+     */
+    LiteWebServer(const ServerConf srv_conf, int listen_sock = -1, int ready_chan = -1);
     LiteWebServer(const LiteWebServer&) = delete;
     LiteWebServer(LiteWebServer&&) = delete;
     LiteWebServer& operator=(const LiteWebServer&) = delete;
@@ -34,14 +50,68 @@ public:
 
 public:
     void start_loop();
+    /**
+     * @brief 创建绑定到srv_conf.port_的监听socket
+     * @param reuseport 设置SO_REUSEPORT，多个socket可以绑定到同一个端口，由内核分配连接
+     * @throw std::runtime_error 创建，绑定或者监听失败
+     */
+    static int create_listen_socket(const ServerConf &srv_conf, bool reuseport);
 
 private:
     void init_log();
     void create_listen_service();
     /**
-     * @brief 处理退出信号
+     * @brief 创建所有ConnLoop共享的资源
+     */
+    void create_shared_res();
+    /**
+     * @brief 启动预热，完成或者超过时间预算后才返回，
+     *        打开的文件放入每个ConnLoop的文件缓存
+     */
+    void warm_up();
+    /**
+     * @brief 等待所有ConnLoop的loop()开始运行
+     * @throw std::runtime_error 超过时间还有没开始运行的，或者loop()提前退出了
+     */
+    void wait_loops_started();
+    /**
+     * @brief 等待所有ConnLoop退出，保存热点路径列表
+     */
+    void save_hot_list();
+    /**
+     * @brief 根据配置计算第idx个ConnLoop绑定的CPU
+     */
+    std::vector<int> loop_cpus(int idx) const;
+    /**
+     * @brief 根据配置生成线程池动态调整大小的策略
+     * @param min_nthread 缩容时最少保留的线程数
+     */
+    chaos::ScalePolicy scale_policy(std::size_t min_nthread) const;
+    /**
+     * @brief 统计各个ConnLoop在上一个周期中的繁忙程度，
+     *        持续不均衡时，将最忙的ConnLoop上的空闲连接迁移到最闲的ConnLoop上
+     */
+    void rebalance();
+    /**
+     * @brief 处理退出信号：
+     *        SIGTERM/SIGINT 立即退出
+     *        SIGQUIT 优雅退出，停止接收新连接，处理完已有的请求后退出
+     *        SIGUSR2 不停机升级，见HotUpgrade
      */
     void register_exit_signal();
+    void handle_signal_event();
+    /**
+     * @brief 停止接收新连接，退出主循环后排空所有ConnLoop
+     */
+    void start_drain();
+    /**
+     * @brief 启动新版本的进程并交出监听socket
+     */
+    void start_upgrade();
+    /**
+     * @brief 处理新进程的通知：就绪后开始排空，新进程提前退出时继续运行
+     */
+    void handle_upgrade_chan();
     void ignore_SIGPIPE();
     /**
      * @brief 分配新连接给线程池中的一个线程处理
@@ -53,16 +123,66 @@ private:
      *        贪心的，一次accept完多个链接
      */
     void deal_new_conn_greedy();
+    /**
+     * @brief 选择分配新连接的ConnLoop，从pool_idx_开始轮询，跳过达到max_conns_per_loop_的
+     * @return 达到max_conns_或者全部满了时返回-1
+     */
+    int pick_loop() const;
+    /**
+     * @brief 从epoll中移除监听socket，停止接收连接
+     */
+    void pause_accept();
+    /**
+     * @brief 有空闲的名额时，重新把监听socket加入epoll
+     */
+    void resume_accept();
+    /**
+     * @brief 描述符用完时，释放预留的描述符，接收一个连接并立即关闭，然后重新预留
+     * @return 是否接收到了连接
+     */
+    bool accept_and_drop();
+    /**
+     * @brief 汇总各个ConnLoop，线程池和缓存的指标，生成Prometheus文本格式，在主线程中调用
+     */
+    std::string render_metrics() const;
 
 private:
     const ServerConf srv_conf_;
     bool running_;
     int epoll_fd_;
     int srv_sock_;
+    bool draining_;
+    // 升级启动时和旧进程的channel，多进程模式下和主进程的channel，
+    // 或者升级过程中和新进程的channel
+    int upgrade_chan_;
+    pid_t upgrade_pid_;
+    uint32_t srv_sock_events_;
+    bool accept_paused_;
+    // 预留的描述符（/dev/null）
+    int spare_fd_;
+    //!!! 注意成员的声明顺序，析构顺序与之相反：
+    // 先停止事件循环，再停止后台线程池，最后释放共享资源
+    std::unique_ptr<DocRoot> doc_root_;
+    std::unique_ptr<CompressCache> compress_cache_;
+    std::unique_ptr<ContentCache> content_cache_;
+    std::unique_ptr<MmapCache> mmap_cache_;
+    std::unique_ptr<ETagCache> etag_cache_;
+    ConnLoopShared loop_shared_;
+    chaos::ThreadPool bgpool_;
+    // IO线程池中的任务持有ConnLoop的引用，不依赖与事件循环的析构顺序
+    std::unique_ptr<chaos::ThreadPool> iopool_;
     chaos::ThreadPool eventpool_;
     struct epoll_event *events_;
     std::vector<std::shared_ptr<ConnLoop> > conn_loops_;
+    std::vector<std::future<void> > loop_futures_;
+    // 再平衡的状态，只在主线程中访问
+    std::vector<uint64_t> loop_busy_ns_;
+    SteadyClock::time_point rebalance_at_;
+    int imbalance_rounds_;
     uint8_t pool_idx_;
+    AcceptorMetrics acceptor_metrics_;
+    // 管理端口，在析构函数中先于epoll_fd_关闭
+    std::unique_ptr<MetricsService> metrics_service_;
 };
 
 #endif //SRC_LITEWEBSERVER_H_
@@ -0,0 +1,146 @@
+#ifndef SRC_LRUCACHE_H_
+#define SRC_LRUCACHE_H_
+
+#include <list>
+#include <unordered_map>
+#include <utility>
+#include <functional>
+
+#include <stddef.h>
+
+
+/**
+ * @brief 简单的LRU缓存
+ *        1. std::list维护访问顺序，头部是最近访问的，尾部是最久未访问的
+ *        2. unordered_map保存key->list迭代器，用于快速查找
+ *        3. 每个条目带有一个cost（例如占用的字节数），
+ *           总cost超过max_cost，或者条目数超过max_items时，从尾部淘汰
+ *        !!! 非线程安全，需要调用者自己加锁，或者只在单个线程中使用
+ */
+template <typename Key, typename Value, typename Hash = std::hash<Key> >
+class LruCache
+{
+private:
+    struct Node
+    {
+        Key key;
+        Value val;
+        std::size_t cost;
+    };
+    using NodeList = std::list<Node>;
+
+public:
+    /**
+     * @param max_cost 最大总cost，0表示不限制
+     * @param max_items 最大条目数，0表示不限制
+     */
+    explicit LruCache(std::size_t max_cost, std::size_t max_items = 0)
+        : max_cost_(max_cost)
+        , max_items_(max_items)
+        , cost_(0)
+        {}
+
+public:
+    /**
+     * @brief 查找并将条目移动到最近访问的位置
+     * @return 找到返回值的指针，否则返回nullptr，
+     *         指针在下一次修改缓存（put，erase，clear）前有效
+     */
+    Value* get(const Key &key)
+    {
+        auto it = map_.find(key);
+        if (it == map_.end()) {
+            return nullptr;
+        }
+        list_.splice(list_.begin(), list_, it->second);
+        return &(it->second->val);
+    }
+
+    /**
+     * @brief 查找但不改变访问顺序
+     */
+    const Value* peek(const Key &key) const
+    {
+        auto it = map_.find(key);
+        if (it == map_.end()) {
+            return nullptr;
+        }
+        return &(it->second->val);
+    }
+
+    /**
+     * @brief 插入或替换条目，插入后可能会淘汰最久未访问的条目，
+     *        如果单个条目的cost就超过了max_cost，它自己也会被淘汰
+     */
+    void put(const Key &key, Value val, std::size_t cost = 1)
+    {
+        auto it = map_.find(key);
+        if (it != map_.end()) {
+            cost_ -= it->second->cost;
+            it->second->val = std::move(val);
+            it->second->cost = cost;
+            list_.splice(list_.begin(), list_, it->second);
+        } else {
+            list_.push_front(Node{key, std::move(val), cost});
+            map_.emplace(key, list_.begin());
+        }
+        cost_ += cost;
+        evict();
+    }
+
+    bool erase(const Key &key)
+    {
+        auto it = map_.find(key);
+        if (it == map_.end()) {
+            return false;
+        }
+        cost_ -= it->second->cost;
+        list_.erase(it->second);
+        map_.erase(it);
+        return true;
+    }
+
+    void clear()
+    {
+        map_.clear();
+        list_.clear();
+        cost_ = 0;
+    }
+
+    /**
+     * @brief 按照从最近到最久的访问顺序遍历，
+     *        fn返回false时停止遍历
+     */
+    void for_each(const std::function<bool(const Key&, const Value&)> &fn) const
+    {
+        for (const auto &node : list_) {
+            if (!fn(node.key, node.val)) { break; }
+        }
+    }
+
+    std::size_t size() const { return list_.size(); }
+    std::size_t cost() const { return cost_; }
+    std::size_t max_cost() const { return max_cost_; }
+
+private:
+    void evict()
+    {
+        while (!list_.empty()
+               && ((max_cost_ != 0 && cost_ > max_cost_)
+                   || (max_items_ != 0 && list_.size() > max_items_))) {
+            Node &last = list_.back();
+            cost_ -= last.cost;
+            map_.erase(last.key);
+            list_.pop_back();
+        }
+    }
+
+private:
+    std::size_t max_cost_;
+    std::size_t max_items_;
+    std::size_t cost_;
+    NodeList list_;
+    std::unordered_map<Key, typename NodeList::iterator, Hash> map_;
+};
+
+#endif // SRC_LRUCACHE_H_
@@ -12,6 +12,7 @@
 #include <arpa/inet.h>
 
 #include "litewebserver.h"
+#include "masterprocess.h"
 #include "userconn.h"
 #include "httpdata.h"
 #include "debughelper.h"
@@ -97,6 +98,25 @@
 // }
 
 
+// HttpResponse stream_csv(const HttpRequest &req)
+// {
+//     HttpResponse rsp(req);
+//     auto row = std::make_shared<int>(0);
+//     rsp.set_body_stream(
+//         [row](std::string &chunk, std::size_t max_bytes, const HttpResponse::StreamWaker &) -> bool {
+//             while (*row < 100000 && chunk.size() < max_bytes) {
+//                 chunk += std::to_string(*row) + ",row" + std::to_string(*row) + "\n";
+//                 ++(*row);
+//             }
+//             return *row < 100000;
+//         },
+//         HttpContentType::UNKNOWN
+//     );
+//     rsp.header_oper(HttpResponse::HeaderOper::MODIFY, "Content-Type", "text/csv");
+//     return rsp;
+// }
+
+
 int main()
 {
     /**
@@ -141,8 +161,13 @@ int main()
     // );
     // UserConn::register_router("/get/content", HttpMethod::GET, get_content);
     // UserConn::register_router("/post/content", HttpMethod::POST, post_content);
+    // UserConn::register_router("/stream/csv", HttpMethod::GET, stream_csv);
     
     ServerConf conf(8080, "../testsite");
+    if (conf.worker_processes_ > 0) {
+        MasterProcess master(conf);
+        return master.run();
+    }
     LiteWebServer server(conf);
     server.start_loop();
 
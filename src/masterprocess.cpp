@@ -0,0 +1,416 @@
+#include "masterprocess.h"
+
+#include <stdexcept>
+#include <algorithm>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+
+#include "spdlog/spdlog.h"
+
+#include "litewebserver.h"
+#include "cpuutil.h"
+#include "fdutil.h"
+#include "hotupgrade.h"
+
+
+// 工作进程启动后不到这么久就退出，认为是启动失败，延迟重启
+constexpr const int WORKER_MIN_LIFETIME_MS = 1000;
+// 启动失败的工作进程延迟重启的时间
+constexpr const int WORKER_RESPAWN_DELAY_MS = 1000;
+// 通知工作进程退出后，超过drain_timeout_ms_再加上这么久还没有退出的，直接SIGKILL
+constexpr const int WORKER_STOP_GRACE_MS = 5 * 1000;
+// 重新启动过程中，检查新进程是否就绪的间隔
+constexpr const int WORKER_READY_CHECK_MS = 50;
+
+
+MasterProcess::MasterProcess(const ServerConf &srv_conf)
+    : srv_conf_(srv_conf)
+    , master_pid_(getpid())
+    , workers_(std::max(srv_conf.worker_processes_, 1))
+    , stopping_(false)
+{
+    sigemptyset(&old_mask_);
+}
+
+MasterProcess::~MasterProcess()
+{
+    for (int sock : listen_socks_) {
+        close(sock);
+    }
+}
+
+int MasterProcess::run()
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGQUIT);
+    sigaddset(&set, SIGHUP);
+    // 信号只通过sigtimedwait同步处理，主进程始终是单线程的，fork是安全的
+    sigprocmask(SIG_BLOCK, &set, &old_mask_);
+
+    try {
+        create_listeners();
+    } catch (const std::exception &) {
+        sigprocmask(SIG_SETMASK, &old_mask_, nullptr);
+        throw;
+    }
+
+    SPDLOG_INFO("master {} starting {} workers, {} listen socket(s)",
+                master_pid_, workers_.size(), listen_socks_.size());
+    for (std::size_t idx = 0; idx < workers_.size(); ++idx) {
+        spawn_worker(idx);
+    }
+
+    while (true) {
+        respawn_workers();
+        check_reload();
+        if (stopping_ && all_exited()) {
+            break;
+        }
+
+        int timeout_ms = next_timeout_ms(1000);
+        struct timespec ts;
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = static_cast<long>(timeout_ms % 1000) * 1000000;
+        siginfo_t info;
+        int sig = sigtimedwait(&set, &info, &ts);
+
+        switch (sig) {
+        case SIGCHLD:
+            reap_workers();
+            break;
+        case SIGTERM:
+        case SIGINT:
+        case SIGQUIT:
+            if (!stopping_) {
+                SPDLOG_INFO("master received signal {}, stopping workers", sig);
+                stopping_ = true;
+                stop_at_ = SteadyClock::now();
+                // SIGQUIT让工作进程处理完已有的请求再退出
+                signal_workers(sig == SIGQUIT ? SIGQUIT : SIGTERM);
+            }
+            break;
+        case SIGHUP:
+            // 新进程和原来的进程共用主进程持有的监听socket，
+            // 新进程就绪后原来的进程才停止接收连接，不会出现没有进程接收连接的窗口
+            if (!stopping_) {
+                SPDLOG_INFO("master received SIGHUP, reloading workers");
+                reload_workers();
+            }
+            break;
+        default:
+            // 超时或者被其他信号中断
+            break;
+        }
+
+        int stop_timeout_ms = srv_conf_.drain_timeout_ms_ + WORKER_STOP_GRACE_MS;
+        if (stopping_ && SteadyClock::now() - stop_at_ > MilliSeconds(stop_timeout_ms)) {
+            SPDLOG_WARN("workers did not stop in {}ms, killing", stop_timeout_ms);
+            signal_workers(SIGKILL);
+        }
+    }
+
+    sigprocmask(SIG_SETMASK, &old_mask_, nullptr);
+    SPDLOG_INFO("master {} exited", master_pid_);
+    return 0;
+}
+
+std::string MasterProcess::worker_log_file(const std::string &log_file, std::size_t idx)
+{
+    std::size_t slash = log_file.rfind('/');
+    std::size_t dot = log_file.rfind('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash) || dot == 0
+        || (slash != std::string::npos && dot == slash + 1)) {
+        return log_file + "." + std::to_string(idx);
+    }
+    return log_file.substr(0, dot) + "." + std::to_string(idx) + log_file.substr(dot);
+}
+
+void MasterProcess::create_listeners()
+{
+    std::size_t n = srv_conf_.reuseport_ ? workers_.size() : 1;
+    for (std::size_t i = 0; i < n; ++i) {
+        listen_socks_.push_back(LiteWebServer::create_listen_socket(srv_conf_, srv_conf_.reuseport_));
+    }
+}
+
+void MasterProcess::spawn_worker(std::size_t idx, bool wait_ready)
+{
+    Worker &worker = workers_[idx];
+    // chans[0]由主进程持有，chans[1]交给工作进程
+    int chans[2] = {-1, -1};
+    if (wait_ready && socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, chans) != 0) {
+        SPDLOG_ERROR("create ready channel for worker {} failed: {}", idx, strerror(errno));
+        return;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        SPDLOG_ERROR("fork worker {} failed: {}", idx, strerror(errno));
+        worker.respawn_at = SteadyClock::now() + MilliSeconds(WORKER_RESPAWN_DELAY_MS);
+        if (wait_ready) {
+            close(chans[0]);
+            close(chans[1]);
+        }
+        return;
+    }
+    if (pid == 0) {
+        if (wait_ready) {
+            close(chans[0]);
+        }
+        run_worker(idx, chans[1]);
+    }
+
+    if (wait_ready) {
+        // 工作进程退出时主进程才能读到channel关闭
+        close(chans[1]);
+        FdUtil::set_nonblocking(chans[0]);
+    }
+    worker.ready_chan = chans[0];
+    worker.pid = pid;
+    worker.started = SteadyClock::now();
+    SPDLOG_INFO("worker {} started, pid {}", idx, pid);
+}
+
+void MasterProcess::run_worker(std::size_t idx, int ready_chan)
+{
+    // 主进程退出（包括被SIGKILL）时工作进程也退出
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != master_pid_) {
+        _exit(1);
+    }
+    sigprocmask(SIG_SETMASK, &old_mask_, nullptr);
+
+    int listen_sock = listen_socks_.size() == 1 ? listen_socks_[0] : listen_socks_[idx];
+    for (int sock : listen_socks_) {
+        if (sock != listen_sock) {
+            close(sock);
+        }
+    }
+    // 主进程等待其他工作进程就绪的channel
+    for (const Worker &worker : workers_) {
+        if (worker.ready_chan >= 0) {
+            close(worker.ready_chan);
+        }
+    }
+
+    // 在创建任何线程之前绑定，之后创建的线程都继承这个设置，
+    // 内存也会按first-touch分配在这个节点上
+    if (!srv_conf_.worker_numa_nodes_.empty()) {
+        std::vector<int> nodes = CpuUtil::parse_cpu_list(srv_conf_.worker_numa_nodes_);
+        std::vector<int> cpus;
+        if (!nodes.empty()) {
+            cpus = CpuUtil::node_cpus(nodes[idx % nodes.size()]);
+        }
+        if (cpus.empty() || CpuUtil::pin_current_thread(cpus) != 0) {
+            fprintf(stderr, "worker %zu bind numa nodes %s failed, running unbound\n",
+                    idx, srv_conf_.worker_numa_nodes_.c_str());
+        }
+    }
+
+    ServerConf conf = srv_conf_;
+    conf.log_file_ = worker_log_file(srv_conf_.log_file_, idx);
+    if (conf.metrics_port_ > 0) {
+        conf.metrics_port_ = static_cast<uint16_t>(conf.metrics_port_ + idx);
+    }
+
+    int code = 0;
+    try {
+        LiteWebServer server(conf, listen_sock, ready_chan);
+        server.start_loop();
+    } catch (const std::exception &e) {
+        fprintf(stderr, "worker %zu failed: %s\n", idx, e.what());
+        code = 1;
+    }
+    // 工作进程的日志是异步的，_exit不会析构静态对象，先把日志写完
+    spdlog::shutdown();
+    // 不能使用exit，它会执行atexit注册的函数并刷新从主进程复制来的stdio缓冲区，
+    // 主进程还没有输出的内容会被再输出一次
+    _exit(code);
+}
+
+void MasterProcess::reap_workers()
+{
+    int status = 0;
+    pid_t pid = 0;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        auto retired = std::find_if(retired_.begin(), retired_.end(),
+                                    [pid](const Retired &old) { return old.pid == pid; });
+        if (retired != retired_.end()) {
+            SPDLOG_INFO("old worker (pid {}) exited", pid);
+            retired_.erase(retired);
+            continue;
+        }
+
+        auto it = std::find_if(workers_.begin(), workers_.end(), [pid](const Worker &worker) {
+            return worker.pid == pid || worker.old_pid == pid;
+        });
+        if (it == workers_.end()) {
+            continue;
+        }
+        std::size_t idx = static_cast<std::size_t>(it - workers_.begin());
+
+        if (it->old_pid == pid) {
+            // 新进程还没有就绪，它就绪后接替这个位置，不需要重启
+            SPDLOG_WARN("worker {} (old pid {}) exited before its replacement was ready", idx, pid);
+            it->old_pid = 0;
+            continue;
+        }
+        if (it->ready_chan >= 0) {
+            close(it->ready_chan);
+            it->ready_chan = -1;
+        }
+
+        if (WIFSIGNALED(status)) {
+            SPDLOG_WARN("worker {} (pid {}) killed by signal {}", idx, pid, WTERMSIG(status));
+        } else if (WEXITSTATUS(status) != 0) {
+            SPDLOG_WARN("worker {} (pid {}) exited with code {}", idx, pid, WEXITSTATUS(status));
+        } else {
+            SPDLOG_INFO("worker {} (pid {}) exited", idx, pid);
+        }
+
+        if (it->old_pid != 0) {
+            // 新进程在就绪之前退出了，原来的进程还在接收连接，继续使用它
+            SPDLOG_ERROR("worker {} (pid {}) exited before ready, keep running pid {}",
+                         idx, pid, it->old_pid);
+            it->pid = it->old_pid;
+            it->old_pid = 0;
+            continue;
+        }
+
+        SteadyClock::time_point now = SteadyClock::now();
+        it->pid = 0;
+        it->respawn_at = now;
+        if (now - it->started < MilliSeconds(WORKER_MIN_LIFETIME_MS)) {
+            it->respawn_at = now + MilliSeconds(WORKER_RESPAWN_DELAY_MS);
+        }
+    }
+}
+
+void MasterProcess::respawn_workers()
+{
+    if (stopping_) {
+        return;
+    }
+    SteadyClock::time_point now = SteadyClock::now();
+    for (std::size_t idx = 0; idx < workers_.size(); ++idx) {
+        if (workers_[idx].pid == 0 && workers_[idx].respawn_at <= now) {
+            spawn_worker(idx);
+        }
+    }
+}
+
+void MasterProcess::reload_workers()
+{
+    for (std::size_t idx = 0; idx < workers_.size(); ++idx) {
+        Worker &worker = workers_[idx];
+        // 没有在运行的由respawn_workers启动，上一次重新启动还没有完成的跳过
+        if (worker.pid == 0 || worker.old_pid != 0) {
+            continue;
+        }
+        worker.old_pid = worker.pid;
+        worker.pid = 0;
+        spawn_worker(idx, true);
+        if (worker.pid == 0) {
+            // 启动失败，继续使用原来的进程
+            worker.pid = worker.old_pid;
+            worker.old_pid = 0;
+        }
+    }
+}
+
+void MasterProcess::check_reload()
+{
+    if (stopping_) {
+        return;
+    }
+
+    SteadyClock::time_point now = SteadyClock::now();
+    for (std::size_t idx = 0; idx < workers_.size(); ++idx) {
+        Worker &worker = workers_[idx];
+        if (worker.ready_chan < 0) {
+            continue;
+        }
+        int ready = HotUpgrade::check_ready(worker.ready_chan);
+        if (ready == 0) {
+            continue;
+        }
+        close(worker.ready_chan);
+        worker.ready_chan = -1;
+        // 新进程在就绪之前退出了，由reap_workers恢复原来的进程
+        if (ready < 0 || worker.old_pid == 0) {
+            continue;
+        }
+
+        SPDLOG_INFO("worker {} (pid {}) is ready, stopping old pid {}", idx, worker.pid, worker.old_pid);
+        kill(worker.old_pid, SIGQUIT);
+        Retired old;
+        old.pid = worker.old_pid;
+        old.quit_at = now;
+        retired_.push_back(old);
+        worker.old_pid = 0;
+    }
+
+    int stop_timeout_ms = srv_conf_.drain_timeout_ms_ + WORKER_STOP_GRACE_MS;
+    for (const Retired &old : retired_) {
+        if (now - old.quit_at > MilliSeconds(stop_timeout_ms)) {
+            SPDLOG_WARN("old worker (pid {}) did not stop in {}ms, killing", old.pid, stop_timeout_ms);
+            kill(old.pid, SIGKILL);
+        }
+    }
+}
+
+void MasterProcess::signal_workers(int sig)
+{
+    for (const Worker &worker : workers_) {
+        if (worker.pid > 0) {
+            kill(worker.pid, sig);
+        }
+        if (worker.old_pid > 0) {
+            kill(worker.old_pid, sig);
+        }
+    }
+    for (const Retired &old : retired_) {
+        kill(old.pid, sig);
+    }
+}
+
+bool MasterProcess::all_exited() const
+{
+    return retired_.empty()
+           && std::all_of(workers_.begin(), workers_.end(), [](const Worker &worker) {
+                  return worker.pid == 0 && worker.old_pid == 0;
+              });
+}
+
+int MasterProcess::next_timeout_ms(int max_ms) const
+{
+    if (stopping_) {
+        return max_ms;
+    }
+
+    SteadyClock::time_point now = SteadyClock::now();
+    int timeout_ms = max_ms;
+    for (const Worker &worker : workers_) {
+        if (worker.ready_chan >= 0) {
+            timeout_ms = std::min(timeout_ms, WORKER_READY_CHECK_MS);
+        }
+        if (worker.pid != 0) {
+            continue;
+        }
+        auto wait = std::chrono::duration_cast<MilliSeconds>(worker.respawn_at - now).count();
+        timeout_ms = std::min(timeout_ms, static_cast<int>(std::max<long long>(wait, 0)));
+    }
+    return timeout_ms;
+}
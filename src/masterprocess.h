@@ -0,0 +1,116 @@
+#ifndef SRC_MASTERPROCESS_H_
+#define SRC_MASTERPROCESS_H_
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+#include <signal.h>
+#include <sys/types.h>
+
+#include "serverconf.h"
+#include "timeutil.h"
+
+
+/**
+ * @brief 多进程模式的主进程（类似nginx的master）
+ *        1. 主进程绑定端口后fork出worker_processes_个工作进程，
+ *           每个工作进程继承监听socket，运行完整的LiteWebServer，
+ *           各自独立的堆和缓存，没有跨进程的锁竞争，一个进程崩溃也不影响其他进程
+ *        2. reuseport_时每个工作进程有自己的SO_REUSEPORT监听socket，由内核分配连接，
+ *           socket由主进程持有，工作进程重启期间到达的连接留在它的队列中，不会丢失
+ *        3. 主进程不处理请求，只等待信号：
+ *           SIGTERM/SIGINT 通知所有工作进程退出，全部退出后主进程退出
+ *           SIGQUIT 同上，但工作进程会处理完已有的请求再退出
+ *           SIGHUP 先为每个工作进程启动替代的新进程（重新打开日志，重新预热等），
+ *                  新进程开始接收连接后再通知原来的进程优雅退出，期间一直有进程在接收连接
+ *           SIGCHLD 回收退出的工作进程，不是主进程要求的退出时重新启动，
+ *                   启动后很快又退出的进程延迟重启，避免反复崩溃占满CPU
+ *        4. 主进程退出时工作进程会收到SIGTERM（PR_SET_PDEATHSIG），不会留下孤儿进程
+ */
+class MasterProcess
+{
+public:
+    explicit MasterProcess(const ServerConf &srv_conf);
+    MasterProcess(const MasterProcess&) = delete;
+    MasterProcess(MasterProcess&&) = delete;
+    MasterProcess& operator=(const MasterProcess&) = delete;
+    MasterProcess& operator=(MasterProcess&&) = delete;
+    ~MasterProcess();
+
+public:
+    /**
+     * @brief 创建监听socket和工作进程，并一直运行到所有工作进程退出
+     * @return 进程的退出码
+     */
+    int run();
+
+    /**
+     * @brief 工作进程的日志文件名，在扩展名前加上编号，例如litewebserver.log -> litewebserver.0.log
+     */
+    static std::string worker_log_file(const std::string &log_file, std::size_t idx);
+
+private:
+    struct Worker
+    {
+        pid_t pid = 0;
+        SteadyClock::time_point started;
+        // pid为0时，到这个时间重新启动
+        SteadyClock::time_point respawn_at;
+        // 重新启动过程中被替代的进程，pid就绪后通知它退出
+        pid_t old_pid = 0;
+        // 等待pid就绪的channel，没有等待时为-1
+        int ready_chan = -1;
+    };
+
+    // 已经通知退出，正在排空连接的进程，不占用工作进程的位置，退出后不重启
+    struct Retired
+    {
+        pid_t pid = 0;
+        SteadyClock::time_point quit_at;
+    };
+
+    void create_listeners();
+    /**
+     * @param wait_ready 新进程开始接收连接后通过ready_chan通知主进程
+     */
+    void spawn_worker(std::size_t idx, bool wait_ready = false);
+    /**
+     * @brief 在子进程中运行LiteWebServer，不会返回
+     */
+    [[noreturn]] void run_worker(std::size_t idx, int ready_chan);
+    void reap_workers();
+    void respawn_workers();
+    /**
+     * @brief 为每个工作进程启动替代的新进程，原来的进程在新进程就绪后才退出
+     */
+    void reload_workers();
+    /**
+     * @brief 检查替代的新进程是否就绪，就绪的通知原来的进程优雅退出；
+     *        排空超时的原来的进程直接SIGKILL
+     */
+    void check_reload();
+    /**
+     * @brief 通知所有进程，包括重新启动过程中原来的进程
+     */
+    void signal_workers(int sig);
+    bool all_exited() const;
+    /**
+     * @brief 距离下一个需要重启的工作进程的时间，没有时返回max_ms
+     */
+    int next_timeout_ms(int max_ms) const;
+
+private:
+    const ServerConf srv_conf_;
+    pid_t master_pid_;
+    // 共享模式下只有一个，reuseport_时每个工作进程一个
+    std::vector<int> listen_socks_;
+    std::vector<Worker> workers_;
+    std::vector<Retired> retired_;
+    // 主进程原来的信号掩码，工作进程中恢复
+    sigset_t old_mask_;
+    bool stopping_;
+    SteadyClock::time_point stop_at_;
+};
+
+#endif // SRC_MASTERPROCESS_H_
@@ -0,0 +1,172 @@
+#ifndef SRC_METRICS_H_
+#define SRC_METRICS_H_
+
+#include <string>
+#include <atomic>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "httpdata.h"
+
+
+constexpr const std::size_t CACHE_LINE_BYTES = 64;
+
+#define X(NAME) + 1
+constexpr const std::size_t HTTP_METHOD_NUM = 0 HTTPMETHOD_ENUM;
+#undef X
+#define X(NAME, CODE, DESC) + 1
+constexpr const std::size_t HTTP_CODE_NUM = 0 HTTPCODE_ENUM;
+#undef X
+
+/**
+ * @brief HttpCode在HTTPCODE_ENUM中的序号，用作计数器数组的下标
+ */
+inline std::size_t http_code_index(HttpCode code)
+{
+    std::size_t idx = 0;
+    #define X(NAME, CODE, DESC) if (code == HttpCode::NAME) { return idx; } ++idx;
+    HTTPCODE_ENUM
+    #undef X
+    return 0;
+}
+
+/**
+ * @brief 序号对应的HttpCode，http_code_index的逆运算
+ */
+inline HttpCode http_code_at(std::size_t idx)
+{
+    std::size_t i = 0;
+    #define X(NAME, CODE, DESC) if (i++ == idx) { return HttpCode::NAME; }
+    HTTPCODE_ENUM
+    #undef X
+    return HttpCode::UNKNOWN;
+}
+
+// 每次epoll_wait返回的事件数的直方图，第0个桶为0个事件，
+// 第i个桶的上界为2^(i-1)，最后一个桶没有上界
+constexpr const std::size_t EVENTS_HIST_BUCKETS = 15;
+
+
+/**
+ * @brief 只有一个写者的计数器
+ *        写入只是普通的读取和存储，没有加锁或者原子的读-改-写指令，
+ *        其他线程随时可以读取（可能读到稍旧的值）
+ */
+class MetricCounter
+{
+public:
+    MetricCounter() : val_(0) {}
+    MetricCounter(const MetricCounter&) = delete;
+    MetricCounter& operator=(const MetricCounter&) = delete;
+
+public:
+    void add(uint64_t n = 1) {
+        val_.store(val_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    uint64_t get() const { return val_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> val_;
+};
+
+/**
+ * @brief 每个ConnLoop的指标，只由所属的ConnLoop线程写入，导出时再汇总
+ *        前后各填充一个缓存行，不会和其他线程写入的数据共享缓存行
+ */
+struct LoopMetrics
+{
+    char pad_head[CACHE_LINE_BYTES];
+    // 完成的请求数，按请求方法和状态码
+    MetricCounter requests[HTTP_METHOD_NUM][HTTP_CODE_NUM];
+    MetricCounter bytes_in;
+    // 发送的字节数，包括sendfile发送的
+    MetricCounter bytes_out;
+    MetricCounter sendfile_bytes;
+    MetricCounter timeouts;
+    MetricCounter parse_errors;
+    // 每次epoll_wait返回的事件数，不包括自旋时没有事件的
+    MetricCounter events_hist[EVENTS_HIST_BUCKETS];
+    MetricCounter events_sum;
+    char pad_tail[CACHE_LINE_BYTES];
+
+    void record_request(HttpMethod method, HttpCode code) {
+        std::size_t m = static_cast<std::size_t>(method);
+        requests[m < HTTP_METHOD_NUM ? m : 0][http_code_index(code)].add();
+    }
+    void record_events(int n) {
+        events_hist[events_bucket(n)].add();
+        events_sum.add(static_cast<uint64_t>(n));
+    }
+    static std::size_t events_bucket(int n) {
+        if (n <= 1) {
+            return n > 0 ? 1 : 0;
+        }
+        std::size_t idx = 2 + static_cast<std::size_t>(31 - __builtin_clz(static_cast<unsigned>(n - 1)));
+        return idx < EVENTS_HIST_BUCKETS ? idx : EVENTS_HIST_BUCKETS - 1;
+    }
+};
+
+/**
+ * @brief 接收连接的主线程的指标，只由主线程写入
+ */
+struct AcceptorMetrics
+{
+    char pad_head[CACHE_LINE_BYTES];
+    MetricCounter accepts;
+    // 描述符用完时接收后直接关闭的连接
+    MetricCounter accept_dropped;
+    char pad_tail[CACHE_LINE_BYTES];
+};
+
+
+/**
+ * @brief 生成Prometheus文本格式（0.0.4）的指标
+ *        同一个指标的所有样本需要连续输出，先调用family输出HELP和TYPE
+ */
+class MetricsWriter
+{
+public:
+    /**
+     * @param type counter，gauge，histogram
+     */
+    void family(const char *name, const char *help, const char *type)
+    {
+        out_.append("# HELP ").append(name).append(" ").append(help).append("\n");
+        out_.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+    }
+
+    /**
+     * @param labels 已经格式化的标签，例如 method="GET",code="200"，为空表示没有标签
+     */
+    void sample(const char *name, const std::string &labels, uint64_t val)
+    {
+        sample_head(name, labels);
+        out_.append(std::to_string(val)).append("\n");
+    }
+    void sample(const char *name, const std::string &labels, double val)
+    {
+        sample_head(name, labels);
+        char buf[32] = {0};
+        snprintf(buf, sizeof(buf), "%.9g", val);
+        out_.append(buf).append("\n");
+    }
+
+    const std::string& str() const { return out_; }
+
+private:
+    void sample_head(const char *name, const std::string &labels)
+    {
+        out_.append(name);
+        if (!labels.empty()) {
+            out_.append("{").append(labels).append("}");
+        }
+        out_.append(" ");
+    }
+
+private:
+    std::string out_;
+};
+
+#endif // SRC_METRICS_H_
@@ -0,0 +1,242 @@
+#include "metricsservice.h"
+
+#include <vector>
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "spdlog/spdlog.h"
+
+#include "fdutil.h"
+#include "httpdata.h"
+
+
+// 同时处理的管理连接数上限
+constexpr const std::size_t METRICS_MAX_CONNS = 16;
+// 管理连接从接收到发送完毕的最长时间
+constexpr const int METRICS_CONN_TIMEOUT_MS = 5 * 1000;
+// 请求的最大长度，指标请求只有请求行和几个请求头
+constexpr const std::size_t METRICS_MAX_REQ_BYTES = 8 * 1024;
+constexpr const int METRICS_BACKLOG = 64;
+constexpr const char *METRICS_CONTENT_TYPE = "text/plain; version=0.0.4; charset=utf-8";
+
+
+MetricsService::MetricsService(const ServerConf &srv_conf, RenderFunc render)
+    : srv_conf_(srv_conf)
+    , render_(std::move(render))
+    , epoll_fd_(-1)
+    , listen_sock_(-1)
+    {}
+
+MetricsService::~MetricsService()
+{
+    stop();
+}
+
+bool MetricsService::start(int epoll_fd)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(srv_conf_.metrics_port_);
+    if (inet_pton(AF_INET, srv_conf_.metrics_addr_.c_str(), &addr.sin_addr) != 1) {
+        SPDLOG_ERROR("metrics: invalid address {}", srv_conf_.metrics_addr_);
+        return false;
+    }
+
+    int sock = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        SPDLOG_ERROR("metrics: create socket failed: {}", strerror(errno));
+        return false;
+    }
+    if (FdUtil::set_socket_reuseaddr(sock) != 0
+        || FdUtil::set_socket_reuseport(sock) != 0
+        || bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0
+        || listen(sock, METRICS_BACKLOG) != 0
+        || FdUtil::epoll_add_fd(epoll_fd, sock, EPOLLIN | EPOLLET) != 0) {
+        SPDLOG_ERROR("metrics: listen on {}:{} failed: {}",
+                     srv_conf_.metrics_addr_, srv_conf_.metrics_port_, strerror(errno));
+        close(sock);
+        return false;
+    }
+
+    epoll_fd_ = epoll_fd;
+    listen_sock_ = sock;
+    SPDLOG_INFO("metrics: serving {} on {}:{}",
+                srv_conf_.metrics_path_, srv_conf_.metrics_addr_, srv_conf_.metrics_port_);
+    return true;
+}
+
+void MetricsService::stop()
+{
+    if (listen_sock_ >= 0) {
+        FdUtil::epoll_del_fd(epoll_fd_, listen_sock_);
+        close(listen_sock_);
+        listen_sock_ = -1;
+    }
+    for (auto &conn : conns_) {
+        FdUtil::epoll_del_fd(epoll_fd_, conn.first);
+        close(conn.first);
+    }
+    conns_.clear();
+}
+
+bool MetricsService::handle_event(int fd, uint32_t events)
+{
+    if (fd < 0) {
+        return false;
+    }
+    if (fd == listen_sock_) {
+        accept_conns();
+        return true;
+    }
+    if (conns_.find(fd) == conns_.end()) {
+        return false;
+    }
+    if (events & (EPOLLHUP | EPOLLERR)) {
+        close_conn(fd);
+    } else {
+        handle_conn(fd);
+    }
+    return true;
+}
+
+void MetricsService::accept_conns()
+{
+    while (true) {
+        int sock = accept4(listen_sock_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock < 0) {
+            if (errno == EINTR) { continue; }
+            break;
+        }
+
+        if (conns_.size() >= METRICS_MAX_CONNS) {
+            close_expired();
+        }
+        if (conns_.size() >= METRICS_MAX_CONNS) {
+            close(sock);
+            continue;
+        }
+        if (FdUtil::epoll_add_fd(epoll_fd_, sock, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) != 0) {
+            close(sock);
+            continue;
+        }
+        AdminConn &conn = conns_[sock];
+        conn.expire = SteadyClock::now() + MilliSeconds(METRICS_CONN_TIMEOUT_MS);
+    }
+}
+
+void MetricsService::handle_conn(int fd)
+{
+    AdminConn &conn = conns_[fd];
+
+    // 边缘触发，一次读完
+    if (conn.out.empty()) {
+        char buf[4096];
+        // 客户端发送完请求后可能半关闭连接，仍然需要回复
+        bool eof = false;
+        while (true) {
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n > 0) {
+                conn.in.append(buf, n);
+                if (conn.in.size() > METRICS_MAX_REQ_BYTES) {
+                    close_conn(fd);
+                    return;
+                }
+                continue;
+            }
+            if (n == 0) {
+                eof = true;
+                break;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                close_conn(fd);
+                return;
+            }
+            break;
+        }
+        if (conn.in.find("\r\n\r\n") == std::string::npos) {
+            if (eof) {
+                close_conn(fd);
+            }
+            return;
+        }
+        make_response(conn.in, conn.out);
+    }
+
+    while (conn.sent < conn.out.size()) {
+        ssize_t n = send(fd, conn.out.data() + conn.sent, conn.out.size() - conn.sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            conn.sent += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // 等待下一次可写事件
+            return;
+        }
+        break;
+    }
+    close_conn(fd);
+}
+
+void MetricsService::make_response(const std::string &req_data, std::string &rsp) const
+{
+    HttpRequest req;
+    req.parse(req_data, 0);
+
+    HttpCode code = HttpCode::OK;
+    std::string body;
+    if (!req.parse_complete() || req.is_bad_req()) {
+        code = HttpCode::BAD_REQUEST;
+    } else if (req.get_path() != srv_conf_.metrics_path_) {
+        code = HttpCode::NOT_FOUND;
+    } else if (req.get_method() != HttpMethod::GET) {
+        code = HttpCode::NOT_ALLOWED;
+    } else {
+        body = render_();
+    }
+    if (code != HttpCode::OK) {
+        body = std::string(http_enum_to_str(code)) + "\n";
+    }
+
+    rsp.clear();
+    rsp.append("HTTP/1.1 ").append(std::to_string(static_cast<int>(code))).append(" ")
+       .append(http_enum_to_str(code)).append("\r\n")
+       .append("Content-Type: ").append(METRICS_CONTENT_TYPE).append("\r\n")
+       .append("Content-Length: ").append(std::to_string(body.size())).append("\r\n")
+       .append("Connection: close\r\n")
+       .append("\r\n")
+       .append(body);
+}
+
+void MetricsService::close_conn(int fd)
+{
+    FdUtil::epoll_del_fd(epoll_fd_, fd);
+    close(fd);
+    conns_.erase(fd);
+}
+
+void MetricsService::close_expired()
+{
+    SteadyClock::time_point now = SteadyClock::now();
+    std::vector<int> expired;
+    for (const auto &conn : conns_) {
+        if (conn.second.expire <= now) {
+            expired.push_back(conn.first);
+        }
+    }
+    for (int fd : expired) {
+        close_conn(fd);
+    }
+}
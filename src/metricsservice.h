@@ -0,0 +1,83 @@
+#ifndef SRC_METRICSSERVICE_H_
+#define SRC_METRICSSERVICE_H_
+
+#include <string>
+#include <functional>
+#include <unordered_map>
+
+#include <stdint.h>
+
+#include "serverconf.h"
+#include "timeutil.h"
+
+
+/**
+ * @brief 管理端口上的指标服务，GET metrics_path_返回Prometheus文本格式的指标
+ *        1. 监听socket和管理连接都注册到主线程的epoll中（边缘触发），由主线程处理，
+ *           指标在请求到达时才汇总生成，不影响ConnLoop
+ *        2. 每个连接只处理一个请求，响应发送完毕后关闭
+ *        3. 连接数有上限，满了时先关闭超时的连接，仍然满了时拒绝新连接
+ *        监听socket设置了SO_REUSEPORT，不停机升级时新进程可以在旧进程退出前绑定同一个端口
+ */
+class MetricsService
+{
+public:
+    using RenderFunc = std::function<std::string()>;
+
+public:
+    /**
+     * @param render 生成指标文本，在主线程中调用
+     */
+    MetricsService(const ServerConf &srv_conf, RenderFunc render);
+    MetricsService(const MetricsService&) = delete;
+    MetricsService(MetricsService&&) = delete;
+    MetricsService& operator=(const MetricsService&) = delete;
+    MetricsService& operator=(MetricsService&&) = delete;
+    ~MetricsService();
+
+public:
+    /**
+     * @brief 创建监听socket并加入epoll_fd，失败时只记录日志，不影响其他服务
+     * @return 是否启动成功
+     */
+    bool start(int epoll_fd);
+    /**
+     * @brief 关闭监听socket和所有管理连接
+     */
+    void stop();
+    /**
+     * @brief 处理主线程epoll中的事件
+     * @return fd不属于本服务时返回false
+     */
+    bool handle_event(int fd, uint32_t events);
+
+private:
+    void accept_conns();
+    void handle_conn(int fd);
+    /**
+     * @brief 请求接收完毕后生成响应
+     */
+    void make_response(const std::string &req_data, std::string &rsp) const;
+    void close_conn(int fd);
+    /**
+     * @brief 关闭超时的连接
+     */
+    void close_expired();
+
+    struct AdminConn
+    {
+        std::string in;
+        std::string out;
+        std::size_t sent = 0;
+        SteadyClock::time_point expire;
+    };
+
+private:
+    const ServerConf &srv_conf_;
+    RenderFunc render_;
+    int epoll_fd_;
+    int listen_sock_;
+    std::unordered_map<int, AdminConn> conns_;
+};
+
+#endif // SRC_METRICSSERVICE_H_
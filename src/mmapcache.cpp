@@ -0,0 +1,89 @@
+#include "mmapcache.h"
+
+#include <functional>
+
+#include <sys/mman.h>
+
+
+// 分片数量，大于ConnLoop的数量即可
+constexpr const std::size_t MMAP_CACHE_SHARDS = 16;
+// 不超过该大小的文件映射后立即全部预读，更大的文件只提示顺序访问
+constexpr const off_t MMAP_WILLNEED_MAX_SIZE = 4 * 1024 * 1024;
+
+
+MappedFile::~MappedFile()
+{
+    if (addr != MAP_FAILED && addr != nullptr) {
+        munmap(addr, size);
+    }
+}
+
+MmapCache::MmapCache(std::size_t max_bytes, off_t max_file_size)
+    : max_file_size_(max_file_size)
+{
+    shards_.reserve(MMAP_CACHE_SHARDS);
+    for (std::size_t i = 0; i < MMAP_CACHE_SHARDS; ++i) {
+        shards_.emplace_back(new Shard(max_bytes / MMAP_CACHE_SHARDS));
+    }
+}
+
+MappedFilePtr MmapCache::get(const std::string &path, const OpenFile &file)
+{
+    if (file.fd < 0 || file.size <= 0 || file.size > max_file_size_) {
+        return nullptr;
+    }
+
+    Shard &shard = shard_of(path);
+    {
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        MappedFilePtr *mapped = shard.cache.get(path);
+        if (mapped != nullptr
+            && (*mapped)->ino == file.ino
+            && (*mapped)->mtime == file.mtime
+            && (*mapped)->size == file.size) {
+            return *mapped;
+        }
+    }
+
+    // 在锁外映射，多个线程同时未命中时可能重复映射，后插入的覆盖先插入的
+    MappedFilePtr mapped = map_file(file);
+    if (!mapped) {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    shard.cache.put(path, mapped, mapped->size);
+    return mapped;
+}
+
+std::size_t MmapCache::bytes()
+{
+    std::size_t total = 0;
+    for (auto &shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard->mtx);
+        total += shard->cache.cost();
+    }
+    return total;
+}
+
+MappedFilePtr MmapCache::map_file(const OpenFile &file)
+{
+    void *addr = mmap(nullptr, file.size, PROT_READ, MAP_SHARED, file.fd, 0);
+    if (addr == MAP_FAILED) {
+        return nullptr;
+    }
+
+    // 小文件一次性预读进页缓存，大文件只提示顺序读，让内核加大预读窗口
+    if (file.size <= MMAP_WILLNEED_MAX_SIZE) {
+        madvise(addr, file.size, MADV_WILLNEED);
+    } else {
+        madvise(addr, file.size, MADV_SEQUENTIAL);
+    }
+
+    return std::make_shared<MappedFile>(addr, file.size, file.ino, file.mtime);
+}
+
+MmapCache::Shard& MmapCache::shard_of(const std::string &path)
+{
+    return *shards_[std::hash<std::string>()(path) % shards_.size()];
+}
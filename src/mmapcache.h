@@ -0,0 +1,105 @@
+#ifndef SRC_MMAPCACHE_H_
+#define SRC_MMAPCACHE_H_
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "lrucache.h"
+#include "filecache.h"
+
+
+/**
+ * @brief 映射到内存中的文件，最后一个引用释放时munmap
+ */
+struct MappedFile
+{
+public:
+    MappedFile(void *addr, off_t size, ino_t ino, time_t mtime)
+        : addr(addr)
+        , size(size)
+        , ino(ino)
+        , mtime(mtime)
+        {}
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile(MappedFile&&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    MappedFile& operator=(MappedFile&&) = delete;
+
+public:
+    const char* data() const { return static_cast<const char*>(addr); }
+
+public:
+    void *addr;
+    off_t size;
+    ino_t ino;
+    time_t mtime;
+};
+
+using MappedFilePtr = std::shared_ptr<const MappedFile>;
+
+
+/**
+ * @brief 文件映射缓存
+ *        热点文件只映射一次，所有ConnLoop的连接共享同一个映射，
+ *        通过send/writev发送映射中的数据，不需要每个连接持有文件描述符，
+ *        同时也为在用户态对文件内容进行变换（例如Range的multipart）提供了基础
+ *        1. 以文件路径为key，同时记录inode，mtime和大小，文件变化后重新映射
+ *        2. 映射的总大小有上限，超过后按LRU淘汰，
+ *           被淘汰的映射在正在使用它的连接结束后才会被释放
+ *        3. 按key的哈希分片加锁
+ *        !!! 文件在映射后被截断时，send会返回EFAULT，连接会被关闭，
+ *            不会像直接访问内存那样触发SIGBUS
+ *        线程安全
+ */
+class MmapCache
+{
+public:
+    /**
+     * @param max_bytes 映射的总大小上限（虚拟内存）
+     * @param max_file_size 超过该大小的文件不映射，继续使用sendfile
+     */
+    MmapCache(std::size_t max_bytes, off_t max_file_size);
+    MmapCache(const MmapCache&) = delete;
+    MmapCache(MmapCache&&) = delete;
+    MmapCache& operator=(const MmapCache&) = delete;
+    MmapCache& operator=(MmapCache&&) = delete;
+    ~MmapCache() = default;
+
+public:
+    /**
+     * @brief 获取文件的映射，未命中或者已经过期时重新映射
+     * @param path 文件的完整路径
+     * @param file 已经打开的文件
+     * @return 成功返回映射，文件太大，为空或者映射失败返回nullptr
+     */
+    MappedFilePtr get(const std::string &path, const OpenFile &file);
+    off_t max_file_size() const { return max_file_size_; }
+    std::size_t bytes();
+
+    /**
+     * @brief 映射文件，并根据文件大小给出预读建议
+     */
+    static MappedFilePtr map_file(const OpenFile &file);
+
+private:
+    struct Shard
+    {
+        explicit Shard(std::size_t max_bytes) : cache(max_bytes) {}
+        std::mutex mtx;
+        LruCache<std::string, MappedFilePtr> cache;
+    };
+
+    Shard& shard_of(const std::string &path);
+
+private:
+    const off_t max_file_size_;
+    std::vector<std::unique_ptr<Shard> > shards_;
+};
+
+#endif // SRC_MMAPCACHE_H_
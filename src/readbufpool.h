@@ -0,0 +1,123 @@
+#ifndef SRC_READBUFPOOL_H_
+#define SRC_READBUFPOOL_H_
+
+#include <string>
+#include <vector>
+#include <utility>
+
+#include <stddef.h>
+
+
+// 读缓冲区各个等级的容量，第一级能容纳绝大多数只有请求头的请求
+constexpr const std::size_t READ_BUF_CLASS_BYTES[] = {2 * 1024, 8 * 1024, 32 * 1024, 128 * 1024};
+constexpr const std::size_t READ_BUF_CLASS_NUM = sizeof(READ_BUF_CLASS_BYTES) / sizeof(READ_BUF_CLASS_BYTES[0]);
+
+/**
+ * @brief 连接读缓冲区的池，每个ConnLoop一个
+ *        1. 数据先读进ConnLoop的临时缓冲区，再追加到从池中借出的缓冲区中解析，
+ *           请求解析完毕时归还，空闲的keep-alive连接不持有缓冲区
+ *        2. 按容量分为几个等级，请求头或者请求体较大时换成更大一级的缓冲区，
+ *           超过最大等级的直接分配，归还时释放
+ *        3. 每个等级的空闲缓冲区后进先出，最近归还的还在CPU缓存中，超过max_free的直接释放
+ *        !!! 非线程安全，只在所属的ConnLoop中使用
+ */
+class ReadBufPool
+{
+public:
+    /**
+     * @param max_free 每个等级最多保留的空闲缓冲区数量
+     */
+    explicit ReadBufPool(std::size_t max_free)
+        : max_free_(max_free)
+        , free_(READ_BUF_CLASS_NUM)
+        , pooled_bytes_(0)
+        {}
+    ReadBufPool(const ReadBufPool&) = delete;
+    ReadBufPool(ReadBufPool&&) = delete;
+    ReadBufPool& operator=(const ReadBufPool&) = delete;
+    ReadBufPool& operator=(ReadBufPool&&) = delete;
+
+public:
+    /**
+     * @brief 保证buf可以再追加add_bytes字节而不重新分配，
+     *        容量不够时从池中借出一个足够大的缓冲区，复制已有的数据，旧的归还
+     */
+    void reserve(std::string &buf, std::size_t add_bytes)
+    {
+        std::size_t need = buf.size() + add_bytes;
+        if (buf.capacity() >= need) {
+            return;
+        }
+
+        std::string bigger = acquire(need);
+        bigger.append(buf);
+        release(buf);
+        buf.swap(bigger);
+    }
+
+    /**
+     * @brief 归还缓冲区，之后buf为空并且不持有内存
+     */
+    void release(std::string &buf)
+    {
+        int idx = class_of_capacity(buf.capacity());
+        if (idx < 0 || free_[idx].size() >= max_free_) {
+            std::string().swap(buf);
+            return;
+        }
+        buf.clear();
+        pooled_bytes_ += buf.capacity();
+        free_[idx].emplace_back();
+        free_[idx].back().swap(buf);
+    }
+
+    /**
+     * @brief 池中空闲缓冲区的总容量
+     */
+    std::size_t pooled_bytes() const { return pooled_bytes_; }
+
+private:
+    std::string acquire(std::size_t need)
+    {
+        std::string buf;
+        for (std::size_t i = 0; i < READ_BUF_CLASS_NUM; ++i) {
+            if (READ_BUF_CLASS_BYTES[i] < need) {
+                continue;
+            }
+            if (!free_[i].empty()) {
+                buf.swap(free_[i].back());
+                free_[i].pop_back();
+                pooled_bytes_ -= buf.capacity();
+            } else {
+                buf.reserve(READ_BUF_CLASS_BYTES[i]);
+            }
+            return buf;
+        }
+        // 超过最大等级，按倍数增长，避免逐次追加时反复复制
+        buf.reserve(need * 2);
+        return buf;
+    }
+
+    /**
+     * @brief 只有容量在[READ_BUF_CLASS_BYTES[i], READ_BUF_CLASS_BYTES[i + 1])之间的才能归还到第i级
+     * @return 不属于任何等级返回-1
+     */
+    static int class_of_capacity(std::size_t capacity)
+    {
+        if (capacity < READ_BUF_CLASS_BYTES[0] || capacity >= READ_BUF_CLASS_BYTES[READ_BUF_CLASS_NUM - 1] * 2) {
+            return -1;
+        }
+        int idx = 0;
+        while (static_cast<std::size_t>(idx + 1) < READ_BUF_CLASS_NUM && capacity >= READ_BUF_CLASS_BYTES[idx + 1]) {
+            ++idx;
+        }
+        return idx;
+    }
+
+private:
+    std::size_t max_free_;
+    std::vector<std::vector<std::string> > free_;
+    std::size_t pooled_bytes_;
+};
+
+#endif // SRC_READBUFPOOL_H_
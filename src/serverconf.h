@@ -4,16 +4,32 @@
 #include <string>
 
 #include <cstdint>
+#include <cstddef>
+
+#include <sys/types.h>
 
 #include "filepathutil.h"
+#include "cpuutil.h"
+
 
+/**
+ * @brief 文件响应体的发送方式
+ *        SENDFILE: 每个连接持有文件描述符，使用sendfile零拷贝发送
+ *        MMAP: 文件映射一次后被所有连接共享，使用send/writev发送映射中的数据，
+ *              超过mmap_max_size_的文件仍然使用sendfile
+ */
+enum class FileServeMode
+{
+    SENDFILE,
+    MMAP
+};
 
 class ServerConf
 {
 public:
     ServerConf(uint16_t port,
                std::string doc_root,
-               uint8_t nthread = 4,
+               uint8_t nthread = static_cast<uint8_t>(CpuUtil::default_nthread()),
                int backlog = 1024,
                bool epoll_et_srv = false,
                bool epoll_et_conn = false,
@@ -25,6 +41,70 @@ public:
         , epoll_et_srv_(epoll_et_srv)
         , epoll_et_conn_(epoll_et_conn)
         , epoll_max_events_(epoll_max_events)
+        , open_file_cache_max_(1024)
+        , open_file_cache_valid_ms_(1000)
+        , doc_root_dir_cache_max_(256)
+        , small_file_cache_max_bytes_(32 * 1024 * 1024)
+        , small_file_max_size_(64 * 1024)
+        , bg_nthread_(2)
+        , bg_max_nthread_(0)
+        , bg_low_lane_cap_(0)
+        , pool_work_stealing_(false)
+        , pool_scale_interval_ms_(100)
+        , pool_scale_up_wait_us_(2000)
+        , pool_scale_down_wait_us_(200)
+        , gzip_static_(false)
+        , gzip_(false)
+        , gzip_level_(6)
+        , gzip_min_length_(256)
+        , gzip_max_length_(8 * 1024 * 1024)
+        , gzip_cache_max_bytes_(64 * 1024 * 1024)
+        , file_serve_mode_(FileServeMode::SENDFILE)
+        , mmap_max_size_(64 * 1024 * 1024)
+        , mmap_cache_max_bytes_(static_cast<std::size_t>(1024) * 1024 * 1024)
+        , etag_hash_(false)
+        , etag_hash_max_size_(16 * 1024 * 1024)
+        , etag_hash_cache_max_(4096)
+        , snd_budget_per_event_(512 * 1024)
+        , tcp_notsent_lowat_(0)
+        , async_file_io_(false)
+        , io_nthread_(4)
+        , io_max_nthread_(0)
+        , io_readahead_bytes_(256 * 1024)
+        , warmup_(false)
+        , warmup_walk_(true)
+        , warmup_budget_ms_(5000)
+        , warmup_max_files_(100000)
+        , warmup_readahead_bytes_(1024 * 1024)
+        , hot_list_file_("")
+        , hot_list_max_(1024)
+        , loop_cpus_("")
+        , loop_numa_nodes_("")
+        , acceptor_cpus_("")
+        , rebalance_interval_ms_(0)
+        , rebalance_busy_diff_(0.25)
+        , rebalance_min_busy_(0.5)
+        , rebalance_sustain_rounds_(3)
+        , rebalance_max_conns_(64)
+        , busy_poll_us_(0)
+        , busy_poll_min_us_(10)
+        , so_busy_poll_us_(0)
+        , log_file_("litewebserver.log")
+        , worker_processes_(0)
+        , reuseport_(false)
+        , worker_numa_nodes_("")
+        , drain_timeout_ms_(30 * 1000)
+        , max_conns_(0)
+        , max_conns_per_loop_(0)
+        , shed_loop_lag_us_(0)
+        , shed_io_queue_depth_(0)
+        , shed_retry_after_s_(1)
+        , max_request_bytes_(1024 * 1024)
+        , mem_stats_interval_ms_(0)
+        , max_conn_mem_bytes_(0)
+        , metrics_port_(0)
+        , metrics_addr_("127.0.0.1")
+        , metrics_path_("/metrics")
         {/* TODO 校验一下参数是否可用 */};
 
 public:
@@ -41,6 +121,156 @@ public:
     //TODO conn et mode not implemented now
     bool epoll_et_conn_;
     uint16_t epoll_max_events_;
+    // 每个ConnLoop最多缓存的打开的文件数量，0表示不缓存
+    std::size_t open_file_cache_max_;
+    // 缓存的文件的有效期，过期后通过stat校验文件是否被修改，
+    // 也就是说文件被修改后最多需要这么久才能生效
+    int open_file_cache_valid_ms_;
+    // 缓存的doc_root子目录描述符的数量，0表示所有文件都从doc_root开始解析
+    std::size_t doc_root_dir_cache_max_;
+    // 小文件内容缓存的总大小上限，所有ConnLoop共享，0表示不缓存
+    std::size_t small_file_cache_max_bytes_;
+    // 不超过该大小的文件才会被缓存到内存中，更大的文件继续使用sendfile发送
+    off_t small_file_max_size_;
+    // 后台线程池的线程数，用于压缩等不适合在事件循环中执行的任务
+    uint8_t bg_nthread_;
+    // 后台线程池的最大线程数，大于bg_nthread_时根据任务的排队时间动态调整线程数
+    uint8_t bg_max_nthread_;
+    // 后台线程池中低优先级任务（动态压缩）同时执行的最大数量，0表示不限制，
+    // 避免压缩占满所有后台线程，导致ETag计算等任务一直排队
+    uint8_t bg_low_lane_cap_;
+    // 后台线程池和IO线程池使用工作窃取模式
+    bool pool_work_stealing_;
+    // 动态调整线程池大小的检查周期
+    int pool_scale_interval_ms_;
+    // 任务排队时间的p95超过该值时扩容
+    int pool_scale_up_wait_us_;
+    // 任务排队时间的p95低于该值且利用率较低时缩容
+    int pool_scale_down_wait_us_;
+    // 客户端接受时，优先发送同名的预压缩文件（.br/.gz），类似nginx的gzip_static
+    bool gzip_static_;
+    // 对文本类文件进行动态压缩（gzip/deflate），压缩结果缓存在内存中
+    bool gzip_;
+    int gzip_level_;
+    // 只压缩大小在[gzip_min_length_, gzip_max_length_]之间的文件
+    off_t gzip_min_length_;
+    off_t gzip_max_length_;
+    // 压缩缓存的总大小上限
+    std::size_t gzip_cache_max_bytes_;
+    FileServeMode file_serve_mode_;
+    // MMAP模式下，超过该大小的文件不映射，继续使用sendfile发送
+    off_t mmap_max_size_;
+    // MMAP模式下，所有映射的总大小上限（虚拟内存，实际占用的是页缓存）
+    std::size_t mmap_cache_max_bytes_;
+    // 使用文件内容的哈希作为ETag（后台计算，计算完成前使用mtime和大小生成的ETag），
+    // 内容不变的重新部署不会使客户端缓存失效
+    bool etag_hash_;
+    // 超过该大小的文件不计算哈希
+    off_t etag_hash_max_size_;
+    // 最多缓存的哈希ETag数量
+    std::size_t etag_hash_cache_max_;
+    // 每次可写事件中，一个连接最多发送的字节数，用完后让出事件循环，
+    // 避免大文件下载占满ConnLoop，饿死同一个ConnLoop上的其他请求，0表示不限制
+    std::size_t snd_budget_per_event_;
+    // 客户端连接的TCP_NOTSENT_LOWAT，0表示使用系统默认值
+    int tcp_notsent_lowat_;
+    // 打开文件缓存未命中，或者即将发送的数据不在页缓存中时，
+    // 在IO线程池中完成open，fstat和磁盘读取，避免阻塞ConnLoop
+    bool async_file_io_;
+    // IO线程池的线程数
+    uint8_t io_nthread_;
+    // IO线程池的最大线程数，大于io_nthread_时动态调整线程数
+    uint8_t io_max_nthread_;
+    // IO线程池每次预读的数据量
+    off_t io_readahead_bytes_;
+    // 启动时在开始监听之前预热缓存：打开文件，读入小文件，预读其他文件的开头
+    bool warmup_;
+    // 预热时遍历整个doc_root，否则只预热热点路径列表中的文件
+    bool warmup_walk_;
+    // 预热的时间预算，超过后放弃剩余的任务，直接开始监听
+    int warmup_budget_ms_;
+    // 最多预热的文件数量
+    std::size_t warmup_max_files_;
+    // 预热时每个文件预读的数据量
+    off_t warmup_readahead_bytes_;
+    // 热点路径列表文件，退出时保存各个ConnLoop缓存中最近访问的文件，
+    // 下次启动预热时优先处理，为空表示不保存
+    std::string hot_list_file_;
+    // 热点路径列表的最大长度
+    std::size_t hot_list_max_;
+    // ConnLoop绑定的CPU列表，格式和内核一致，例如"0-3,8"，
+    // 第i个ConnLoop绑定到列表中的第(i % n)个CPU上，为空表示不绑定
+    std::string loop_cpus_;
+    // ConnLoop绑定的NUMA节点列表，例如"0-1"，loop_cpus_为空时生效，
+    // 第i个ConnLoop绑定到第(i % n)个节点的所有CPU上，为空表示不绑定
+    std::string loop_numa_nodes_;
+    // 接收连接的主线程绑定的CPU列表，为空表示不绑定
+    std::string acceptor_cpus_;
+    // 连接再平衡的检查周期，0表示不启用
+    // 连接交给ConnLoop后不会再改变，长连接分布不均时，部分ConnLoop会一直处于繁忙状态，
+    // 启用后每个周期统计各个ConnLoop的繁忙程度（处理事件的时间占比），
+    // 持续不均衡时，把最忙的ConnLoop上空闲的长连接迁移到最闲的ConnLoop上
+    int rebalance_interval_ms_;
+    // 最忙和最闲的ConnLoop的繁忙程度之差超过该值，才认为不均衡
+    double rebalance_busy_diff_;
+    // 最忙的ConnLoop的繁忙程度超过该值，才需要迁移
+    double rebalance_min_busy_;
+    // 连续多少个周期不均衡，才开始迁移
+    int rebalance_sustain_rounds_;
+    // 每次最多迁移的连接数
+    std::size_t rebalance_max_conns_;
+    // 低延迟模式：ConnLoop处理完事件后，在一段时间内用0超时的epoll_wait自旋，
+    // 而不是阻塞等待，省去唤醒和调度的延迟，代价是自旋期间占满CPU，适合独占的CPU
+    // 自旋窗口根据负载在[busy_poll_min_us_, busy_poll_us_]之间自适应，空闲时缩小到0，
+    // busy_poll_us_为0表示不启用
+    int busy_poll_us_;
+    int busy_poll_min_us_;
+    // 客户端连接的SO_BUSY_POLL（同时设置SO_PREFER_BUSY_POLL），单位：微秒，0表示不设置，
+    // 在阻塞的系统调用中直接轮询网卡队列，超过net.core.busy_read时需要CAP_NET_ADMIN
+    int so_busy_poll_us_;
+    // 日志文件，多进程模式下每个工作进程在扩展名前加上自己的编号，例如litewebserver.0.log
+    std::string log_file_;
+    // 工作进程的数量，0表示单进程模式
+    // 大于0时由主进程绑定端口，然后fork出这么多工作进程，每个工作进程运行完整的LiteWebServer，
+    // 主进程负责转发信号和重启异常退出的工作进程，注意nthread_等配置是每个工作进程的
+    int worker_processes_;
+    // 多进程模式下，主进程为每个工作进程创建一个SO_REUSEPORT的监听socket，由内核分配连接，
+    // 否则所有工作进程共享同一个监听socket（EPOLLEXCLUSIVE）
+    bool reuseport_;
+    // 工作进程绑定的NUMA节点列表，例如"0-1"，第i个工作进程的所有线程绑定到第(i % n)个节点的CPU上，
+    // 为空表示不绑定
+    std::string worker_numa_nodes_;
+    // 优雅退出（SIGQUIT，不停机升级后的旧进程）时，等待已有请求处理完毕的最长时间，单位：毫秒，
+    // 超过后直接关闭剩余的连接
+    int drain_timeout_ms_;
+    // 最大连接数（多进程模式下是每个工作进程的），0表示不限制
+    // 达到上限时暂停接收连接（从epoll中移除监听socket），新连接留在内核的完成队列中，
+    // 有连接关闭后恢复
+    std::size_t max_conns_;
+    // 每个ConnLoop的最大连接数，0表示不限制，轮询到的ConnLoop满了时分配给下一个，
+    // 全部满了时同样暂停接收连接
+    std::size_t max_conns_per_loop_;
+    // 过载保护：事件循环的延迟超过这个值时，新的请求直接回复503，单位：微秒，0表示不启用
+    int shed_loop_lag_us_;
+    // 过载保护：IO线程池排队的任务超过这个值时，新的请求直接回复503，0表示不启用
+    std::size_t shed_io_queue_depth_;
+    // 503响应中的Retry-After，单位：秒
+    int shed_retry_after_s_;
+    // 一个请求（请求行，请求头和请求体）最多缓存的字节数，超过后还没有解析完的连接直接关闭
+    std::size_t max_request_bytes_;
+    // 每个ConnLoop统计内存占用（按类别，带最高值）的周期，0表示不统计，
+    // 统计时遍历所有连接，连接很多时不要设置得太短；ConnLoop空闲时最长DEF_EPOLL_WAIT_TIMEOUT统计一次
+    int mem_stats_interval_ms_;
+    // 单个连接最多占用的内存，超过后直接关闭，0表示不限制
+    // 接收请求时检查，其他时候在统计内存占用时检查
+    std::size_t max_conn_mem_bytes_;
+    // 管理端口，提供Prometheus格式的指标，0表示不启用
+    // 多进程模式下第i个工作进程监听metrics_port_ + i
+    uint16_t metrics_port_;
+    // 管理端口绑定的地址，默认只允许本机访问
+    std::string metrics_addr_;
+    // 指标的路径
+    std::string metrics_path_;
 };
 
 #endif //SRC_SERVER_CONF_H_
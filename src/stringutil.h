@@ -71,6 +71,18 @@ public:
 
     inline static
     void str_to_lower(std::string &str);
+
+    /**
+     * @brief 去掉字符串首尾的空白字符（空格和制表符）
+     */
+    inline static
+    void str_trim(std::string &str);
+
+    /**
+     * @brief 字符串在堆上占用的字节数，短字符串优化（SSO）保存在对象内部的为0
+     */
+    inline static
+    std::size_t str_heap_bytes(const std::string &str);
 };
 
 std::vector<std::string> StringUtil::str_split(
@@ -148,6 +160,8 @@ bool StringUtil::str_to_inum(T &ret, const std::string &str, F fn)
 {
     char *end_ptr = nullptr;
 
+    // errno不会被成功的调用重置，需要手动清零，否则可能误判为溢出
+    errno = 0;
     ret = fn(str.c_str(), &end_ptr, 10);
     if (*end_ptr != '\0') {
         return false;
@@ -165,4 +179,22 @@ void StringUtil::str_to_lower(std::string &str)
                    str.begin(), ::tolower);
 }
 
+void StringUtil::str_trim(std::string &str)
+{
+    std::size_t beg = str.find_first_not_of(" \t");
+    if (beg == std::string::npos) {
+        str.clear();
+        return;
+    }
+    std::size_t end = str.find_last_not_of(" \t");
+    str = str.substr(beg, end - beg + 1);
+}
+
+std::size_t StringUtil::str_heap_bytes(const std::string &str)
+{
+    // 空字符串的容量就是对象内部能保存的长度
+    static const std::size_t sso_capacity = std::string().capacity();
+    return str.capacity() > sso_capacity ? str.capacity() + 1 : 0;
+}
+
 #endif //SRC_STRING_UTIL_H_
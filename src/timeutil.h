@@ -8,14 +8,19 @@
 #include <iomanip>
 #include <ctime>
 #include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <string>
 
 #include <stdint.h>
+#include <time.h>
 
 // #include "spdlog/spdlog.h"
 
 using SteadyClock = std::chrono::steady_clock;
 using SystemClock = std::chrono::system_clock;
 using MilliSeconds = std::chrono::milliseconds;
+using NanoSeconds = std::chrono::nanoseconds;
 constexpr const int DEF_TIMER_EXPIRE_MS = 10 * 1000;
 
 /**
@@ -43,6 +48,75 @@ inline std::string system_nowtime_str(bool ms = false)
     return oss.str();
 }
 
+/**
+ * @brief 获取HTTP格式的时间字符串（RFC 7231 IMF-fixdate），
+ *        用于Last-Modified，If-Range等头部
+ * @return 时间字符串，格式为：Sun, 06 Nov 1994 08:49:37 GMT
+ */
+inline std::string http_date_str(std::time_t t)
+{
+    static const char *const week_days[] = {
+        "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
+    };
+    static const char *const months[] = {
+        "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+        "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+    };
+
+    // 不使用strftime，避免受locale影响
+    std::tm gmt;
+    gmtime_r(&t, &gmt);
+    char buf[32] = {0};
+    snprintf(buf, sizeof(buf), "%s, %02d %s %04d %02d:%02d:%02d GMT",
+             week_days[gmt.tm_wday], gmt.tm_mday, months[gmt.tm_mon],
+             gmt.tm_year + 1900, gmt.tm_hour, gmt.tm_min, gmt.tm_sec);
+    return buf;
+}
+
+/**
+ * @brief 解析HTTP格式的时间字符串，用于If-Modified-Since等头部
+ *        只支持IMF-fixdate格式，RFC 850和asctime格式已经过时，
+ *        解析失败时条件请求会被忽略，只是多发送一次完整的响应
+ * @param str 时间字符串，格式为：Sun, 06 Nov 1994 08:49:37 GMT
+ * @param t 输出的时间
+ * @return 是否解析成功
+ */
+inline bool http_date_parse(const std::string &str, std::time_t &t)
+{
+    static const char *const months[] = {
+        "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+        "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+    };
+
+    char week_day[4] = {0};
+    char month[4] = {0};
+    char zone[4] = {0};
+    std::tm gmt;
+    memset(&gmt, 0, sizeof(gmt));
+    int n = sscanf(str.c_str(), "%3s, %d %3s %d %d:%d:%d %3s",
+                   week_day, &gmt.tm_mday, month, &gmt.tm_year,
+                   &gmt.tm_hour, &gmt.tm_min, &gmt.tm_sec, zone);
+    if (n != 8 || strcmp(zone, "GMT") != 0) {
+        return false;
+    }
+
+    gmt.tm_mon = -1;
+    for (int i = 0; i < 12; ++i) {
+        if (strcmp(month, months[i]) == 0) {
+            gmt.tm_mon = i;
+            break;
+        }
+    }
+    if (gmt.tm_mon < 0 || gmt.tm_mday < 1 || gmt.tm_mday > 31
+        || gmt.tm_hour > 23 || gmt.tm_min > 59 || gmt.tm_sec > 60) {
+        return false;
+    }
+    gmt.tm_year -= 1900;
+
+    t = timegm(&gmt);
+    return t != static_cast<std::time_t>(-1);
+}
+
 struct TimerNode 
 {
 public:
@@ -115,6 +189,20 @@ public:
         timer_map_.erase(id);
     }
 
+    /**
+     * @brief 获取定时器的超时时间
+     * @return 定时器不存在时返回false
+     */
+    bool get_timer(int id, SteadyClock::time_point &expire_time) const
+    {
+        auto one_timer = timer_map_.find(id);
+        if (one_timer == timer_map_.end()) {
+            return false;
+        }
+        expire_time = one_timer->second;
+        return true;
+    }
+
     void handle_expired_timers(std::vector<int> &expired)
     {
         auto now = SteadyClock::now();
@@ -167,6 +255,17 @@ public:
         return timer_map_.size();
     }
 
+    /**
+     * @brief 估算占用的内存，队列中包括已经失效但还没有弹出的节点
+     */
+    std::size_t mem_bytes() const
+    {
+        // 哈希表每个节点额外有一个next指针，再加上桶数组
+        return timer_queue_.size() * sizeof(TimerNode)
+               + timer_map_.size() * (sizeof(std::pair<const int, SteadyClock::time_point>) + sizeof(void*))
+               + timer_map_.bucket_count() * sizeof(void*);
+    }
+
 private:
     std::priority_queue<TimerNode,
                         std::deque<TimerNode>,
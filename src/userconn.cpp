@@ -1,9 +1,13 @@
 #include "userconn.h"
 
 #include <string>
+#include <cstdio>
+#include <cstdint>
+#include <atomic>
+#include <algorithm>
 
-#include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/sendfile.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -13,18 +17,25 @@
 #include "litewebserver.h"
 #include "timeutil.h"
 #include "filepathutil.h"
+#include "fdutil.h"
 // #include "debughelper.h"
 
-//BUG 目前chunk size不能大于系统缓冲区大小，否则永远无法写入数据
-constexpr const int HTTP_FILE_CHUNK_SIZE = 64 * 1024;
+// sendfile每次发送的大小由发送缓冲区的剩余空间决定，限定在这个范围内
+constexpr const std::size_t HTTP_FILE_CHUNK_MIN_SIZE = 16 * 1024;
+constexpr const std::size_t HTTP_FILE_CHUNK_MAX_SIZE = 4 * 1024 * 1024;
+// 每次向流式响应体的生产者拉取的最大字节数
+constexpr const std::size_t HTTP_STREAM_CHUNK_SIZE = 16 * 1024;
 
 
 std::map<HttpCode, UserConn::HandleFunc> UserConn::err_handler_ = {
     {HttpCode::MOVED_PERMANENTLY, err_handler_301},
     {HttpCode::BAD_REQUEST, err_handler_400},
+    {HttpCode::FORBIDDEN, err_handler_403},
     {HttpCode::NOT_FOUND, err_handler_404},
     {HttpCode::NOT_ALLOWED, err_handler_405},
-    {HttpCode::INTERNAL_SERVER_ERROR, err_handler_500}
+    {HttpCode::RANGE_NOT_SATISFIABLE, err_handler_416},
+    {HttpCode::INTERNAL_SERVER_ERROR, err_handler_500},
+    {HttpCode::SERVICE_UNAVAILABLE, err_handler_503}
 };
 std::map<std::string, std::map<HttpMethod, UserConn::HandleFunc> > UserConn::router_;
 
@@ -33,6 +44,19 @@ void UserConn::register_err_handler(const HttpCode &code, HandleFunc func)
     err_handler_[code] = func;
 }
 
+std::string UserConn::make_shed_rsp(int retry_after_s)
+{
+    HttpRequest req;
+    req.parse("GET / HTTP/1.1\r\n\r\n", 0);
+    HttpResponse rsp = err_handler_[HttpCode::SERVICE_UNAVAILABLE](req);
+    if (rsp.get_body_kind() != HttpResponse::BodyKind::BIN) {
+        rsp = def_err_handler(HttpCode::SERVICE_UNAVAILABLE, req);
+    }
+    rsp.header_oper(HttpResponse::HeaderOper::MODIFY, "Connection", "close");
+    rsp.header_oper(HttpResponse::HeaderOper::MODIFY, "Retry-After", std::to_string(retry_after_s));
+    return rsp.get_base_rsp() + rsp.get_body();
+}
+
 void UserConn::register_router(const std::string &path, HttpMethod method, HandleFunc func)
 {
     router_[path][method] = func;
@@ -45,6 +69,13 @@ UserConn::~UserConn()
 
 void UserConn::process_in()
 {
+    // 请求超过上限还没有解析完，不再接收
+    if (buffer_r_.size() >= conf_->max_request_bytes_) {
+        SPDLOG_DEBUG("request too large, cli_sock: {}, bytes: {}", cli_sock_, buffer_r_.size());
+        connloop_->conn_close(cli_sock_);
+        return;
+    }
+
     // 接收数据
     bool ret = recv_from_cli();
     if (ret != true) {
@@ -52,17 +83,34 @@ void UserConn::process_in()
         return;
     }
     // SPDLOG_DEBUG("recv from client, cli_sock: {}, data: {}",
-    //              cli_sock_, buffer_data_to_str(buffer_r_, buffer_r_bytes_));
+    //              cli_sock_, buffer_data_to_str(buffer_r_, buffer_r_.size()));
 
     // 解析收到的数据
     req_parsed_bytes_ += req_.parse(buffer_r_, req_parsed_bytes_);
+    // 请求头或者请求体占用的内存超过单个连接的上限
+    if (conf_->max_conn_mem_bytes_ > 0 && mem_bytes() > conf_->max_conn_mem_bytes_) {
+        connloop_->conn_mem_exceeded(cli_sock_);
+        return;
+    }
     if (!req_.parse_complete()) {
         connloop_->mod_conn_event_read(cli_sock_);
         return;
     }
+    release_buffer_r();
 
     // SPDLOG_DEBUG("request current data: {}", req_.dump_data_str());
 
+    if (req_.is_bad_req()) {
+        connloop_->metrics().parse_errors.add();
+    }
+
+    // 过载时不再路由和打开文件，直接发送准备好的503响应并关闭连接
+    if (connloop_->overloaded()) {
+        connloop_->metrics().record_request(req_.get_method(), HttpCode::SERVICE_UNAVAILABLE);
+        connloop_->shed_conn(cli_sock_);
+        return;
+    }
+
     // 返回数据生成后注册epoll写事件，待可写事件触发后
     // 会调用UserConn::process_out，进行处理
     connloop_->mod_conn_event_write(cli_sock_);
@@ -70,48 +118,49 @@ void UserConn::process_in()
 
 void UserConn::process_out()
 {
-    route_path();
-
-    // SPDLOG_DEBUG("response current data: {}", rsp_.dump_data_str());
+    // 每次可写事件重新计算发送预算
+    snd_budget_ = conf_->snd_budget_per_event_ > 0
+                  ? conf_->snd_budget_per_event_ : SIZE_MAX;
 
-    // 如果是文件类型，打开文件
-    // 打不开的话，返回500错误
-    //!!! 这里必须判断file_fd_是否是已经打开的，
+    // 路由和打开文件只在第一次触发写事件时进行，
     // 因为发送过程可能因为文件过大，系统缓冲区满而无法一次发完
     // 这时会重新注册EPOLLOUT事件，导致process_out重入，
     // 如果再次打开文件，旧的文件描述符会发生泄漏，
     // 出现越来越多的未关闭描述符
-    if (rsp_.body_is_file() && file_fd_ == -1) {
-        std::string file_path = combine_two_path(conf_->doc_root_, rsp_.get_body());
-        file_fd_ = open(file_path.c_str(), O_RDONLY);
-        if (file_fd_ >= 0) {
-            struct stat file_stat;
-            fstat(file_fd_, &file_stat);
-            // 如果是路径的话，返回301错误
-            // 记得关闭文件描述符
-            if (file_stat.st_mode & S_IFDIR) {
-                close_file_fd();
-                rsp_ = err_handler_[HttpCode::MOVED_PERMANENTLY](req_);
-            } else {
-                file_size_ = file_stat.st_size;
-                rsp_.header_oper(HttpResponse::HeaderOper::MODIFY,
-                                "Content-Length", std::to_string(file_size_));
-            }
-        } else {
-            if (errno == ENOENT) {
-                rsp_ = err_handler_[HttpCode::NOT_FOUND](req_);
-            } else {
-                rsp_ = err_handler_[HttpCode::INTERNAL_SERVER_ERROR](req_);
-                SPDLOG_ERROR("{} open failed, code: {}, msg: {}", file_path, errno, strerror(errno));
-            }
+    if (!routed_) {
+        route_path();
+        // SPDLOG_DEBUG("response current data: {}", rsp_.dump_data_str());
+        routed_ = true;
+        // 正在排空连接，告诉客户端这是最后一个响应
+        if (connloop_->draining()) {
+            rsp_.header_oper(HttpResponse::HeaderOper::MODIFY, "Connection", "close");
         }
     }
+    // 文件需要在IO线程池中打开时，先不注册任何事件，
+    // 完成后由ConnLoop重新调用process_out
+    if (rsp_.body_is_file() && !body_opened_) {
+        if (!open_body_file()) {
+            return;
+        }
+        body_opened_ = true;
+    }
 
     if (!send_to_cli()) {
+        if (snd_error_) {
+            connloop_->conn_close(cli_sock_);
+            return;
+        }
+        // 等待IO线程池把数据读进页缓存，或者等待流式响应的生产者唤醒，同上
+        if (io_pending_ || stream_parked_) {
+            return;
+        }
         connloop_->mod_conn_event_write(cli_sock_);
     } else {
+        connloop_->metrics().record_request(req_.get_method(), rsp_.get_code());
         std::string conn_state;
-        if (req_.get_header("Connection", conn_state))
+        // 以响应中的Connection为准，错误处理或者不带长度的流式响应
+        // 会将其修改为close
+        if (rsp_.get_header("Connection", conn_state))
         {
             StringUtil::str_to_lower(conn_state);
             if (conn_state == "keep-alive") {
@@ -128,14 +177,383 @@ void UserConn::process_out()
     }
 }
 
-//BUG 需要考虑数据很大，撑爆缓冲区满的情况
+bool UserConn::open_body_file()
+{
+    // 文件相对于doc_root打开，规范化后的路径同时也是各个缓存的key
+    std::string file_path;
+    if (!normalize_url_path(rsp_.get_body(), file_path)) {
+        set_err_rsp(HttpCode::BAD_REQUEST);
+        return true;
+    }
+    bool compressible = content_type_compressible(rsp_.get_body_type());
+
+    if (compressible) {
+        // 响应内容随Accept-Encoding变化，需要告诉缓存服务器
+        rsp_.header_oper(HttpResponse::HeaderOper::MODIFY, "Vary", "Accept-Encoding");
+        bool served = false;
+        if (conf_->gzip_static_) {
+            if (!open_precompressed_file(file_path, served)) {
+                return false;
+            }
+            if (served) {
+                return true;
+            }
+        }
+    }
+
+    // 打不开的话，返回404，403或500错误
+    if (!resolve_file(file_path, file_)) {
+        return false;
+    }
+    if (file_->err != 0) {
+        if (file_->err == ENOENT || file_->err == ENOTDIR) {
+            set_err_rsp(HttpCode::NOT_FOUND);
+        } else if (file_->err == EXDEV || file_->err == ELOOP || file_->err == EACCES) {
+            // 通过符号链接等方式逃出doc_root，或者没有权限
+            set_err_rsp(HttpCode::FORBIDDEN);
+        } else {
+            set_err_rsp(HttpCode::INTERNAL_SERVER_ERROR);
+            SPDLOG_ERROR("{} open failed, code: {}, msg: {}", file_path, file_->err, strerror(file_->err));
+        }
+        close_file_fd();
+        return true;
+    }
+
+    // 如果是路径的话，返回301错误
+    // 记得释放文件
+    if (file_->is_dir) {
+        close_file_fd();
+        set_err_rsp(HttpCode::MOVED_PERMANENTLY);
+        return true;
+    }
+    // 客户端的缓存仍然有效时，不需要再读取文件
+    if (check_not_modified(file_path)) {
+        return true;
+    }
+    file_size_ = file_->size;
+
+    // 动态压缩，压缩缓存命中时直接发送内存中的压缩数据，不再需要文件
+    // 带有Range的请求直接发送原始文件，压缩数据的Range没有意义
+    CompressCache *compress_cache = connloop_->shared()->compress_cache;
+    std::string range;
+    if (compressible && compress_cache != nullptr && !req_.get_header("Range", range)) {
+        CompressCache::Encoding enc = CompressCache::Encoding::GZIP;
+        bool accepted = true;
+        if (req_.accept_encoding("gzip")) {
+            enc = CompressCache::Encoding::GZIP;
+        } else if (req_.accept_encoding("deflate")) {
+            enc = CompressCache::Encoding::DEFLATE;
+        } else {
+            accepted = false;
+        }
+
+        if (accepted) {
+            CompressCache::Buffer data = compress_cache->get(file_path, file_, enc);
+            if (data) {
+                close_file_fd();
+                file_buf_ = std::shared_ptr<const char>(data, data->data());
+                file_size_ = data->size();
+                rsp_.header_oper(HttpResponse::HeaderOper::MODIFY,
+                                 "Content-Encoding", CompressCache::encoding_name(enc));
+                // 压缩后的内容和原文件不是逐字节相同的，只能使用弱ETag
+                std::string etag;
+                if (rsp_.get_header("ETag", etag) && etag.compare(0, 2, "W/") != 0) {
+                    rsp_.header_oper(HttpResponse::HeaderOper::MODIFY, "ETag", "W/" + etag);
+                }
+                // 压缩数据不支持Range
+                set_body_segments_full();
+                return true;
+            }
+        }
+    }
+
+    if (!use_mem_body(file_path)) {
+        return false;
+    }
+    set_body_segments();
+    return true;
+}
+
+bool UserConn::resolve_file(const std::string &path, OpenFilePtr &file)
+{
+    // 异步打开完成后，open_body_file会从头执行一遍，
+    // 本次请求中已经打开过的文件直接使用结果，即使它没有被缓存（例如EMFILE）
+    for (const auto &resolved : resolved_files_) {
+        if (resolved.first == path) {
+            file = resolved.second;
+            return true;
+        }
+    }
+
+    if (connloop_->shared()->io_pool == nullptr) {
+        file = connloop_->file_cache().open(path);
+        return true;
+    }
+
+    file = connloop_->file_cache().lookup(path);
+    if (file) {
+        return true;
+    }
+
+    io_pending_ = true;
+    connloop_->async_open_file(shared_from_this(), path);
+    return false;
+}
+
+bool UserConn::stream_wake()
+{
+    if (!stream_parked_) {
+        return false;
+    }
+    stream_parked_ = false;
+    return true;
+}
+
+void UserConn::io_done(const std::string &path, const OpenFilePtr &file)
+{
+    io_pending_ = false;
+    if (file) {
+        resolved_files_.emplace_back(path, file);
+    } else {
+        // 预读刚刚完成，下一次发送不需要再探测
+        skip_page_probe_ = true;
+    }
+}
+
+bool UserConn::check_not_modified(const std::string &file_path)
+{
+    std::string stat_etag = make_etag(file_->mtime, file_->size);
+    std::string etag = stat_etag;
+    ETagCache *etag_cache = connloop_->shared()->etag_cache;
+    if (etag_cache != nullptr) {
+        std::string hash_etag = etag_cache->get(file_path, file_);
+        if (!hash_etag.empty()) {
+            etag = hash_etag;
+        }
+    }
+    rsp_.header_oper(HttpResponse::HeaderOper::MODIFY, "ETag", etag);
+    rsp_.header_oper(HttpResponse::HeaderOper::MODIFY,
+                     "Last-Modified", http_date_str(file_->mtime));
+
+    HttpMethod method = req_.get_method();
+    if (method != HttpMethod::GET && method != HttpMethod::HEAD) {
+        return false;
+    }
+
+    // 同时存在时，If-None-Match优先，忽略If-Modified-Since
+    std::string val;
+    bool not_modified = false;
+    if (req_.get_header("If-None-Match", val)) {
+        // 哈希计算完成前客户端拿到的是mtime和大小生成的ETag，
+        // 文件没有变化时它也是有效的
+        not_modified = etag_match(val, etag, true)
+                       || (etag != stat_etag && etag_match(val, stat_etag, true));
+    } else if (req_.get_header("If-Modified-Since", val)) {
+        time_t since = 0;
+        not_modified = http_date_parse(val, since) && file_->mtime <= since;
+    }
+    if (!not_modified) {
+        return false;
+    }
+
+    // 304只有响应头，和其他没有响应体的响应一样，一次send就可以发送完毕
+    close_file_fd();
+    rsp_.set_code(HttpCode::NOT_MODIFIED);
+    rsp_.set_no_body();
+    rsp_.header_oper(HttpResponse::HeaderOper::DEL, "Content-Length", "");
+    return true;
+}
+
+bool UserConn::use_mem_body(const std::string &file_path)
+{
+    ContentCache *content_cache = connloop_->shared()->content_cache;
+    if (content_cache != nullptr && file_->size <= content_cache->max_file_size()) {
+        ContentCache::Buffer data = content_cache->peek(file_path, *file_);
+        if (!data) {
+            // 未命中时需要读取整个文件，不在页缓存中的话会阻塞本线程，
+            // 交给IO线程池读取并缓存，完成后再从缓存中获取
+            if (connloop_->shared()->io_pool != nullptr && !skip_page_probe_
+                && !(OpenFileCache::page_cached(*file_, 0)
+                     && OpenFileCache::page_cached(*file_, file_->size - 1))) {
+                io_pending_ = true;
+                connloop_->async_fill_content(shared_from_this(), file_path, file_);
+                return false;
+            }
+            data = content_cache->get(file_path, *file_);
+        }
+        if (data) {
+            // 内容已经在内存中，不再需要文件
+            file_.reset();
+            file_buf_ = std::shared_ptr<const char>(data, data->data());
+            return true;
+        }
+    }
+
+    MmapCache *mmap_cache = connloop_->shared()->mmap_cache;
+    if (mmap_cache != nullptr && file_->size <= mmap_cache->max_file_size()) {
+        MappedFilePtr mapped = mmap_cache->get(file_path, *file_);
+        if (mapped) {
+            // 映射由MmapCache和正在发送的连接共同持有，不再需要文件
+            file_.reset();
+            file_buf_ = std::shared_ptr<const char>(mapped, mapped->data());
+        }
+    }
+    return true;
+}
+
+void UserConn::set_body_segments_full()
+{
+    body_segs_.clear();
+    body_segs_.push_back(BodySegment{"", 0, file_size_});
+    rsp_.header_oper(HttpResponse::HeaderOper::MODIFY,
+                     "Content-Length", std::to_string(file_size_));
+}
+
+void UserConn::set_body_segments()
+{
+    rsp_.header_oper(HttpResponse::HeaderOper::MODIFY, "Accept-Ranges", "bytes");
+
+    std::string range;
+    if (req_.get_method() != HttpMethod::GET || !req_.get_header("Range", range)) {
+        set_body_segments_full();
+        return;
+    }
+
+    // If-Range和当前文件的版本不一致时，说明客户端缓存的内容已经过期，
+    // 需要返回整个文件，If-Range可以是ETag（强比较）或者Last-Modified
+    std::string if_range;
+    if (req_.get_header("If-Range", if_range)) {
+        std::string validator;
+        bool matched = false;
+        if (if_range.compare(0, 1, "\"") == 0 || if_range.compare(0, 2, "W/") == 0) {
+            matched = rsp_.get_header("ETag", validator) && etag_match(if_range, validator, false);
+        } else {
+            matched = rsp_.get_header("Last-Modified", validator) && if_range == validator;
+        }
+        if (!matched) {
+            set_body_segments_full();
+            return;
+        }
+    }
+
+    std::vector<HttpRange> ranges;
+    HttpRangeResult result = parse_range_header(range, file_size_, ranges);
+    if (result == HttpRangeResult::NONE) {
+        set_body_segments_full();
+        return;
+    }
+    if (result == HttpRangeResult::UNSATISFIABLE) {
+        off_t size = file_size_;
+        close_file_fd();
+        set_err_rsp(HttpCode::RANGE_NOT_SATISFIABLE);
+        rsp_.header_oper(HttpResponse::HeaderOper::MODIFY,
+                         "Content-Range", "bytes */" + std::to_string(size));
+        return;
+    }
+
+    const std::string total = "/" + std::to_string(file_size_);
+    body_segs_.clear();
+    rsp_.set_code(HttpCode::PARTIAL_CONTENT);
+
+    if (ranges.size() == 1) {
+        const HttpRange &r = ranges.front();
+        body_segs_.push_back(BodySegment{"", r.first, r.length()});
+        rsp_.header_oper(HttpResponse::HeaderOper::MODIFY, "Content-Range",
+                         "bytes " + std::to_string(r.first) + "-"
+                           + std::to_string(r.last) + total);
+        rsp_.header_oper(HttpResponse::HeaderOper::MODIFY,
+                         "Content-Length", std::to_string(r.length()));
+        return;
+    }
+
+    // multipart/byteranges:
+    // \r\n--boundary\r\n
+    // Content-Type: text/html\r\n
+    // Content-Range: bytes 0-99/1000\r\n
+    // \r\n
+    // <data>
+    // ...
+    // \r\n--boundary--\r\n
+    static std::atomic<unsigned long long> boundary_seq(0);
+    char boundary[32] = {0};
+    snprintf(boundary, sizeof(boundary), "%020llu", ++boundary_seq);
+
+    std::string part_type;
+    if (rsp_.get_header("Content-Type", part_type)) {
+        part_type = "Content-Type: " + part_type + "\r\n";
+    }
+
+    off_t content_len = 0;
+    for (const auto &r : ranges) {
+        BodySegment seg{"\r\n--", r.first, r.length()};
+        seg.head += boundary;
+        seg.head += "\r\n" + part_type;
+        seg.head += "Content-Range: bytes " + std::to_string(r.first) + "-"
+                    + std::to_string(r.last) + total + "\r\n\r\n";
+        content_len += seg.head.size() + seg.length;
+        body_segs_.push_back(std::move(seg));
+    }
+    body_segs_.push_back(BodySegment{std::string("\r\n--") + boundary + "--\r\n", 0, 0});
+    content_len += body_segs_.back().head.size();
+
+    rsp_.header_oper(HttpResponse::HeaderOper::MODIFY, "Content-Type",
+                     std::string("multipart/byteranges; boundary=") + boundary);
+    rsp_.header_oper(HttpResponse::HeaderOper::MODIFY,
+                     "Content-Length", std::to_string(content_len));
+}
+
+bool UserConn::open_precompressed_file(const std::string &file_path, bool &served)
+{
+    served = false;
+
+    // 按照压缩率从高到低尝试
+    static const char *const codings[][2] = {
+        {"br", ".br"},
+        {"gzip", ".gz"}
+    };
+
+    for (const auto &coding : codings) {
+        if (!req_.accept_encoding(coding[0])) {
+            continue;
+        }
+
+        // 不存在的预压缩文件也会被缓存，不会每次都去查找
+        OpenFilePtr file;
+        if (!resolve_file(file_path + coding[1], file)) {
+            return false;
+        }
+        if (file->err != 0 || file->is_dir) {
+            continue;
+        }
+
+        file_ = file;
+        served = true;
+        if (check_not_modified(file_path + coding[1])) {
+            return true;
+        }
+        file_size_ = file_->size;
+        rsp_.header_oper(HttpResponse::HeaderOper::MODIFY,
+                         "Content-Encoding", coding[0]);
+        if (!use_mem_body(file_path + coding[1])) {
+            return false;
+        }
+        set_body_segments();
+        return true;
+    }
+
+    return true;
+}
+
 //TODO 最好一次性把数据读完，而不是每次epollin读一次，优化性能
 bool UserConn::recv_from_cli()
 {
-    size_t remain_size = buffer_r_.size() - buffer_r_bytes_;
-    char *read_begin = &(*buffer_r_.begin()) + buffer_r_bytes_;
+    std::size_t remain_size = conf_->max_request_bytes_ - buffer_r_.size();
+    if (remain_size > READ_SCRATCH_BYTES) {
+        remain_size = READ_SCRATCH_BYTES;
+    }
+    char *scratch = connloop_->read_scratch();
 
-    ssize_t recv_bytes = recv(cli_sock_, read_begin, remain_size, 0);
+    ssize_t recv_bytes = recv(cli_sock_, scratch, remain_size, 0);
 
     if (recv_bytes <= 0) {
         // 不管是 == 0：客户端关闭连接
@@ -147,16 +565,44 @@ bool UserConn::recv_from_cli()
         //（目前考虑到的EAGAIN EWOULDBLOCK EINTR）都有处理，不知道还有没有其他的
         return false;
     } else {
-        buffer_r_bytes_ += recv_bytes;
+        connloop_->metrics().bytes_in.add(recv_bytes);
+        connloop_->read_buf_pool().reserve(buffer_r_, recv_bytes);
+        buffer_r_.append(scratch, recv_bytes);
     }
 
     return true;
 }
 
+void UserConn::snd_consume(std::size_t bytes)
+{
+    snd_budget_ -= (bytes < snd_budget_ ? bytes : snd_budget_);
+    connloop_->metrics().bytes_out.add(bytes);
+}
+
+std::size_t UserConn::rsp_mem_bytes() const
+{
+    std::size_t bytes = rsp_.mem_bytes()
+                        + StringUtil::str_heap_bytes(stream_buf_)
+                        + StringUtil::str_heap_bytes(stream_chunk_)
+                        + body_segs_.capacity() * sizeof(BodySegment);
+    for (const BodySegment &seg : body_segs_) {
+        bytes += StringUtil::str_heap_bytes(seg.head);
+    }
+    for (const auto &resolved : resolved_files_) {
+        bytes += sizeof(resolved) + StringUtil::str_heap_bytes(resolved.first);
+    }
+    return bytes;
+}
+
+void UserConn::release_buffer_r()
+{
+    connloop_->read_buf_pool().release(buffer_r_);
+}
+
 void UserConn::route_path()
 {
     if (req_.is_bad_req()) {
-        rsp_ = err_handler_[HttpCode::BAD_REQUEST](req_);
+        set_err_rsp(HttpCode::BAD_REQUEST);
         return;
     } else {
         std::string path = req_.get_path();
@@ -165,22 +611,29 @@ void UserConn::route_path()
         if (it_path != router_.end()) {
             const auto &call_fn = it_path->second.find(method);
             if (call_fn != it_path->second.end()) {
-                rsp_ = call_fn->second(req_);
+                rsp_.assign(call_fn->second(req_));
             } else {
-                rsp_ = err_handler_[HttpCode::NOT_ALLOWED](req_);
+                set_err_rsp(HttpCode::NOT_ALLOWED);
             }
         } else {
             // "/" "/foo/bar/" "/foo/"
             // 都认为是根目录
+            // 静态文件直接填写rsp_，复用上一个请求留下的容量
+            rsp_.reset(req_);
             if (req_.get_path().back() == '/') {
-                rsp_ = root_handler(req_);
+                root_handler(req_, rsp_);
             } else {
-                rsp_ = static_file_handler(req_);
+                static_file_handler(req_, rsp_);
             }
         }
     }
 }
 
+void UserConn::set_err_rsp(HttpCode code)
+{
+    rsp_.assign(err_handler_[code](req_));
+}
+
 bool UserConn::send_to_cli()
 {
     if (!base_rsp_snd_) {
@@ -201,67 +654,317 @@ bool UserConn::send_to_cli()
 void UserConn::send_base_rsp()
 {
     ssize_t send_bytes = 0;
+    const std::string &base_rsp = rsp_.get_base_rsp();
+
+    // 响应体在内存中时，和响应头合并为一次writev发送，
+    // 小文件和错误页面只需要一次系统调用
+    const char *body = nullptr;
+    size_t body_size = 0;
+    body_mem_slice(body, body_size);
+    body_size = snd_quota(body_size);
 
     while (true) {
-        size_t remain_size = rsp_.get_base_rsp().size() - rsp_base_snd_bytes_;
-        const char *snd_beg = rsp_.get_base_rsp().data() + rsp_base_snd_bytes_;
+        size_t remain_size = base_rsp.size() - rsp_base_snd_bytes_;
+        const char *snd_beg = base_rsp.data() + rsp_base_snd_bytes_;
 
         // 理论上不会出现remain_size < 0的情况
         if (remain_size <= 0) {
             base_rsp_snd_ = true;
             return;
         }
-        send_bytes = send(cli_sock_, snd_beg, remain_size, 0);
+        if (body_size > 0) {
+            struct iovec iov[2];
+            iov[0].iov_base = const_cast<char*>(snd_beg);
+            iov[0].iov_len = remain_size;
+            iov[1].iov_base = const_cast<char*>(body);
+            iov[1].iov_len = body_size;
+            send_bytes = writev(cli_sock_, iov, 2);
+        } else {
+            send_bytes = send(cli_sock_, snd_beg, remain_size, 0);
+        }
         if (send_bytes <= 0) {
             // 事件线程会根据epoll触发的事件进行处理
             //（目前考虑到的EAGAIN EWOULDBLOCK EINTR）都有处理，不知道还有没有其他的
             return;
         }
+        snd_consume(send_bytes);
+        if (static_cast<size_t>(send_bytes) >= remain_size) {
+            rsp_base_snd_bytes_ += remain_size;
+            body_mem_consumed(send_bytes - remain_size);
+            base_rsp_snd_ = true;
+            return;
+        }
         rsp_base_snd_bytes_ += send_bytes;
     }
 }
 
+void UserConn::body_mem_slice(const char *&data, size_t &size)
+{
+    data = nullptr;
+    size = 0;
+
+    if (rsp_.get_body_kind() == HttpResponse::BodyKind::BIN) {
+        data = rsp_.get_body().data() + rsp_body_snd_bytes_;
+        size = rsp_.get_body().size() - rsp_body_snd_bytes_;
+    } else if (rsp_.body_is_file() && file_buf_ && body_seg_idx_ < body_segs_.size()) {
+        // 只合并第一个分段的数据，multipart的分段头还是单独发送
+        const BodySegment &seg = body_segs_[body_seg_idx_];
+        if (seg.head.empty()) {
+            data = file_buf_.get() + seg.offset + seg_snd_bytes_;
+            size = seg.length - seg_snd_bytes_;
+        }
+    }
+}
+
+void UserConn::body_mem_consumed(size_t size)
+{
+    if (size == 0) {
+        return;
+    }
+    if (rsp_.body_is_file()) {
+        seg_snd_bytes_ += size;
+    }
+    rsp_body_snd_bytes_ += size;
+}
+
 void UserConn::send_body()
+{
+    if (rsp_.body_is_file()) {
+        send_file_body();
+    } else if (rsp_.body_is_stream()) {
+        send_stream_body();
+    } else {
+        send_bin_body();
+    }
+}
+
+std::size_t UserConn::file_chunk_size()
+{
+    // 发送缓冲区的剩余空间，开启自动调整时SO_SNDBUF会变化，所以每次都重新获取，
+    // 每次sendfile都不超过剩余空间，缓冲区满时的调用只会得到EAGAIN
+    int sndbuf = FdUtil::get_socket_sndbuf(cli_sock_);
+    int notsent = FdUtil::get_tcp_notsent_bytes(cli_sock_);
+    if (sndbuf <= 0) {
+        return HTTP_FILE_CHUNK_MIN_SIZE;
+    }
+
+    std::size_t chunk = static_cast<std::size_t>(sndbuf);
+    if (notsent > 0 && notsent < sndbuf) {
+        chunk -= notsent;
+    }
+    if (chunk < HTTP_FILE_CHUNK_MIN_SIZE) {
+        chunk = HTTP_FILE_CHUNK_MIN_SIZE;
+    } else if (chunk > HTTP_FILE_CHUNK_MAX_SIZE) {
+        chunk = HTTP_FILE_CHUNK_MAX_SIZE;
+    }
+    return chunk;
+}
+
+void UserConn::send_file_body()
 {
     ssize_t send_bytes = 0;
+    // 只有sendfile需要限制每次的大小，内存中的数据由send自己决定能发送多少
+    std::size_t chunk = SIZE_MAX;
+    if (!file_buf_ && body_seg_idx_ < body_segs_.size()) {
+        // 即将发送的数据不在页缓存中时，sendfile会阻塞整个ConnLoop，
+        // 交给IO线程池预读，完成后再继续发送
+        const BodySegment &seg = body_segs_[body_seg_idx_];
+        if (connloop_->shared()->io_pool != nullptr && !skip_page_probe_
+            && seg_snd_bytes_ < seg.length
+            && !OpenFileCache::page_cached(*file_, seg.offset + seg_snd_bytes_)) {
+            io_pending_ = true;
+            connloop_->async_warm_file(shared_from_this(), file_, seg.offset + seg_snd_bytes_);
+            return;
+        }
+        skip_page_probe_ = false;
+        chunk = file_chunk_size();
+    }
 
-    if (rsp_.body_is_file()) {
-        while (true) {
-            send_bytes = file_size_ - rsp_body_snd_bytes_;
+    while (body_seg_idx_ < body_segs_.size()) {
+        // 预算用完，让出事件循环，等待下一次可写事件
+        if (snd_budget_ == 0) {
+            return;
+        }
+        const BodySegment &seg = body_segs_[body_seg_idx_];
+
+        // 先发送分段头
+        if (seg_head_snd_bytes_ < seg.head.size()) {
+            std::size_t head_remain = seg.head.size() - seg_head_snd_bytes_;
+            if (file_buf_ && seg.length > seg_snd_bytes_) {
+                // 数据在内存中时，分段头和分段数据合并为一次writev
+                struct iovec iov[2];
+                iov[0].iov_base = const_cast<char*>(seg.head.data()) + seg_head_snd_bytes_;
+                iov[0].iov_len = head_remain;
+                iov[1].iov_base = const_cast<char*>(file_buf_.get()) + seg.offset + seg_snd_bytes_;
+                iov[1].iov_len = snd_quota(seg.length - seg_snd_bytes_);
+                send_bytes = writev(cli_sock_, iov, 2);
+            } else {
+                send_bytes = send(cli_sock_, seg.head.data() + seg_head_snd_bytes_,
+                                  head_remain, 0);
+            }
             if (send_bytes <= 0) {
-                body_snd_ = true;
-                close_file_fd();
                 return;
             }
-            if (send_bytes > HTTP_FILE_CHUNK_SIZE) {
-                send_bytes = HTTP_FILE_CHUNK_SIZE;
+            snd_consume(send_bytes);
+            if (static_cast<std::size_t>(send_bytes) <= head_remain) {
+                seg_head_snd_bytes_ += send_bytes;
+            } else {
+                seg_head_snd_bytes_ += head_remain;
+                seg_snd_bytes_ += send_bytes - head_remain;
+                rsp_body_snd_bytes_ += send_bytes - head_remain;
             }
-            send_bytes = sendfile(cli_sock_, file_fd_, &rsp_body_snd_bytes_, send_bytes);
-            if (send_bytes <= 0) {
-                // 事件线程会根据epoll触发的事件进行处理
-                //（目前考虑到的EAGAIN EWOULDBLOCK EINTR）都有处理，不知道还有没有其他的
-                //TODO 调整系统缓冲区大小是否能提升性能？
+            continue;
+        }
+
+        off_t remain_size = seg.length - seg_snd_bytes_;
+        if (remain_size <= 0) {
+            ++body_seg_idx_;
+            seg_head_snd_bytes_ = 0;
+            seg_snd_bytes_ = 0;
+            continue;
+        }
+
+        off_t offset = seg.offset + seg_snd_bytes_;
+        std::size_t want = snd_quota(std::min<std::size_t>(remain_size, chunk));
+        if (file_buf_) {
+            // 文件内容已经在内存中（压缩缓存，小文件缓存，mmap），直接发送
+            send_bytes = send(cli_sock_, file_buf_.get() + offset, want, 0);
+        } else {
+            // 文件描述符被多个连接共享，必须使用offset指针
+            send_bytes = sendfile(cli_sock_, file_->fd, &offset, want);
+            if (send_bytes > 0) {
+                connloop_->metrics().sendfile_bytes.add(send_bytes);
+            } else if (send_bytes == 0) {
+                // 已经到了文件末尾，但还没有发送完：文件在缓存的有效期内被截断了，
+                // 已经发出的Content-Length无法兑现，只能关闭连接
+                SPDLOG_WARN("file shrank while sending, expected {} bytes, cli_sock: {}",
+                            file_->size, cli_sock_);
+                connloop_->file_cache().invalidate(*file_);
+                snd_error_ = true;
                 return;
             }
         }
-    } else {
-        while (true) {
-            size_t remain_size = rsp_.get_body().size() - rsp_body_snd_bytes_;
-            const char *snd_beg = rsp_.get_body().data() + rsp_body_snd_bytes_;
+        if (send_bytes <= 0) {
+            // 事件线程会根据epoll触发的事件进行处理
+            //（目前考虑到的EAGAIN EWOULDBLOCK EINTR）都有处理，不知道还有没有其他的
+            return;
+        }
+        seg_snd_bytes_ += send_bytes;
+        rsp_body_snd_bytes_ += send_bytes;
+        snd_consume(send_bytes);
+        // 没有发送完，说明缓冲区已经满了，不需要再调用一次得到EAGAIN
+        if (static_cast<std::size_t>(send_bytes) < want && seg_snd_bytes_ < seg.length) {
+            return;
+        }
+    }
+
+    body_snd_ = true;
+    close_file_fd();
+}
+
+void UserConn::send_bin_body()
+{
+    ssize_t send_bytes = 0;
+
+    while (true) {
+        size_t remain_size = rsp_.get_body().size() - rsp_body_snd_bytes_;
+        const char *snd_beg = rsp_.get_body().data() + rsp_body_snd_bytes_;
+
+        // 理论上不会出现remain_size < 0的情况
+        if (remain_size <= 0) {
+            body_snd_ = true;
+            return;
+        }
+        if (snd_budget_ == 0) {
+            return;
+        }
+        send_bytes = send(cli_sock_, snd_beg, snd_quota(remain_size), 0);
+
+        if (send_bytes <= 0) {
+            // 事件线程会根据epoll触发的事件进行处理
+            //（目前考虑到的EAGAIN EWOULDBLOCK EINTR）都有处理，不知道还有没有其他的
+            return;
+        }
+        rsp_body_snd_bytes_ += send_bytes;
+        snd_consume(send_bytes);
+    }
+}
 
-            // 理论上不会出现remain_size < 0的情况
-            if (remain_size <= 0) {
+void UserConn::send_stream_body()
+{
+    ssize_t send_bytes = 0;
+
+    while (true) {
+        // 上一块数据发送完毕后，才拉取下一块数据，
+        // socket不可写时不会拉取，从而实现背压
+        if (stream_buf_snd_bytes_ >= stream_buf_.size()) {
+            if (stream_end_) {
                 body_snd_ = true;
                 return;
             }
-            send_bytes = send(cli_sock_, snd_beg, remain_size, 0);
-
-            if (send_bytes <= 0) {
-                // 事件线程会根据epoll触发的事件进行处理
-                //（目前考虑到的EAGAIN EWOULDBLOCK EINTR）都有处理，不知道还有没有其他的
+            fill_stream_buf();
+            // 生产者暂时没有数据，挂起连接，socket一直可写，
+            // 如果继续等待可写事件会让事件循环空转，由生产者有数据后唤醒
+            if (stream_buf_.empty() && !stream_end_) {
+                stream_parked_ = true;
                 return;
             }
-            rsp_body_snd_bytes_ += send_bytes;
+            continue;
         }
+
+        if (snd_budget_ == 0) {
+            return;
+        }
+        size_t remain_size = stream_buf_.size() - stream_buf_snd_bytes_;
+        const char *snd_beg = stream_buf_.data() + stream_buf_snd_bytes_;
+        send_bytes = send(cli_sock_, snd_beg, snd_quota(remain_size), 0);
+        if (send_bytes <= 0) {
+            // 事件线程会根据epoll触发的事件进行处理
+            return;
+        }
+        stream_buf_snd_bytes_ += send_bytes;
+        rsp_body_snd_bytes_ += send_bytes;
+        snd_consume(send_bytes);
+    }
+}
+
+void UserConn::fill_stream_buf()
+{
+    stream_buf_.clear();
+    stream_chunk_.clear();
+    stream_buf_snd_bytes_ = 0;
+
+    if (!stream_waker_) {
+        std::weak_ptr<UserConn> weak_conn = shared_from_this();
+        // 流式响应期间连接不会被迁移，生产者可能比ConnLoop活得更久，所以只持有弱引用
+        std::weak_ptr<ConnLoop> weak_loop = connloop_->shared_from_this();
+        stream_waker_ = [weak_conn, weak_loop]() {
+            std::shared_ptr<ConnLoop> loop = weak_loop.lock();
+            if (loop) {
+                loop->wake_conn(weak_conn);
+            }
+        };
+    }
+    bool more = rsp_.produce_body(stream_chunk_, HTTP_STREAM_CHUNK_SIZE, stream_waker_);
+    stream_end_ = !more;
+
+    if (!rsp_.body_is_chunked()) {
+        stream_buf_.swap(stream_chunk_);
+        return;
+    }
+
+    // chunk-size CRLF chunk-data CRLF
+    // 大小为0的chunk表示结束，所以空数据块不能发送
+    if (!stream_chunk_.empty()) {
+        char size_line[32] = {0};
+        int n = snprintf(size_line, sizeof(size_line), "%zx\r\n", stream_chunk_.size());
+        stream_buf_.reserve(n + stream_chunk_.size() + 2 + 5);
+        stream_buf_.append(size_line, n);
+        stream_buf_.append(stream_chunk_);
+        stream_buf_.append("\r\n");
+    }
+    if (stream_end_) {
+        // last-chunk CRLF，不发送trailer
+        stream_buf_.append("0\r\n\r\n");
     }
 }
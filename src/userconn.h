@@ -5,6 +5,8 @@
 #include <functional>
 #include <map>
 #include <memory>
+#include <vector>
+#include <utility>
 
 #include <stdlib.h>
 #include <stdint.h>
@@ -12,17 +14,33 @@
 
 #include "serverconf.h"
 #include "httpdata.h"
-
-constexpr const int BUFFER_MIN_SIZE_R = 2048;
+#include "filecache.h"
 
 class ConnLoop;
 
+/**
+ * @brief 文件响应体中的一段数据
+ *        先发送head，再发送文件中[offset, offset + length)的数据，
+ *        普通的文件响应只有一段，multipart/byteranges响应有多段
+ */
+struct BodySegment
+{
+    std::string head;
+    off_t offset;
+    off_t length;
+};
+
 
-class UserConn {
+class UserConn : public std::enable_shared_from_this<UserConn> {
 public:
     using HandleFunc = HttpResponse(*)(const HttpRequest&);
     static void register_err_handler(const HttpCode &code, HandleFunc func);
     static void register_router(const std::string &path, HttpMethod method, HandleFunc func);
+    /**
+     * @brief 生成过载时直接发送的503响应（带Retry-After），使用注册的503处理函数，
+     *        处理函数返回的不是内存中的响应体时使用默认的
+     */
+    static std::string make_shed_rsp(int retry_after_s);
 
 public:
     UserConn(ConnLoop *const connloop,
@@ -31,16 +49,29 @@ public:
         : connloop_(connloop)
         , conf_(conf)
         , cli_sock_(cli_sock)
-        , buffer_r_(BUFFER_MIN_SIZE_R, '\0')
-        , buffer_r_bytes_(0)
+        , buffer_r_("")
         , req_parsed_bytes_(0)
         , rsp_(req_)
+        , routed_(false)
+        , body_opened_(false)
+        , io_pending_(false)
+        , skip_page_probe_(false)
         , base_rsp_snd_(false)
         , body_snd_(false)
+        , snd_error_(false)
+        , snd_budget_(0)
         , rsp_base_snd_bytes_(0)
         , rsp_body_snd_bytes_(0)
-        , file_fd_(-1)
+        , file_(nullptr)
+        , file_buf_(nullptr)
         , file_size_(0)
+        , body_seg_idx_(0)
+        , seg_head_snd_bytes_(0)
+        , seg_snd_bytes_(0)
+        , stream_buf_snd_bytes_(0)
+        , stream_end_(false)
+        , stream_parked_(false)
+        , stream_waker_(nullptr)
         {}
     ~UserConn();
     // 五法则，实现拷贝，移动，析构中的任意一个，都需要将其他四个实现
@@ -53,34 +84,176 @@ public:
 public:
     void process_in();
     void process_out();
+    /**
+     * @brief IO线程池中的任务完成，由ConnLoop在本线程中调用，之后会重新调用process_out
+     * @param path 打开的文件路径，预读任务为空
+     * @param file 打开的文件，预读任务为nullptr
+     */
+    void io_done(const std::string &path, const OpenFilePtr &file);
+    /**
+     * @brief 流式响应的生产者唤醒了连接，由ConnLoop在本线程中调用
+     * @return 连接正在等待数据时返回true，之后会重新调用process_out
+     */
+    bool stream_wake();
+    int cli_sock() const { return cli_sock_; }
+    /**
+     * @brief 连接是否处于请求的边界：上一个响应已经发送完毕，
+     *        下一个请求还没有收到任何数据，也没有等待中的IO任务
+     *        只有这种状态的连接才能迁移到其他ConnLoop
+     */
+    bool idle() const {
+        return buffer_r_.empty() && req_parsed_bytes_ == 0
+               && !routed_ && !io_pending_ && !base_rsp_snd_ && !body_snd_;
+    }
+    /**
+     * @brief 读缓冲区占用的堆内存
+     */
+    std::size_t read_buf_bytes() const { return StringUtil::str_heap_bytes(buffer_r_); }
+    std::size_t req_mem_bytes() const { return req_.mem_bytes(); }
+    /**
+     * @brief 响应占用的堆内存，包括流式响应的缓存和分段的头部，
+     *        不包括共享的缓存（小文件缓存，压缩缓存，mmap映射）中的文件内容
+     */
+    std::size_t rsp_mem_bytes() const;
+    /**
+     * @brief 连接占用的全部内存，包括UserConn对象本身
+     */
+    std::size_t mem_bytes() const {
+        return sizeof(UserConn) + read_buf_bytes() + req_mem_bytes() + rsp_mem_bytes();
+    }
+    /**
+     * @brief 连接迁移到其他ConnLoop后，由新的ConnLoop在自己的线程中调用
+     */
+    void attach_loop(ConnLoop *connloop) { connloop_ = connloop; }
 
 private:
+    /**
+     * @brief 接收数据到本线程的临时缓冲区，再追加到buffer_r_，
+     *        buffer_r_的容量不够时从读缓冲区池中换一个更大的
+     */
     bool recv_from_cli();
+    /**
+     * @brief 请求解析完毕后，数据已经复制到req_中，把buffer_r_归还到读缓冲区池
+     */
+    void release_buffer_r();
     void route_path();
+    /**
+     * @brief 使用注册的错误处理函数生成响应，复制到rsp_中，不丢弃rsp_保留的容量
+     */
+    void set_err_rsp(HttpCode code);
+    /**
+     * @brief 打开响应体对应的文件，设置长度和编码相关的响应头，
+     *        失败时会将响应替换为对应的错误响应
+     * @return false 文件正在IO线程池中打开或者读取，完成后需要重新调用
+     */
+    bool open_body_file();
+    /**
+     * @brief 尝试打开同名的预压缩文件（.br/.gz）
+     * @param served 输出参数，客户端不接受对应的编码或者文件不存在时为false
+     * @return false 文件正在IO线程池中打开，完成后需要重新调用
+     */
+    bool open_precompressed_file(const std::string &file_path, bool &served);
+    /**
+     * @brief 通过打开文件缓存获取文件，
+     *        启用了IO线程池且缓存未命中时，提交异步打开任务
+     * @return false 文件正在IO线程池中打开，file无效
+     */
+    bool resolve_file(const std::string &path, OpenFilePtr &file);
+    /**
+     * @brief 设置ETag和Last-Modified，并根据If-None-Match和If-Modified-Since
+     *        判断客户端的缓存是否仍然有效，有效时将响应替换为304，并释放文件
+     * @param file_path file_的完整路径
+     * @return 是否返回304
+     */
+    bool check_not_modified(const std::string &file_path);
+    /**
+     * @brief 根据Range和If-Range设置需要发送的文件分段，
+     *        以及对应的状态码和Content-Range，Content-Length等响应头
+     *        If-Range和响应中已经设置的ETag或者Last-Modified比较
+     */
+    void set_body_segments();
+    /**
+     * @brief 发送整个文件
+     */
+    void set_body_segments_full();
+    /**
+     * @brief 小文件使用内存中的缓存发送，
+     *        MMAP模式下其他不太大的文件使用共享的映射发送，
+     *        成功后释放file_
+     * @return false 文件内容不在页缓存中，需要在IO线程池中读取，完成后重新调用open_body_file
+     */
+    bool use_mem_body(const std::string &file_path);
     void close_file_fd() {
-        if (file_fd_!= -1) {
-            close(file_fd_);
-            file_fd_ = -1;
-            file_size_ = 0;
-        }
+        // 文件由OpenFileCache管理，这里只是释放引用，
+        // 最后一个引用释放时才会真正关闭文件
+        file_.reset();
+        file_buf_.reset();
+        file_size_ = 0;
+        body_segs_.clear();
+        body_seg_idx_ = 0;
+        seg_head_snd_bytes_ = 0;
+        seg_snd_bytes_ = 0;
     }
     bool send_to_cli();
     void send_base_rsp();
+    /**
+     * @brief 获取当前待发送的、已经在内存中的响应体数据
+     *        用于和响应头合并发送，没有时size为0
+     */
+    void body_mem_slice(const char *&data, size_t &size);
+    /**
+     * @brief 和响应头合并发送时，记录已发送的响应体字节数
+     */
+    void body_mem_consumed(size_t size);
     void send_body();
+    /**
+     * @brief 根据发送缓冲区的状态计算每次sendfile的大小
+     */
+    std::size_t file_chunk_size();
+    void send_file_body();
+    void send_bin_body();
+    void send_stream_body();
+    /**
+     * @brief 从响应中拉取下一块流式数据到stream_buf_，
+     *        如果是chunked编码，会同时加上chunk的头尾
+     */
+    void fill_stream_buf();
+    /**
+     * @brief 按照本次可写事件的剩余预算限制发送的字节数
+     */
+    std::size_t snd_quota(std::size_t want) const {
+        return want < snd_budget_ ? want : snd_budget_;
+    }
+    /**
+     * @brief 从本次可写事件的发送预算中扣除已发送的字节数，并计入发送字节的指标
+     */
+    void snd_consume(std::size_t bytes);
     /**
      * @brief 重置连接状态
      *        当完成一次完整的收发请求后，如果该链接需要继续使用，就需要重置连接状态
      */
     void conn_state_reset() {
-        buffer_r_bytes_ = 0;
+        release_buffer_r();
         req_.reset();
         req_parsed_bytes_ = 0;
         rsp_.reset();
+        routed_ = false;
+        body_opened_ = false;
+        io_pending_ = false;
+        skip_page_probe_ = false;
+        resolved_files_.clear();
         base_rsp_snd_ = false;
         body_snd_ = false;
+        snd_error_ = false;
         rsp_base_snd_bytes_ = 0;
         rsp_body_snd_bytes_ = 0;
         close_file_fd();
+        stream_buf_.clear();
+        stream_chunk_.clear();
+        stream_buf_snd_bytes_ = 0;
+        stream_end_ = false;
+        stream_parked_ = false;
+        stream_waker_ = nullptr;
     }
 
 private:
@@ -88,20 +261,52 @@ private:
     static std::map<std::string, std::map<HttpMethod, HandleFunc> > router_;
 
 private:
-    ConnLoop *const connloop_;
+    // 连接可能在空闲时被迁移到其他ConnLoop
+    ConnLoop *connloop_;
     const ServerConf *const conf_;
     int cli_sock_;
+    // 只保存正在接收中的请求的数据，size()就是已接收的字节数，
+    // 没有正在接收的请求时不持有内存
     std::string buffer_r_;
-    std::size_t buffer_r_bytes_;
     HttpRequest req_;
     uint32_t req_parsed_bytes_;
     HttpResponse rsp_;
+    // 写事件可能因为缓冲区满多次触发，只有第一次需要路由
+    bool routed_;
+    bool body_opened_;
+    // 正在等待IO线程池中的任务，这期间不注册任何事件
+    bool io_pending_;
+    // IO线程池刚刚读取过文件（预读或者填充小文件缓存），数据在页缓存中，不需要再探测
+    bool skip_page_probe_;
+    // 本次请求中在IO线程池中打开的文件
+    std::vector<std::pair<std::string, OpenFilePtr> > resolved_files_;
     bool base_rsp_snd_;
     bool body_snd_;
+    // 响应无法继续发送（例如文件被截断），需要关闭连接
+    bool snd_error_;
+    // 本次可写事件中还能发送的字节数，见ServerConf::snd_budget_per_event_
+    std::size_t snd_budget_;
     uint32_t rsp_base_snd_bytes_;
     off_t rsp_body_snd_bytes_;
-    int file_fd_;
+    OpenFilePtr file_;
+    // 文件内容在内存中（压缩缓存，小文件缓存，mmap映射），不为空时代替file_发送
+    // 通过shared_ptr的别名构造指向数据本身，同时持有数据所属对象的引用
+    std::shared_ptr<const char> file_buf_;
     off_t file_size_;
+    std::vector<BodySegment> body_segs_;
+    std::size_t body_seg_idx_;
+    std::size_t seg_head_snd_bytes_;
+    off_t seg_snd_bytes_;
+    // 流式响应体的发送缓存，只有发送完毕后才会拉取下一块，
+    // 所以每个连接的内存占用是有上限的
+    std::string stream_buf_;
+    std::string stream_chunk_;
+    std::size_t stream_buf_snd_bytes_;
+    bool stream_end_;
+    // 生产者暂时没有数据，等待唤醒，这期间不注册任何事件
+    bool stream_parked_;
+    // 交给生产者的唤醒函数，每个流式响应创建一次
+    HttpResponse::StreamWaker stream_waker_;
 };
 
 #endif  // SRC_USER_CONN_H_
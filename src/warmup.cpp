@@ -0,0 +1,229 @@
+#include "warmup.h"
+
+#include <fstream>
+#include <stdexcept>
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "spdlog/spdlog.h"
+
+#include "filepathutil.h"
+
+
+WarmUp::WarmUp(const ServerConf &srv_conf, const ConnLoopShared &shared)
+    : srv_conf_(srv_conf)
+    , shared_(shared)
+    , pool_(nullptr)
+    , stop_(false)
+    , files_warmed_(0)
+    , pending_(0)
+{}
+
+WarmUp::FileList WarmUp::run(const std::vector<std::string> &hot_paths)
+{
+    SteadyClock::time_point deadline = SteadyClock::now()
+                                       + MilliSeconds(srv_conf_.warmup_budget_ms_);
+    std::size_t nthread = srv_conf_.io_nthread_ > 0 ? srv_conf_.io_nthread_ : 4;
+
+    {
+        // 线程池只在预热期间存在，析构时等待所有已经提交的任务结束，
+        // 超时后任务检查到stop_会立即返回
+        chaos::ThreadPool pool(nthread, nthread);
+        pool_ = &pool;
+
+        for (const std::string &path : hot_paths) {
+            submit_file(path, true);
+        }
+        if (srv_conf_.warmup_walk_) {
+            submit([this]() { walk_dir("/"); });
+        }
+
+        std::unique_lock<std::mutex> lock(mtx_);
+        if (!done_cond_.wait_until(lock, deadline, [this]() { return pending_ == 0; })) {
+            SPDLOG_WARN("warm-up exceeded its budget of {}ms, {} tasks abandoned",
+                        srv_conf_.warmup_budget_ms_, pending_);
+        }
+        stop_ = true;
+        lock.unlock();
+    }
+    pool_ = nullptr;
+
+    // 热点文件最后放入LRU，所以放在列表的前面，由调用者逆序插入
+    FileList files;
+    files.swap(hot_files_);
+    for (auto &file : walk_files_) {
+        if (files.size() >= srv_conf_.open_file_cache_max_) { break; }
+        files.push_back(std::move(file));
+    }
+    walk_files_.clear();
+    return files;
+}
+
+void WarmUp::submit(const std::function<void()> &task)
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (stop_) { return; }
+        ++pending_;
+    }
+
+    auto wrapped = [this, task]() {
+        if (!should_stop()) {
+            task();
+        }
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (--pending_ == 0) {
+            done_cond_.notify_all();
+        }
+    };
+
+    try {
+        pool_->post(std::move(wrapped));
+    } catch (const std::exception &) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        --pending_;
+    }
+}
+
+void WarmUp::submit_file(const std::string &path, bool hot)
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (seen_.size() >= srv_conf_.warmup_max_files_
+            || !seen_.insert(path).second) {
+            return;
+        }
+    }
+    submit([this, path, hot]() { warm_file(path, hot); });
+}
+
+void WarmUp::walk_dir(const std::string &dir)
+{
+    int fd = shared_.doc_root->open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        return;
+    }
+    DIR *dp = fdopendir(fd);
+    if (dp == nullptr) {
+        close(fd);
+        return;
+    }
+
+    std::string prefix = (dir == "/") ? dir : dir + "/";
+    struct dirent *ent = nullptr;
+    while (!should_stop() && (ent = readdir(dp)) != nullptr) {
+        // 跳过"."，".."以及隐藏文件（.git等）
+        if (ent->d_name[0] == '.') {
+            continue;
+        }
+
+        unsigned char type = ent->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(dirfd(dp), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                continue;
+            }
+            type = S_ISDIR(st.st_mode) ? DT_DIR : (S_ISLNK(st.st_mode) ? DT_LNK : DT_REG);
+        }
+
+        std::string path = prefix + ent->d_name;
+        if (type == DT_DIR) {
+            // 不进入指向目录的符号链接，避免循环
+            submit([this, path]() { walk_dir(path); });
+        } else if (type == DT_REG || type == DT_LNK) {
+            submit_file(path, false);
+        }
+    }
+
+    closedir(dp);
+}
+
+void WarmUp::warm_file(const std::string &path, bool hot)
+{
+    OpenFilePtr file = OpenFileCache::open_file(*shared_.doc_root, path);
+    if (file->err != 0 || file->is_dir) {
+        return;
+    }
+
+    ContentCache *content_cache = shared_.content_cache;
+    MmapCache *mmap_cache = shared_.mmap_cache;
+    if (content_cache != nullptr && file->size <= content_cache->max_file_size()) {
+        // 读取内容的同时也把它带进了页缓存
+        content_cache->get(path, *file);
+    } else {
+        if (mmap_cache != nullptr && file->size <= mmap_cache->max_file_size()) {
+            mmap_cache->get(path, *file);
+        }
+        OpenFileCache::warm(*file, 0, srv_conf_.warmup_readahead_bytes_);
+    }
+    ++files_warmed_;
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    FileList &files = hot ? hot_files_ : walk_files_;
+    if (files.size() < srv_conf_.open_file_cache_max_) {
+        files.emplace_back(path, file);
+    }
+}
+
+std::vector<std::string> WarmUp::load_hot_list(const std::string &file, std::size_t max)
+{
+    std::vector<std::string> paths;
+    std::ifstream in(file);
+    if (!in) {
+        return paths;
+    }
+
+    std::unordered_set<std::string> seen;
+    std::string line;
+    std::string path;
+    while (paths.size() < max && std::getline(in, line)) {
+        if (!normalize_url_path(line, path) || path.back() == '/') {
+            continue;
+        }
+        if (seen.insert(path).second) {
+            paths.push_back(path);
+        }
+    }
+    return paths;
+}
+
+bool WarmUp::save_hot_list(const std::string &file, const std::vector<std::string> &paths)
+{
+    // 多进程模式下每个工作进程都会保存，临时文件名加上pid避免互相覆盖
+    std::string tmp = file + "." + std::to_string(getpid()) + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::trunc);
+        for (const std::string &path : paths) {
+            out << path << '\n';
+        }
+        out.flush();
+        if (!out) {
+            unlink(tmp.c_str());
+            return false;
+        }
+    }
+    return rename(tmp.c_str(), file.c_str()) == 0;
+}
+
+std::vector<std::string> WarmUp::merge_hot_lists(const std::vector<std::vector<std::string> > &lists,
+                                                 std::size_t max)
+{
+    std::vector<std::string> merged;
+    std::unordered_set<std::string> seen;
+    for (std::size_t rank = 0; merged.size() < max; ++rank) {
+        bool any = false;
+        for (const auto &list : lists) {
+            if (rank >= list.size()) { continue; }
+            any = true;
+            if (merged.size() < max && seen.insert(list[rank]).second) {
+                merged.push_back(list[rank]);
+            }
+        }
+        if (!any) { break; }
+    }
+    return merged;
+}
@@ -0,0 +1,92 @@
+#ifndef SRC_WARMUP_H_
+#define SRC_WARMUP_H_
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <unordered_set>
+
+#include "serverconf.h"
+#include "filecache.h"
+#include "connloop.h"
+#include "ChaosThreadPool.h"
+
+
+/**
+ * @brief 启动时的缓存预热
+ *        重启后的第一批请求都要经历冷的open，stat和页缓存缺失，发布期间延迟会明显升高，
+ *        在开始监听之前完成预热，可以把这部分开销挪到服务就绪之前
+ *        1. 先回放上次退出时保存的热点路径列表，再并行遍历doc_root，
+ *           每个目录是线程池中的一个任务，子目录继续作为新任务提交
+ *        2. 对每个文件：打开并获取元数据；小文件读入内容缓存，MMAP模式下建立映射，
+ *           其他文件通过readahead预读开头的数据
+ *        3. 打开的文件作为结果返回，由调用者放入每个ConnLoop的打开文件缓存
+ *        4. 超过时间预算或者文件数量上限后停止，未完成的任务直接放弃
+ */
+class WarmUp
+{
+public:
+    using FileList = std::vector<std::pair<std::string, OpenFilePtr> >;
+
+public:
+    WarmUp(const ServerConf &srv_conf, const ConnLoopShared &shared);
+    WarmUp(const WarmUp&) = delete;
+    WarmUp(WarmUp&&) = delete;
+    WarmUp& operator=(const WarmUp&) = delete;
+    WarmUp& operator=(WarmUp&&) = delete;
+    ~WarmUp() = default;
+
+public:
+    /**
+     * @brief 执行预热，阻塞到完成或者超过时间预算
+     * @param hot_paths 优先预热的路径（规范化后的URL路径），按热度从高到低排列
+     * @return 打开的文件，热点路径在前，最多open_file_cache_max_个
+     */
+    FileList run(const std::vector<std::string> &hot_paths);
+    std::size_t files_warmed() const { return files_warmed_.load(); }
+
+    /**
+     * @brief 读取热点路径列表，每行一个路径，无效的路径会被忽略
+     * @param max 最多读取的路径数量
+     */
+    static std::vector<std::string> load_hot_list(const std::string &file, std::size_t max);
+    /**
+     * @brief 保存热点路径列表，先写入临时文件再rename，不会留下写了一半的列表
+     * @return 成功返回true
+     */
+    static bool save_hot_list(const std::string &file, const std::vector<std::string> &paths);
+    /**
+     * @brief 合并多个ConnLoop的热点路径，按排名交替取出并去重
+     * @param lists 每个列表按热度从高到低排列
+     */
+    static std::vector<std::string> merge_hot_lists(const std::vector<std::vector<std::string> > &lists,
+                                                    std::size_t max);
+
+private:
+    void submit(const std::function<void()> &task);
+    void submit_file(const std::string &path, bool hot);
+    void walk_dir(const std::string &dir);
+    void warm_file(const std::string &path, bool hot);
+    bool should_stop() const { return stop_.load(std::memory_order_relaxed); }
+
+private:
+    const ServerConf &srv_conf_;
+    const ConnLoopShared &shared_;
+    chaos::ThreadPool *pool_;
+    std::atomic<bool> stop_;
+    std::atomic<std::size_t> files_warmed_;
+    std::mutex mtx_;
+    std::condition_variable done_cond_;
+    // 已经提交但还没有完成的任务数量
+    std::size_t pending_;
+    // 热点路径和遍历可能重复，每个文件只处理一次
+    std::unordered_set<std::string> seen_;
+    FileList hot_files_;
+    FileList walk_files_;
+};
+
+#endif // SRC_WARMUP_H_
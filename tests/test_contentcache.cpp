@@ -0,0 +1,115 @@
+#include <gtest/gtest.h>
+#include "contentcache.h"
+
+#include <string>
+#include <fstream>
+#include <cstdio>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+
+static std::string make_temp_dir()
+{
+    char tmpl[] = "/tmp/lws_contentcache_XXXXXX";
+    return mkdtemp(tmpl) != nullptr ? tmpl : "";
+}
+
+static void write_file(const std::string &path, const std::string &data)
+{
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out << data;
+}
+
+
+TEST(ContentCacheTest, Invalidate) {
+    std::string dir = make_temp_dir();
+    ASSERT_FALSE(dir.empty());
+    write_file(dir + "/a.txt", "hello");
+    DocRoot doc_root(dir, 0, 0);
+    ContentCache cache(1024 * 1024, 1024);
+
+    OpenFilePtr file1 = OpenFileCache::open_file(doc_root, "/a.txt");
+    ContentCache::Buffer data1 = cache.get("/a.txt", *file1);
+    ASSERT_NE(data1, nullptr);
+    EXPECT_EQ(*data1, "hello");
+    EXPECT_EQ(cache.peek("/a.txt", *file1), data1);
+    EXPECT_GT(cache.bytes(), 0);
+
+    /**
+     * @brief 大小变化时失效，重新读取
+     */
+    write_file(dir + "/a.txt", "hello world");
+    OpenFilePtr file2 = OpenFileCache::open_file(doc_root, "/a.txt");
+    EXPECT_EQ(cache.peek("/a.txt", *file2), nullptr);
+    ContentCache::Buffer data2 = cache.get("/a.txt", *file2);
+    ASSERT_NE(data2, nullptr);
+    EXPECT_EQ(*data2, "hello world");
+
+    /**
+     * @brief 被替换成大小相同的文件，inode不同时失效
+     */
+    write_file(dir + "/tmp.txt", "HELLO WORLD");
+    ASSERT_EQ(rename((dir + "/tmp.txt").c_str(), (dir + "/a.txt").c_str()), 0);
+    OpenFilePtr file3 = OpenFileCache::open_file(doc_root, "/a.txt");
+    EXPECT_EQ(cache.peek("/a.txt", *file3), nullptr);
+    EXPECT_EQ(*cache.get("/a.txt", *file3), "HELLO WORLD");
+
+    /**
+     * @brief 只有mtime不同时失效
+     */
+    std::shared_ptr<OpenFile> file4 = std::make_shared<OpenFile>();
+    file4->ino = file3->ino;
+    file4->size = file3->size;
+    file4->mtime = file3->mtime;
+    EXPECT_NE(cache.peek("/a.txt", *file4), nullptr);
+    file4->mtime = file3->mtime + 1;
+    EXPECT_EQ(cache.peek("/a.txt", *file4), nullptr);
+
+    /**
+     * @brief 超过max_file_size的文件不缓存
+     */
+    write_file(dir + "/big.txt", std::string(2048, 'x'));
+    OpenFilePtr big = OpenFileCache::open_file(doc_root, "/big.txt");
+    EXPECT_EQ(cache.get("/big.txt", *big), nullptr);
+
+    unlink((dir + "/a.txt").c_str());
+    unlink((dir + "/big.txt").c_str());
+    rmdir(dir.c_str());
+}
+
+TEST(ContentCacheTest, ShardCap) {
+    std::string dir = make_temp_dir();
+    ASSERT_FALSE(dir.empty());
+    DocRoot doc_root(dir, 0, 0);
+    // 总上限平均分给每个分片，每个分片不超过max_bytes / 分片数量
+    const std::size_t max_bytes = 1024;
+    ContentCache cache(max_bytes, 4096);
+
+    /**
+     * @brief 超过一个分片上限的文件仍然返回内容，但是不会留在缓存中
+     */
+    write_file(dir + "/big.txt", std::string(2048, 'x'));
+    OpenFilePtr big = OpenFileCache::open_file(doc_root, "/big.txt");
+    ContentCache::Buffer data = cache.get("/big.txt", *big);
+    ASSERT_NE(data, nullptr);
+    EXPECT_EQ(data->size(), 2048);
+    EXPECT_EQ(cache.peek("/big.txt", *big), nullptr);
+    EXPECT_EQ(cache.bytes(), 0);
+
+    /**
+     * @brief 很多小文件，总大小不超过上限
+     */
+    for (int i = 0; i < 64; ++i) {
+        std::string path = "/f" + std::to_string(i) + ".txt";
+        write_file(dir + path, std::string(40, 'a'));
+        OpenFilePtr file = OpenFileCache::open_file(doc_root, path);
+        EXPECT_NE(cache.get(path, *file), nullptr);
+        EXPECT_LE(cache.bytes(), max_bytes);
+        unlink((dir + path).c_str());
+    }
+    EXPECT_GT(cache.bytes(), 0);
+
+    unlink((dir + "/big.txt").c_str());
+    rmdir(dir.c_str());
+}
@@ -0,0 +1,25 @@
+#include <gtest/gtest.h>
+#include "cpuutil.h"
+
+using namespace std;
+
+
+TEST(CpuUtilTest, ParseCpuList) {
+    EXPECT_EQ(CpuUtil::parse_cpu_list("0"), vector<int>({0}));
+    EXPECT_EQ(CpuUtil::parse_cpu_list("0-3"), vector<int>({0, 1, 2, 3}));
+    EXPECT_EQ(CpuUtil::parse_cpu_list("0-1,8,10-11\n"), vector<int>({0, 1, 8, 10, 11}));
+    EXPECT_EQ(CpuUtil::parse_cpu_list(" 3, 1-2 ,1"), vector<int>({1, 2, 3}));
+    EXPECT_TRUE(CpuUtil::parse_cpu_list("").empty());
+    EXPECT_TRUE(CpuUtil::parse_cpu_list("a").empty());
+    EXPECT_TRUE(CpuUtil::parse_cpu_list("3-1").empty());
+    EXPECT_TRUE(CpuUtil::parse_cpu_list("1-2x").empty());
+    EXPECT_TRUE(CpuUtil::parse_cpu_list("1x").empty());
+    EXPECT_TRUE(CpuUtil::parse_cpu_list("-1").empty());
+}
+
+TEST(CpuUtilTest, DefaultNThread) {
+    int n = CpuUtil::default_nthread();
+    EXPECT_GE(n, 1);
+    EXPECT_LE(n, CpuUtil::affinity_cpu_count());
+    EXPECT_EQ(CpuUtil::default_nthread(1), 1);
+}
@@ -0,0 +1,40 @@
+#include <gtest/gtest.h>
+#include "fdutil.h"
+
+#include <sys/stat.h>
+
+using namespace std;
+
+
+TEST(FdUtilTest, SendRecvFds) {
+    int chan[2] = {-1, -1};
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, chan), 0);
+    int pipe_fds[2] = {-1, -1};
+    ASSERT_EQ(pipe(pipe_fds), 0);
+
+    ASSERT_GT(FdUtil::send_fds(chan[0], vector<int>{pipe_fds[0], pipe_fds[1]}), 0);
+    vector<int> fds;
+    ASSERT_EQ(FdUtil::recv_fds(chan[1], fds), 0);
+    ASSERT_EQ(fds.size(), 2u);
+
+    // 收到的是同一个打开的文件，并且设置了FD_CLOEXEC
+    struct stat st_sent, st_recv;
+    ASSERT_EQ(fstat(pipe_fds[0], &st_sent), 0);
+    ASSERT_EQ(fstat(fds[0], &st_recv), 0);
+    EXPECT_EQ(st_sent.st_ino, st_recv.st_ino);
+    EXPECT_TRUE(fcntl(fds[0], F_GETFD) & FD_CLOEXEC);
+    ASSERT_EQ(write(fds[1], "x", 1), 1);
+    char c = 0;
+    ASSERT_EQ(read(pipe_fds[0], &c, 1), 1);
+    EXPECT_EQ(c, 'x');
+    for (int fd : fds) { close(fd); }
+
+    EXPECT_EQ(FdUtil::send_fds(chan[0], vector<int>()), -1);
+
+    // 对端关闭
+    close(chan[0]);
+    EXPECT_EQ(FdUtil::recv_fds(chan[1], fds), -1);
+    EXPECT_TRUE(fds.empty());
+
+    for (int fd : {chan[1], pipe_fds[0], pipe_fds[1]}) { close(fd); }
+}
@@ -0,0 +1,150 @@
+#include <gtest/gtest.h>
+#include "filecache.h"
+
+#include <string>
+#include <fstream>
+#include <cstdio>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+
+static std::string make_temp_dir()
+{
+    char tmpl[] = "/tmp/lws_filecache_XXXXXX";
+    return mkdtemp(tmpl) != nullptr ? tmpl : "";
+}
+
+static void write_file(const std::string &path, const std::string &data)
+{
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out << data;
+}
+
+static void remove_temp_dir(const std::string &dir)
+{
+    for (const char *name : {"a.txt", "b.txt", "new.txt", "tmp.txt"}) {
+        unlink((dir + "/" + name).c_str());
+    }
+    rmdir(dir.c_str());
+}
+
+
+TEST(OpenFileCacheTest, Revalidate) {
+    std::string dir = make_temp_dir();
+    ASSERT_FALSE(dir.empty());
+    write_file(dir + "/a.txt", "hello");
+    DocRoot doc_root(dir, 0, 0);
+
+    /**
+     * @brief 有效期内命中，不会感知文件的变化
+     */
+    OpenFileCache cache1(&doc_root, 16, 60 * 1000);
+    OpenFilePtr file1 = cache1.open("/a.txt");
+    EXPECT_EQ(file1->err, 0);
+    EXPECT_EQ(file1->size, 5);
+    write_file(dir + "/a.txt", "hello world");
+    EXPECT_EQ(cache1.lookup("/a.txt"), file1);
+
+    /**
+     * @brief 过期后重新校验，大小变化时失效，重新打开
+     */
+    OpenFileCache cache2(&doc_root, 16, 0);
+    OpenFilePtr file2 = cache2.open("/a.txt");
+    EXPECT_EQ(file2->size, 11);
+    EXPECT_EQ(cache2.lookup("/a.txt"), file2);      // 没有变化，继续使用
+    write_file(dir + "/a.txt", "hello");
+    EXPECT_EQ(cache2.lookup("/a.txt"), nullptr);
+    OpenFilePtr file3 = cache2.open("/a.txt");
+    EXPECT_NE(file3, file2);
+    EXPECT_EQ(file3->size, 5);
+
+    /**
+     * @brief 被替换成大小相同的文件，mtime可能在同一秒内，inode不同时失效
+     */
+    write_file(dir + "/tmp.txt", "world");
+    ASSERT_EQ(rename((dir + "/tmp.txt").c_str(), (dir + "/a.txt").c_str()), 0);
+    EXPECT_EQ(cache2.lookup("/a.txt"), nullptr);
+    OpenFilePtr file4 = cache2.open("/a.txt");
+    EXPECT_NE(file4->ino, file3->ino);
+
+    /**
+     * @brief 不存在的文件也会被缓存，创建后失效
+     */
+    OpenFilePtr file5 = cache2.open("/new.txt");
+    EXPECT_EQ(file5->err, ENOENT);
+    EXPECT_EQ(cache2.lookup("/new.txt"), file5);    // 仍然不存在
+    write_file(dir + "/new.txt", "new");
+    EXPECT_EQ(cache2.lookup("/new.txt"), nullptr);
+    EXPECT_EQ(cache2.open("/new.txt")->err, 0);
+
+    remove_temp_dir(dir);
+}
+
+TEST(OpenFileCacheTest, Insert) {
+    std::string dir = make_temp_dir();
+    ASSERT_FALSE(dir.empty());
+    write_file(dir + "/a.txt", "hello");
+    DocRoot doc_root(dir, 0, 0);
+    OpenFileCache cache(&doc_root, 16, 60 * 1000);
+
+    /**
+     * @brief 暂时性的错误不缓存，同时删除旧的条目
+     */
+    OpenFilePtr file1 = cache.open("/a.txt");
+    EXPECT_EQ(cache.size(), 1);
+    std::shared_ptr<OpenFile> emfile = std::make_shared<OpenFile>();
+    emfile->err = EMFILE;
+    cache.insert("/a.txt", emfile);
+    EXPECT_EQ(cache.lookup("/a.txt"), nullptr);
+    EXPECT_EQ(cache.size(), 0);
+
+    /**
+     * @brief 不存在的文件缓存
+     */
+    std::shared_ptr<OpenFile> enoent = std::make_shared<OpenFile>();
+    enoent->err = ENOENT;
+    cache.insert("/b.txt", enoent);
+    EXPECT_EQ(cache.lookup("/b.txt"), enoent);
+
+    /**
+     * @brief 不缓存时open总是重新打开
+     */
+    OpenFileCache cache_off(&doc_root, 0, 60 * 1000);
+    OpenFilePtr file2 = cache_off.open("/a.txt");
+    EXPECT_EQ(file2->err, 0);
+    EXPECT_NE(cache_off.open("/a.txt"), file2);
+    EXPECT_EQ(cache_off.size(), 0);
+
+    remove_temp_dir(dir);
+}
+
+TEST(OpenFileCacheTest, Invalidate) {
+    std::string dir = make_temp_dir();
+    ASSERT_FALSE(dir.empty());
+    write_file(dir + "/a.txt", "hello");
+    write_file(dir + "/b.txt", "world");
+    DocRoot doc_root(dir, 0, 0);
+    OpenFileCache cache(&doc_root, 16, 60 * 1000);
+
+    OpenFilePtr file_a = cache.open("/a.txt");
+    OpenFilePtr file_b = cache.open("/b.txt");
+    // 同一个文件可以被多个key缓存
+    cache.insert("/alias.txt", file_a);
+    EXPECT_EQ(cache.size(), 3);
+
+    // 删除所有指向file_a的条目，其他的不受影响
+    cache.invalidate(*file_a);
+    EXPECT_EQ(cache.size(), 1);
+    EXPECT_EQ(cache.lookup("/a.txt"), nullptr);
+    EXPECT_EQ(cache.lookup("/alias.txt"), nullptr);
+    EXPECT_EQ(cache.lookup("/b.txt"), file_b);
+
+    // 正在发送的连接仍然持有文件
+    EXPECT_GE(file_a->fd, 0);
+    OpenFilePtr file_a2 = cache.open("/a.txt");
+    EXPECT_NE(file_a2, file_a);
+
+    remove_temp_dir(dir);
+}
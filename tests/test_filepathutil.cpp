@@ -90,3 +90,28 @@ TEST(FilePathUtilTest, CombineTwoPath) {
     newpath = combine_two_path(path1, path2);
     EXPECT_EQ(newpath, "/aaabbb");
 }
+
+TEST(FilePathUtilTest, NormalizeUrlPath) {
+    std::string out;
+
+    EXPECT_TRUE(normalize_url_path("/", out));
+    EXPECT_EQ(out, "/");
+    EXPECT_TRUE(normalize_url_path("/index.html", out));
+    EXPECT_EQ(out, "/index.html");
+    EXPECT_TRUE(normalize_url_path("/a//b/./c.html", out));
+    EXPECT_EQ(out, "/a/b/c.html");
+    EXPECT_TRUE(normalize_url_path("/a/b/../c.html", out));
+    EXPECT_EQ(out, "/a/c.html");
+    EXPECT_TRUE(normalize_url_path("/a/b/", out));
+    EXPECT_EQ(out, "/a/b/");
+    EXPECT_TRUE(normalize_url_path("/a/..", out));
+    EXPECT_EQ(out, "/");
+    EXPECT_TRUE(normalize_url_path("/..a/b..", out));
+    EXPECT_EQ(out, "/..a/b..");
+
+    // 超出根目录
+    EXPECT_FALSE(normalize_url_path("/..", out));
+    EXPECT_FALSE(normalize_url_path("/a/../../etc/passwd", out));
+    EXPECT_FALSE(normalize_url_path("a/b", out));
+    EXPECT_FALSE(normalize_url_path("", out));
+}
@@ -210,3 +210,277 @@ TEST(HttpRequestTest, Parse) {
     EXPECT_TRUE(httpReq14.parse_complete());
     EXPECT_FALSE(httpReq14.is_bad_req());
 }
+
+TEST(HttpRequestTest, HeaderFieldsCap) {
+    std::string data = "GET / HTTP/1.1\r\n";
+    for (std::size_t i = 0; i < HTTP_MAX_HEADER_FIELDS; ++i) {
+        data += "X-H" + std::to_string(i) + ": v\r\n";
+    }
+
+    HttpRequest req1;
+    req1.parse(data + "\r\n", 0);
+    EXPECT_TRUE(req1.parse_complete());
+    EXPECT_FALSE(req1.is_bad_req());
+
+    // 超过上限的请求是非法请求
+    HttpRequest req2;
+    req2.parse(data + "X-Extra: v\r\n\r\n", 0);
+    EXPECT_TRUE(req2.parse_complete());
+    EXPECT_TRUE(req2.is_bad_req());
+}
+
+TEST(HttpResponseTest, BodyStream) {
+    /**
+     * @brief HTTP/1.1使用chunked编码，不带Content-Length
+     */
+    HttpRequest req1;
+    std::string data1 = "GET /stream HTTP/1.1\r\n"
+                        "Host: www.example.com\r\n"
+                        "Connection: keep-alive\r\n"
+                        "\r\n";
+    req1.parse(data1, 0);
+    HttpResponse rsp1(req1);
+    int calls = 0;
+    rsp1.set_body_stream(
+        [&calls](std::string &chunk, std::size_t max_bytes, const HttpResponse::StreamWaker &) -> bool {
+            chunk.append(max_bytes < 4 ? max_bytes : 4, 'a');
+            return ++calls < 3;
+        },
+        HttpContentType::JSON_TYPE
+    );
+    std::string val;
+    EXPECT_TRUE(rsp1.body_is_stream());
+    EXPECT_TRUE(rsp1.body_is_chunked());
+    EXPECT_FALSE(rsp1.get_header("Content-Length", val));
+    EXPECT_TRUE(rsp1.get_header("Transfer-Encoding", val));
+    EXPECT_EQ(val, "chunked");
+    EXPECT_TRUE(rsp1.get_header("Connection", val));
+    EXPECT_EQ(val, "keep-alive");
+
+    std::string chunk;
+    EXPECT_TRUE(rsp1.produce_body(chunk, 16));
+    EXPECT_EQ(chunk, "aaaa");
+    chunk.clear();
+    EXPECT_TRUE(rsp1.produce_body(chunk, 16));
+    chunk.clear();
+    EXPECT_FALSE(rsp1.produce_body(chunk, 16));
+
+    // 改回普通响应体后，不再是chunked
+    rsp1.set_body_bin("abc", HttpContentType::HTML_TYPE);
+    EXPECT_FALSE(rsp1.body_is_stream());
+    EXPECT_FALSE(rsp1.get_header("Transfer-Encoding", val));
+    EXPECT_TRUE(rsp1.get_header("Content-Length", val));
+    EXPECT_EQ(val, "3");
+
+    /**
+     * @brief HTTP/1.0不支持chunked，发送完后需要关闭连接
+     */
+    HttpRequest req2;
+    std::string data2 = "GET /stream HTTP/1.0\r\n"
+                        "Connection: keep-alive\r\n"
+                        "\r\n";
+    req2.parse(data2, 0);
+    HttpResponse rsp2(req2);
+    rsp2.set_body_stream(
+        [](std::string &, std::size_t, const HttpResponse::StreamWaker &) -> bool { return false; },
+        HttpContentType::HTML_TYPE
+    );
+    EXPECT_TRUE(rsp2.body_is_stream());
+    EXPECT_FALSE(rsp2.body_is_chunked());
+    EXPECT_FALSE(rsp2.get_header("Transfer-Encoding", val));
+    EXPECT_TRUE(rsp2.get_header("Connection", val));
+    EXPECT_EQ(val, "close");
+}
+
+TEST(HttpRequestTest, AcceptEncoding) {
+    HttpRequest req1;
+    std::string data1 = "GET /index.html HTTP/1.1\r\n"
+                        "Accept-Encoding: gzip, deflate;q=0.5, br;q=0\r\n"
+                        "\r\n";
+    req1.parse(data1, 0);
+    EXPECT_TRUE(req1.accept_encoding("gzip"));
+    EXPECT_TRUE(req1.accept_encoding("deflate"));
+    EXPECT_FALSE(req1.accept_encoding("br"));
+    EXPECT_FALSE(req1.accept_encoding("zstd"));
+
+    // 通配符
+    HttpRequest req2;
+    std::string data2 = "GET /index.html HTTP/1.1\r\n"
+                        "Accept-Encoding: GZIP;q=0.000, *\r\n"
+                        "\r\n";
+    req2.parse(data2, 0);
+    EXPECT_FALSE(req2.accept_encoding("gzip"));
+    EXPECT_TRUE(req2.accept_encoding("br"));
+
+    // 没有Accept-Encoding
+    HttpRequest req3;
+    std::string data3 = "GET /index.html HTTP/1.1\r\n"
+                        "\r\n";
+    req3.parse(data3, 0);
+    EXPECT_FALSE(req3.accept_encoding("gzip"));
+}
+
+TEST(HttpRangeTest, Parse) {
+    std::vector<HttpRange> ranges;
+
+    // 单个Range
+    EXPECT_EQ(parse_range_header("bytes=0-499", 1000, ranges), HttpRangeResult::OK);
+    ASSERT_EQ(ranges.size(), 1);
+    EXPECT_EQ(ranges[0].first, 0);
+    EXPECT_EQ(ranges[0].last, 499);
+    EXPECT_EQ(ranges[0].length(), 500);
+
+    // 开放结尾，后缀，超出文件末尾的截断
+    EXPECT_EQ(parse_range_header("bytes=500-, -100, 900-2000", 1000, ranges), HttpRangeResult::OK);
+    ASSERT_EQ(ranges.size(), 3);
+    EXPECT_EQ(ranges[0].first, 500);
+    EXPECT_EQ(ranges[0].last, 999);
+    EXPECT_EQ(ranges[1].first, 900);
+    EXPECT_EQ(ranges[1].last, 999);
+    EXPECT_EQ(ranges[2].last, 999);
+
+    // 后缀大于文件大小，返回整个文件
+    EXPECT_EQ(parse_range_header("bytes=-5000", 1000, ranges), HttpRangeResult::OK);
+    ASSERT_EQ(ranges.size(), 1);
+    EXPECT_EQ(ranges[0].first, 0);
+    EXPECT_EQ(ranges[0].last, 999);
+
+    // 无法满足
+    EXPECT_EQ(parse_range_header("bytes=1000-", 1000, ranges), HttpRangeResult::UNSATISFIABLE);
+    EXPECT_EQ(parse_range_header("bytes=-0", 1000, ranges), HttpRangeResult::UNSATISFIABLE);
+    // 部分无法满足，忽略无法满足的部分
+    EXPECT_EQ(parse_range_header("bytes=2000-3000,0-0", 1000, ranges), HttpRangeResult::OK);
+    EXPECT_EQ(ranges.size(), 1);
+
+    // 无法识别，忽略Range
+    EXPECT_EQ(parse_range_header("items=0-1", 1000, ranges), HttpRangeResult::NONE);
+    EXPECT_EQ(parse_range_header("bytes=5-1", 1000, ranges), HttpRangeResult::NONE);
+    EXPECT_EQ(parse_range_header("bytes=a-b", 1000, ranges), HttpRangeResult::NONE);
+    EXPECT_EQ(parse_range_header("bytes=-", 1000, ranges), HttpRangeResult::NONE);
+    EXPECT_EQ(parse_range_header("bytes=+1-2", 1000, ranges), HttpRangeResult::NONE);
+    std::string many = "bytes=0-0";
+    for (std::size_t i = 0; i < HTTP_MAX_RANGES; ++i) {
+        many += ",0-0";
+    }
+    EXPECT_EQ(parse_range_header(many, 1000, ranges), HttpRangeResult::NONE);
+}
+
+TEST(HttpETagTest, Match) {
+    EXPECT_EQ(make_etag(0x5f3e, 0x1a2b), "\"5f3e-1a2b\"");
+
+    const std::string etag = "\"5f3e-1a2b\"";
+    // 弱比较，If-None-Match
+    EXPECT_TRUE(etag_match("\"5f3e-1a2b\"", etag, true));
+    EXPECT_TRUE(etag_match("W/\"5f3e-1a2b\"", etag, true));
+    EXPECT_TRUE(etag_match("\"aaa\", \"5f3e-1a2b\"", etag, true));
+    EXPECT_TRUE(etag_match("*", etag, true));
+    EXPECT_TRUE(etag_match("\"5f3e-1a2b\"", "W/" + etag, true));
+    EXPECT_FALSE(etag_match("\"5f3e-1a2c\"", etag, true));
+    EXPECT_FALSE(etag_match("5f3e-1a2b", etag, true));
+    EXPECT_FALSE(etag_match("", etag, true));
+
+    // 强比较，If-Range，弱ETag永远不匹配
+    EXPECT_TRUE(etag_match("\"5f3e-1a2b\"", etag, false));
+    EXPECT_FALSE(etag_match("W/\"5f3e-1a2b\"", etag, false));
+    EXPECT_FALSE(etag_match("\"5f3e-1a2b\"", "W/" + etag, false));
+}
+
+TEST(HttpResponseTest, ServiceUnavailable) {
+    HttpRequest req;
+    req.parse("GET / HTTP/1.1\r\nConnection: keep-alive\r\n\r\n", 0);
+    HttpResponse rsp = err_handler_503(req);
+    std::string val;
+    EXPECT_EQ(rsp.get_base_rsp().compare(0, 33, "HTTP/1.1 503 Service Unavailable\r"), 0);
+    EXPECT_TRUE(rsp.get_header("Connection", val));
+    EXPECT_EQ(val, "close");
+    EXPECT_EQ(rsp.get_body_kind(), HttpResponse::BodyKind::BIN);
+}
+
+TEST(HttpRequestTest, ResetReuse) {
+    /**
+     * @brief keep-alive连接上复用同一个HttpRequest，上一个请求的字段不能残留
+     */
+    HttpRequest req;
+    std::string data = "POST /submit?a=1&b=2 HTTP/1.1\r\n"
+                       "Host: localhost\r\n"
+                       "Content-Length: 5\r\n"
+                       "\r\n"
+                       "hello";
+    EXPECT_EQ(req.parse(data, 0), data.size());
+    ASSERT_TRUE(req.parse_complete());
+    EXPECT_EQ(req.get_body(), "hello");
+
+    req.reset();
+    data = "GET /index.html?c=3 HTTP/1.1\r\n"
+           "Connection: keep-alive\r\n"
+           "\r\n";
+    EXPECT_EQ(req.parse(data, 0), data.size());
+    ASSERT_TRUE(req.parse_complete());
+    EXPECT_FALSE(req.is_bad_req());
+    std::string val;
+    EXPECT_FALSE(req.get_header("Host", val));
+    EXPECT_FALSE(req.get_header("Content-Length", val));
+    EXPECT_FALSE(req.get_param("a", val));
+    EXPECT_TRUE(req.get_param("c", val));
+    EXPECT_EQ(val, "3");
+    EXPECT_TRUE(req.get_header("Connection", val));
+    EXPECT_EQ(val, "keep-alive");
+    EXPECT_EQ(req.get_body(), "");
+
+    // 头部行中没有": "是非法请求
+    req.reset();
+    data = "GET / HTTP/1.1\r\nHost localhost\r\n\r\n";
+    req.parse(data, 0);
+    EXPECT_TRUE(req.parse_complete());
+    EXPECT_TRUE(req.is_bad_req());
+}
+
+TEST(HttpRequestTest, ResponseReuse) {
+    /**
+     * @brief reset(req)和用req构造的结果相同，上一个响应的字段不能残留
+     */
+    HttpRequest req;
+    std::string data = "GET /index.html HTTP/1.1\r\n"
+                       "Connection: keep-alive\r\n"
+                       "\r\n";
+    req.parse(data, 0);
+    HttpResponse fresh(req);
+    static_file_handler(req, fresh);
+
+    HttpResponse rsp(req);
+    rsp.set_code(HttpCode::NOT_FOUND);
+    rsp.header_oper(HttpResponse::HeaderOper::ADD, "Location", "/a/");
+    rsp.set_body_bin("not found", HttpContentType::HTML_TYPE);
+    rsp.get_base_rsp();
+    rsp.reset(req);
+    static_file_handler(req, rsp);
+    EXPECT_EQ(rsp.get_base_rsp(), fresh.get_base_rsp());
+    EXPECT_EQ(rsp.get_body(), "/index.html");
+    EXPECT_TRUE(rsp.body_is_file());
+
+    /**
+     * @brief assign复制处理函数返回的响应
+     */
+    rsp.assign(err_handler_404(req));
+    HttpResponse err = err_handler_404(req);
+    EXPECT_EQ(rsp.get_code(), HttpCode::NOT_FOUND);
+    EXPECT_EQ(rsp.get_base_rsp(), err.get_base_rsp());
+    EXPECT_EQ(rsp.get_body(), err.get_body());
+    EXPECT_FALSE(rsp.body_is_file());
+}
+
+TEST(HttpRequestTest, MemBytes) {
+    /**
+     * @brief reset后保留小的容量，很大的请求体被释放
+     */
+    HttpRequest req;
+    std::string data = "POST /submit HTTP/1.1\r\n"
+                       "Content-Length: 100000\r\n"
+                       "\r\n" + std::string(100000, 'a');
+    req.parse(data, 0);
+    ASSERT_TRUE(req.parse_complete());
+    EXPECT_GE(req.mem_bytes(), 100000);
+
+    req.reset();
+    EXPECT_LT(req.mem_bytes(), 8 * 1024);
+}
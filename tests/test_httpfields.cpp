@@ -0,0 +1,73 @@
+#include <gtest/gtest.h>
+#include "httpfields.h"
+
+#include <string>
+
+
+TEST(HttpFieldsTest, FuncTest) {
+    /**
+     * @brief 插入，查找，同名字段保留第一个
+     */
+    HttpFields fields(4);
+    EXPECT_TRUE(fields.emplace("Host", "localhost"));
+    EXPECT_TRUE(fields.emplace("Connection", "keep-alive"));
+    EXPECT_FALSE(fields.emplace("Host", "example.com"));
+    ASSERT_NE(fields.find("Host"), nullptr);
+    EXPECT_EQ(*fields.find("Host"), "localhost");
+    EXPECT_EQ(fields.find("Accept"), nullptr);
+    EXPECT_EQ(fields.size(), 2);
+
+    /**
+     * @brief operator[]修改或者插入，删除后保持顺序
+     */
+    fields["Host"] = "example.com";
+    fields["Accept"] = "*/*";
+    EXPECT_EQ(*fields.find("Host"), "example.com");
+    EXPECT_TRUE(fields.erase("Host"));
+    EXPECT_FALSE(fields.erase("Host"));
+    std::string order;
+    for (const auto &kv : fields) {
+        order += kv.first + ";";
+    }
+    EXPECT_EQ(order, "Connection;Accept;");
+
+    /**
+     * @brief clear后复用槽位，字符串的容量保留下来
+     */
+    const std::string long_val(64, 'x');
+    fields["User-Agent"] = long_val;
+    std::size_t retained = fields.retained_bytes();
+    fields.clear();
+    EXPECT_TRUE(fields.empty());
+    EXPECT_EQ(fields.find("Connection"), nullptr);
+    EXPECT_EQ(fields.retained_bytes(), retained);
+    // 同样的下一个请求不再分配内存
+    EXPECT_TRUE(fields.emplace("Connection", "close"));
+    EXPECT_TRUE(fields.emplace("Accept", "*/*"));
+    EXPECT_TRUE(fields.emplace("Referer", long_val));
+    EXPECT_EQ(fields.retained_bytes(), retained);
+    EXPECT_EQ(*fields.find("Referer"), long_val);
+
+    /**
+     * @brief 超过上限时释放
+     */
+    fields.clear();
+    fields.trim(retained);
+    EXPECT_EQ(fields.retained_bytes(), retained);
+    fields.trim(0);
+    EXPECT_EQ(fields.retained_bytes(), 0);
+    EXPECT_TRUE(fields.emplace("Host", "localhost"));
+    EXPECT_EQ(*fields.find("Host"), "localhost");
+
+    /**
+     * @brief assign按顺序复制，写入已有的槽位
+     */
+    HttpFields other({{"Content-Type", "text/html"}, {"Content-Length", "3"}});
+    fields.assign(other);
+    EXPECT_EQ(fields.size(), 2);
+    EXPECT_EQ(fields.find("Host"), nullptr);
+    EXPECT_EQ(fields.begin()->first, "Content-Type");
+    EXPECT_EQ(*fields.find("Content-Length"), "3");
+    fields.assign(fields);
+    EXPECT_EQ(fields.size(), 2);
+}
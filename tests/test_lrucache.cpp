@@ -0,0 +1,57 @@
+#include <gtest/gtest.h>
+#include "lrucache.h"
+
+#include <string>
+#include <vector>
+
+
+TEST(LruCacheTest, FuncTest) {
+    /**
+     * @brief 按条目数淘汰
+     */
+    LruCache<std::string, int> cache1(0, 2);
+    cache1.put("a", 1);
+    cache1.put("b", 2);
+    EXPECT_NE(cache1.get("a"), nullptr);   // a变为最近访问
+    cache1.put("c", 3);                    // 淘汰b
+    EXPECT_EQ(cache1.get("b"), nullptr);
+    ASSERT_NE(cache1.get("a"), nullptr);
+    EXPECT_EQ(*cache1.get("a"), 1);
+    EXPECT_EQ(cache1.size(), 2);
+
+    /**
+     * @brief 按cost淘汰，替换已存在的条目
+     */
+    LruCache<std::string, std::string> cache2(10);
+    cache2.put("x", "xxxx", 4);
+    cache2.put("y", "yyyy", 4);
+    EXPECT_EQ(cache2.cost(), 8);
+    cache2.put("x", "xx", 2);
+    EXPECT_EQ(cache2.cost(), 6);
+    cache2.put("z", "zzzzz", 5);           // 超过10，淘汰最久未访问的y
+    EXPECT_EQ(cache2.peek("y"), nullptr);
+    EXPECT_EQ(cache2.cost(), 7);
+    // 单个条目超过上限，会被直接淘汰
+    cache2.put("big", "0123456789ab", 12);
+    EXPECT_EQ(cache2.peek("big"), nullptr);
+    EXPECT_EQ(cache2.cost(), 0);
+
+    /**
+     * @brief 删除和遍历顺序
+     */
+    LruCache<int, int> cache3(0);
+    cache3.put(1, 1);
+    cache3.put(2, 2);
+    cache3.put(3, 3);
+    EXPECT_TRUE(cache3.erase(2));
+    EXPECT_FALSE(cache3.erase(2));
+    cache3.get(1);
+    std::vector<int> order;
+    cache3.for_each([&order](const int &key, const int &) {
+        order.push_back(key);
+        return true;
+    });
+    EXPECT_EQ(order, std::vector<int>({1, 3}));
+    cache3.clear();
+    EXPECT_EQ(cache3.size(), 0);
+}
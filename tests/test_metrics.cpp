@@ -0,0 +1,70 @@
+#include <gtest/gtest.h>
+#include "metrics.h"
+
+#include <string>
+
+
+TEST(MetricsTest, EventsBucket) {
+    /**
+     * @brief 第0个桶为0个事件，第i个桶的上界为2^(i-1)
+     */
+    EXPECT_EQ(LoopMetrics::events_bucket(0), 0);
+    EXPECT_EQ(LoopMetrics::events_bucket(1), 1);
+    EXPECT_EQ(LoopMetrics::events_bucket(2), 2);
+    EXPECT_EQ(LoopMetrics::events_bucket(3), 3);
+    EXPECT_EQ(LoopMetrics::events_bucket(4), 3);
+    EXPECT_EQ(LoopMetrics::events_bucket(5), 4);
+    EXPECT_EQ(LoopMetrics::events_bucket(1024), 11);
+    EXPECT_EQ(LoopMetrics::events_bucket(1025), 12);
+    EXPECT_EQ(LoopMetrics::events_bucket(1 << 20), EVENTS_HIST_BUCKETS - 1);
+}
+
+TEST(MetricsTest, HttpCodeIndex) {
+    for (std::size_t i = 0; i < HTTP_CODE_NUM; ++i) {
+        EXPECT_EQ(http_code_index(http_code_at(i)), i);
+    }
+    EXPECT_EQ(http_code_at(http_code_index(HttpCode::NOT_FOUND)), HttpCode::NOT_FOUND);
+    EXPECT_EQ(http_code_at(HTTP_CODE_NUM), HttpCode::UNKNOWN);
+}
+
+TEST(MetricsTest, LoopMetrics) {
+    LoopMetrics metrics;
+    metrics.record_request(HttpMethod::GET, HttpCode::OK);
+    metrics.record_request(HttpMethod::GET, HttpCode::OK);
+    metrics.record_request(HttpMethod::HEAD, HttpCode::NOT_MODIFIED);
+    std::size_t get = static_cast<std::size_t>(HttpMethod::GET);
+    std::size_t head = static_cast<std::size_t>(HttpMethod::HEAD);
+    EXPECT_EQ(metrics.requests[get][http_code_index(HttpCode::OK)].get(), 2);
+    EXPECT_EQ(metrics.requests[head][http_code_index(HttpCode::NOT_MODIFIED)].get(), 1);
+    EXPECT_EQ(metrics.requests[get][http_code_index(HttpCode::NOT_MODIFIED)].get(), 0);
+
+    metrics.record_events(0);
+    metrics.record_events(3);
+    metrics.record_events(3);
+    EXPECT_EQ(metrics.events_hist[0].get(), 1);
+    EXPECT_EQ(metrics.events_hist[3].get(), 2);
+    EXPECT_EQ(metrics.events_sum.get(), 6);
+
+    /**
+     * @brief 前后的填充保证计数器不和相邻对象共享缓存行
+     */
+    EXPECT_GE(sizeof(LoopMetrics), 2 * CACHE_LINE_BYTES);
+}
+
+TEST(MetricsTest, Writer) {
+    MetricsWriter w;
+    w.family("lws_test_total", "Test counter.", "counter");
+    w.sample("lws_test_total", "", static_cast<uint64_t>(3));
+    w.sample("lws_test_total", "method=\"GET\",code=\"200\"", static_cast<uint64_t>(5));
+    w.family("lws_test_seconds", "Test gauge.", "gauge");
+    w.sample("lws_test_seconds", "", 0.25);
+
+    EXPECT_EQ(w.str(),
+              "# HELP lws_test_total Test counter.\n"
+              "# TYPE lws_test_total counter\n"
+              "lws_test_total 3\n"
+              "lws_test_total{method=\"GET\",code=\"200\"} 5\n"
+              "# HELP lws_test_seconds Test gauge.\n"
+              "# TYPE lws_test_seconds gauge\n"
+              "lws_test_seconds 0.25\n");
+}
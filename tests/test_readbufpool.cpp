@@ -0,0 +1,58 @@
+#include <gtest/gtest.h>
+#include "readbufpool.h"
+
+#include <string>
+
+
+TEST(ReadBufPoolTest, FuncTest) {
+    ReadBufPool pool(1);
+
+    /**
+     * @brief 小请求留在字符串内部，不占用池中的缓冲区
+     */
+    std::string buf;
+    pool.reserve(buf, 8);
+    buf.append("GET / \r\n");
+    pool.release(buf);
+    EXPECT_EQ(pool.pooled_bytes(), 0);
+
+    /**
+     * @brief 按等级借出，归还后复用
+     */
+    pool.reserve(buf, 100);
+    EXPECT_GE(buf.capacity(), READ_BUF_CLASS_BYTES[0]);
+    buf.append(100, 'a');
+    const char *data = buf.data();
+    pool.release(buf);
+    EXPECT_TRUE(buf.empty());
+    EXPECT_EQ(pool.pooled_bytes(), READ_BUF_CLASS_BYTES[0]);
+    pool.reserve(buf, 100);
+    EXPECT_EQ(buf.data(), data);
+    EXPECT_EQ(pool.pooled_bytes(), 0);
+
+    /**
+     * @brief 容量不够时换成更大一级的，保留已有的数据
+     */
+    buf.append(100, 'b');
+    pool.reserve(buf, READ_BUF_CLASS_BYTES[0]);
+    EXPECT_GE(buf.capacity(), READ_BUF_CLASS_BYTES[1]);
+    EXPECT_EQ(buf, std::string(100, 'b'));
+    // 旧的归还到第一级
+    EXPECT_EQ(pool.pooled_bytes(), READ_BUF_CLASS_BYTES[0]);
+
+    /**
+     * @brief 每个等级最多保留max_free个，超过最大等级的直接释放
+     */
+    std::string other;
+    pool.reserve(other, 100);
+    std::string third;
+    pool.reserve(third, 100);
+    pool.release(other);
+    pool.release(third);
+    EXPECT_EQ(pool.pooled_bytes(), READ_BUF_CLASS_BYTES[0]);
+
+    std::string huge;
+    pool.reserve(huge, READ_BUF_CLASS_BYTES[READ_BUF_CLASS_NUM - 1] * 4);
+    pool.release(huge);
+    EXPECT_EQ(pool.pooled_bytes(), READ_BUF_CLASS_BYTES[0]);
+}
@@ -21,3 +21,28 @@ TEST(StringuitlTest, FuncTest) {
     StringUtil::str_to_lower(str);
     EXPECT_EQ(str, ""); 
 }
+
+TEST(StringuitlTest, Trim) {
+    std::string str = "  gzip\t";
+    StringUtil::str_trim(str);
+    EXPECT_EQ(str, "gzip");
+
+    str = "q=0.5";
+    StringUtil::str_trim(str);
+    EXPECT_EQ(str, "q=0.5");
+
+    str = " \t ";
+    StringUtil::str_trim(str);
+    EXPECT_EQ(str, "");
+}
+
+TEST(StringuitlTest, HeapBytes) {
+    std::string str = "gzip";
+    EXPECT_EQ(StringUtil::str_heap_bytes(str), 0);
+
+    str.assign(1000, 'a');
+    EXPECT_GE(StringUtil::str_heap_bytes(str), 1000);
+
+    std::string().swap(str);
+    EXPECT_EQ(StringUtil::str_heap_bytes(str), 0);
+}
@@ -0,0 +1,374 @@
+#include <gtest/gtest.h>
+#include "ChaosThreadPool.h"
+
+#include <atomic>
+#include <vector>
+#include <future>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+
+using namespace std;
+
+
+static void run_basic(bool work_stealing) {
+    chaos::ThreadPool pool(4, 4, false, work_stealing);
+
+    vector<future<int> > results;
+    for (int i = 0; i < 1000; ++i) {
+        results.push_back(pool.enqueue([](int x) { return x * x; }, i));
+    }
+    for (int i = 0; i < 1000; ++i) {
+        EXPECT_EQ(results[i].get(), i * i);
+    }
+}
+
+static void run_nested(bool work_stealing) {
+    const int expected = (1 << 11) - 1;
+    atomic<int> count(0);
+    function<void(int)> spawn;
+    chaos::ThreadPool pool(4, 4, false, work_stealing);
+    // 任务中继续提交子任务，工作窃取模式下子任务放入工作线程自己的队列
+    spawn = [&](int depth) {
+        count.fetch_add(1);
+        if (depth == 0) { return; }
+        pool.enqueue(spawn, depth - 1);
+        pool.enqueue(spawn, depth - 1);
+    };
+    pool.enqueue(spawn, 10);
+
+    auto deadline = chrono::steady_clock::now() + chrono::seconds(10);
+    while (count.load() < expected && chrono::steady_clock::now() < deadline) {
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    EXPECT_EQ(count.load(), expected);
+}
+
+TEST(ThreadPoolTest, Basic) {
+    run_basic(false);
+}
+
+TEST(ThreadPoolTest, NestedTasks) {
+    run_nested(false);
+}
+
+TEST(ThreadPoolTest, WorkStealingBasic) {
+    run_basic(true);
+}
+
+TEST(ThreadPoolTest, WorkStealingNestedTasks) {
+    run_nested(true);
+}
+
+TEST(ThreadPoolTest, WorkStealingIdleWakeup) {
+    chaos::ThreadPool pool(2, 2, false, true);
+    // 等工作线程全部进入休眠后再提交，确认能被唤醒
+    this_thread::sleep_for(chrono::milliseconds(50));
+    for (int round = 0; round < 20; ++round) {
+        EXPECT_EQ(pool.enqueue([round]() { return round; }).get(), round);
+    }
+}
+
+TEST(ThreadPoolTest, TaskMoveOnly) {
+    int calls = 0;
+    // 小对象保存在内部
+    chaos::Task small([&calls]() { ++calls; });
+    EXPECT_TRUE(static_cast<bool>(small));
+    small();
+    EXPECT_EQ(calls, 1);
+
+    // 只能移动的可调用对象
+    unique_ptr<int> value(new int(41));
+    chaos::Task move_only([&calls, value = std::move(value)]() { calls += *value; });
+    chaos::Task moved(std::move(move_only));
+    EXPECT_FALSE(static_cast<bool>(move_only));
+    moved();
+    EXPECT_EQ(calls, 42);
+
+    // 超过内部缓冲区的对象在堆上分配
+    char big[chaos::Task::INLINE_SIZE * 2] = {1};
+    chaos::Task large([&calls, big]() { calls += big[0]; });
+    chaos::Task assigned;
+    assigned = std::move(large);
+    assigned();
+    EXPECT_EQ(calls, 43);
+}
+
+static void run_post(bool work_stealing) {
+    const int n = 10000;
+    atomic<int> count(0);
+    chaos::ThreadPool pool(4, 4, false, work_stealing);
+
+    for (int i = 0; i < n; ++i) {
+        pool.post([&count](int x) { count.fetch_add(x); }, 1);
+    }
+    vector<chaos::Task> batch;
+    for (int i = 0; i < n; ++i) {
+        batch.emplace_back([&count]() { count.fetch_add(1); });
+    }
+    pool.post_bulk(batch.begin(), batch.end());
+    // 抛出的异常被忽略，不影响工作线程
+    pool.post([]() { throw std::runtime_error("ignored"); });
+
+    auto deadline = chrono::steady_clock::now() + chrono::seconds(10);
+    while (count.load() < 2 * n && chrono::steady_clock::now() < deadline) {
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    EXPECT_EQ(count.load(), 2 * n);
+    EXPECT_EQ(pool.enqueue([]() { return 7; }).get(), 7);
+}
+
+TEST(ThreadPoolTest, Post) {
+    run_post(false);
+}
+
+TEST(ThreadPoolTest, WorkStealingPost) {
+    run_post(true);
+}
+
+static void run_stats(bool work_stealing) {
+    const int n = 1000;
+    chaos::ThreadPool pool(2, 2, false, work_stealing);
+    chaos::PoolStats before = pool.stats();
+    EXPECT_EQ(before.workers, 2u);
+    EXPECT_EQ(before.completed, 0u);
+
+    vector<future<void> > results;
+    for (int i = 0; i < n; ++i) {
+        results.push_back(pool.enqueue([]() {}));
+    }
+    for (auto &result : results) {
+        result.get();
+    }
+
+    // future就绪时统计数据可能还没有写入
+    auto deadline = chrono::steady_clock::now() + chrono::seconds(10);
+    while (pool.stats().completed < static_cast<uint64_t>(n)
+           && chrono::steady_clock::now() < deadline) {
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    chaos::PoolStats delta = pool.stats().since(before);
+    EXPECT_EQ(delta.completed, static_cast<uint64_t>(n));
+    EXPECT_EQ(delta.queue_depth, 0u);
+    uint64_t samples = 0;
+    for (uint64_t count : delta.wait_hist) { samples += count; }
+    EXPECT_EQ(samples, static_cast<uint64_t>(n));
+    EXPECT_GT(delta.wait_percentile_us(0.95), 0u);
+}
+
+TEST(ThreadPoolTest, Stats) {
+    run_stats(false);
+}
+
+TEST(ThreadPoolTest, WorkStealingStats) {
+    run_stats(true);
+}
+
+TEST(ThreadPoolTest, WaitPercentile) {
+    chaos::PoolStats stats;
+    EXPECT_EQ(stats.wait_percentile_us(0.95), 0u);
+    EXPECT_EQ(chaos::PoolStats::wait_bucket(500), 0u);
+    EXPECT_EQ(chaos::PoolStats::wait_bucket(1000), 1u);
+    EXPECT_EQ(chaos::PoolStats::wait_bucket(3000), 2u);
+    EXPECT_EQ(chaos::PoolStats::wait_bucket(INT64_MAX), static_cast<size_t>(WAIT_HIST_BUCKETS - 1));
+
+    // 90个不到1微秒，10个约1毫秒
+    stats.wait_hist[0] = 90;
+    stats.wait_hist[chaos::PoolStats::wait_bucket(1000 * 1000)] = 10;
+    EXPECT_EQ(stats.wait_percentile_us(0.5), 1u);
+    EXPECT_EQ(stats.wait_percentile_us(0.95), 1024u);
+}
+
+static void run_autoscale(bool work_stealing) {
+    chaos::ScalePolicy policy;
+    policy.interval_ms = 10;
+    policy.up_wait_us = 1000;
+    policy.up_rounds = 1;
+    policy.down_rounds = 3;
+    policy.step_up = 2;
+    policy.min_workers = 1;
+    chaos::ThreadPool pool(1, 4, true, work_stealing, policy);
+    EXPECT_EQ(pool.stats().workers, 1u);
+
+    // 一个线程处理不过来，排队时间超过阈值后扩容
+    atomic<int> done(0);
+    const int n = 400;
+    for (int i = 0; i < n; ++i) {
+        pool.post([&done]() {
+            this_thread::sleep_for(chrono::milliseconds(2));
+            done.fetch_add(1);
+        });
+    }
+    size_t peak = 0;
+    auto deadline = chrono::steady_clock::now() + chrono::seconds(10);
+    while (done.load() < n && chrono::steady_clock::now() < deadline) {
+        peak = max(peak, pool.stats().workers);
+        this_thread::sleep_for(chrono::milliseconds(5));
+    }
+    EXPECT_EQ(done.load(), n);
+    EXPECT_GT(peak, 1u);
+    EXPECT_LE(peak, 4u);
+
+    // 空闲后缩容到min_workers
+    deadline = chrono::steady_clock::now() + chrono::seconds(10);
+    while (pool.stats().workers > 1 && chrono::steady_clock::now() < deadline) {
+        this_thread::sleep_for(chrono::milliseconds(5));
+    }
+    EXPECT_EQ(pool.stats().workers, 1u);
+    EXPECT_EQ(pool.enqueue([]() { return 7; }).get(), 7);
+}
+
+TEST(ThreadPoolTest, AutoScale) {
+    run_autoscale(false);
+}
+
+TEST(ThreadPoolTest, WorkStealingAutoScale) {
+    run_autoscale(true);
+}
+
+// 阻塞唯一的工作线程，直到release
+struct Gate {
+    void block(chaos::ThreadPool &pool) {
+        pool.post([this]() {
+            entered.store(true);
+            while (!released.load()) {
+                this_thread::sleep_for(chrono::milliseconds(1));
+            }
+        });
+        while (!entered.load()) {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+    }
+    void release() { released.store(true); }
+
+    atomic<bool> entered{false};
+    atomic<bool> released{false};
+};
+
+static void run_priority(bool work_stealing) {
+    chaos::ThreadPool pool(1, 1, false, work_stealing);
+    Gate gate;
+    gate.block(pool);
+
+    mutex mtx;
+    vector<int> order;
+    auto record = [&mtx, &order](int x) {
+        lock_guard<mutex> lock(mtx);
+        order.push_back(x);
+    };
+    pool.post_with(chaos::TaskOptions(chaos::Priority::LOW), record, 3);
+    pool.post_with(chaos::TaskOptions(chaos::Priority::NORMAL), record, 2);
+    pool.post_with(chaos::TaskOptions(chaos::Priority::HIGH), record, 1);
+    pool.post_with(chaos::TaskOptions(chaos::Priority::LOW), record, 4);
+    chaos::PoolStats stats = pool.stats();
+    EXPECT_EQ(stats.lane_depth[static_cast<size_t>(chaos::Priority::HIGH)], 1u);
+    EXPECT_EQ(stats.lane_depth[static_cast<size_t>(chaos::Priority::LOW)], 2u);
+    gate.release();
+
+    pool.enqueue_with(chaos::TaskOptions(chaos::Priority::LOW), []() {}).get();
+    EXPECT_EQ(order, vector<int>({1, 2, 3, 4}));
+}
+
+TEST(ThreadPoolTest, Priority) {
+    run_priority(false);
+}
+
+TEST(ThreadPoolTest, WorkStealingPriority) {
+    run_priority(true);
+}
+
+static void run_deadline(bool work_stealing) {
+    chaos::ThreadPool pool(1, 1, false, work_stealing);
+    Gate gate;
+    gate.block(pool);
+
+    atomic<int> count(0);
+    auto expired = pool.enqueue_with(
+        chaos::TaskOptions::within(chaos::Priority::NORMAL, chrono::milliseconds(1)),
+        [&count]() { count.fetch_add(1); return 1; });
+    pool.post_with(chaos::TaskOptions::within(chaos::Priority::HIGH, chrono::milliseconds(1)),
+                   [&count]() { count.fetch_add(1); });
+    auto alive = pool.enqueue_with(
+        chaos::TaskOptions::within(chaos::Priority::NORMAL, chrono::seconds(60)),
+        [&count]() { count.fetch_add(1); return 2; });
+    this_thread::sleep_for(chrono::milliseconds(10));
+    gate.release();
+
+    EXPECT_EQ(alive.get(), 2);
+    try {
+        expired.get();
+        ADD_FAILURE() << "expired task was executed";
+    } catch (const future_error &e) {
+        EXPECT_EQ(e.code(), make_error_code(future_errc::broken_promise));
+    }
+    EXPECT_EQ(count.load(), 1);
+
+    auto deadline = chrono::steady_clock::now() + chrono::seconds(10);
+    while (pool.stats().expired < 2 && chrono::steady_clock::now() < deadline) {
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    EXPECT_EQ(pool.stats().expired, 2u);
+}
+
+TEST(ThreadPoolTest, Deadline) {
+    run_deadline(false);
+}
+
+TEST(ThreadPoolTest, WorkStealingDeadline) {
+    run_deadline(true);
+}
+
+static void run_lane_cap(bool work_stealing) {
+    chaos::ThreadPool pool(4, 4, false, work_stealing);
+    pool.set_lane_cap(chaos::Priority::LOW, 1);
+
+    atomic<int> running(0);
+    atomic<int> peak(0);
+    vector<future<void> > results;
+    for (int i = 0; i < 20; ++i) {
+        results.push_back(pool.enqueue_with(chaos::TaskOptions(chaos::Priority::LOW), [&]() {
+            int now = running.fetch_add(1) + 1;
+            int old = peak.load();
+            while (now > old && !peak.compare_exchange_weak(old, now)) {}
+            this_thread::sleep_for(chrono::milliseconds(10));
+            running.fetch_sub(1);
+        }));
+    }
+    // 后台任务只占用一个线程，其他优先级的任务不需要等待它们全部完成（约200毫秒）
+    auto start = chrono::steady_clock::now();
+    EXPECT_EQ(pool.enqueue([]() { return 5; }).get(), 5);
+    EXPECT_LT(chrono::steady_clock::now() - start, chrono::milliseconds(100));
+
+    for (auto &result : results) {
+        result.get();
+    }
+    EXPECT_EQ(peak.load(), 1);
+
+    // 取消限制后可以并发执行
+    pool.set_lane_cap(chaos::Priority::LOW, 0);
+    results.clear();
+    for (int i = 0; i < 8; ++i) {
+        results.push_back(pool.enqueue_with(chaos::TaskOptions(chaos::Priority::LOW), [&]() {
+            int now = running.fetch_add(1) + 1;
+            int old = peak.load();
+            while (now > old && !peak.compare_exchange_weak(old, now)) {}
+            this_thread::sleep_for(chrono::milliseconds(5));
+            running.fetch_sub(1);
+        }));
+    }
+    for (auto &result : results) {
+        result.get();
+    }
+    EXPECT_GT(peak.load(), 1);
+}
+
+TEST(ThreadPoolTest, LaneCap) {
+    run_lane_cap(false);
+}
+
+TEST(ThreadPoolTest, WorkStealingLaneCap) {
+    run_lane_cap(true);
+}
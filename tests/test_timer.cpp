@@ -32,6 +32,10 @@ TEST(TimerTest, iswork) {
     TimerNode node4 = timer_mgr.get_top();
     EXPECT_EQ(node4.id, 1);
     EXPECT_EQ(timer_mgr.queue_size(), 5);
+    SteadyClock::time_point expire;
+    EXPECT_TRUE(timer_mgr.get_timer(13, expire));
+    EXPECT_EQ(expire, now + seconds(7));
+    EXPECT_FALSE(timer_mgr.get_timer(14, expire));
 
     /**
      * @brief 测试移除timer
@@ -64,3 +68,18 @@ TEST(TimerTest, iswork) {
     EXPECT_EQ(expired.size(), 1);
     EXPECT_EQ(timer_mgr.queue_size(), 1);
 }
+
+TEST(TimeUtilTest, HttpDate) {
+    EXPECT_EQ(http_date_str(784111777), "Sun, 06 Nov 1994 08:49:37 GMT");
+    EXPECT_EQ(http_date_str(0), "Thu, 01 Jan 1970 00:00:00 GMT");
+
+    std::time_t t = 0;
+    EXPECT_TRUE(http_date_parse("Sun, 06 Nov 1994 08:49:37 GMT", t));
+    EXPECT_EQ(t, 784111777);
+    EXPECT_TRUE(http_date_parse(http_date_str(1700000000), t));
+    EXPECT_EQ(t, 1700000000);
+    // 不支持的格式
+    EXPECT_FALSE(http_date_parse("Sunday, 06-Nov-94 08:49:37 GMT", t));
+    EXPECT_FALSE(http_date_parse("Sun, 06 Foo 1994 08:49:37 GMT", t));
+    EXPECT_FALSE(http_date_parse("", t));
+}